@@ -0,0 +1,422 @@
+/**
+ * CanAggregate.cpp
+ * \brief implements rolling per-id aggregates
+ */
+#include "CanAggregate.h"
+#include "CanNode.h"
+#include "CanTime.h"
+#include <string.h>
+
+/// marks a bucket that has never been used
+#define EMPTY_EPOCH UINT64_MAX
+
+CanAggregate::Entry *CanAggregate::entries[CAN_STD_ID_MAX + 1] = {nullptr};
+CanAggregate::Entry **CanAggregate::extEntries = nullptr;
+uint32_t CanAggregate::extSize = 0;
+uint32_t CanAggregate::extUsed = 0;
+const uint32_t CanAggregate::bucketMs[CAN_NUM_WINDOWS] = {10, 100, 1000};
+std::mutex CanAggregate::lock;
+std::atomic<uint32_t> CanAggregate::tracked(0);
+
+/**
+ * Decode the value of a scalar CanNode data message.
+ *
+ * \returns true if the message held a scalar value of a known type.
+ */
+static bool decodeValue(const CanMessage *msg, int64_t *value) {
+  if (msg->rtr || msg->len < 2) {
+    return false;
+  }
+
+  switch (msg->data[0] >> 5) {
+  case CAN_INT8: {
+    int8_t data;
+    if (CanNode::getData(msg, &data) != DATA_OK) return false;
+    *value = data;
+    return true;
+  }
+  case CAN_UINT8: {
+    uint8_t data;
+    if (CanNode::getData(msg, &data) != DATA_OK) return false;
+    *value = data;
+    return true;
+  }
+  case CAN_INT16: {
+    int16_t data;
+    if (CanNode::getData(msg, &data) != DATA_OK) return false;
+    *value = data;
+    return true;
+  }
+  case CAN_UINT16: {
+    uint16_t data;
+    if (CanNode::getData(msg, &data) != DATA_OK) return false;
+    *value = data;
+    return true;
+  }
+  case CAN_INT32: {
+    int32_t data;
+    if (CanNode::getData(msg, &data) != DATA_OK) return false;
+    *value = data;
+    return true;
+  }
+  case CAN_UINT32: {
+    uint32_t data;
+    if (CanNode::getData(msg, &data) != DATA_OK) return false;
+    *value = data;
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+/**
+ * Allocates the rings for an id. Messages from the id are aggregated from the
+ * next call to CanNode::checkForMessages().
+ *
+ * \param id id to keep aggregates for
+ *
+ * \returns true if the id is tracked, false if the id is invalid or out of
+ * memory.
+ */
+bool CanAggregate::track(uint32_t id) {
+  if (!can_id_valid(id)) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (find(id) != nullptr) {
+      return true;
+    }
+
+    Entry *entry = (Entry *)calloc(1, sizeof(Entry));
+    if (entry == nullptr) {
+      return false;
+    }
+    for (int w = 0; w < CAN_NUM_WINDOWS; ++w) {
+      for (int b = 0; b < CAN_AGG_BUCKETS; ++b) {
+        entry->ring[w][b].epoch = EMPTY_EPOCH;
+      }
+    }
+    entry->id = id;
+
+    if (!(id & CAN_ID_EXT)) {
+      entries[id] = entry;
+    } else if (!insertExt(entry)) {
+      free(entry);
+      return false;
+    }
+    tracked.fetch_add(1, std::memory_order_relaxed);
+  }
+  // the kernel may only be passing ids that have a filter
+  CanNode::can_add_filter_id(id);
+  return true;
+}
+
+/**
+ * \param id id that should no longer be aggregated
+ */
+void CanAggregate::untrack(uint32_t id) {
+  std::lock_guard<std::mutex> guard(lock);
+  Entry *entry = find(id);
+  if (entry == nullptr) {
+    return;
+  }
+  if (id & CAN_ID_EXT) {
+    removeExt(id);
+  } else {
+    entries[id] = nullptr;
+  }
+  free(entry);
+  tracked.fetch_sub(1, std::memory_order_relaxed);
+}
+
+/**
+ * \returns the entry of a tracked id, or nullptr.
+ */
+CanAggregate::Entry *CanAggregate::find(uint32_t id) {
+  if (!(id & CAN_ID_EXT)) {
+    return id <= CAN_STD_ID_MAX ? entries[id] : nullptr;
+  }
+  if (extUsed == 0) {
+    return nullptr;
+  }
+  uint32_t mask = extSize - 1;
+  for (uint32_t i = can_id_hash(id) & mask;; i = (i + 1) & mask) {
+    if (extEntries[i] == nullptr) {
+      return nullptr;
+    }
+    if (extEntries[i]->id == id) {
+      return extEntries[i];
+    }
+  }
+}
+
+/**
+ * Add an entry to the extended id table, growing it to keep it at most half
+ * full so lookups stay short.
+ */
+bool CanAggregate::insertExt(Entry *entry) {
+  if ((extUsed + 1) * 2 > extSize) {
+    uint32_t size = extSize ? extSize * 2 : 16;
+    Entry **grown = (Entry **)calloc(size, sizeof(Entry *));
+    if (grown == nullptr) {
+      return false;
+    }
+    for (uint32_t i = 0; i < extSize; ++i) {
+      if (extEntries[i] == nullptr) {
+        continue;
+      }
+      uint32_t j = can_id_hash(extEntries[i]->id) & (size - 1);
+      while (grown[j] != nullptr) {
+        j = (j + 1) & (size - 1);
+      }
+      grown[j] = extEntries[i];
+    }
+    free(extEntries);
+    extEntries = grown;
+    extSize = size;
+  }
+
+  uint32_t i = can_id_hash(entry->id) & (extSize - 1);
+  while (extEntries[i] != nullptr) {
+    i = (i + 1) & (extSize - 1);
+  }
+  extEntries[i] = entry;
+  extUsed++;
+  return true;
+}
+
+/**
+ * Remove an id from the extended id table, moving later entries of the same
+ * probe run back so no tombstones are needed.
+ */
+void CanAggregate::removeExt(uint32_t id) {
+  uint32_t mask = extSize - 1;
+  uint32_t i = can_id_hash(id) & mask;
+  while (extEntries[i]->id != id) {
+    i = (i + 1) & mask;
+  }
+  extEntries[i] = nullptr;
+  extUsed--;
+
+  for (uint32_t j = (i + 1) & mask; extEntries[j] != nullptr;
+       j = (j + 1) & mask) {
+    uint32_t home = can_id_hash(extEntries[j]->id) & mask;
+    // move back if the hole is between its home slot and where it is
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      extEntries[i] = extEntries[j];
+      extEntries[j] = nullptr;
+      i = j;
+    }
+  }
+}
+
+/**
+ * The window is made of the last \ref CAN_AGG_BUCKETS buckets, including the
+ * bucket that is currently filling. Reading a snapshot never touches raw
+ * messages.
+ *
+ * \param id tracked id
+ * \param window window to read
+ * \param stats[out] aggregate of the window
+ *
+ * \returns false if the id is not tracked.
+ */
+bool CanAggregate::snapshot(uint32_t id, CanAggWindow window,
+                            CanAggStats *stats) {
+  std::lock_guard<std::mutex> guard(lock);
+  Entry *entry = find(id);
+  if (entry == nullptr || window >= CAN_NUM_WINDOWS || stats == nullptr) {
+    return false;
+  }
+
+  uint64_t cur = can_time_ms() / bucketMs[window];
+  combine(entry, window, cur - (CAN_AGG_BUCKETS - 1), cur, stats);
+  return true;
+}
+
+/**
+ * The handler is called from CanNode::checkForMessages() with the aggregate
+ * of each completed window, i.e. every 100ms, 1s or 10s. The elapsed window
+ * is noticed when the next message from the id arrives, so ids that go
+ * silent stop producing callbacks.
+ *
+ * \param id tracked id
+ * \param window window to subscribe to
+ * \param handle function to call
+ *
+ * \returns false if the id is not tracked or there is no free subscriber slot.
+ */
+bool CanAggregate::subscribe(uint32_t id, CanAggWindow window,
+                             aggHandler handle) {
+  std::lock_guard<std::mutex> guard(lock);
+  Entry *entry = find(id);
+  if (entry == nullptr || window >= CAN_NUM_WINDOWS || handle == nullptr) {
+    return false;
+  }
+
+  for (int i = 0; i < CAN_AGG_SUBSCRIBERS; ++i) {
+    if (entry->subs[window][i] == nullptr) {
+      entry->subs[window][i] = handle;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Called by CanNode::checkForMessages() for every received frame. Frames
+ * cost nothing while no id is tracked, else a single table lookup or a short
+ * hash probe for extended ids under the lock. Frames from untracked ids are
+ * never copied out of the receive batch.
+ *
+ * \param view received frame
+ */
+void CanAggregate::update(const CanMessageView *view) {
+  if (tracked.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+  Elapsed elapsed[CAN_NUM_WINDOWS];
+  uint32_t count;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    Entry *entry = find(view->id());
+    if (entry == nullptr) {
+      return;
+    }
+    CanMessage msg;
+    view->copy(&msg);
+    count = add(entry, &msg, elapsed);
+  }
+  notify(elapsed, count);
+}
+
+/**
+ * \param msg received message
+ */
+void CanAggregate::update(const CanMessage *msg) {
+  if (tracked.load(std::memory_order_relaxed) == 0) {
+    return;
+  }
+  Elapsed elapsed[CAN_NUM_WINDOWS];
+  uint32_t count;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    Entry *entry = find(can_msg_id(msg));
+    if (entry == nullptr) {
+      return;
+    }
+    count = add(entry, msg, elapsed);
+  }
+  notify(elapsed, count);
+}
+
+/**
+ * Add a message to the buckets of an entry, with the lock held.
+ *
+ * \param elapsed[out] windows that elapsed and have subscribers, one per
+ * window at most
+ *
+ * \returns the number of elapsed windows.
+ */
+uint32_t CanAggregate::add(Entry *entry, const CanMessage *msg,
+                           Elapsed *elapsed) {
+  uint32_t count = 0;
+  int64_t value;
+  bool hasValue = decodeValue(msg, &value);
+  uint64_t now = can_time_ms();
+
+  for (int w = 0; w < CAN_NUM_WINDOWS; ++w) {
+    uint64_t cur = now / bucketMs[w];
+    Bucket *bucket = &entry->ring[w][cur % CAN_AGG_BUCKETS];
+
+    if (bucket->epoch != cur) {
+      // find the newest bucket to see if a whole window has elapsed
+      uint64_t last = EMPTY_EPOCH;
+      for (int b = 0; b < CAN_AGG_BUCKETS; ++b) {
+        uint64_t epoch = entry->ring[w][b].epoch;
+        if (epoch != EMPTY_EPOCH && (last == EMPTY_EPOCH || epoch > last)) {
+          last = epoch;
+        }
+      }
+
+      if (last != EMPTY_EPOCH &&
+          cur / CAN_AGG_BUCKETS != last / CAN_AGG_BUCKETS &&
+          entry->subs[w][0] != nullptr) {
+        uint64_t first = (last / CAN_AGG_BUCKETS) * CAN_AGG_BUCKETS;
+        Elapsed *e = &elapsed[count++];
+        e->id = entry->id;
+        e->window = (CanAggWindow)w;
+        combine(entry, e->window, first, first + CAN_AGG_BUCKETS - 1,
+                &e->stats);
+        memcpy(e->subs, entry->subs[w], sizeof(e->subs));
+      }
+
+      // recycle the bucket
+      bucket->epoch = cur;
+      bucket->frames = 0;
+      bucket->samples = 0;
+      bucket->sum = 0;
+    }
+
+    bucket->frames++;
+    if (hasValue) {
+      if (bucket->samples == 0 || value < bucket->min) {
+        bucket->min = value;
+      }
+      if (bucket->samples == 0 || value > bucket->max) {
+        bucket->max = value;
+      }
+      bucket->sum += value;
+      bucket->samples++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Call the subscribers of elapsed windows, without the lock held.
+ */
+void CanAggregate::notify(const Elapsed *elapsed, uint32_t count) {
+  for (uint32_t e = 0; e < count; ++e) {
+    for (int i = 0; i < CAN_AGG_SUBSCRIBERS && elapsed[e].subs[i]; ++i) {
+      elapsed[e].subs[i](elapsed[e].id, elapsed[e].window, &elapsed[e].stats);
+    }
+  }
+}
+
+void CanAggregate::combine(const Entry *entry, CanAggWindow window,
+                           uint64_t firstEpoch, uint64_t lastEpoch,
+                           CanAggStats *stats) {
+  int64_t sum = 0;
+  stats->frames = 0;
+  stats->samples = 0;
+  stats->min = 0;
+  stats->max = 0;
+
+  for (int b = 0; b < CAN_AGG_BUCKETS; ++b) {
+    const Bucket *bucket = &entry->ring[window][b];
+    if (bucket->epoch == EMPTY_EPOCH || bucket->epoch < firstEpoch ||
+        bucket->epoch > lastEpoch) {
+      continue;
+    }
+
+    stats->frames += bucket->frames;
+    if (bucket->samples == 0) {
+      continue;
+    }
+    if (stats->samples == 0 || bucket->min < stats->min) {
+      stats->min = bucket->min;
+    }
+    if (stats->samples == 0 || bucket->max > stats->max) {
+      stats->max = bucket->max;
+    }
+    stats->samples += bucket->samples;
+    sum += bucket->sum;
+  }
+
+  stats->mean = stats->samples ? (double)sum / stats->samples : 0.0;
+  stats->rate =
+      stats->frames * 1000.0 / (bucketMs[window] * (double)CAN_AGG_BUCKETS);
+}
@@ -0,0 +1,144 @@
+/**
+ * \file CanAggregate.h
+ * \brief Rolling per-id aggregates of received CanNode data.
+ *
+ * CanAggregate keeps min/max/mean/rate statistics for a set of tracked ids
+ * over fixed 100ms, 1s and 10s windows. Each window is a ring of
+ * \ref CAN_AGG_BUCKETS buckets, so adding a message is O(1) and reading a
+ * window only combines a handful of buckets instead of replaying raw history.
+ *
+ * Aggregates are updated from CanNode::checkForMessages(), so they are only
+ * as fresh as the message loop. Ids are passed with \ref CAN_ID_EXT set for
+ * 29-bit extended ids.
+ *
+ * Ids can be tracked, read and subscribed to from any thread, a mutex keeps
+ * them consistent with the loop. Subscribers are called on the loop thread
+ * once the mutex is released, so they may read or subscribe themselves.
+ *
+ * Example code
+ * ~~~~~~~~~~~~ {.c}
+ * void tempStats(uint32_t id, CanAggWindow window, const CanAggStats *stats);
+ *
+ * CanAggregate::track(ENGINE_TEMP);
+ * CanAggregate::subscribe(ENGINE_TEMP, CAN_WINDOW_1S, tempStats);
+ *
+ * // somewhere else, e.g. a dashboard refresh
+ * CanAggStats stats;
+ * if (CanAggregate::snapshot(ENGINE_TEMP, CAN_WINDOW_10S, &stats)) {
+ *   // use stats.mean, stats.rate ...
+ * }
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_AGGREGATE_H_
+#define _CAN_AGGREGATE_H_
+
+#include "CanMessageView.h"
+#include "CanTypes.h"
+#include <atomic>
+#include <mutex>
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Number of buckets each window is divided into
+#define CAN_AGG_BUCKETS 10
+
+#ifndef CAN_AGG_SUBSCRIBERS
+/// Number of subscribers per id and window. Can be overwriten by redefinition
+#define CAN_AGG_SUBSCRIBERS 4
+#endif
+
+/**
+ * \enum CanAggWindow
+ * \brief Aggregation windows kept for every tracked id.
+ */
+typedef enum {
+  CAN_WINDOW_100MS, ///< 100 mili-second window (10ms buckets)
+  CAN_WINDOW_1S,    ///< 1 second window (100ms buckets)
+  CAN_WINDOW_10S,   ///< 10 second window (1s buckets)
+  CAN_NUM_WINDOWS
+} CanAggWindow;
+
+/**
+ * \struct CanAggStats
+ * \brief Aggregate of the messages received from one id over a window.
+ *
+ * Every message counts towards \ref frames and \ref rate. Only messages that
+ * can be decoded with a scalar getData function count towards \ref samples,
+ * \ref min, \ref max and \ref mean.
+ */
+typedef struct {
+  uint32_t frames;  ///< Messages received in the window
+  uint32_t samples; ///< Messages that carried a scalar value
+  int64_t min;      ///< Smallest value (valid if samples > 0)
+  int64_t max;      ///< Largest value (valid if samples > 0)
+  double mean;      ///< Mean value (valid if samples > 0)
+  double rate;      ///< Messages per second over the window
+} CanAggStats;
+
+/**
+ * \typedef aggHandler
+ * \brief Called with the aggregate of a window each time the window elapses.
+ */
+typedef void (*aggHandler)(uint32_t id, CanAggWindow window,
+                           const CanAggStats *stats);
+
+class CanAggregate {
+public:
+  /// \brief Start keeping aggregates for an id.
+  static bool track(uint32_t id);
+  /// \brief Stop keeping aggregates for an id and drop its subscribers.
+  static void untrack(uint32_t id);
+  /// \brief Get the current aggregate of an id over a window.
+  static bool snapshot(uint32_t id, CanAggWindow window, CanAggStats *stats);
+  /// \brief Call a handler every time a window of an id elapses.
+  static bool subscribe(uint32_t id, CanAggWindow window, aggHandler handle);
+  /// \brief Add a received message to the aggregates of its id.
+  static void update(const CanMessage *msg);
+  /// \brief Update with a received frame, only copied if its id is tracked.
+  static void update(const CanMessageView *view);
+
+private:
+  /// One bucket of a window ring
+  typedef struct {
+    uint64_t epoch;   ///< bucket number since the start of the clock
+    uint32_t frames;  ///< messages in this bucket
+    uint32_t samples; ///< decoded values in this bucket
+    int64_t min;      ///< smallest value in this bucket
+    int64_t max;      ///< largest value in this bucket
+    int64_t sum;      ///< sum of values in this bucket
+  } Bucket;
+
+  /// Rings and subscribers for one id
+  typedef struct {
+    uint32_t id; ///< with CAN_ID_EXT set for extended ids
+    Bucket ring[CAN_NUM_WINDOWS][CAN_AGG_BUCKETS];
+    aggHandler subs[CAN_NUM_WINDOWS][CAN_AGG_SUBSCRIBERS];
+  } Entry;
+
+  /// A window that elapsed, to tell its subscribers about
+  typedef struct {
+    uint32_t id;
+    CanAggWindow window;
+    CanAggStats stats;
+    aggHandler subs[CAN_AGG_SUBSCRIBERS];
+  } Elapsed;
+
+  static Entry *entries[CAN_STD_ID_MAX + 1]; ///< standard ids
+  static Entry **extEntries; ///< extended ids, open addressing by id hash
+  static uint32_t extSize;   ///< slots in extEntries, a power of two
+  static uint32_t extUsed;   ///< tracked extended ids
+  static const uint32_t bucketMs[CAN_NUM_WINDOWS];
+  static std::mutex lock;    ///< guards the tables and the entries
+  static std::atomic<uint32_t> tracked; ///< tracked ids, read without lock
+
+  static Entry *find(uint32_t id);
+  static bool insertExt(Entry *entry);
+  static void removeExt(uint32_t id);
+  static uint32_t add(Entry *entry, const CanMessage *msg, Elapsed *elapsed);
+  static void notify(const Elapsed *elapsed, uint32_t count);
+  static void combine(const Entry *entry, CanAggWindow window,
+                      uint64_t firstEpoch, uint64_t lastEpoch,
+                      CanAggStats *stats);
+};
+
+#endif //_CAN_AGGREGATE_H_
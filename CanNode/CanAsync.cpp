@@ -0,0 +1,391 @@
+/**
+ * CanAsync.cpp
+ * \brief implements awaitable exchanges and their executor
+ */
+#include "CanAsync.h"
+#include "CanNode.h"
+#include "CanTime.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+CanAwaitLink *CanAsync::buckets[CAN_ASYNC_BUCKETS];
+CanExchange *CanAsync::ready = nullptr;
+CanExchange *CanAsync::readyTail = nullptr;
+uint32_t CanAsync::numWaiting = 0;
+CanTimerWheel CanAsync::wheel;
+int CanAsync::timerFd = -1;
+uint64_t CanAsync::start = 0;
+bool CanAsync::ticking = false;
+
+CanExchange::CanExchange(uint32_t id, uint16_t timeout, Kind kind,
+                         uint8_t rtrLen, uint8_t rtrData)
+    : next(nullptr), timeout(timeout), kind(kind), state(NO_DATA),
+      done(false), rtrLen(rtrLen), rtrData(rtrData) {
+  timer.next = nullptr;
+  timer.prev = nullptr;
+  link.next = nullptr;
+  link.prev = nullptr;
+  link.exchange = nullptr;
+  link.id = id;
+  link.index = 0;
+}
+
+bool CanExchange::await_suspend(std::coroutine_handle<> coroutine) {
+  waiter = coroutine;
+  return CanAsync::wait(this);
+}
+
+CanStringRequest::CanStringRequest(uint32_t id, uint16_t timeout)
+    : CanExchange(id, timeout, EXCHANGE_STRING, 1,
+                  CAN_GET_NAME | (CAN_INT8 << 5)),
+      len(0) {
+  str[0] = '\0';
+}
+
+CanPollGroup::CanPollGroup(const uint32_t *ids, uint32_t count,
+                           uint16_t timeout, CanPollResult *results,
+                           const uint16_t *timeouts)
+    : CanExchange(0, timeout, EXCHANGE_GROUP, 0, 0), ids(ids),
+      timeouts(timeouts), results(results), links(nullptr), count(count),
+      replies(0), remaining(0), sent(0) {}
+
+CanString CanStringRequest::await_resume() const {
+  CanString result;
+  result.state = state;
+  memcpy(result.str, str, len + 1);
+  return result;
+}
+
+/**
+ * Start or stop the tick of the timeout wheel. It only runs while exchanges
+ * are waiting.
+ */
+bool CanAsync::setTimer(bool run) {
+  if (timerFd < 0) {
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0) {
+      perror("can async timerfd");
+      return false;
+    }
+  }
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (run) {
+    spec.it_interval.tv_nsec = CAN_ASYNC_TICK * 1000000L;
+    spec.it_value = spec.it_interval;
+    // carry on from the tick the wheel stopped at, without catching up
+    start = can_time_ms() - wheel.now() * CAN_ASYNC_TICK;
+  }
+  if (timerfd_settime(timerFd, 0, &spec, NULL) < 0) {
+    perror("can async timerfd_settime");
+    return false;
+  }
+  ticking = run;
+  return true;
+}
+
+/**
+ * Send the rtr of an exchange to id.
+ */
+CanState CanAsync::sendRtr(const CanExchange *exchange, uint32_t id) {
+  // the kernel may only be passing ids that have a filter
+  CanNode::can_add_filter_id(id);
+
+  CanMessage msg;
+  can_set_msg_id(&msg, id);
+  msg.rtr = true;
+  msg.len = exchange->rtrLen;
+  msg.data[0] = exchange->rtrData;
+  return CanNode::can_tx(&msg, 5);
+}
+
+void CanAsync::link(CanAwaitLink *link, CanExchange *exchange, uint32_t id,
+                    uint32_t index) {
+  CanAwaitLink **bucket = &buckets[can_id_hash(id) & (CAN_ASYNC_BUCKETS - 1)];
+  link->exchange = exchange;
+  link->id = id;
+  link->index = index;
+  link->prev = nullptr;
+  link->next = *bucket;
+  if (*bucket != nullptr) {
+    (*bucket)->prev = link;
+  }
+  *bucket = link;
+}
+
+void CanAsync::unlink(CanAwaitLink *link) {
+  if (link->exchange == nullptr) {
+    return;
+  }
+  if (link->prev != nullptr) {
+    link->prev->next = link->next;
+  } else {
+    buckets[can_id_hash(link->id) & (CAN_ASYNC_BUCKETS - 1)] = link->next;
+  }
+  if (link->next != nullptr) {
+    link->next->prev = link->prev;
+  }
+  link->exchange = nullptr;
+}
+
+/**
+ * Put an exchange in the table and send its rtr.
+ *
+ * \returns false if it is already done because the rtr was not sent.
+ */
+bool CanAsync::wait(CanExchange *exchange) {
+  if (!ticking && !setTimer(true)) {
+    exchange->state = DATA_ERROR;
+    exchange->done = true;
+    return false;
+  }
+  if (exchange->kind == CanExchange::EXCHANGE_GROUP) {
+    return waitGroup((CanPollGroup *)exchange);
+  }
+
+  CanState sent = sendRtr(exchange, exchange->link.id);
+  if (sent != BUS_OK) {
+    exchange->state = sent;
+    exchange->done = true;
+    return false;
+  }
+  link(&exchange->link, exchange, exchange->link.id, 0);
+
+  uint64_t due = can_time_ms() + exchange->timeout - start;
+  wheel.add(&exchange->timer, (due + CAN_ASYNC_TICK - 1) / CAN_ASYNC_TICK);
+  numWaiting++;
+  return true;
+}
+
+/**
+ * Send the rtrs of a group as one batch and put every id that was sent in
+ * the table. The timer of the group runs to the earliest deadline of its ids
+ * and is moved on as they time out (see expireGroup()).
+ *
+ * \returns false if it is already done because no rtr was sent.
+ */
+bool CanAsync::waitGroup(CanPollGroup *group) {
+  group->links =
+      (CanAwaitLink *)calloc(group->count ? group->count : 1,
+                             sizeof(CanAwaitLink));
+  if (group->links == nullptr) {
+    group->state = DATA_ERROR;
+    group->done = true;
+    return false;
+  }
+
+  // a hold of the caller stays in place, its flush sends the rtrs too
+  bool held = CanNode::holdTx(true);
+  for (uint32_t i = 0; i < group->count; ++i) {
+    CanPollResult *result = &group->results[i];
+    result->id = group->ids[i];
+    result->latency = 0;
+    result->state = sendRtr(group, group->ids[i]);
+    if (result->state == BUS_OK) {
+      result->state = NO_DATA;
+      link(&group->links[i], group, group->ids[i], i);
+      group->remaining++;
+    }
+  }
+  CanNode::holdTx(held);
+  if (!held) {
+    CanNode::flushTx();
+  }
+  group->sent = can_time_ns();
+
+  if (group->remaining == 0) {
+    free(group->links);
+    group->links = nullptr;
+    group->state = group->count != 0 ? group->results[0].state : DATA_OK;
+    group->done = true;
+    return false;
+  }
+  uint64_t now = can_time_ms() - start;
+  uint64_t first = UINT64_MAX;
+  for (uint32_t i = 0; i < group->count; ++i) {
+    uint16_t timeout = group->timeout;
+    if (group->timeouts != nullptr && group->timeouts[i] != 0 &&
+        group->timeouts[i] < timeout) {
+      timeout = group->timeouts[i];
+    }
+    group->links[i].due = (now + timeout + CAN_ASYNC_TICK - 1) /
+                          CAN_ASYNC_TICK;
+    if (group->links[i].exchange != nullptr && group->links[i].due < first) {
+      first = group->links[i].due;
+    }
+  }
+  wheel.add(&group->timer, first);
+  numWaiting++;
+  return true;
+}
+
+/**
+ * Take an exchange out of the table and queue its coroutine to be resumed.
+ */
+void CanAsync::finish(CanExchange *exchange, CanState state) {
+  if (exchange->kind == CanExchange::EXCHANGE_GROUP) {
+    CanPollGroup *group = (CanPollGroup *)exchange;
+    for (uint32_t i = 0; i < group->count; ++i) {
+      unlink(&group->links[i]);
+    }
+    free(group->links);
+    group->links = nullptr;
+  } else {
+    unlink(&exchange->link);
+  }
+  wheel.remove(&exchange->timer);
+  numWaiting--;
+
+  exchange->state = state;
+  exchange->done = true;
+  if (!exchange->waiter) {
+    return;
+  }
+  exchange->next = nullptr;
+  if (readyTail != nullptr) {
+    readyTail->next = exchange;
+  } else {
+    ready = exchange;
+  }
+  readyTail = exchange;
+}
+
+/**
+ * \returns true if the frame is (part of) the reply of the exchange, its
+ * state is \ref DATA_OK once the whole reply is in.
+ */
+bool CanAsync::take(CanAwaitLink *link, const CanMessageView *view) {
+  CanExchange *exchange = link->exchange;
+  if (view->rtr()) {
+    return false;
+  }
+  if (exchange->kind == CanExchange::EXCHANGE_GROUP) {
+    // the id is answered, the group waits for the others
+    CanPollGroup *group = (CanPollGroup *)exchange;
+    CanPollResult *result = &group->results[link->index];
+    view->copy(&result->msg);
+    result->state = DATA_OK;
+    result->latency = (can_time_ns() - group->sent) / 1000;
+    unlink(link);
+    group->replies++;
+    if (--group->remaining == 0) {
+      exchange->state = DATA_OK;
+    }
+    return true;
+  }
+  if (exchange->kind == CanExchange::EXCHANGE_DATA) {
+    view->copy(&((CanRequest *)exchange)->msg);
+    exchange->state = DATA_OK;
+    return true;
+  }
+
+  CanStringRequest *request = (CanStringRequest *)exchange;
+  const uint8_t *data = view->data();
+  if (view->len() == 0 || (data[0] & 0x1F) != CAN_NAME_INFO) {
+    return false;
+  }
+  for (uint8_t i = 1; i < view->len(); ++i) {
+    if (data[i] == '\0' || request->len == MAX_INFO_LEN) {
+      exchange->state = DATA_OK;
+      break;
+    }
+    request->str[request->len++] = data[i];
+  }
+  request->str[request->len] = '\0';
+  if (request->len == MAX_INFO_LEN) {
+    exchange->state = DATA_OK;
+  }
+  return true;
+}
+
+/**
+ * Called from CanNode::checkForMessages() for every received frame. The
+ * coroutines of finished exchanges are only resumed by the next service().
+ *
+ * \returns true if the frame was a reply to a waiting exchange.
+ */
+bool CanAsync::deliver(const CanMessageView *view) {
+  if (numWaiting == 0) {
+    return false;
+  }
+  uint32_t id = view->id();
+  bool taken = false;
+  CanAwaitLink *link = buckets[can_id_hash(id) & (CAN_ASYNC_BUCKETS - 1)];
+  while (link != nullptr) {
+    CanAwaitLink *next = link->next;
+    CanExchange *exchange = link->exchange;
+    if (link->id == id && take(link, view)) {
+      taken = true;
+      if (exchange->state == DATA_OK) {
+        finish(exchange, DATA_OK);
+      }
+    }
+    link = next;
+  }
+  return taken;
+}
+
+void CanAsync::expire(CanTimerWheel::Timer *timer, void *) {
+  CanExchange *exchange = (CanExchange *)timer;
+  if (exchange->kind == CanExchange::EXCHANGE_GROUP) {
+    expireGroup((CanPollGroup *)exchange);
+    return;
+  }
+  finish(exchange, NO_DATA);
+}
+
+/**
+ * Give up on the ids of a group whose deadline passed, their results stay
+ * \ref NO_DATA. The group is done once no id is left waiting, otherwise its
+ * timer moves on to the next deadline.
+ */
+void CanAsync::expireGroup(CanPollGroup *group) {
+  uint64_t next = UINT64_MAX;
+  for (uint32_t i = 0; i < group->count; ++i) {
+    CanAwaitLink *link = &group->links[i];
+    if (link->exchange == nullptr) {
+      continue;
+    }
+    if (link->due <= wheel.now()) {
+      unlink(link);
+      group->remaining--;
+    } else if (link->due < next) {
+      next = link->due;
+    }
+  }
+  if (group->remaining == 0) {
+    finish(group, NO_DATA);
+    return;
+  }
+  wheel.add(&group->timer, next);
+}
+
+/**
+ * Called from CanNode::checkForMessages() before and after the receive
+ * batch. Coroutines run here until they await again or return, exchanges
+ * they start are waited for like the others.
+ */
+void CanAsync::service() {
+  uint64_t expirations;
+  if (ticking && read(timerFd, &expirations, sizeof(expirations)) ==
+                     sizeof(expirations)) {
+    wheel.advance((can_time_ms() - start) / CAN_ASYNC_TICK, expire, nullptr);
+  }
+
+  while (ready != nullptr) {
+    CanExchange *exchange = ready;
+    ready = exchange->next;
+    if (ready == nullptr) {
+      readyTail = nullptr;
+    }
+    // the exchange is gone once its coroutine runs on or returns
+    exchange->waiter.resume();
+  }
+
+  if (ticking && numWaiting == 0) {
+    setTimer(false);
+  }
+}
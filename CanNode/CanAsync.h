@@ -0,0 +1,270 @@
+/**
+ * \file CanAsync.h
+ * \brief Request/response exchanges as C++20 coroutines.
+ *
+ * Asking a node for its data or its name means sending an rtr and waiting
+ * for the reply, which blocks the message loop if done with requestName() or
+ * a loop around can_rx(). CanNode::request(), CanNode::requestName() and
+ * CanNode::requestInfo() with a timeout only return an awaitable instead.
+ * A coroutine returning \ref CanTask awaits it, the rtr is sent and the
+ * coroutine is suspended until checkForMessages() receives the reply or the
+ * timeout passes.
+ *
+ * Every exchange lives in the frame of the coroutine waiting for it: the
+ * frame (a few hundred bytes) is all an outstanding exchange costs, so
+ * thousands of them can wait at once without threads or polling. Waiting
+ * exchanges are found by reply id in a hash table, timeouts are kept in a
+ * CanTimerWheel. CanNode::pollGroup() waits for the replies of a whole set of
+ * ids as one exchange. The executor is single-threaded and runs inside
+ * checkForMessages(), coroutines are resumed there after the handlers of the
+ * receive batch have been called. Start and await exchanges on the loop
+ * thread only.
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanTask survey(uint32_t id) {
+ *   CanString name = co_await CanNode::requestName(id, 200);
+ *   CanReply reply = co_await CanNode::request(id, 50);
+ *   if (name.state == DATA_OK && reply.state == DATA_OK) {
+ *     printf("%s: %d\n", name.str, reply.msg.data[1]);
+ *   }
+ * }
+ *
+ * for (uint32_t id = THROTTLE; id < THROTTLE + 64; id += 4) {
+ *   survey(id);
+ * }
+ * while (CanAsync::waiting() != 0) {
+ *   CanNode::waitForMessages(100);
+ *   CanNode::checkForMessages();
+ * }
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_ASYNC_H_
+#define _CAN_ASYNC_H_
+
+#include "CanMessageView.h"
+#include "CanTimerWheel.h"
+#include "CanTypes.h"
+#include <coroutine>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef CAN_ASYNC_BUCKETS
+/// Buckets of the table of waiting exchanges, a power of two. Can be
+/// overwriten by redefinition
+#define CAN_ASYNC_BUCKETS 1024
+#endif
+
+#ifndef CAN_ASYNC_TICK
+/// mili-seconds per tick of the timeout wheel, timeouts pass up to one tick
+/// late. Can be overwriten by redefinition
+#define CAN_ASYNC_TICK 5
+#endif
+
+/**
+ * \brief Return type of a coroutine that awaits exchanges.
+ *
+ * The coroutine starts running when called and frees its frame when it
+ * returns, nobody has to keep or await the task. If its frame cannot be
+ * allocated the coroutine does not run at all.
+ */
+class CanTask {
+public:
+  struct promise_type {
+    CanTask get_return_object() { return CanTask(); }
+    static CanTask get_return_object_on_allocation_failure() {
+      return CanTask();
+    }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { abort(); }
+
+    // frames come from malloc() like the rest of the library
+    static void *operator new(size_t size) noexcept { return malloc(size); }
+    static void operator delete(void *frame) { free(frame); }
+  };
+};
+
+/**
+ * \struct CanReply
+ * \brief Result of awaiting CanNode::request().
+ */
+typedef struct {
+  CanState state; ///< \ref DATA_OK, \ref NO_DATA if the node did not answer
+                  ///< in time, or why the rtr could not be sent
+  CanMessage msg; ///< the reply, if state is \ref DATA_OK
+} CanReply;
+
+/**
+ * \struct CanString
+ * \brief Result of awaiting CanNode::requestName() or requestInfo().
+ */
+typedef struct {
+  CanState state;              ///< \ref DATA_OK, or as in \ref CanReply
+  char str[MAX_INFO_LEN + 1];  ///< the string, or the part of it that
+                               ///< arrived before the timeout
+} CanString;
+
+/**
+ * \struct CanPollResult
+ * \brief Reply to one id of CanNode::pollGroup().
+ */
+typedef struct {
+  uint32_t id;      ///< id the rtr was sent to
+  CanState state;   ///< \ref DATA_OK, \ref NO_DATA if there was no reply
+                    ///< before the deadline of the id, or why the rtr was
+                    ///< not sent
+  uint32_t latency; ///< micro-seconds from sending the rtrs to the reply
+  CanMessage msg;   ///< the reply, if state is \ref DATA_OK
+} CanPollResult;
+
+class CanExchange;
+
+/**
+ * \struct CanAwaitLink
+ * \brief Puts an exchange in the table under one reply id.
+ */
+typedef struct CanAwaitLink {
+  CanAwaitLink *next;    ///< next in the bucket
+  CanAwaitLink *prev;    ///< previous in the bucket
+  CanExchange *exchange; ///< NULL while the link is not in the table
+  uint32_t id;           ///< id the rtr goes to and the reply comes from
+  uint32_t index;        ///< position of the id in a group
+  uint64_t due;          ///< tick the id of a group times out on
+} CanAwaitLink;
+
+/**
+ * \brief An exchange waiting for its reply, the part the executor sees.
+ */
+class CanExchange {
+public:
+  CanExchange(const CanExchange &) = delete;
+  CanExchange &operator=(const CanExchange &) = delete;
+
+  bool await_ready() const { return false; }
+  /// \brief Send the rtr and wait, resumes right away if it was not sent.
+  bool await_suspend(std::coroutine_handle<> coroutine);
+
+protected:
+  friend class CanAsync;
+
+  /// How replies are taken
+  typedef enum {
+    EXCHANGE_DATA,   ///< the first data frame of the id
+    EXCHANGE_STRING, ///< string frames of the id up to the terminating 0
+    EXCHANGE_GROUP,  ///< the first data frame of each id of a group
+  } Kind;
+
+  CanExchange(uint32_t id, uint16_t timeout, Kind kind, uint8_t rtrLen,
+              uint8_t rtrData);
+
+  CanTimerWheel::Timer timer; ///< must stay the first member
+  CanAwaitLink link;          ///< in the table, unused by a group
+  CanExchange *next;          ///< next in the ready list
+  std::coroutine_handle<> waiter; ///< NULL for a blocking pollGroup()
+  uint16_t timeout;           ///< mili-seconds
+  Kind kind;
+  CanState state;
+  bool done;                  ///< out of the table, replied or timed out
+  uint8_t rtrLen;             ///< bytes of the rtr, rtrData is the first
+  uint8_t rtrData;
+};
+
+/**
+ * \brief Awaitable returned by CanNode::request(), yields a \ref CanReply.
+ */
+class CanRequest : public CanExchange {
+public:
+  CanReply await_resume() const { return {state, msg}; }
+
+private:
+  friend class CanAsync;
+  friend class CanNode;
+
+  CanRequest(uint32_t id, uint16_t timeout)
+      : CanExchange(id, timeout, EXCHANGE_DATA, 0, 0), msg() {}
+
+  CanMessage msg;
+};
+
+/**
+ * \brief Awaitable returned by CanNode::requestName() and requestInfo(),
+ * yields a \ref CanString.
+ */
+class CanStringRequest : public CanExchange {
+public:
+  CanString await_resume() const;
+
+private:
+  friend class CanAsync;
+  friend class CanNode;
+
+  CanStringRequest(uint32_t id, uint16_t timeout);
+
+  char str[MAX_INFO_LEN + 1];
+  uint8_t len; ///< characters received so far
+};
+
+/**
+ * \brief The rtrs of CanNode::pollGroup() and the replies collected so far.
+ */
+class CanPollGroup : public CanExchange {
+private:
+  friend class CanAsync;
+  friend class CanNode;
+
+  CanPollGroup(const uint32_t *ids, uint32_t count, uint16_t timeout,
+               CanPollResult *results, const uint16_t *timeouts);
+
+  const uint32_t *ids;
+  const uint16_t *timeouts; ///< mili-seconds per id, or NULL
+  CanPollResult *results;
+  CanAwaitLink *links; ///< one per id
+  uint32_t count;
+  uint32_t replies;    ///< ids that answered
+  uint32_t remaining;  ///< ids still waiting
+  uint64_t sent;       ///< can_time_ns() the rtrs went out
+};
+
+/**
+ * \brief The executor, driven by CanNode::checkForMessages().
+ */
+class CanAsync {
+public:
+  /// \brief Number of exchanges waiting for a reply.
+  static uint32_t waiting() { return numWaiting; }
+  /// \brief File descriptor that is readable when a tick passed, or -1.
+  static int fd() { return timerFd; }
+  /// \brief Pass a received frame to the exchanges waiting for its id.
+  static bool deliver(const CanMessageView *view);
+  /// \brief Time out exchanges and resume the ones that are done.
+  static void service();
+
+private:
+  friend class CanExchange;
+  friend class CanNode;
+
+  static CanAwaitLink *buckets[CAN_ASYNC_BUCKETS];
+  static CanExchange *ready;     ///< done, resumed in this order
+  static CanExchange *readyTail;
+  static uint32_t numWaiting;
+  static CanTimerWheel wheel;
+  static int timerFd;
+  static uint64_t start;         ///< can_time_ms() of tick 0
+  static bool ticking;           ///< timerFd is armed
+
+  static bool wait(CanExchange *exchange);
+  static bool waitGroup(CanPollGroup *group);
+  static CanState sendRtr(const CanExchange *exchange, uint32_t id);
+  static void link(CanAwaitLink *link, CanExchange *exchange, uint32_t id,
+                   uint32_t index);
+  static void unlink(CanAwaitLink *link);
+  static void finish(CanExchange *exchange, CanState state);
+  static bool take(CanAwaitLink *link, const CanMessageView *view);
+  static bool setTimer(bool run);
+  static void expire(CanTimerWheel::Timer *timer, void *ctx);
+  static void expireGroup(CanPollGroup *group);
+};
+
+#endif //_CAN_ASYNC_H_
@@ -0,0 +1,468 @@
+/**
+ * CanBridge.cpp
+ * \brief implements batching frames into UDP multicast datagrams
+ */
+#include "CanBridge.h"
+#include "CanTime.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+/// "CB" read as a little endian 16-bit number
+#define BRIDGE_MAGIC 0x4243
+/// Version of the datagram layout
+#define BRIDGE_VERSION 1
+/// Bytes before the first frame of a datagram
+#define HEADER_LEN 24
+/// Bytes of a frame before its data
+#define RECORD_LEN 10
+/// Flags of a frame: a CAN FD frame, and its bit rate switch and error state
+#define RECORD_FD 0x01
+#define RECORD_BRS 0x02
+#define RECORD_ESI 0x04
+
+static inline void put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+  put16(p, (uint16_t)v);
+  put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static inline void put64(uint8_t *p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint16_t get16(const uint8_t *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+  return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static inline uint64_t get64(const uint8_t *p) {
+  return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+CanBridge::CanBridge()
+    : sock(-1), self(0), datagramSize(0), maxLatency(0), txBuf(NULL),
+      txFrames(0), txBase(0), txOpen(0), txSeq(0), txSince(0), rxBuf(NULL),
+      framesSent(0), datagramsSent(0), sendErrors(0), framesReceived(0),
+      datagramsReceived(0), datagramsLost(0), datagramsLate(0),
+      badDatagrams(0) {
+  memset(&dest, 0, sizeof(dest));
+  memset(peers, 0, sizeof(peers));
+}
+
+/**
+ * Sends what is still pending.
+ */
+CanBridge::~CanBridge() {
+  close();
+}
+
+/**
+ * Binds the port of the group, so several bridges on one host can receive
+ * it, and joins the group on the local interface.
+ *
+ * \param config where to send, NULL for the defaults
+ *
+ * \returns false if the socket could not be set up.
+ */
+bool CanBridge::open(const CanBridgeConfig *config) {
+  CanBridgeConfig c;
+  memset(&c, 0, sizeof(c));
+  if (config != NULL) {
+    c = *config;
+  }
+  if (c.group == NULL) {
+    c.group = "239.255.67.66";
+  }
+  if (c.port == 0) {
+    c.port = 47806;
+  }
+  if (c.ttl == 0) {
+    c.ttl = 1;
+  }
+  if (c.datagramSize == 0) {
+    c.datagramSize = 1400;
+  }
+  if (c.datagramSize > CAN_BRIDGE_MTU) {
+    c.datagramSize = CAN_BRIDGE_MTU;
+  }
+  // at least one frame of each size has to fit
+  if (c.datagramSize < HEADER_LEN + RECORD_LEN + CAN_MAX_DATA) {
+    c.datagramSize = HEADER_LEN + RECORD_LEN + CAN_MAX_DATA;
+  }
+  if (c.maxLatency == 0) {
+    c.maxLatency = 2000;
+  }
+
+  close();
+  datagramSize = c.datagramSize;
+  maxLatency = (uint64_t)c.maxLatency * 1000;
+
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(c.port);
+  struct ip_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (inet_pton(AF_INET, c.group, &dest.sin_addr) != 1 ||
+      (c.local != NULL &&
+       inet_pton(AF_INET, c.local, &mreq.imr_interface) != 1)) {
+    fprintf(stderr, "can bridge: bad address %s\n",
+            c.local != NULL ? c.local : c.group);
+    return false;
+  }
+  mreq.imr_multiaddr = dest.sin_addr;
+
+  sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  int enable = 1;
+  if (sock < 0 ||
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) <
+          0 ||
+      bind(sock, (struct sockaddr *)&dest, sizeof(dest)) < 0 ||
+      setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) <
+          0 ||
+      setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &mreq.imr_interface,
+                 sizeof(mreq.imr_interface)) < 0 ||
+      setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &c.ttl,
+                 sizeof(c.ttl)) < 0) {
+    perror("can bridge socket");
+    close();
+    return false;
+  }
+
+  txBuf = (uint8_t *)malloc(CAN_BRIDGE_BATCH * CAN_BRIDGE_MTU);
+  rxBuf = (uint8_t *)malloc(CAN_BRIDGE_BATCH * CAN_BRIDGE_MTU);
+  if (txBuf == NULL || rxBuf == NULL) {
+    close();
+    return false;
+  }
+
+  // a new id after each restart, so receivers do not see a sequence gap
+  if (getrandom(&self, sizeof(self), 0) != sizeof(self)) {
+    self = (uint32_t)(can_time_ns() ^ ((uint64_t)getpid() << 16));
+  }
+  txFrames = 0;
+  txOpen = 0;
+  txSeq = 0;
+  txSince = 0;
+  memset(peers, 0, sizeof(peers));
+  return true;
+}
+
+void CanBridge::close() {
+  if (sock >= 0 && txBuf != NULL) {
+    flush();
+  }
+  if (sock >= 0) {
+    ::close(sock);
+    sock = -1;
+  }
+  free(txBuf);
+  free(rxBuf);
+  txBuf = NULL;
+  rxBuf = NULL;
+}
+
+/**
+ * \param view received frame, read where it is
+ * \param timestamp when it was received, in nano-seconds of any clock
+ */
+void CanBridge::add(const CanMessageView &view, uint64_t timestamp) {
+  uint8_t flags = 0;
+  if (view.fd()) {
+    flags = RECORD_FD | (view.fdFlags() & CANFD_BRS ? RECORD_BRS : 0) |
+            (view.fdFlags() & CANFD_ESI ? RECORD_ESI : 0);
+  }
+  // CanMessageView ids carry CAN_ID_EXT, which is CAN_EFF_FLAG
+  put(view.id() | (view.rtr() ? CAN_RTR_FLAG : 0), view.len(), flags,
+      view.data(), timestamp);
+}
+
+/**
+ * A message goes as a CAN FD frame if it is longer than 8 bytes, the way
+ * CanNode::can_tx() sends it.
+ *
+ * \param msg message to send
+ * \param timestamp when it was received, in nano-seconds of any clock
+ */
+void CanBridge::add(const CanMessage *msg, uint64_t timestamp) {
+  put(msg->id | (msg->ext ? CAN_EFF_FLAG : 0) | (msg->rtr ? CAN_RTR_FLAG : 0),
+      msg->len, msg->len > CAN_MAX_DLEN ? RECORD_FD : 0, msg->data, timestamp);
+}
+
+/**
+ * Frames are written into the open datagram as they come. A datagram is
+ * sealed when the next frame does not fit, or when its time is too far from
+ * the first frame to fit in 32 bits, and the batch is sent once all
+ * \ref CAN_BRIDGE_BATCH datagrams are sealed.
+ */
+void CanBridge::put(uint32_t canId, uint8_t len, uint8_t flags,
+                    const uint8_t *data, uint64_t timestamp) {
+  if (txBuf == NULL) {
+    return;
+  }
+  if (len > CAN_MAX_DATA) {
+    len = CAN_MAX_DATA;
+  }
+  uint32_t record = RECORD_LEN + len;
+  if (txFrames != 0 && (txLen[txOpen] + record > datagramSize ||
+                        timestamp - txBase > UINT32_MAX)) {
+    seal();
+    if (txOpen == CAN_BRIDGE_BATCH) {
+      flush();
+    }
+  }
+  if (txFrames == 0) {
+    txLen[txOpen] = HEADER_LEN;
+    txBase = timestamp;
+    if (txSince == 0) {
+      txSince = can_time_ns();
+    }
+  }
+
+  uint8_t *p = txBuf + txOpen * CAN_BRIDGE_MTU + txLen[txOpen];
+  put32(p, (uint32_t)(timestamp - txBase));
+  put32(p + 4, canId);
+  p[8] = len;
+  p[9] = flags;
+  memcpy(p + RECORD_LEN, data, len);
+  txLen[txOpen] += record;
+  txFrames++;
+}
+
+/**
+ * Write the header of the open datagram and start the next one.
+ */
+void CanBridge::seal() {
+  uint8_t *p = txBuf + txOpen * CAN_BRIDGE_MTU;
+  put16(p, BRIDGE_MAGIC);
+  p[2] = BRIDGE_VERSION;
+  p[3] = 0;
+  put32(p + 4, self);
+  put32(p + 8, txSeq++);
+  put16(p + 12, txFrames);
+  put16(p + 14, 0);
+  put64(p + 16, txBase);
+  txOpen++;
+  txFrames = 0;
+}
+
+/**
+ * A datagram the kernel refuses is counted in
+ * \ref CanBridgeStats::sendErrors and skipped, so one bad send does not hold
+ * up the rest of the batch.
+ *
+ * \returns the number of datagrams sent.
+ */
+uint32_t CanBridge::flush() {
+  if (txBuf == NULL) {
+    return 0;
+  }
+  if (txFrames != 0) {
+    seal();
+  }
+
+  struct mmsghdr msgs[CAN_BRIDGE_BATCH];
+  struct iovec iov[CAN_BRIDGE_BATCH];
+  memset(msgs, 0, txOpen * sizeof(msgs[0]));
+  for (uint32_t i = 0; i < txOpen; ++i) {
+    iov[i].iov_base = txBuf + i * CAN_BRIDGE_MTU;
+    iov[i].iov_len = txLen[i];
+    msgs[i].msg_hdr.msg_name = &dest;
+    msgs[i].msg_hdr.msg_namelen = sizeof(dest);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  uint32_t sent = 0;
+  uint32_t done = 0;
+  while (done < txOpen) {
+    int n = sendmmsg(sock, msgs + done, txOpen - done, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // the first datagram failed, drop it and go on with the others
+      sendErrors++;
+      done++;
+      continue;
+    }
+    for (int i = 0; i < n; ++i) {
+      framesSent += get16(txBuf + (done + i) * CAN_BRIDGE_MTU + 12);
+    }
+    sent += n;
+    done += n;
+  }
+  datagramsSent += sent;
+
+  txOpen = 0;
+  txSince = 0;
+  return sent;
+}
+
+/**
+ * Call from the loop that adds frames, e.g. after checkForMessages().
+ */
+void CanBridge::service() {
+  if (txSince != 0 && can_time_ns() - txSince >= maxLatency) {
+    flush();
+  }
+}
+
+/**
+ * For waitForMessages() or poll(), so a batch that does not fill up still
+ * goes out in time.
+ *
+ * \param max mili-seconds to return if nothing is pending
+ */
+uint32_t CanBridge::timeout(uint32_t max) const {
+  if (txSince == 0) {
+    return max;
+  }
+  uint64_t now = can_time_ns();
+  uint64_t due = txSince + maxLatency;
+  uint64_t wait = due > now ? (due - now + 999999) / 1000000 : 0;
+  return wait < max ? (uint32_t)wait : max;
+}
+
+/**
+ * Reads up to \ref CAN_BRIDGE_BATCH datagrams with one recvmmsg(), without
+ * waiting. Datagrams of this bridge, of other programs and cut ones are
+ * skipped, a datagram that ends early is used up to the last whole frame.
+ *
+ * \param handle called for every frame, in the order they were added
+ *
+ * \returns the number of frames handed to handle.
+ */
+uint32_t CanBridge::receive(const CanBridgeHandler &handle) {
+  if (rxBuf == NULL) {
+    return 0;
+  }
+  struct mmsghdr msgs[CAN_BRIDGE_BATCH];
+  struct iovec iov[CAN_BRIDGE_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < CAN_BRIDGE_BATCH; ++i) {
+    iov[i].iov_base = rxBuf + i * CAN_BRIDGE_MTU;
+    iov[i].iov_len = CAN_BRIDGE_MTU;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int count = recvmmsg(sock, msgs, CAN_BRIDGE_BATCH, MSG_DONTWAIT, NULL);
+  if (count < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      perror("can bridge receive");
+    }
+    return 0;
+  }
+
+  uint32_t frames = 0;
+  CanBridgeFrame frame;
+  for (int i = 0; i < count; ++i) {
+    const uint8_t *p = rxBuf + i * CAN_BRIDGE_MTU;
+    uint32_t len = msgs[i].msg_len;
+    if (len < HEADER_LEN || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+        get16(p) != BRIDGE_MAGIC || p[2] != BRIDGE_VERSION) {
+      badDatagrams++;
+      continue;
+    }
+    frame.sender = get32(p + 4);
+    if (frame.sender == self) {
+      // looped back by multicast
+      continue;
+    }
+    datagramsReceived++;
+    track(frame.sender, get32(p + 8));
+
+    uint16_t numFrames = get16(p + 12);
+    uint64_t base = get64(p + 16);
+    uint32_t off = HEADER_LEN;
+    for (uint16_t f = 0; f < numFrames; ++f) {
+      if (off + RECORD_LEN > len || p[off + 8] > CAN_MAX_DATA ||
+          (p[off + 8] > CAN_MAX_DLEN && !(p[off + 9] & RECORD_FD)) ||
+          off + RECORD_LEN + p[off + 8] > len) {
+        badDatagrams++;
+        break;
+      }
+      uint32_t canId = get32(p + off + 4);
+      CanMessage *msg = &frame.msg;
+      frame.timestamp = base + get32(p + off);
+      msg->ext = (canId & CAN_EFF_FLAG) != 0;
+      msg->id = canId & (msg->ext ? CAN_EFF_MASK : CAN_SFF_MASK);
+      msg->rtr = (canId & CAN_RTR_FLAG) != 0;
+      msg->fmi = CAN_NO_FMI;
+      msg->len = p[off + 8];
+      uint8_t flags = p[off + 9];
+      frame.fdFlags = 0;
+      if (flags & RECORD_FD) {
+        frame.fdFlags = CANFD_FDF | (flags & RECORD_BRS ? CANFD_BRS : 0) |
+                        (flags & RECORD_ESI ? CANFD_ESI : 0);
+      }
+      memcpy(msg->data, p + off + RECORD_LEN, msg->len);
+      memset(msg->data + msg->len, 0, CAN_MAX_DATA - msg->len);
+      off += RECORD_LEN + msg->len;
+
+      handle(frame);
+      frames++;
+    }
+  }
+  framesReceived += frames;
+  return frames;
+}
+
+/**
+ * Follow the sequence numbers of a sender. The first datagram of a sender
+ * starts its count, a datagram older than the newest one is late (and was
+ * counted as lost when the newer one arrived).
+ */
+void CanBridge::track(uint32_t sender, uint32_t seq) {
+  Peer *peer = NULL;
+  Peer *unused = NULL;
+  for (int i = 0; i < CAN_BRIDGE_PEERS; ++i) {
+    if (peers[i].used && peers[i].sender == sender) {
+      peer = &peers[i];
+      break;
+    }
+    if (!peers[i].used && unused == NULL) {
+      unused = &peers[i];
+    }
+  }
+  if (peer == NULL) {
+    // too many senders, one of them starts over
+    peer = unused != NULL ? unused : &peers[sender % CAN_BRIDGE_PEERS];
+    peer->used = true;
+    peer->sender = sender;
+    peer->next = seq + 1;
+    return;
+  }
+
+  int32_t gap = (int32_t)(seq - peer->next);
+  if (gap < 0) {
+    datagramsLate++;
+    return;
+  }
+  datagramsLost += gap;
+  peer->next = seq + 1;
+}
+
+void CanBridge::getStats(CanBridgeStats *stats) const {
+  stats->framesSent = framesSent;
+  stats->datagramsSent = datagramsSent;
+  stats->sendErrors = sendErrors;
+  stats->framesReceived = framesReceived;
+  stats->datagramsReceived = datagramsReceived;
+  stats->datagramsLost = datagramsLost;
+  stats->datagramsLate = datagramsLate;
+  stats->badDatagrams = badDatagrams;
+}
@@ -0,0 +1,203 @@
+/**
+ * \file CanBridge.h
+ * \brief Carries frames between machines in batches over UDP multicast.
+ *
+ * A datagram per frame costs a system call and about 50 bytes of headers for
+ * 8 bytes of data. A CanBridge packs the frames given to add() into
+ * datagrams of up to \ref CanBridgeConfig::datagramSize bytes, together with
+ * the time each frame was received, and sends the datagrams of a batch with
+ * one sendmmsg(). A batch goes out when \ref CAN_BRIDGE_BATCH datagrams are
+ * full, when flush() is called, or from service() once its oldest frame has
+ * waited \ref CanBridgeConfig::maxLatency. receive() reads the datagrams
+ * waiting with one recvmmsg() and hands each frame to a handler.
+ *
+ * Every datagram carries the id of the bridge that sent it and a sequence
+ * number, so receivers count lost and late datagrams per sender. Datagrams a
+ * bridge sent itself are ignored when multicast loops them back to it.
+ *
+ * The bridge does not need a bus: frames can come from a batch handler (see
+ * CanNode::setBatchHandler()) or any other source, and received frames can be
+ * sent with CanNode::can_tx() or kept in memory. Adding and sending belong to
+ * one thread, receiving may run on another.
+ *
+ * Datagram layout, little endian:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | 2     | magic, "CB"                                                  |
+ * | 1     | version, 1                                                   |
+ * | 1     | reserved, 0                                                  |
+ * | 4     | id of the sending bridge                                     |
+ * | 4     | sequence number                                              |
+ * | 2     | number of frames                                             |
+ * | 2     | reserved, 0                                                  |
+ * | 8     | timestamp of the first frame in nano-seconds                 |
+ *
+ * followed by each frame:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | 4     | nano-seconds after the first frame                           |
+ * | 4     | SocketCAN can_id, with CAN_EFF_FLAG and CAN_RTR_FLAG         |
+ * | 1     | number of data bytes                                         |
+ * | 1     | flags, 1 for a CAN FD frame, 2 for BRS, 4 for ESI            |
+ * | len   | data                                                         |
+ */
+#ifndef _CAN_BRIDGE_H_
+#define _CAN_BRIDGE_H_
+
+#include "CanHandler.h"
+#include "CanMessageView.h"
+#include "CanTypes.h"
+#include <atomic>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifndef CAN_BRIDGE_BATCH
+/// Datagrams sent with one sendmmsg() or read with one recvmmsg(). Can be
+/// overwriten by redefinition
+#define CAN_BRIDGE_BATCH 32
+#endif
+
+#ifndef CAN_BRIDGE_MTU
+/// Largest datagram sent or received (a 9000 byte jumbo frame less the IP and
+/// UDP headers). Can be overwriten by redefinition
+#define CAN_BRIDGE_MTU 8972
+#endif
+
+#ifndef CAN_BRIDGE_PEERS
+/// Senders whose sequence numbers a receiver follows. Can be overwriten by
+/// redefinition
+#define CAN_BRIDGE_PEERS 16
+#endif
+
+/**
+ * \struct CanBridgeConfig
+ * \brief Where a bridge sends and how it batches.
+ *
+ * Zero fields keep the defaults.
+ */
+typedef struct {
+  const char *group;     ///< IPv4 multicast group (default "239.255.67.66")
+  uint16_t port;         ///< UDP port (default 47806)
+  const char *local;     ///< address of the network interface to use, NULL
+                         ///< for the one the routing table picks
+  uint8_t ttl;           ///< multicast hops (default 1, the local network)
+  uint16_t datagramSize; ///< most bytes in one datagram (default 1400, at
+                         ///< most \ref CAN_BRIDGE_MTU)
+  uint32_t maxLatency;   ///< micro-seconds the oldest frame may wait for a
+                         ///< batch to fill up (default 2000)
+} CanBridgeConfig;
+
+/**
+ * \struct CanBridgeFrame
+ * \brief A frame taken out of a received datagram.
+ */
+typedef struct {
+  uint64_t timestamp; ///< as given to add() on the sending side
+  uint32_t sender;    ///< id of the bridge that sent the frame
+  CanMessage msg;     ///< the frame
+  uint8_t fdFlags;    ///< CANFD_FDF for a CAN FD frame, with its CANFD_BRS
+                      ///< and CANFD_ESI
+} CanBridgeFrame;
+
+/**
+ * \typedef CanBridgeHandler
+ * \brief Receiver of frames, a function or a callable with bound context
+ * (see CanDelegate).
+ *
+ * \see CanBridge::receive
+ */
+typedef CanDelegate<const CanBridgeFrame &> CanBridgeHandler;
+
+/**
+ * \struct CanBridgeStats
+ * \brief Counters of a bridge since open().
+ */
+typedef struct {
+  uint64_t framesSent;        ///< frames in datagrams the kernel took
+  uint64_t datagramsSent;     ///< datagrams the kernel took
+  uint64_t sendErrors;        ///< datagrams dropped because sending failed
+  uint64_t framesReceived;    ///< frames handed to receive() handlers
+  uint64_t datagramsReceived; ///< datagrams of other bridges read
+  uint64_t datagramsLost;     ///< gaps in the sequence numbers of senders
+  uint64_t datagramsLate;     ///< datagrams that arrived after a later one
+  uint64_t badDatagrams;      ///< datagrams that were not a bridge's or cut
+} CanBridgeStats;
+
+class CanBridge {
+public:
+  CanBridge();
+  ~CanBridge();
+  CanBridge(const CanBridge &) = delete;
+  CanBridge &operator=(const CanBridge &) = delete;
+
+  /// \brief Join the multicast group and get ready to send.
+  bool open(const CanBridgeConfig *config);
+  /// \brief Send what is pending and leave the group.
+  void close();
+  /// \brief Add a received frame to the batch, in place.
+  void add(const CanMessageView &view, uint64_t timestamp);
+  /// \brief Add a message to the batch.
+  void add(const CanMessage *msg, uint64_t timestamp);
+  /// \brief Send the pending datagrams now, returns how many were sent.
+  uint32_t flush();
+  /// \brief Send the batch if its oldest frame waited long enough.
+  void service();
+  /// \brief Mili-seconds until service() has to send the batch, at most max.
+  uint32_t timeout(uint32_t max) const;
+  /// \brief Read the datagrams waiting and call handle for each frame.
+  uint32_t receive(const CanBridgeHandler &handle);
+  /// \brief Socket that is readable when datagrams arrived.
+  int fd() const { return sock; }
+  /// \brief Id this bridge puts in its datagrams.
+  uint32_t id() const { return self; }
+  /// \brief Get the counters of the bridge.
+  void getStats(CanBridgeStats *stats) const;
+
+private:
+  /// sequence numbers seen from one sender
+  typedef struct {
+    uint32_t sender;
+    uint32_t next; ///< sequence number expected next
+    bool used;
+  } Peer;
+
+  void put(uint32_t canId, uint8_t len, uint8_t flags, const uint8_t *data,
+           uint64_t timestamp);
+  void seal();
+  void track(uint32_t sender, uint32_t seq);
+
+  int sock;
+  uint32_t self;               ///< random id of this bridge
+  struct sockaddr_in dest;
+  uint16_t datagramSize;
+  uint64_t maxLatency;         ///< ns
+
+  // sending, datagrams of the current batch
+  uint8_t *txBuf;              ///< CAN_BRIDGE_BATCH datagrams
+  uint16_t txLen[CAN_BRIDGE_BATCH];
+  uint16_t txFrames;           ///< frames in the open datagram
+  uint64_t txBase;             ///< timestamp of its first frame
+  uint32_t txOpen;             ///< datagram frames are added to
+  uint32_t txSeq;              ///< sequence number of the next datagram
+  uint64_t txSince;            ///< can_time_ns() the oldest frame was added,
+                               ///< 0 if nothing is pending
+
+  // receiving
+  uint8_t *rxBuf;              ///< CAN_BRIDGE_BATCH datagrams
+  Peer peers[CAN_BRIDGE_PEERS];
+
+  std::atomic<uint64_t> framesSent;
+  std::atomic<uint64_t> datagramsSent;
+  std::atomic<uint64_t> sendErrors;
+  std::atomic<uint64_t> framesReceived;
+  std::atomic<uint64_t> datagramsReceived;
+  std::atomic<uint64_t> datagramsLost;
+  std::atomic<uint64_t> datagramsLate;
+  std::atomic<uint64_t> badDatagrams;
+};
+
+#endif //_CAN_BRIDGE_H_
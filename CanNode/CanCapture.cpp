@@ -0,0 +1,260 @@
+/**
+ * CanCapture.cpp
+ * \brief implements capturing CAN interfaces through AF_PACKET rings
+ */
+#include "CanCapture.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+CanCapture::Ring CanCapture::rings[CAN_CAPTURE_MAX];
+uint8_t CanCapture::numRings = 0;
+
+void CanCaptureFrame::copy(CanMessage *msg) const {
+  can_set_msg_id(msg, id());
+  msg->fmi = CAN_NO_FMI;
+  msg->rtr = rtr();
+  msg->len = len() > CAN_MAX_DATA ? CAN_MAX_DATA : len();
+  memcpy(msg->data, frame->data, msg->len);
+  memset(msg->data + msg->len, 0, CAN_MAX_DATA - msg->len);
+}
+
+/**
+ * Opens an AF_PACKET socket on the interface and maps a TPACKET_V3 ring of
+ * config->blocks blocks. Needs CAP_NET_RAW.
+ *
+ * \param interface name of the interface, e.g. "can0"
+ * \param config size of the ring, NULL for the defaults
+ *
+ * \returns the number the frames of the interface carry in
+ * CanCaptureFrame::interface(), or -1 if it could not be opened.
+ */
+int CanCapture::open(const char *interface, const CanCaptureConfig *config) {
+  CanCaptureConfig cfg = {1 << 20, 8, 10, false, false};
+  if (config != NULL) {
+    cfg.blockSize = config->blockSize != 0 ? config->blockSize : cfg.blockSize;
+    cfg.blocks = config->blocks != 0 ? config->blocks : cfg.blocks;
+    cfg.blockTimeout =
+        config->blockTimeout != 0 ? config->blockTimeout : cfg.blockTimeout;
+    cfg.outgoing = config->outgoing;
+    cfg.hwTimestamps = config->hwTimestamps;
+  }
+  if (numRings == CAN_CAPTURE_MAX) {
+    fprintf(stderr, "%s: more than %d interfaces captured\n", interface,
+            CAN_CAPTURE_MAX);
+    return -1;
+  }
+
+  unsigned int ifindex = if_nametoindex(interface);
+  if (ifindex == 0) {
+    perror(interface);
+    return -1;
+  }
+
+  // protocol 0 receives nothing until bind() names the protocol and the
+  // interface, so frames of other interfaces never land in the ring
+  int fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("can capture socket");
+    return -1;
+  }
+
+  int version = TPACKET_V3;
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) < 0) {
+    perror("can capture TPACKET_V3");
+    ::close(fd);
+    return -1;
+  }
+#ifdef PACKET_IGNORE_OUTGOING
+  // older kernels lack it, drain() skips outgoing frames as well
+  int ignore = cfg.outgoing ? 0 : 1;
+  setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore, sizeof(ignore));
+#endif
+  if (cfg.hwTimestamps) {
+    // interfaces without hardware stamps keep the software ones
+    int stamps = SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (setsockopt(fd, SOL_PACKET, PACKET_TIMESTAMP, &stamps,
+                   sizeof(stamps)) < 0) {
+      perror("can capture PACKET_TIMESTAMP");
+    }
+  }
+
+  // frames are at most CANFD_MTU, the frame size only has to divide a block
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = cfg.blockSize;
+  req.tp_block_nr = cfg.blocks;
+  req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+  req.tp_frame_nr = cfg.blockSize / req.tp_frame_size * cfg.blocks;
+  req.tp_retire_blk_tov = cfg.blockTimeout;
+  if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+    perror("can capture PACKET_RX_RING");
+    ::close(fd);
+    return -1;
+  }
+
+  size_t size = (size_t)cfg.blockSize * cfg.blocks;
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("can capture mmap");
+    ::close(fd);
+    return -1;
+  }
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("can capture bind");
+    munmap(map, size);
+    ::close(fd);
+    return -1;
+  }
+
+  Ring *ring = &rings[numRings];
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = fd;
+  ring->map = (uint8_t *)map;
+  ring->blockSize = cfg.blockSize;
+  ring->blocks = cfg.blocks;
+  ring->outgoing = cfg.outgoing;
+  return numRings++;
+}
+
+/**
+ * Hand over the frames of the blocks the kernel has filled, and give the
+ * blocks back. At most one pass over the ring, so a busy interface does not
+ * starve the others.
+ *
+ * \returns the number of frames handed over.
+ */
+uint32_t CanCapture::drain(uint8_t interface, const CanCaptureHandler &handle) {
+  Ring *ring = &rings[interface];
+  CanCaptureFrame frame;
+  frame.ifc = interface;
+  uint32_t frames = 0;
+
+  for (uint32_t b = 0; b < ring->blocks; ++b) {
+    struct tpacket_block_desc *block =
+        (struct tpacket_block_desc *)(ring->map +
+                                      (size_t)ring->next * ring->blockSize);
+    // the kernel hands a block over by setting TP_STATUS_USER
+    if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER)) {
+      break;
+    }
+
+    const uint8_t *pkt =
+        (const uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+    for (uint32_t p = 0; p < block->hdr.bh1.num_pkts; ++p) {
+      const struct tpacket3_hdr *hdr = (const struct tpacket3_hdr *)pkt;
+      const struct sockaddr_ll *addr =
+          (const struct sockaddr_ll *)(pkt +
+                                       TPACKET_ALIGN(sizeof(*hdr)));
+      pkt += hdr->tp_next_offset;
+
+      // only classic and CAN FD frames, not e.g. CAN XL
+      if (hdr->tp_snaplen != CAN_MTU && hdr->tp_snaplen != CANFD_MTU) {
+        continue;
+      }
+      frame.isOutgoing = addr->sll_pkttype == PACKET_OUTGOING;
+      if (frame.isOutgoing && !ring->outgoing) {
+        continue;
+      }
+      frame.frame =
+          (const struct canfd_frame *)((const uint8_t *)hdr + hdr->tp_mac);
+      frame.isFd = hdr->tp_snaplen == CANFD_MTU;
+      frame.ns = hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+      handle(frame);
+      frames++;
+    }
+
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    ring->next = (ring->next + 1) % ring->blocks;
+  }
+
+  ring->stats.frames += frames;
+  return frames;
+}
+
+/**
+ * Reads every block that is ready on any interface. Only if there were none
+ * does it wait in poll() for the kernel to hand over a block, which happens
+ * when a block is full or its blockTimeout passed.
+ *
+ * \param timeout mili-seconds to wait if no frames are ready, 0 to not wait,
+ * -1 to wait until there are
+ * \param handle called for each frame, the frame is only valid while it runs
+ *
+ * \returns the number of frames handed over.
+ */
+uint32_t CanCapture::poll(int timeout, const CanCaptureHandler &handle) {
+  uint32_t frames = 0;
+  for (uint8_t i = 0; i < numRings; ++i) {
+    frames += drain(i, handle);
+  }
+  if (frames != 0 || timeout == 0 || numRings == 0) {
+    return frames;
+  }
+
+  struct pollfd fds[CAN_CAPTURE_MAX];
+  for (uint8_t i = 0; i < numRings; ++i) {
+    fds[i].fd = rings[i].fd;
+    fds[i].events = POLLIN | POLLERR;
+    fds[i].revents = 0;
+  }
+  if (::poll(fds, numRings, timeout) < 0 && errno != EINTR) {
+    perror("can capture poll");
+    return 0;
+  }
+
+  for (uint8_t i = 0; i < numRings; ++i) {
+    frames += drain(i, handle);
+  }
+  return frames;
+}
+
+/**
+ * \param interface number returned by open()
+ * \param stats[out] counters of the interface
+ *
+ * \returns false if there is no such interface.
+ */
+bool CanCapture::getStats(uint8_t interface, CanCaptureStats *stats) {
+  if (interface >= numRings) {
+    return false;
+  }
+  Ring *ring = &rings[interface];
+
+  // the kernel clears its counters each time they are read
+  struct tpacket_stats_v3 kernel;
+  socklen_t len = sizeof(kernel);
+  if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &kernel, &len) ==
+      0) {
+    ring->stats.dropped += kernel.tp_drops;
+    ring->stats.freezes += kernel.tp_freeze_q_cnt;
+  }
+  *stats = ring->stats;
+  return true;
+}
+
+void CanCapture::close() {
+  for (uint8_t i = 0; i < numRings; ++i) {
+    munmap(rings[i].map, (size_t)rings[i].blockSize * rings[i].blocks);
+    ::close(rings[i].fd);
+  }
+  numRings = 0;
+}
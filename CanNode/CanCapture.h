@@ -0,0 +1,160 @@
+/**
+ * \file CanCapture.h
+ * \brief Captures CAN interfaces through memory mapped AF_PACKET rings.
+ *
+ * Logging a fully loaded bus through the raw socket still costs a system call
+ * per batch and a copy of every frame. CanCapture instead opens each
+ * interface with an AF_PACKET socket and a TPACKET_V3 ring shared with the
+ * kernel. The kernel fills whole blocks of frames together with their
+ * timestamps, and frames are read straight out of the ring: no copies, and
+ * no system call at all while blocks are ready. poll() is only called when
+ * every ring is empty.
+ *
+ * Capturing does not need a CanNode and does not touch the CanNode socket,
+ * so up to \ref CAN_CAPTURE_MAX interfaces can be captured next to (or
+ * without) a bus. Frames of one interface are handed over in the order they
+ * were received, frames of different interfaces can be merged by timestamp.
+ * The functions are meant to be called from one thread.
+ *
+ * Example code
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanCapture::open("can0", NULL);
+ * CanCapture::open("can1", NULL);
+ * for (;;) {
+ *   CanCapture::poll(100, [](const CanCaptureFrame &frame) {
+ *     record(frame.interface(), frame.timestamp(), frame.id(), frame.data(),
+ *            frame.len());
+ *   });
+ * }
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_CAPTURE_H_
+#define _CAN_CAPTURE_H_
+
+#include "CanHandler.h"
+#include "CanTypes.h"
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef CAN_CAPTURE_MAX
+/// Number of interfaces that can be captured at once. Can be overwriten by
+/// redefinition
+#define CAN_CAPTURE_MAX 8
+#endif
+
+/**
+ * \struct CanCaptureConfig
+ * \brief Size and behaviour of the ring of one interface.
+ *
+ * Zero fields keep the defaults.
+ */
+typedef struct {
+  uint32_t blockSize;    ///< Bytes per block, a power of two multiple of the
+                         ///< page size (default 1 MiB)
+  uint32_t blocks;       ///< Blocks in the ring (default 8)
+  uint32_t blockTimeout; ///< mili-seconds before a block that is not full is
+                         ///< handed over anyway (default 10)
+  bool outgoing;         ///< Also capture frames sent from this host
+  bool hwTimestamps;     ///< Use hardware timestamps if the interface has
+                         ///< them
+} CanCaptureConfig;
+
+/**
+ * \struct CanCaptureStats
+ * \brief Counters of the ring of one interface since it was opened.
+ */
+typedef struct {
+  uint64_t frames;   ///< Frames read from the ring
+  uint64_t dropped;  ///< Frames the kernel dropped because the ring was full
+  uint64_t freezes;  ///< Times the ring filled up
+} CanCaptureStats;
+
+/**
+ * \brief One captured frame, read in place in the ring.
+ *
+ * Only valid while the handler it was passed to runs, the block it is in is
+ * then given back to the kernel. copy() keeps the frame as a CanMessage.
+ */
+class CanCaptureFrame {
+public:
+  CanCaptureFrame(const CanCaptureFrame &) = delete;
+  CanCaptureFrame &operator=(const CanCaptureFrame &) = delete;
+
+  /// \brief Id of the frame, with \ref CAN_ID_EXT set for an extended id.
+  uint32_t id() const {
+    return frame->can_id & CAN_EFF_FLAG
+               ? frame->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK)
+               : frame->can_id & CAN_SFF_MASK;
+  }
+  /// \brief Check if the frame has an extended 29-bit id.
+  bool ext() const { return (frame->can_id & CAN_EFF_FLAG) != 0; }
+  /// \brief Check if the frame is a remote transmission request.
+  bool rtr() const { return (frame->can_id & CAN_RTR_FLAG) != 0; }
+  /// \brief Check if this is an error frame (see linux/can/error.h).
+  bool error() const { return (frame->can_id & CAN_ERR_FLAG) != 0; }
+  /// \brief Check if this is a CAN FD frame.
+  bool fd() const { return isFd; }
+  /// \brief Check if the frame was sent from this host.
+  bool outgoing() const { return isOutgoing; }
+  /// \brief Number of data bytes.
+  uint8_t len() const {
+    uint8_t max = isFd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+    return frame->len > max ? max : frame->len;
+  }
+  /// \brief Data bytes of the frame, len() of them.
+  const uint8_t *data() const { return frame->data; }
+  /// \brief Kernel timestamp in nano-seconds since the epoch.
+  uint64_t timestamp() const { return ns; }
+  /// \brief Position of the interface in the order it was opened.
+  uint8_t interface() const { return ifc; }
+  /// \brief Copy the frame into a message that outlives the ring.
+  void copy(CanMessage *msg) const;
+
+private:
+  friend class CanCapture;
+  CanCaptureFrame() = default;
+
+  const struct canfd_frame *frame; ///< in the ring, only len() data bytes
+  uint64_t ns;
+  uint8_t ifc;
+  bool isFd;
+  bool isOutgoing;
+};
+
+/**
+ * \typedef CanCaptureHandler
+ * \brief Called for each captured frame, a function or a callable with bound
+ * context (see CanDelegate).
+ */
+typedef CanDelegate<const CanCaptureFrame &> CanCaptureHandler;
+
+class CanCapture {
+public:
+  /// \brief Start capturing an interface, returns its number or -1.
+  static int open(const char *interface, const CanCaptureConfig *config);
+  /// \brief Call handle for every captured frame, waiting up to timeout ms.
+  static uint32_t poll(int timeout, const CanCaptureHandler &handle);
+  /// \brief Get the counters of an interface.
+  static bool getStats(uint8_t interface, CanCaptureStats *stats);
+  /// \brief Stop capturing all interfaces.
+  static void close();
+
+private:
+  typedef struct {
+    int fd;
+    uint8_t *map;        ///< the ring, blocks * blockSize bytes
+    uint32_t blockSize;
+    uint32_t blocks;
+    uint32_t next;       ///< next block to read
+    bool outgoing;       ///< hand over frames sent from this host
+    CanCaptureStats stats;
+  } Ring;
+
+  static Ring rings[CAN_CAPTURE_MAX];
+  static uint8_t numRings;
+
+  static uint32_t drain(uint8_t interface, const CanCaptureHandler &handle);
+};
+
+#endif //_CAN_CAPTURE_H_
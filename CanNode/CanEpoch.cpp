@@ -0,0 +1,141 @@
+/**
+ * CanEpoch.cpp
+ * \brief implements epoch based reclamation
+ */
+#include "CanEpoch.h"
+#include <sched.h>
+#include <stdlib.h>
+
+std::atomic<uint64_t> CanEpoch::global(1);
+CanEpoch::Reader CanEpoch::readers[CAN_EPOCH_READERS];
+thread_local CanEpoch::Slot CanEpoch::local = {nullptr};
+thread_local uint32_t CanEpoch::depth = 0;
+CanEpoch::Retired *CanEpoch::retired = nullptr;
+uint32_t CanEpoch::numRetired = 0;
+uint32_t CanEpoch::sizeRetired = 0;
+
+CanEpoch::Slot::~Slot() {
+  if (reader != nullptr) {
+    reader->epoch.store(0, std::memory_order_release);
+    reader->used.store(false, std::memory_order_release);
+  }
+}
+
+/**
+ * Get the slot of the calling thread, claiming a free one on first use. If
+ * every slot is taken this waits for a thread to exit.
+ */
+CanEpoch::Reader *CanEpoch::reader() {
+  if (local.reader != nullptr) {
+    return local.reader;
+  }
+  for (;;) {
+    for (uint32_t i = 0; i < CAN_EPOCH_READERS; ++i) {
+      bool used = false;
+      if (!readers[i].used.load(std::memory_order_relaxed) &&
+          readers[i].used.compare_exchange_strong(used, true,
+                                                  std::memory_order_acquire)) {
+        local.reader = &readers[i];
+        return local.reader;
+      }
+    }
+    sched_yield();
+  }
+}
+
+void CanEpoch::enter() {
+  if (depth++ > 0) {
+    return;
+  }
+  // seq_cst so a writer scanning the slots after retiring sees this epoch
+  reader()->epoch.store(global.load(std::memory_order_seq_cst),
+                        std::memory_order_seq_cst);
+}
+
+void CanEpoch::leave() {
+  if (depth == 0 || --depth > 0) {
+    return;
+  }
+  local.reader->epoch.store(0, std::memory_order_release);
+}
+
+/**
+ * \returns the epoch of the oldest running read section, or UINT64_MAX if
+ * there is none.
+ */
+uint64_t CanEpoch::oldest() {
+  uint64_t min = UINT64_MAX;
+  for (uint32_t i = 0; i < CAN_EPOCH_READERS; ++i) {
+    uint64_t epoch = readers[i].epoch.load(std::memory_order_seq_cst);
+    if (epoch != 0 && epoch < min) {
+      min = epoch;
+    }
+  }
+  return min;
+}
+
+/**
+ * Call once arg can no longer be reached by readers that start now. Readers
+ * that started before may still be using it, release is called once they all
+ * left, from a later reclaim().
+ *
+ * \param release function that frees arg
+ * \param arg what to free
+ *
+ * \returns false if out of memory, arg is then released right away after
+ * waiting for the running read sections.
+ */
+bool CanEpoch::retire(epochRelease release, void *arg) {
+  uint64_t epoch = global.fetch_add(1, std::memory_order_seq_cst);
+
+  if (numRetired == sizeRetired) {
+    uint32_t size = sizeRetired * 2 + 32;
+    Retired *grown = (Retired *)realloc(retired, size * sizeof(Retired));
+    if (grown == nullptr) {
+      synchronize();
+      release(arg);
+      return false;
+    }
+    retired = grown;
+    sizeRetired = size;
+  }
+  retired[numRetired].epoch = epoch;
+  retired[numRetired].release = release;
+  retired[numRetired].arg = arg;
+  numRetired++;
+  return true;
+}
+
+void CanEpoch::reclaim() {
+  uint64_t min = oldest();
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < numRetired; ++i) {
+    // readers at min entered after anything retired before min
+    if (retired[i].epoch < min) {
+      retired[i].release(retired[i].arg);
+    } else {
+      retired[kept++] = retired[i];
+    }
+  }
+  numRetired = kept;
+}
+
+/**
+ * A read section of the calling thread itself is not waited for, so this can
+ * be called from a handler that is being dispatched.
+ */
+void CanEpoch::synchronize() {
+  uint64_t epoch = global.fetch_add(1, std::memory_order_seq_cst);
+  for (uint32_t i = 0; i < CAN_EPOCH_READERS; ++i) {
+    if (&readers[i] == local.reader) {
+      continue;
+    }
+    for (;;) {
+      uint64_t seen = readers[i].epoch.load(std::memory_order_seq_cst);
+      if (seen == 0 || seen > epoch) {
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
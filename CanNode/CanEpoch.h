@@ -0,0 +1,78 @@
+/**
+ * \file CanEpoch.h
+ * \brief Epoch based reclamation for data that is read without a lock.
+ *
+ * Readers mark the code that looks at shared data with enter() and leave(),
+ * which only store to a slot of their own thread. A writer that unlinks
+ * something readers may still be looking at passes it to retire() instead of
+ * freeing it. reclaim() runs the release function of everything retired
+ * before the oldest read section still running, so a reader never sees its
+ * data freed from under it and never has to wait for a writer.
+ *
+ * retire() and reclaim() are not synchronized with each other, the caller
+ * serializes them (CanRegistry does so with its writer lock).
+ */
+#ifndef _CAN_EPOCH_H_
+#define _CAN_EPOCH_H_
+
+#include <atomic>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef CAN_EPOCH_READERS
+/// Maximum number of threads inside a read section at the same time. Can be
+/// overwriten by redefinition
+#define CAN_EPOCH_READERS 64
+#endif
+
+/**
+ * \typedef epochRelease
+ * \brief Function that frees something passed to CanEpoch::retire().
+ */
+typedef void (*epochRelease)(void *arg);
+
+class CanEpoch {
+public:
+  /// \brief Start a read section, sections of one thread may nest.
+  static void enter();
+  /// \brief End a read section.
+  static void leave();
+  /// \brief Release arg once no read section can still be looking at it.
+  static bool retire(epochRelease release, void *arg);
+  /// \brief Release everything no read section can be looking at any more.
+  static void reclaim();
+  /// \brief Wait until every read section of other threads running now ended.
+  static void synchronize();
+
+private:
+  /// Epoch of one reading thread, 0 outside of a read section
+  struct alignas(64) Reader {
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> used;
+  };
+
+  /// Reader slot of a thread, given back when the thread exits
+  struct Slot {
+    Reader *reader;
+    ~Slot();
+  };
+
+  typedef struct {
+    uint64_t epoch; ///< global epoch when it was retired
+    epochRelease release;
+    void *arg;
+  } Retired;
+
+  static std::atomic<uint64_t> global;
+  static Reader readers[CAN_EPOCH_READERS];
+  static thread_local Slot local;
+  static thread_local uint32_t depth;
+  static Retired *retired;
+  static uint32_t numRetired;
+  static uint32_t sizeRetired;
+
+  static Reader *reader();
+  static uint64_t oldest();
+};
+
+#endif //_CAN_EPOCH_H_
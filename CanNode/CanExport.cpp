@@ -0,0 +1,779 @@
+/**
+ * CanExport.cpp
+ * \brief implements the columnar export of capture files
+ */
+#include "CanExport.h"
+#include "CanNode.h"
+#include <algorithm>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+/// bytes of a chunk header in a column file
+#define CHUNK_HEADER 16
+/// element of a getData() signal sent as a single value
+#define SCALAR 0xFF
+
+static const char *typeNames[] = {"u8", "i8", "u16", "i16", "u32", "i32"};
+
+static inline uint64_t zigzag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/// put value as a varint, returns the bytes used
+static inline uint32_t put_varint(uint8_t *p, uint64_t value) {
+  uint32_t n = 0;
+  while (value >= 0x80) {
+    p[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  p[n++] = (uint8_t)value;
+  return n;
+}
+
+/// take a varint, false if it runs past end
+static inline bool get_varint(const uint8_t **p, const uint8_t *end,
+                              uint64_t *value) {
+  uint64_t v = 0;
+  for (uint32_t shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*p)++;
+    v |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      *value = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+  for (int b = 0; b < 4; ++b) {
+    p[b] = (uint8_t)(value >> (8 * b));
+  }
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/// grow a malloc'd buffer to hold at least need bytes
+static bool reserve(uint8_t **buf, size_t *max, size_t need) {
+  if (need <= *max) {
+    return true;
+  }
+  size_t size = *max == 0 ? 4096 : *max;
+  while (size < need) {
+    size *= 2;
+  }
+  uint8_t *more = (uint8_t *)realloc(*buf, size);
+  if (more == NULL) {
+    return false;
+  }
+  *buf = more;
+  *max = size;
+  return true;
+}
+
+/// print a string as a JSON string
+static void json_string(FILE *f, const char *str) {
+  fputc('"', f);
+  for (; *str != '\0'; ++str) {
+    if (*str == '"' || *str == '\\') {
+      fputc('\\', f);
+    }
+    if ((unsigned char)*str >= 0x20) {
+      fputc(*str, f);
+    }
+  }
+  fputc('"', f);
+}
+
+/// print an id the way the tools take it, e for an extended id
+static int id_string(char *buf, size_t size, uint32_t id) {
+  if (id & CAN_ID_EXT) {
+    return snprintf(buf, size, "e0x%08X", id & ~CAN_ID_EXT);
+  }
+  return snprintf(buf, size, "0x%03X", id);
+}
+
+CanExport::CanExport() {
+  signals = NULL;
+  numSignals = 0;
+  dir = NULL;
+  columns = NULL;
+  numColumns = 0;
+  maxColumns = 0;
+  bytesOut = 0;
+  failed = false;
+}
+
+CanExport::~CanExport() {
+  for (uint32_t i = 0; i < numColumns; ++i) {
+    free(columns[i].buf);
+  }
+  free(columns);
+  free(signals);
+}
+
+/**
+ * Reads signal definitions, see CanExport.h for the format. Lines that
+ * are empty or start with # are skipped.
+ *
+ * \returns false if the file could not be read or has a bad line.
+ */
+bool CanExport::loadSignals(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+
+  char line[256];
+  uint32_t lineNo = 0;
+  uint32_t max = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f) != NULL) {
+    lineNo++;
+    char *hash = strchr(line, '#');
+    if (hash != NULL) {
+      *hash = '\0';
+    }
+    CanSignal sig;
+    memset(&sig, 0, sizeof(sig));
+    sig.scale = 1;
+    char id[32];
+    char type = 'u';
+    unsigned start = 0, bits = 0;
+    int fields = sscanf(line, "%63s %31s %u %u %c %lf %lf %15s", sig.name, id,
+                        &start, &bits, &type, &sig.scale, &sig.offset,
+                        sig.unit);
+    if (fields <= 0) {
+      continue;
+    }
+
+    bool ext = id[0] == 'e';
+    char *end;
+    unsigned long value = strtoul(id + (ext ? 1 : 0), &end, 0);
+    sig.id = ext ? ((uint32_t)value | CAN_ID_EXT) : (uint32_t)value;
+    sig.start = (uint16_t)start;
+    sig.bits = (uint8_t)bits;
+    sig.isSigned = type == 's';
+    if (fields < 4 || *end != '\0' || !can_id_valid(sig.id) || bits == 0 ||
+        bits > 64 || start + bits > 8 * CANFD_MAX_DLEN ||
+        (type != 'u' && type != 's')) {
+      fprintf(stderr, "%s:%u: bad signal\n", path, lineNo);
+      ok = false;
+      break;
+    }
+
+    if (numSignals == max) {
+      max = max == 0 ? 64 : max * 2;
+      CanSignal *more = (CanSignal *)realloc(signals, max * sizeof(CanSignal));
+      if (more == NULL) {
+        ok = false;
+        break;
+      }
+      signals = more;
+    }
+    signals[numSignals++] = sig;
+  }
+  fclose(f);
+
+  // by id, signals of an id stay in the order of the file
+  std::stable_sort(signals, signals + numSignals,
+                   [](const CanSignal &a, const CanSignal &b) {
+                     return a.id < b.id;
+                   });
+  return ok && numSignals > 0;
+}
+
+/**
+ * Decode the values of one frame into the block, by the definitions if any
+ * were loaded, by getData() if not.
+ */
+void CanExport::decode(const CanLogFrame &frame, Block *block) const {
+  block->frames++;
+  if (frame.rtr() || frame.error()) {
+    block->skipped++;
+    return;
+  }
+  // arrays of 8-bit values are the longest, one value per data byte
+  if (block->numValues + CANFD_MAX_DLEN > block->maxValues) {
+    uint32_t max = block->maxValues == 0 ? 4096 : block->maxValues * 2;
+    Value *more = (Value *)realloc(block->values, max * sizeof(Value));
+    if (more == NULL) {
+      block->skipped++;
+      return;
+    }
+    block->values = more;
+    block->maxValues = max;
+  }
+  Value *out = block->values + block->numValues;
+  uint32_t found = 0;
+
+  if (numSignals != 0) {
+    uint32_t id = frame.id();
+    const CanSignal *sig = std::lower_bound(
+        signals, signals + numSignals, id,
+        [](const CanSignal &s, uint32_t id) { return s.id < id; });
+    for (; sig < signals + numSignals && sig->id == id; ++sig) {
+      uint32_t first = sig->start / 8;
+      uint32_t shift = sig->start % 8;
+      uint32_t bytes = (shift + sig->bits + 7) / 8;
+      if (first + bytes > frame.len()) {
+        continue;
+      }
+      unsigned __int128 word = 0;
+      for (uint32_t b = 0; b < bytes; ++b) {
+        word |= (unsigned __int128)frame.data()[first + b] << (8 * b);
+      }
+      uint64_t raw = (uint64_t)(word >> shift);
+      if (sig->bits < 64) {
+        raw &= (1ULL << sig->bits) - 1;
+        if (sig->isSigned && (raw >> (sig->bits - 1)) & 1) {
+          raw |= ~0ULL << sig->bits;
+        }
+      }
+      out[found].key = sig - signals;
+      out[found].timestamp = frame.timestamp();
+      out[found].value = (int64_t)raw;
+      found++;
+    }
+  } else if (frame.len() >= 2 && (frame.data()[0] & 0x1F) == CAN_DATA &&
+             (frame.data()[0] >> 5) <= CAN_INT32) {
+    // only frames that look like sendData ones are worth the copy
+    CanMessage msg;
+    frame.copy(&msg);
+    uint8_t type = msg.data[0] >> 5;
+    uint8_t count = 0;
+    int64_t values[CAN_MAX_ARRAY];
+    CanState state = INVALID_TYPE;
+    switch (type) {
+    case CAN_UINT8: {
+      uint8_t v[CAN_MAX_ARRAY];
+      state = CanNode::getData(&msg, v, CAN_MAX_ARRAY, &count);
+      std::copy(v, v + count, values);
+      break;
+    }
+    case CAN_INT8: {
+      int8_t v[CAN_MAX_ARRAY];
+      state = CanNode::getData(&msg, v, CAN_MAX_ARRAY, &count);
+      std::copy(v, v + count, values);
+      break;
+    }
+    case CAN_UINT16: {
+      uint16_t v[CAN_MAX_ARRAY / 2];
+      state = CanNode::getData(&msg, v, CAN_MAX_ARRAY / 2, &count);
+      std::copy(v, v + count, values);
+      break;
+    }
+    case CAN_INT16: {
+      int16_t v[CAN_MAX_ARRAY / 2];
+      state = CanNode::getData(&msg, v, CAN_MAX_ARRAY / 2, &count);
+      std::copy(v, v + count, values);
+      break;
+    }
+    case CAN_UINT32: {
+      uint32_t v[CAN_MAX_ARRAY / 4];
+      state = CanNode::getData(&msg, v, CAN_MAX_ARRAY / 4, &count);
+      std::copy(v, v + count, values);
+      break;
+    }
+    case CAN_INT32: {
+      int32_t v[CAN_MAX_ARRAY / 4];
+      state = CanNode::getData(&msg, v, CAN_MAX_ARRAY / 4, &count);
+      std::copy(v, v + count, values);
+      break;
+    }
+    }
+    if (state == DATA_OK) {
+      // the type is part of the key so chunks never mix types
+      uint64_t key = (uint64_t)frame.id() << 16 | (uint64_t)type << 8;
+      for (uint8_t i = 0; i < count; ++i) {
+        out[i].key = key | (count == 1 ? SCALAR : i);
+        out[i].timestamp = frame.timestamp();
+        out[i].value = values[i];
+      }
+      found = count;
+    }
+  }
+
+  block->numValues += found;
+  if (found == 0) {
+    block->skipped++;
+  }
+}
+
+/**
+ * Sort the values of a block by signal, keeping their order in time, and
+ * encode each signal into a chunk.
+ */
+void CanExport::encode(Block *block) const {
+  std::stable_sort(block->values, block->values + block->numValues,
+                   [](const Value &a, const Value &b) {
+                     return a.key < b.key;
+                   });
+  block->numBytes = 0;
+  for (uint32_t i = 0; i < block->numValues;) {
+    uint32_t end = i;
+    while (end < block->numValues &&
+           block->values[end].key == block->values[i].key) {
+      end++;
+    }
+    size_t need = block->numBytes + sizeof(ChunkHead) + 20 * (end - i);
+    if (!reserve(&block->bytes, &block->maxBytes, need)) {
+      block->skipped += end - i;
+      i = end;
+      continue;
+    }
+
+    ChunkHead head;
+    memset(&head, 0, sizeof(head));
+    head.key = block->values[i].key;
+    head.count = end - i;
+    head.first = UINT64_MAX;
+    head.type = numSignals != 0 ? 0 : (uint8_t)(head.key >> 8);
+    uint8_t *p = block->bytes + block->numBytes + sizeof(ChunkHead);
+    uint8_t *start = p;
+    uint64_t prev = 0;
+    for (uint32_t v = i; v < end; ++v) {
+      uint64_t ts = block->values[v].timestamp;
+      p += put_varint(p, zigzag((int64_t)(ts - prev)));
+      prev = ts;
+      head.first = ts < head.first ? ts : head.first;
+      head.last = ts > head.last ? ts : head.last;
+    }
+    head.tsBytes = (uint32_t)(p - start);
+    int64_t prevValue = 0;
+    for (uint32_t v = i; v < end; ++v) {
+      int64_t value = block->values[v].value;
+      p += put_varint(p, zigzag((int64_t)((uint64_t)value - prevValue)));
+      prevValue = value;
+    }
+    head.valueBytes = (uint32_t)(p - start) - head.tsBytes;
+    memcpy(block->bytes + block->numBytes, &head, sizeof(head));
+    block->numBytes = p - block->bytes;
+    i = end;
+  }
+}
+
+/**
+ * Find the column of a signal, creating it and its file the first time.
+ */
+CanExport::Column *CanExport::column(uint64_t key, uint8_t type) {
+  Column *col = std::lower_bound(
+      columns, columns + numColumns, key,
+      [](const Column &c, uint64_t key) { return c.key < key; });
+  if (col < columns + numColumns && col->key == key) {
+    return col;
+  }
+
+  if (numColumns == maxColumns) {
+    uint32_t max = maxColumns == 0 ? 64 : maxColumns * 2;
+    Column *more = (Column *)realloc(columns, max * sizeof(Column));
+    if (more == NULL) {
+      return NULL;
+    }
+    col = more + (col - columns);
+    columns = more;
+    maxColumns = max;
+  }
+  memmove(col + 1, col, (columns + numColumns - col) * sizeof(Column));
+  numColumns++;
+  memset(col, 0, sizeof(*col));
+  col->key = key;
+  col->type = type;
+  col->first = UINT64_MAX;
+
+  if (numSignals != 0) {
+    snprintf(col->name, sizeof(col->name), "%s", signals[key].name);
+  } else {
+    uint32_t id = (uint32_t)(key >> 16);
+    uint8_t element = (uint8_t)key;
+    int n = id_string(col->name, sizeof(col->name), id);
+    if (element != SCALAR) {
+      snprintf(col->name + n, sizeof(col->name) - n, ".%u", element);
+    }
+  }
+  // names become file names, keep them to safe characters
+  size_t n = 0;
+  for (const char *c = col->name; *c != '\0'; ++c) {
+    bool safe = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+                (*c >= '0' && *c <= '9') || *c == '.' || *c == '-';
+    col->file[n++] = safe ? *c : '_';
+  }
+  // opening a file another column uses would truncate it
+  for (uint32_t suffix = 1;; ++suffix) {
+    if (suffix == 1) {
+      snprintf(col->file + n, sizeof(col->file) - n, ".col");
+    } else {
+      snprintf(col->file + n, sizeof(col->file) - n, "-%u.col", suffix);
+    }
+    bool taken = false;
+    for (uint32_t i = 0; i < numColumns && !taken; ++i) {
+      taken = &columns[i] != col && strcmp(columns[i].file, col->file) == 0;
+    }
+    if (!taken) {
+      break;
+    }
+  }
+
+  uint8_t header[8] = {'C', 'C', 'O', 'L', 1, 0, 0, 0};
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, col->file);
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 || write(fd, header, sizeof(header)) != sizeof(header)) {
+    perror(path);
+    failed = true;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  bytesOut += sizeof(header);
+  return col;
+}
+
+/**
+ * Add bytes to a column, and append what it holds to its file once that is
+ * \ref CAN_EXPORT_FLUSH bytes or more. len 0 writes out what is held.
+ */
+bool CanExport::append(Column *col, const uint8_t *data, size_t len) {
+  size_t max = col->buf == NULL ? 0 : CAN_EXPORT_FLUSH;
+  if (col->len + len > max) {
+    max = col->len + len > CAN_EXPORT_FLUSH ? col->len + len
+                                            : CAN_EXPORT_FLUSH;
+    uint8_t *more = (uint8_t *)realloc(col->buf, max);
+    if (more == NULL) {
+      return false;
+    }
+    col->buf = more;
+  }
+  memcpy(col->buf + col->len, data, len);
+  col->len += len;
+  bytesOut += len;
+  if (col->len < CAN_EXPORT_FLUSH && len != 0) {
+    return true;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, col->file);
+  int fd = ::open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  bool ok = fd >= 0;
+  for (size_t done = 0; ok && done < col->len;) {
+    ssize_t n = write(fd, col->buf + done, col->len - done);
+    if (n < 0 && errno != EINTR) {
+      ok = false;
+    }
+    done += n > 0 ? n : 0;
+  }
+  if (!ok) {
+    perror(path);
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  col->len = 0;
+  return ok;
+}
+
+bool CanExport::writeManifest(const CanLogReader *log) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/manifest.json", dir);
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+
+  const CanLogFileHeader *header = log->header();
+  fprintf(f, "{\n  \"capture\": {\"first\": %llu, \"last\": %llu, "
+             "\"frames\": %llu, \"interfaces\": [",
+          (unsigned long long)log->first(), (unsigned long long)log->last(),
+          (unsigned long long)log->frames());
+  for (uint8_t i = 0; i < header->numInterfaces; ++i) {
+    char name[CAN_LOG_NAME + 1] = {0};
+    memcpy(name, header->interfaces[i], CAN_LOG_NAME);
+    fprintf(f, i == 0 ? "" : ", ");
+    json_string(f, name);
+  }
+  fprintf(f, "]},\n  \"encoding\": \"delta zigzag varint\",\n"
+             "  \"signals\": [");
+
+  for (uint32_t i = 0; i < numColumns; ++i) {
+    const Column *col = &columns[i];
+    char id[16];
+    fprintf(f, "%s\n    {\"name\": ", i == 0 ? "" : ",");
+    json_string(f, col->name);
+    fprintf(f, ", \"file\": ");
+    json_string(f, col->file);
+    if (numSignals != 0) {
+      const CanSignal *sig = &signals[col->key];
+      id_string(id, sizeof(id), sig->id);
+      fprintf(f,
+              ", \"id\": \"%s\", \"start\": %u, \"bits\": %u, "
+              "\"signed\": %s, \"scale\": %.17g, \"offset\": %.17g, "
+              "\"unit\": ",
+              id, sig->start, sig->bits, sig->isSigned ? "true" : "false",
+              sig->scale, sig->offset);
+      json_string(f, sig->unit);
+    } else {
+      id_string(id, sizeof(id), (uint32_t)(col->key >> 16));
+      fprintf(f, ", \"id\": \"%s\", \"type\": \"%s\"", id,
+              col->type < 6 ? typeNames[col->type] : "?");
+      if ((uint8_t)col->key != SCALAR) {
+        fprintf(f, ", \"element\": %u", (uint8_t)col->key);
+      }
+    }
+    fprintf(f, ", \"count\": %llu, \"first\": %llu, \"last\": %llu}",
+            (unsigned long long)col->count, (unsigned long long)col->first,
+            (unsigned long long)col->last);
+  }
+  fprintf(f, "\n  ]\n}\n");
+  return fclose(f) == 0;
+}
+
+/**
+ * Decodes the blocks of the capture on threads worker threads, a few blocks
+ * ahead, while the calling thread appends the chunks of each block to the
+ * columns in file order.
+ *
+ * \param log capture to export
+ * \param dir directory for the column files and manifest.json, created if
+ * missing
+ * \param threads threads decoding blocks, 0 or 1 to decode on this thread
+ * \param stats[out] what was done, may be NULL
+ *
+ * \returns false if a file could not be written.
+ */
+bool CanExport::run(const CanLogReader *log, const char *outDir,
+                    uint32_t threads, CanExportStats *stats) {
+  if (mkdir(outDir, 0755) < 0 && errno != EEXIST) {
+    perror(outDir);
+    return false;
+  }
+  dir = outDir;
+  failed = false;
+  bytesOut = 0;
+  CanExportStats local;
+  memset(&local, 0, sizeof(local));
+
+  uint32_t window = threads <= 1 ? 1 : 2 * threads;
+  Block *blocks = (Block *)calloc(window, sizeof(Block));
+  if (blocks == NULL) {
+    return false;
+  }
+
+  auto work = [this, log](uint32_t k, Block *block) {
+    block->numValues = 0;
+    block->frames = 0;
+    block->skipped = 0;
+    log->read(k, [this, block](const CanLogFrame &frame) {
+      decode(frame, block);
+    });
+    encode(block);
+  };
+  auto merge = [this, log, &local](uint32_t k, const Block *block) {
+    local.frames += block->frames;
+    local.skipped += block->skipped;
+    local.bytesIn += sizeof(CanLogBlockHeader) + log->block(k)->header->bytes;
+    for (size_t off = 0; off < block->numBytes;) {
+      ChunkHead head;
+      memcpy(&head, block->bytes + off, sizeof(head));
+      off += sizeof(head);
+      size_t len = head.tsBytes + head.valueBytes;
+      // an id sent in several types gets a column for each
+      Column *col = column(head.key, head.type);
+      uint8_t chunk[CHUNK_HEADER] = {0};
+      put32(chunk, head.count);
+      put32(chunk + 4, head.tsBytes);
+      put32(chunk + 8, head.valueBytes);
+      if (col == NULL || !append(col, chunk, sizeof(chunk)) ||
+          !append(col, block->bytes + off, len)) {
+        failed = true;
+      } else {
+        col->count += head.count;
+        col->first = head.first < col->first ? head.first : col->first;
+        col->last = head.last > col->last ? head.last : col->last;
+        local.values += head.count;
+      }
+      off += len;
+    }
+  };
+
+  uint32_t numBlocks = log->blocks();
+  if (threads <= 1) {
+    for (uint32_t k = 0; k < numBlocks; ++k) {
+      work(k, &blocks[0]);
+      merge(k, &blocks[0]);
+    }
+  } else {
+    // slot k % window holds block k once ready[] is k + 1
+    uint32_t *ready = (uint32_t *)calloc(window, sizeof(uint32_t));
+    uint32_t next = 0;
+    uint32_t merged = 0;
+    bool stop = false;
+    std::mutex lock;
+    std::condition_variable changed;
+
+    auto worker = [&]() {
+      for (;;) {
+        uint32_t k;
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          k = next++;
+          if (k >= numBlocks) {
+            return;
+          }
+          changed.wait(guard, [&]() { return stop || k < merged + window; });
+          if (stop) {
+            return;
+          }
+        }
+        work(k, &blocks[k % window]);
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          ready[k % window] = k + 1;
+        }
+        changed.notify_all();
+      }
+    };
+    std::thread *workers = new std::thread[threads];
+    for (uint32_t t = 0; t < threads; ++t) {
+      workers[t] = std::thread(worker);
+    }
+    for (uint32_t k = 0; k < numBlocks; ++k) {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() { return ready[k % window] == k + 1; });
+      }
+      merge(k, &blocks[k % window]);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        merged = k + 1;
+      }
+      changed.notify_all();
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stop = true;
+    }
+    changed.notify_all();
+    for (uint32_t t = 0; t < threads; ++t) {
+      workers[t].join();
+    }
+    delete[] workers;
+    free(ready);
+  }
+
+  for (uint32_t i = 0; i < window; ++i) {
+    free(blocks[i].values);
+    free(blocks[i].bytes);
+  }
+  free(blocks);
+
+  for (uint32_t i = 0; i < numColumns; ++i) {
+    if (!append(&columns[i], NULL, 0)) {
+      failed = true;
+    }
+  }
+  if (!writeManifest(log)) {
+    failed = true;
+  }
+  local.signals = numColumns;
+  local.bytesOut = bytesOut;
+  if (stats != NULL) {
+    *stats = local;
+  }
+  return !failed;
+}
+
+/**
+ * Reads a whole column file, e.g. to check an export. Analysis tools would
+ * read the format themselves, see CanExport.h.
+ *
+ * \param path column file
+ * \param timestamps[out] malloc'd timestamps, for the caller to free
+ * \param values[out] malloc'd values, for the caller to free
+ *
+ * \returns the number of values, -1 if the file could not be read.
+ */
+int64_t CanExport::readColumn(const char *path, uint64_t **timestamps,
+                              int64_t **values) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *buf = (uint8_t *)malloc(size > 0 ? size : 1);
+  bool ok = buf != NULL && fread(buf, 1, size, f) == (size_t)size &&
+            size >= 8 && memcmp(buf, "CCOL", 4) == 0 && buf[4] == 1;
+  fclose(f);
+
+  // count first, then decode into arrays of the right size
+  uint64_t count = 0;
+  for (long off = 8; ok && off < size;) {
+    ok = off + CHUNK_HEADER <= size &&
+         off + CHUNK_HEADER + (uint64_t)get32(buf + off + 4) +
+                 get32(buf + off + 8) <=
+             (uint64_t)size;
+    if (ok) {
+      count += get32(buf + off);
+      off += CHUNK_HEADER + get32(buf + off + 4) + get32(buf + off + 8);
+    }
+  }
+  *timestamps = ok ? (uint64_t *)malloc((count + 1) * sizeof(uint64_t)) : NULL;
+  *values = ok ? (int64_t *)malloc((count + 1) * sizeof(int64_t)) : NULL;
+  ok = ok && *timestamps != NULL && *values != NULL;
+
+  uint64_t n = 0;
+  for (long off = 8; ok && off < size;) {
+    uint32_t chunk = get32(buf + off);
+    const uint8_t *p = buf + off + CHUNK_HEADER;
+    const uint8_t *tsEnd = p + get32(buf + off + 4);
+    const uint8_t *end = tsEnd + get32(buf + off + 8);
+    uint64_t ts = 0, raw;
+    for (uint32_t i = 0; ok && i < chunk; ++i) {
+      ok = get_varint(&p, tsEnd, &raw);
+      if (!ok) {
+        break;
+      }
+      ts += (uint64_t)unzigzag(raw);
+      (*timestamps)[n + i] = ts;
+    }
+    int64_t value = 0;
+    for (uint32_t i = 0; ok && i < chunk; ++i) {
+      ok = get_varint(&p, end, &raw);
+      if (!ok) {
+        break;
+      }
+      value = (int64_t)((uint64_t)value + (uint64_t)unzigzag(raw));
+      (*values)[n + i] = value;
+    }
+    n += chunk;
+    off = end - buf;
+  }
+  free(buf);
+  if (!ok) {
+    free(*timestamps);
+    free(*values);
+    *timestamps = NULL;
+    *values = NULL;
+    fprintf(stderr, "%s: not a column file\n", path);
+    return -1;
+  }
+  return (int64_t)n;
+}
@@ -0,0 +1,176 @@
+/**
+ * \file CanExport.h
+ * \brief Turns a capture file into one columnar file per signal.
+ *
+ * Analysis tools want the history of one sensor as two arrays, timestamps and
+ * values, not a stream of frames of every id. A CanExport decodes the blocks
+ * of a capture file (see CanLogReader) on several threads and writes every
+ * signal to a file of its own, so loading a signal reads only its bytes, and
+ * a manifest.json describing them all.
+ *
+ * Signals come from one of two places:
+ *  - the sendData encoding, when no definitions are loaded: every id whose
+ *    frames getData() accepts is a signal named after the id, e.g. "0x123" or
+ *    "e0x18FEF100", and each element of an array is a signal of its own,
+ *    e.g. "0x123.2". An id sent in more than one type is a signal per
+ *    type, the manifest gives the type of each.
+ *  - a definitions file loaded with loadSignals(), a line per signal:
+ *
+ * ~~~~~~~~~~~~
+ * # name       id          start bits type scale offset unit
+ * wheel_fl     0x300       0     16   u    0.01  0      km/h
+ * yaw_rate     e0x18FEF100 16    12   s    0.1   -204.8 deg/s
+ * ~~~~~~~~~~~~
+ *
+ *    start and bits pick the bits of the data, counted from the least
+ *    significant bit of the first byte (little endian, like the sendData
+ *    encoding), type is u for unsigned or s for signed raw values. scale,
+ *    offset and unit are optional and only go to the manifest: the columns
+ *    keep the raw integers, the physical value is raw * scale + offset.
+ *
+ * Column files are named after their signal, with characters other than
+ * letters, digits, '.' and '-' replaced by '_'. Signals that end up with the
+ * same file name, like "a b" and "a_b" or two definitions of one name, get
+ * "-2", "-3", ... added in the order they first appear, the manifest tells
+ * which file holds which signal.
+ *
+ * A column file is a header followed by chunks, a chunk per block of the
+ * capture the signal appears in. Every chunk can be decoded on its own, all
+ * numbers are little endian:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | 4     | magic, "CCOL"                                                |
+ * | 2     | version, 1                                                   |
+ * | 2     | reserved, 0                                                  |
+ *
+ * followed by the chunks:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | 4     | number of values                                             |
+ * | 4     | bytes of the timestamps                                      |
+ * | 4     | bytes of the values                                          |
+ * | 4     | reserved, 0                                                  |
+ * | ...   | timestamps in nano-seconds since the epoch                   |
+ * | ...   | values                                                       |
+ *
+ * Timestamps and values are each stored as the difference to the one before
+ * in the chunk (to 0 for the first), zigzag mapped (0, -1, 1, -2 become 0, 1,
+ * 2, 3) and written as varints of 7 bits a byte, least significant first,
+ * with the top bit set on all but the last byte.
+ */
+#ifndef _CAN_EXPORT_H_
+#define _CAN_EXPORT_H_
+
+#include "CanLog.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef CAN_EXPORT_FLUSH
+/// Bytes of a column kept in memory before they are appended to its file.
+/// Can be overwriten by redefinition
+#define CAN_EXPORT_FLUSH (256 * 1024)
+#endif
+
+/// Longest signal name, with the terminating 0
+#define CAN_EXPORT_NAME 64
+
+/**
+ * \struct CanSignal
+ * \brief A signal of a definitions file.
+ */
+typedef struct {
+  char name[CAN_EXPORT_NAME];
+  uint32_t id;            ///< with \ref CAN_ID_EXT for an extended id
+  uint16_t start;         ///< first bit, 0 is the lowest bit of data[0]
+  uint8_t bits;           ///< 1 to 64
+  bool isSigned;          ///< sign extend the raw value
+  double scale;           ///< physical value is raw * scale + offset
+  double offset;
+  char unit[16];
+} CanSignal;
+
+/**
+ * \struct CanExportStats
+ * \brief What an export did.
+ */
+typedef struct {
+  uint32_t signals;       ///< column files written
+  uint64_t frames;        ///< frames read
+  uint64_t values;        ///< values written to the columns
+  uint64_t skipped;       ///< frames no signal could be decoded from
+  uint64_t bytesIn;       ///< bytes of the blocks read
+  uint64_t bytesOut;      ///< bytes of the column files
+} CanExportStats;
+
+class CanExport {
+public:
+  CanExport();
+  ~CanExport();
+  CanExport(const CanExport &) = delete;
+  CanExport &operator=(const CanExport &) = delete;
+
+  /// \brief Decode signals by a definitions file instead of getData().
+  bool loadSignals(const char *path);
+  /// \brief Write the columns of every signal of a capture to dir.
+  bool run(const CanLogReader *log, const char *dir, uint32_t threads,
+           CanExportStats *stats = NULL);
+  /// \brief Read a column file back, returns the number of values or -1.
+  static int64_t readColumn(const char *path, uint64_t **timestamps,
+                            int64_t **values);
+
+private:
+  /// a decoded value of a block
+  typedef struct {
+    uint64_t key;         ///< signal: its definition, or for getData()
+                          ///< id << 16 | type << 8 | element
+    uint64_t timestamp;
+    int64_t value;
+  } Value;
+
+  /// the values of a block, encoded a chunk per signal
+  typedef struct {
+    Value *values;
+    uint32_t numValues, maxValues;
+    uint8_t *bytes;       ///< chunks, each a ChunkHead and its data
+    size_t numBytes, maxBytes;
+    uint64_t frames, skipped;
+  } Block;
+
+  /// what an encoded chunk of a block starts with
+  typedef struct {
+    uint64_t key;
+    uint64_t first, last; ///< timestamps
+    uint32_t count;
+    uint32_t tsBytes, valueBytes;
+    uint8_t type;         ///< CanNodeDataType of getData() signals
+  } ChunkHead;
+
+  /// a column being written
+  typedef struct {
+    uint64_t key;
+    char name[CAN_EXPORT_NAME];
+    char file[CAN_EXPORT_NAME + 16]; ///< unique among the columns
+    uint8_t type;
+    uint64_t count, first, last;
+    uint8_t *buf;
+    size_t len;
+  } Column;
+
+  void decode(const CanLogFrame &frame, Block *block) const;
+  void encode(Block *block) const;
+  Column *column(uint64_t key, uint8_t type);
+  bool append(Column *col, const uint8_t *data, size_t len);
+  bool writeManifest(const CanLogReader *log);
+
+  CanSignal *signals;     ///< sorted by id
+  uint32_t numSignals;
+  const char *dir;
+  Column *columns;        ///< sorted by key
+  uint32_t numColumns, maxColumns;
+  uint64_t bytesOut;
+  bool failed;
+};
+
+#endif //_CAN_EXPORT_H_
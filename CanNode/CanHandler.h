@@ -0,0 +1,129 @@
+/**
+ * \file CanHandler.h
+ * \brief Handler of a message, a function or a callable with bound context.
+ *
+ * A CanHandler holds either a plain \ref filterHandler or a small callable,
+ * e.g. a lambda capturing an object or a few values, copied into a fixed size
+ * buffer inside the handler itself. Making one never allocates, and calling
+ * one costs a single indirect call whatever it holds. Callables that do not
+ * fit in \ref CAN_HANDLER_SIZE bytes, or need a destructor (like a lambda
+ * capturing a std::string), are rejected when compiling.
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * class Pitot {
+ *   CanNode node;
+ *   void onThrottle(CanMessage *msg);
+ * public:
+ *   Pitot() : node(PITOT, nullptr) {
+ *     node.addFilter(THROTTLE, CanHandler::bind<&Pitot::onThrottle>(this));
+ *     node.addFilter(THROT_BODY, [this](CanMessage *msg) { onThrottle(msg); });
+ *   }
+ * };
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_HANDLER_H_
+#define _CAN_HANDLER_H_
+
+#include "CanTypes.h"
+#include <new>
+#include <type_traits>
+
+#ifndef CAN_HANDLER_SIZE
+/// Bytes of context a handler can hold, a multiple of the size of a pointer.
+/// Can be overwriten by redefinition
+#define CAN_HANDLER_SIZE (3 * sizeof(void *))
+#endif
+
+/**
+ * \typedef filterHandler
+ * \brief Function pointer to a function that accepts a CanMessage pointer
+ *
+ * A function of this type should look like
+ *
+ * <code> void foo(CanMessage* msg) </code>
+ *
+ * Functions of this type can be used to handle filter matches. These functions
+ * are added set to handle filters with the CanNode_addFilter() function. They
+ * are
+ * called by the CanNode_checkForMessages() function
+ *
+ * \see CanNode_addFilter
+ * \see CanNode_checkForMessages
+ */
+typedef void (*filterHandler)(CanMessage *data);
+
+/**
+ * \brief Handler taking one argument, see \ref CanHandler for messages.
+ */
+template <typename Arg> class CanDelegate {
+public:
+  /// Plain function the delegate can call
+  typedef void (*function)(Arg arg);
+
+  /// \brief A handler that does nothing, false when tested.
+  CanDelegate() : call(nullptr) { context.fn = nullptr; }
+  /// \brief Call a function, NULL gives an empty handler.
+  CanDelegate(function fn) : call(nullptr) { context.fn = fn; }
+
+  /// \brief Call a copy of a callable object (e.g. a lambda) taking Arg.
+  template <typename F,
+            typename = typename std::enable_if<
+                std::is_class<typename std::decay<F>::type>::value &&
+                !std::is_same<typename std::decay<F>::type,
+                              CanDelegate>::value &&
+                std::is_invocable<const typename std::decay<F>::type &,
+                                  Arg>::value>::type>
+  CanDelegate(F &&f) {
+    typedef typename std::decay<F>::type Callable;
+    static_assert(sizeof(Callable) <= CAN_HANDLER_SIZE,
+                  "handler context is larger than CAN_HANDLER_SIZE");
+    static_assert(alignof(Callable) <= alignof(void *),
+                  "handler context is over-aligned");
+    static_assert(std::is_trivially_copyable<Callable>::value &&
+                      std::is_trivially_destructible<Callable>::value,
+                  "handler context has to be trivially copyable");
+    new (context.bytes) Callable(static_cast<F &&>(f));
+    call = invoke<Callable>;
+  }
+
+  /// \brief Call a member function of obj, chosen when compiling.
+  template <auto Method, class T> static CanDelegate bind(T *obj) {
+    return CanDelegate([obj](Arg arg) { (obj->*Method)(arg); });
+  }
+
+  /// \brief Call the handler, it must not be empty.
+  void operator()(Arg arg) const {
+    if (call == nullptr) {
+      context.fn(arg);
+    } else {
+      call(context.bytes, arg);
+    }
+  }
+  /// \brief Check if the handler calls anything.
+  explicit operator bool() const {
+    return call != nullptr || context.fn != nullptr;
+  }
+
+private:
+  typedef void (*invoker)(const void *context, Arg arg);
+
+  template <typename Callable>
+  static void invoke(const void *context, Arg arg) {
+    (*static_cast<const Callable *>(context))(arg);
+  }
+
+  invoker call; ///< calls the callable in context, NULL for a plain function
+  union {
+    function fn; ///< function called when call is NULL
+    alignas(void *) unsigned char bytes[CAN_HANDLER_SIZE];
+  } context;
+};
+
+/**
+ * \typedef CanHandler
+ * \brief Handler of a received message, a \ref filterHandler or a callable
+ * with bound context.
+ */
+typedef CanDelegate<CanMessage *> CanHandler;
+
+#endif //_CAN_HANDLER_H_
@@ -0,0 +1,755 @@
+/**
+ * CanLog.cpp
+ * \brief implements writing and querying indexed capture files
+ */
+#include "CanLog.h"
+#include "CanTime.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+static_assert(sizeof(CanLogFileHeader) == 160, "file header layout");
+static_assert(sizeof(CanLogBlockHeader) == 296, "block header layout");
+static_assert(sizeof(CanLogRecord) == 16, "record layout");
+
+/// write all of buf, false if the file did not take it
+static bool write_all(int fd, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+void CanLogFrame::copy(CanMessage *msg) const {
+  can_set_msg_id(msg, id());
+  msg->fmi = CAN_NO_FMI;
+  msg->rtr = rtr();
+  msg->len = len() > CAN_MAX_DATA ? CAN_MAX_DATA : len();
+  memcpy(msg->data, record->data, msg->len);
+  memset(msg->data + msg->len, 0, CAN_MAX_DATA - msg->len);
+}
+
+CanLogWriter::CanLogWriter() {
+  fd = -1;
+  block = NULL;
+  codec = NULL;
+  packed = NULL;
+  blockSize = 0;
+  used = 0;
+  frames = 0;
+  from = UINT64_MAX;
+  to = 0;
+  memset(&stats, 0, sizeof(stats));
+}
+
+CanLogWriter::~CanLogWriter() { close(); }
+
+/**
+ * \param path file to create
+ * \param config block size, interface names and compression, NULL for the
+ * defaults
+ *
+ * \returns false if the file could not be created.
+ */
+bool CanLogWriter::open(const char *path, const CanLogConfig *config) {
+  if (fd >= 0) {
+    errno = EBUSY;
+    return false;
+  }
+  blockSize = config != NULL && config->blockSize != 0 ? config->blockSize
+                                                        : CAN_LOG_BLOCK_SIZE;
+  if (blockSize < can_log_record_size(CANFD_MAX_DLEN)) {
+    blockSize = can_log_record_size(CANFD_MAX_DLEN);
+  }
+  block = (uint8_t *)malloc(sizeof(CanLogBlockHeader) + blockSize);
+  if (block == NULL) {
+    perror("can log block");
+    return false;
+  }
+  if (config != NULL && config->compress) {
+    codec = new CanLogCodec();
+    packed = (uint8_t *)malloc(sizeof(CanLogBlockHeader) + blockSize);
+    if (packed == NULL) {
+      perror("can log block");
+      close();
+      return false;
+    }
+  }
+
+  fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror(path);
+    close();
+    return false;
+  }
+
+  CanLogFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "CANLOG", 6);
+  header.version = 1;
+  header.headerSize = sizeof(header);
+  header.blockSize = blockSize;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  header.created = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  for (int i = 0; config != NULL && i < CAN_LOG_INTERFACES &&
+                  config->interfaces[i] != NULL;
+       ++i) {
+    strncpy(header.interfaces[i], config->interfaces[i], CAN_LOG_NAME - 1);
+    header.numInterfaces++;
+  }
+
+  memset(&stats, 0, sizeof(stats));
+  if (!write_all(fd, (const uint8_t *)&header, sizeof(header))) {
+    perror(path);
+    close();
+    return false;
+  }
+  stats.bytes = sizeof(header);
+  stats.rawBytes = sizeof(header);
+  used = 0;
+  frames = 0;
+  memset(block, 0, sizeof(CanLogBlockHeader));
+  return true;
+}
+
+/**
+ * Copies the frame into the open block, writing the block first if the frame
+ * does not fit any more.
+ *
+ * \param timestamp nano-seconds since the epoch
+ * \param canId SocketCAN can_id with its flags
+ * \param data len data bytes, at most CANFD_MAX_DLEN are kept
+ * \param flags \ref CAN_LOG_FD, \ref CAN_LOG_OUTGOING
+ * \param interface index into the interface names of the file
+ */
+void CanLogWriter::add(uint64_t timestamp, uint32_t canId,
+                       const uint8_t *data, uint8_t len, uint8_t flags,
+                       uint8_t interface) {
+  if (fd < 0) {
+    return;
+  }
+  if (len > CANFD_MAX_DLEN) {
+    len = CANFD_MAX_DLEN;
+  }
+  uint32_t size = can_log_record_size(len);
+  if (used + size > blockSize) {
+    flush();
+  }
+
+  CanLogBlockHeader *header = (CanLogBlockHeader *)block;
+  CanLogRecord *record =
+      (CanLogRecord *)(block + sizeof(CanLogBlockHeader) + used);
+  record->timestamp = timestamp;
+  record->canId = canId;
+  record->len = len;
+  record->flags = flags;
+  record->interface = interface;
+  record->reserved = 0;
+  // zero the padding first, then the data over it
+  uint32_t padded = size - sizeof(CanLogRecord);
+  if (padded != 0) {
+    memset(record->data + padded - 8, 0, 8);
+  }
+  memcpy(record->data, data, len);
+  used += size;
+  frames++;
+
+  uint32_t bit = can_log_id_bit(canId);
+  header->ids[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+  from = timestamp < from ? timestamp : from;
+  to = timestamp > to ? timestamp : to;
+}
+
+void CanLogWriter::add(const CanCaptureFrame &frame) {
+  uint32_t canId = frame.id();
+  canId |= frame.rtr() ? CAN_RTR_FLAG : 0;
+  canId |= frame.error() ? CAN_ERR_FLAG : 0;
+  uint8_t flags = (frame.fd() ? CAN_LOG_FD : 0) |
+                  (frame.outgoing() ? CAN_LOG_OUTGOING : 0);
+  add(frame.timestamp(), canId, frame.data(), frame.len(), flags,
+      frame.interface());
+}
+
+/**
+ * When compressing, the block is written encoded unless that would not make
+ * it smaller.
+ *
+ * \returns false if the block could not be written, it is dropped then and
+ * counted in \ref CanLogWriterStats::writeErrors.
+ */
+bool CanLogWriter::flush() {
+  if (fd < 0 || frames == 0) {
+    return true;
+  }
+  CanLogBlockHeader *header = (CanLogBlockHeader *)block;
+  memcpy(header->magic, "CLBK", 4);
+  header->encoding = 0;
+  header->frames = frames;
+  header->bytes = used;
+  header->rawBytes = used;
+  header->from = from;
+  header->to = to;
+
+  const uint8_t *out = block;
+  if (codec != NULL) {
+    uint64_t start = can_time_ns();
+    size_t len = codec->encode(block + sizeof(CanLogBlockHeader), used, frames,
+                               packed + sizeof(CanLogBlockHeader), used - 1);
+    stats.encodeNs += can_time_ns() - start;
+    if (len != 0) {
+      header->encoding = 1;
+      header->bytes = (uint32_t)len;
+      memcpy(packed, header, sizeof(CanLogBlockHeader));
+      out = packed;
+    }
+  }
+
+  bool ok = write_all(fd, out, sizeof(CanLogBlockHeader) + header->bytes);
+  if (ok) {
+    stats.frames += frames;
+    stats.blocks++;
+    stats.bytes += sizeof(CanLogBlockHeader) + header->bytes;
+    stats.rawBytes += sizeof(CanLogBlockHeader) + used;
+  } else {
+    perror("can log write");
+    stats.writeErrors++;
+  }
+
+  memset(block, 0, sizeof(CanLogBlockHeader));
+  used = 0;
+  frames = 0;
+  from = UINT64_MAX;
+  to = 0;
+  return ok;
+}
+
+void CanLogWriter::close() {
+  if (fd >= 0) {
+    flush();
+    ::close(fd);
+    fd = -1;
+  }
+  free(block);
+  block = NULL;
+  delete codec;
+  codec = NULL;
+  free(packed);
+  packed = NULL;
+}
+
+CanLogReader::CanLogReader() {
+  fd = -1;
+  map = NULL;
+  size = 0;
+  indexed = 0;
+  file = NULL;
+  index = NULL;
+  numBlocks = 0;
+  maxDecoded = 0;
+  numFrames = 0;
+  firstTime = UINT64_MAX;
+  lastTime = 0;
+}
+
+CanLogReader::~CanLogReader() { close(); }
+
+/**
+ * Maps the file and walks its block headers. Only the headers are read, the
+ * frames are left to the queries.
+ *
+ * \returns false if the file could not be mapped or is not a capture file.
+ */
+bool CanLogReader::open(const char *path) {
+  close();
+  fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CanLogFileHeader)) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    close();
+    return false;
+  }
+  size = (uint64_t)st.st_size;
+  void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    perror(path);
+    map = NULL;
+    close();
+    return false;
+  }
+  map = (const uint8_t *)mem;
+  file = (const CanLogFileHeader *)map;
+  if (memcmp(file->magic, "CANLOG", 6) != 0 || file->version != 1 ||
+      file->headerSize < sizeof(CanLogFileHeader) ||
+      file->headerSize > size) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    close();
+    return false;
+  }
+
+  uint32_t capacity = 0;
+  uint64_t offset = file->headerSize;
+  while (offset + sizeof(CanLogBlockHeader) <= size) {
+    const CanLogBlockHeader *header =
+        (const CanLogBlockHeader *)(map + offset);
+    if (memcmp(header->magic, "CLBK", 4) != 0 ||
+        offset + sizeof(CanLogBlockHeader) + header->bytes > size) {
+      break;
+    }
+    if (numBlocks == capacity) {
+      capacity = capacity == 0 ? 256 : capacity * 2;
+      CanLogBlock *more =
+          (CanLogBlock *)realloc(index, capacity * sizeof(CanLogBlock));
+      if (more == NULL) {
+        perror("can log index");
+        close();
+        return false;
+      }
+      index = more;
+    }
+    index[numBlocks].header = header;
+    index[numBlocks].offset = offset;
+    numBlocks++;
+    if (header->encoding != 0 && header->rawBytes > maxDecoded) {
+      maxDecoded = header->rawBytes;
+    }
+    numFrames += header->frames;
+    firstTime = header->from < firstTime ? header->from : firstTime;
+    lastTime = header->to > lastTime ? header->to : lastTime;
+    offset += sizeof(CanLogBlockHeader) + header->bytes;
+  }
+  indexed = offset;
+  return true;
+}
+
+void CanLogReader::close() {
+  if (map != NULL) {
+    munmap((void *)map, size);
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  free(index);
+  fd = -1;
+  map = NULL;
+  size = 0;
+  indexed = 0;
+  file = NULL;
+  index = NULL;
+  numBlocks = 0;
+  maxDecoded = 0;
+  numFrames = 0;
+  firstTime = UINT64_MAX;
+  lastTime = 0;
+}
+
+/**
+ * Check the time range and id bitmap of a block against a query.
+ */
+bool CanLogReader::wanted(const Plan *plan, const CanLogBlockHeader *block) {
+  const CanLogQuery *query = plan->query;
+  if (block->frames == 0 || block->to < query->from ||
+      block->from >= query->to) {
+    return false;
+  }
+  if (query->numIds == 0) {
+    return true;
+  }
+  for (size_t i = 0; i < sizeof(block->ids); i += 8) {
+    uint64_t a, b;
+    memcpy(&a, block->ids + i, 8);
+    memcpy(&b, plan->bitmap + i, 8);
+    if (a & b) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CanLogReader::matches(const Plan *plan, const CanLogRecord *record) {
+  const CanLogQuery *query = plan->query;
+  if (record->timestamp < query->from || record->timestamp >= query->to) {
+    return false;
+  }
+  if (query->numIds != 0) {
+    if (record->canId & CAN_EFF_FLAG) {
+      uint32_t id = record->canId & (CAN_EFF_FLAG | CAN_EFF_MASK);
+      if (!std::binary_search(plan->ext, plan->ext + plan->numExt, id)) {
+        return false;
+      }
+    } else {
+      uint32_t id = record->canId & CAN_SFF_MASK;
+      if (!(plan->standard[id >> 3] & (1 << (id & 7)))) {
+        return false;
+      }
+    }
+  }
+  if (query->matchLen != 0) {
+    if (record->len < query->matchLen) {
+      return false;
+    }
+    for (uint8_t i = 0; i < query->matchLen; ++i) {
+      if ((record->data[i] ^ query->match[i]) & query->mask[i]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Check every record of a block, and note the offsets of the ones that
+ * match.
+ *
+ * \returns the number of offsets put in found, at most block->frames.
+ */
+uint32_t CanLogReader::scan(const Plan *plan, const CanLogBlockHeader *block,
+                            const uint8_t *records, uint32_t *found) {
+  uint32_t count = 0;
+  uint32_t offset = 0;
+  for (uint32_t f = 0; f < block->frames; ++f) {
+    // a damaged block ends where its records stop making sense
+    if (offset + sizeof(CanLogRecord) > block->rawBytes) {
+      break;
+    }
+    const CanLogRecord *record = (const CanLogRecord *)(records + offset);
+    uint32_t size = can_log_record_size(record->len);
+    if (record->len > CANFD_MAX_DLEN || offset + size > block->rawBytes) {
+      break;
+    }
+    if (matches(plan, record)) {
+      found[count++] = offset;
+    }
+    offset += size;
+  }
+  return count;
+}
+
+/**
+ * Records of a block, in the map for plain blocks, decoded into buffer for
+ * encoded ones.
+ *
+ * \param buffer takes \ref maxDecoded bytes
+ * \param decodeNs[out] time spent decoding is added to it
+ *
+ * \returns NULL if the block can not be decoded.
+ */
+const uint8_t *CanLogReader::records(const CanLogBlock *block,
+                                     CanLogCodec *codec, uint8_t *buffer,
+                                     uint64_t *decodeNs) const {
+  const CanLogBlockHeader *header = block->header;
+  const uint8_t *stored = map + block->offset + sizeof(CanLogBlockHeader);
+  if (header->encoding == 0) {
+    return header->rawBytes <= header->bytes ? stored : NULL;
+  }
+  if (header->encoding != 1 || buffer == NULL) {
+    return NULL;
+  }
+  uint64_t start = can_time_ns();
+  bool ok = codec->decode(stored, header->bytes, header->frames, buffer,
+                          header->rawBytes);
+  *decodeNs += can_time_ns() - start;
+  return ok ? buffer : NULL;
+}
+
+/**
+ * Hand the records found in a block to the handler, without going past the
+ * limit of the query.
+ *
+ * \returns frames handed over.
+ */
+uint64_t CanLogReader::deliver(const Plan *plan, const uint8_t *records,
+                               const uint32_t *found, uint32_t count,
+                               uint64_t handed,
+                               const CanLogHandler &handle) const {
+  uint64_t limit = plan->query->limit;
+  if (limit != 0 && handed + count > limit) {
+    count = (uint32_t)(limit - handed);
+  }
+  CanLogFrame frame;
+  for (uint32_t i = 0; handle && i < count; ++i) {
+    frame.record = (const CanLogRecord *)(records + found[i]);
+    handle(frame);
+  }
+  return count;
+}
+
+/**
+ * Lets callers spread blocks over threads of their own, e.g. to decode them
+ * in parallel. Any number of threads may read blocks at once. Encoded blocks
+ * are decoded into a buffer of the call.
+ *
+ * \param block number of the block, below blocks()
+ * \param handle called for each frame of the block in order, the frame is
+ * only valid while it runs
+ *
+ * \returns the number of frames handed over.
+ */
+uint32_t CanLogReader::read(uint32_t block, const CanLogHandler &handle) const {
+  if (block >= numBlocks) {
+    return 0;
+  }
+  const CanLogBlockHeader *header = index[block].header;
+  CanLogCodec codec;
+  uint8_t *buffer = NULL;
+  if (header->encoding != 0) {
+    buffer = (uint8_t *)malloc(header->rawBytes + 1);
+  }
+  uint64_t decodeNs = 0;
+  const uint8_t *recs = records(&index[block], &codec, buffer, &decodeNs);
+  if (recs == NULL) {
+    free(buffer);
+    return 0;
+  }
+  CanLogFrame frame;
+  uint32_t count = 0;
+  uint32_t offset = 0;
+  for (; count < header->frames; ++count) {
+    if (offset + sizeof(CanLogRecord) > header->rawBytes) {
+      break;
+    }
+    frame.record = (const CanLogRecord *)(recs + offset);
+    uint32_t size = can_log_record_size(frame.record->len);
+    if (frame.record->len > CANFD_MAX_DLEN ||
+        offset + size > header->rawBytes) {
+      break;
+    }
+    handle(frame);
+    offset += size;
+  }
+  free(buffer);
+  return count;
+}
+
+/**
+ * Finds the blocks the index does not rule out, checks their frames and hands
+ * the matching ones to handle, in the order they are in the file.
+ *
+ * With more than one thread, the blocks are scanned by that many worker
+ * threads a few blocks ahead, while the calling thread hands the frames of
+ * each block over as soon as it and the blocks before it are done. handle
+ * always runs on the calling thread.
+ *
+ * \param query frames to hand over
+ * \param threads threads scanning blocks, 0 or 1 to scan on this thread
+ * \param handle called for each matching frame, the frame is only valid
+ * while it runs. An empty handler only counts the frames
+ * \param stats[out] what was read and skipped, may be NULL
+ *
+ * \returns the number of frames handed over.
+ */
+uint64_t CanLogReader::query(const CanLogQuery *query, uint32_t threads,
+                             const CanLogHandler &handle,
+                             CanLogQueryStats *stats) {
+  CanLogQueryStats local;
+  memset(&local, 0, sizeof(local));
+  if (map == NULL) {
+    if (stats != NULL) {
+      *stats = local;
+    }
+    return 0;
+  }
+
+  Plan plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.query = query;
+  plan.ext = (uint32_t *)malloc((query->numIds + 1) * sizeof(uint32_t));
+  if (plan.ext == NULL) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < query->numIds; ++i) {
+    uint32_t id = query->ids[i];
+    uint32_t canId = id & CAN_ID_EXT ? (id & CAN_EFF_MASK) | CAN_EFF_FLAG
+                                     : id & CAN_SFF_MASK;
+    uint32_t bit = can_log_id_bit(canId);
+    plan.bitmap[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+    if (canId & CAN_EFF_FLAG) {
+      plan.ext[plan.numExt++] = canId;
+    } else {
+      plan.standard[canId >> 3] |= (uint8_t)(1 << (canId & 7));
+    }
+  }
+  std::sort(plan.ext, plan.ext + plan.numExt);
+
+  // the index rules out blocks without reading them
+  uint32_t *todo = (uint32_t *)malloc((numBlocks + 1) * sizeof(uint32_t));
+  uint32_t numTodo = 0;
+  uint32_t maxFrames = 1;
+  for (uint32_t i = 0; todo != NULL && i < numBlocks; ++i) {
+    const CanLogBlockHeader *header = index[i].header;
+    if (!wanted(&plan, header)) {
+      local.blocksSkipped++;
+      continue;
+    }
+    todo[numTodo++] = i;
+    maxFrames = header->frames > maxFrames ? header->frames : maxFrames;
+  }
+
+  uint32_t window = threads <= 1 ? 1 : 2 * threads;
+  uint32_t *found =
+      todo == NULL
+          ? NULL
+          : (uint32_t *)malloc((size_t)window * maxFrames * sizeof(uint32_t));
+  // a decoded block per slot, for files with encoded blocks
+  uint8_t *decoded = NULL;
+  if (found != NULL && maxDecoded != 0) {
+    decoded = (uint8_t *)malloc((size_t)window * maxDecoded);
+  }
+  if (found == NULL || (maxDecoded != 0 && decoded == NULL)) {
+    perror("can log query");
+    free(found);
+    free(todo);
+    free(plan.ext);
+    return 0;
+  }
+
+  uint64_t handed = 0;
+  uint32_t done = 0;
+  CanLogCodec codec;
+  if (threads <= 1) {
+    for (; done < numTodo; ++done) {
+      if (query->limit != 0 && handed >= query->limit) {
+        break;
+      }
+      const CanLogBlock *block = &index[todo[done]];
+      const uint8_t *recs = records(block, &codec, decoded, &local.decodeNs);
+      if (recs == NULL) {
+        continue;
+      }
+      uint32_t count = scan(&plan, block->header, recs, found);
+      handed += deliver(&plan, recs, found, count, handed, handle);
+    }
+  } else {
+    // slot k % window holds the matches of todo[k] once ready[] is k + 1
+    uint32_t *counts = (uint32_t *)calloc(window, sizeof(uint32_t));
+    const uint8_t **recsOf =
+        (const uint8_t **)calloc(window, sizeof(const uint8_t *));
+    std::atomic<uint64_t> decodeNs(0);
+    std::atomic<uint32_t> *ready = new std::atomic<uint32_t>[window];
+    for (uint32_t i = 0; i < window; ++i) {
+      ready[i] = 0;
+    }
+    std::atomic<uint32_t> next(0);
+    std::atomic<uint32_t> delivered(0);
+    std::atomic<bool> stop(false);
+    std::mutex lock;
+    std::condition_variable changed;
+
+    auto work = [&]() {
+      CanLogCodec codec;
+      uint64_t ns = 0;
+      for (;;) {
+        uint32_t k = next++;
+        if (k >= numTodo) {
+          break;
+        }
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          changed.wait(guard, [&]() {
+            return stop || k < delivered + window;
+          });
+        }
+        if (stop) {
+          break;
+        }
+        const CanLogBlock *block = &index[todo[k]];
+        // read the whole block ahead rather than a page fault at a time
+        uint64_t start = block->offset & ~(uint64_t)4095;
+        uint64_t end =
+            block->offset + sizeof(CanLogBlockHeader) + block->header->bytes;
+        madvise((void *)(map + start), end - start, MADV_WILLNEED);
+        uint32_t slot = k % window;
+        uint8_t *buffer =
+            decoded == NULL ? NULL : decoded + (size_t)slot * maxDecoded;
+        const uint8_t *recs = records(block, &codec, buffer, &ns);
+        recsOf[slot] = recs;
+        counts[slot] = recs == NULL ? 0
+                                    : scan(&plan, block->header, recs,
+                                           found + (size_t)slot * maxFrames);
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          ready[slot] = k + 1;
+        }
+        changed.notify_all();
+      }
+      decodeNs += ns;
+    };
+    std::thread *workers = new std::thread[threads];
+    for (uint32_t t = 0; t < threads; ++t) {
+      workers[t] = std::thread(work);
+    }
+
+    for (; done < numTodo; ++done) {
+      if (query->limit != 0 && handed >= query->limit) {
+        break;
+      }
+      uint32_t slot = done % window;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() { return ready[slot] == done + 1; });
+      }
+      handed += deliver(&plan, recsOf[slot], found + (size_t)slot * maxFrames,
+                        counts[slot], handed, handle);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        delivered = done + 1;
+      }
+      changed.notify_all();
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stop = true;
+    }
+    changed.notify_all();
+    for (uint32_t t = 0; t < threads; ++t) {
+      workers[t].join();
+    }
+    delete[] workers;
+    delete[] ready;
+    free(recsOf);
+    free(counts);
+    local.decodeNs = decodeNs;
+  }
+
+  for (uint32_t k = 0; k < done; ++k) {
+    const CanLogBlockHeader *header = index[todo[k]].header;
+    local.blocksRead++;
+    local.framesRead += header->frames;
+    local.bytesRead += sizeof(CanLogBlockHeader) + header->bytes;
+    if (header->encoding != 0) {
+      local.bytesDecoded += header->rawBytes;
+    }
+  }
+  local.frames = handed;
+  if (stats != NULL) {
+    *stats = local;
+  }
+  free(decoded);
+  free(found);
+  free(todo);
+  free(plan.ext);
+  return handed;
+}
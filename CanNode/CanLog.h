@@ -0,0 +1,416 @@
+/**
+ * \file CanLog.h
+ * \brief Capture files made of indexed blocks, written by canLogger and
+ * queried in place through a memory map.
+ *
+ * A CanLogWriter collects frames into blocks of about
+ * \ref CanLogConfig::blockSize bytes and writes each block with one write().
+ * Every block starts with a small header holding the time range of its
+ * frames and a bitmap of their ids, so a CanLogReader can tell from the
+ * headers alone which blocks may hold frames of interest. Opening a file
+ * maps it and walks the block headers into an index, a few hundred bytes per
+ * block; a query then skips every block whose time range or id bitmap does
+ * not match and only reads the rest, in parallel if asked to.
+ *
+ * The bitmap has a bit per standard id, extended ids share the bits by a
+ * hash, so a block that may hold an extended id is still checked frame by
+ * frame. A file cut short by a crash is read up to its last whole block.
+ *
+ * With \ref CanLogConfig::compress the records of each block are stored
+ * encoded by a CanLogCodec (see CanLogCodec.h), which only ever needs the
+ * block itself, so the index and queries work the same on compressed files.
+ *
+ * File layout, little endian:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | 6     | magic, "CANLOG"                                              |
+ * | 2     | version, 1                                                   |
+ * | 4     | bytes of this header, 160                                    |
+ * | 4     | block size the writer aimed for                              |
+ * | 8     | time the file was created in nano-seconds since the epoch    |
+ * | 1     | number of interfaces named                                   |
+ * | 7     | reserved, 0                                                  |
+ * | 128   | names of up to 8 interfaces, 16 bytes each                   |
+ *
+ * followed by blocks, each a header:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | 4     | magic, "CLBK"                                                |
+ * | 1     | encoding, 0 for records as below, 1 for CanLogCodec.h        |
+ * | 3     | reserved, 0                                                  |
+ * | 4     | number of frames                                             |
+ * | 4     | bytes stored after this header                               |
+ * | 4     | bytes of the records once decoded                            |
+ * | 4     | reserved, 0                                                  |
+ * | 8     | earliest timestamp in the block                              |
+ * | 8     | latest timestamp in the block                                |
+ * | 256   | id bitmap, bit id for standard ids, a hash for extended ids  |
+ *
+ * and the records of its frames, each 8 byte aligned:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | 8     | timestamp in nano-seconds since the epoch                    |
+ * | 4     | SocketCAN can_id, with its EFF, RTR and ERR flags            |
+ * | 1     | number of data bytes                                         |
+ * | 1     | flags, 1 for a CAN FD frame, 2 for a frame sent by this host |
+ * | 1     | interface, an index into the names of the file header        |
+ * | 1     | reserved, 0                                                  |
+ * | len   | data, padded with zeros to a multiple of 8                   |
+ *
+ * Example code
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanLogReader log;
+ * log.open("drive.canlog");
+ * CanLogQuery query;
+ * can_log_query_init(&query);
+ * uint32_t ids[] = {0x123};
+ * query.ids = ids;
+ * query.numIds = 1;
+ * query.from = log.first() + 60000000000ULL; // the second minute
+ * query.to = query.from + 60000000000ULL;
+ * log.query(&query, 4, [](const CanLogFrame &frame) {
+ *   plot(frame.timestamp(), frame.data()[0]);
+ * });
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_LOG_H_
+#define _CAN_LOG_H_
+
+#include "CanCapture.h"
+#include "CanHandler.h"
+#include "CanLogCodec.h"
+#include "CanTypes.h"
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/// Interfaces a file can name
+#define CAN_LOG_INTERFACES 8
+/// Bytes of an interface name in the file header
+#define CAN_LOG_NAME 16
+/// Bits of the id bitmap of a block
+#define CAN_LOG_BITMAP 2048
+
+/// Record flag of a CAN FD frame
+#define CAN_LOG_FD 0x01
+/// Record flag of a frame sent by the capturing host
+#define CAN_LOG_OUTGOING 0x02
+
+#ifndef CAN_LOG_BLOCK_SIZE
+/// Bytes of frames a writer puts in a block. Can be overwriten by
+/// redefinition
+#define CAN_LOG_BLOCK_SIZE (1 << 20)
+#endif
+
+/**
+ * \struct CanLogFileHeader
+ * \brief Start of a capture file.
+ */
+typedef struct {
+  char magic[6];          ///< "CANLOG"
+  uint16_t version;       ///< 1
+  uint32_t headerSize;    ///< sizeof(CanLogFileHeader)
+  uint32_t blockSize;     ///< block size the writer aimed for
+  uint64_t created;       ///< ns since the epoch
+  uint8_t numInterfaces;  ///< names used
+  uint8_t reserved[7];
+  char interfaces[CAN_LOG_INTERFACES][CAN_LOG_NAME]; ///< interface names
+} CanLogFileHeader;
+
+/**
+ * \struct CanLogBlockHeader
+ * \brief Start of a block, all a reader needs to decide to skip it.
+ */
+typedef struct {
+  char magic[4];          ///< "CLBK"
+  uint8_t encoding;       ///< 0 for plain records, 1 for CanLogCodec
+  uint8_t reserved[3];
+  uint32_t frames;        ///< frames in the block
+  uint32_t bytes;         ///< bytes stored after this header
+  uint32_t rawBytes;      ///< bytes of the records once decoded
+  uint32_t reserved2;
+  uint64_t from;          ///< earliest timestamp
+  uint64_t to;            ///< latest timestamp
+  uint8_t ids[CAN_LOG_BITMAP / 8]; ///< bitmap, see can_log_id_bit()
+} CanLogBlockHeader;
+
+/**
+ * \struct CanLogRecord
+ * \brief A frame as stored in a block, followed by its data.
+ */
+typedef struct {
+  uint64_t timestamp;     ///< ns since the epoch
+  uint32_t canId;         ///< SocketCAN can_id
+  uint8_t len;            ///< data bytes
+  uint8_t flags;          ///< \ref CAN_LOG_FD, \ref CAN_LOG_OUTGOING
+  uint8_t interface;      ///< index into the interface names
+  uint8_t reserved;
+  uint8_t data[];         ///< len bytes, padded to a multiple of 8
+} CanLogRecord;
+
+/**
+ * \brief Bytes a record of len data bytes takes up.
+ */
+static inline uint32_t can_log_record_size(uint8_t len) {
+  return sizeof(CanLogRecord) + ((len + 7U) & ~7U);
+}
+
+/**
+ * \brief Bit of the block id bitmap a SocketCAN can_id sets.
+ *
+ * Standard ids have a bit each, extended ids are spread over all bits by a
+ * multiplicative hash.
+ */
+static inline uint32_t can_log_id_bit(uint32_t canId) {
+  if (canId & CAN_EFF_FLAG) {
+    return ((canId & CAN_EFF_MASK) * 0x9E3779B1U) >> (32 - 11);
+  }
+  return canId & CAN_SFF_MASK;
+}
+
+/**
+ * \struct CanLogConfig
+ * \brief How a writer lays out its file.
+ *
+ * Zero fields keep the defaults.
+ */
+typedef struct {
+  uint32_t blockSize;     ///< bytes of frames per block (default
+                          ///< \ref CAN_LOG_BLOCK_SIZE)
+  const char *interfaces[CAN_LOG_INTERFACES]; ///< names for the header, NULL
+                                              ///< after the last one
+  bool compress;          ///< encode blocks with a CanLogCodec
+} CanLogConfig;
+
+/**
+ * \struct CanLogWriterStats
+ * \brief Counters of a writer since open().
+ */
+typedef struct {
+  uint64_t frames;        ///< frames written
+  uint64_t blocks;        ///< blocks written
+  uint64_t bytes;         ///< bytes written, headers included
+  uint64_t rawBytes;      ///< bytes the file would take unencoded
+  uint64_t encodeNs;      ///< time spent encoding blocks
+  uint64_t writeErrors;   ///< blocks lost because write() failed
+} CanLogWriterStats;
+
+/**
+ * \brief Writes frames to a capture file, one block at a time.
+ *
+ * Frames are copied into the open block, which is written once full, by
+ * flush() or by close(). A writer belongs to one thread.
+ */
+class CanLogWriter {
+public:
+  CanLogWriter();
+  ~CanLogWriter();
+  CanLogWriter(const CanLogWriter &) = delete;
+  CanLogWriter &operator=(const CanLogWriter &) = delete;
+
+  /// \brief Create the file, replacing an existing one, and write its header.
+  bool open(const char *path, const CanLogConfig *config);
+  /// \brief Add a frame given as a SocketCAN can_id and its data.
+  void add(uint64_t timestamp, uint32_t canId, const uint8_t *data,
+           uint8_t len, uint8_t flags, uint8_t interface);
+  /// \brief Add a captured frame.
+  void add(const CanCaptureFrame &frame);
+  /// \brief Write the open block, even if it is not full.
+  bool flush();
+  /// \brief Write what is pending and close the file.
+  void close();
+  /// \brief Frames in the open block.
+  uint32_t pending() const { return frames; }
+  /// \brief Get the counters of the writer.
+  void getStats(CanLogWriterStats *stats) const { *stats = this->stats; }
+
+private:
+  int fd;
+  uint8_t *block;         ///< header and records of the open block
+  CanLogCodec *codec;     ///< NULL unless compressing
+  uint8_t *packed;        ///< header and encoded records of the open block
+  uint32_t blockSize;     ///< bytes of records a block takes
+  uint32_t used;          ///< bytes of records in the open block
+  uint32_t frames;
+  uint64_t from, to;
+  CanLogWriterStats stats;
+};
+
+/**
+ * \brief A frame of a capture file, read in place.
+ *
+ * Only valid while the handler it was passed to runs. copy() keeps the frame
+ * as a CanMessage.
+ */
+class CanLogFrame {
+public:
+  CanLogFrame(const CanLogFrame &) = delete;
+  CanLogFrame &operator=(const CanLogFrame &) = delete;
+
+  /// \brief Id of the frame, with \ref CAN_ID_EXT set for an extended id.
+  uint32_t id() const {
+    return record->canId & CAN_EFF_FLAG
+               ? record->canId & (CAN_EFF_FLAG | CAN_EFF_MASK)
+               : record->canId & CAN_SFF_MASK;
+  }
+  /// \brief SocketCAN can_id of the frame with all its flags.
+  uint32_t canId() const { return record->canId; }
+  /// \brief Check if the frame has an extended 29-bit id.
+  bool ext() const { return (record->canId & CAN_EFF_FLAG) != 0; }
+  /// \brief Check if the frame is a remote transmission request.
+  bool rtr() const { return (record->canId & CAN_RTR_FLAG) != 0; }
+  /// \brief Check if this is an error frame (see linux/can/error.h).
+  bool error() const { return (record->canId & CAN_ERR_FLAG) != 0; }
+  /// \brief Check if this is a CAN FD frame.
+  bool fd() const { return (record->flags & CAN_LOG_FD) != 0; }
+  /// \brief Check if the frame was sent from the capturing host.
+  bool outgoing() const { return (record->flags & CAN_LOG_OUTGOING) != 0; }
+  /// \brief Number of data bytes.
+  uint8_t len() const { return record->len; }
+  /// \brief Data bytes of the frame, len() of them.
+  const uint8_t *data() const { return record->data; }
+  /// \brief Timestamp in nano-seconds since the epoch.
+  uint64_t timestamp() const { return record->timestamp; }
+  /// \brief Index of the interface in the names of the file.
+  uint8_t interface() const { return record->interface; }
+  /// \brief Copy the frame into a message that outlives the query.
+  void copy(CanMessage *msg) const;
+
+private:
+  friend class CanLogReader;
+  CanLogFrame() = default;
+
+  const CanLogRecord *record;
+};
+
+/**
+ * \typedef CanLogHandler
+ * \brief Called for each frame a query matches, a function or a callable
+ * with bound context (see CanDelegate).
+ */
+typedef CanDelegate<const CanLogFrame &> CanLogHandler;
+
+/**
+ * \struct CanLogQuery
+ * \brief Which frames a query hands over, see can_log_query_init().
+ *
+ * A frame matches if its timestamp is in [from, to), its id is one of ids
+ * and its first matchLen data bytes equal match where mask has bits set.
+ */
+typedef struct {
+  uint64_t from;          ///< earliest timestamp, ns since the epoch
+  uint64_t to;            ///< end of the window, UINT64_MAX for no end
+  const uint32_t *ids;    ///< ids with \ref CAN_ID_EXT for extended ids
+  uint32_t numIds;        ///< 0 for every id
+  uint8_t match[CAN_MAX_DATA]; ///< data bytes to compare with
+  uint8_t mask[CAN_MAX_DATA];  ///< bits of the data bytes that are compared
+  uint8_t matchLen;       ///< data bytes compared, shorter frames never match
+  uint64_t limit;         ///< most frames handed over, 0 for no limit
+} CanLogQuery;
+
+/**
+ * \brief Set a query that matches every frame.
+ */
+static inline void can_log_query_init(CanLogQuery *query) {
+  memset(query, 0, sizeof(*query));
+  query->to = UINT64_MAX;
+}
+
+/**
+ * \struct CanLogQueryStats
+ * \brief What a query did.
+ */
+typedef struct {
+  uint64_t frames;        ///< frames handed over
+  uint64_t framesRead;    ///< frames of the blocks read
+  uint32_t blocksRead;    ///< blocks read
+  uint32_t blocksSkipped; ///< blocks the index ruled out
+  uint64_t bytesRead;     ///< bytes of the blocks read
+  uint64_t bytesDecoded;  ///< bytes of records encoded blocks decoded to
+  uint64_t decodeNs;      ///< time spent decoding blocks, all threads
+} CanLogQueryStats;
+
+/**
+ * \struct CanLogBlock
+ * \brief Entry of the index of a file.
+ */
+typedef struct {
+  const CanLogBlockHeader *header; ///< in the map
+  uint64_t offset;        ///< of the header in the file
+} CanLogBlock;
+
+/**
+ * \brief Reads a capture file through a memory map.
+ *
+ * Queries only read the map, so several threads may query one reader at
+ * once.
+ */
+class CanLogReader {
+public:
+  CanLogReader();
+  ~CanLogReader();
+  CanLogReader(const CanLogReader &) = delete;
+  CanLogReader &operator=(const CanLogReader &) = delete;
+
+  /// \brief Map a file and index its blocks.
+  bool open(const char *path);
+  /// \brief Unmap the file.
+  void close();
+  /// \brief Hand the matching frames over in file order.
+  uint64_t query(const CanLogQuery *query, uint32_t threads,
+                 const CanLogHandler &handle, CanLogQueryStats *stats = NULL);
+  /// \brief Hand every frame of one block over, returns how many.
+  uint32_t read(uint32_t block, const CanLogHandler &handle) const;
+  /// \brief Number of whole blocks in the file.
+  uint32_t blocks() const { return numBlocks; }
+  /// \brief Index entry of a block.
+  const CanLogBlock *block(uint32_t i) const { return &index[i]; }
+  /// \brief Header of the file.
+  const CanLogFileHeader *header() const { return file; }
+  /// \brief Earliest timestamp in the file, UINT64_MAX if it has no frames.
+  uint64_t first() const { return firstTime; }
+  /// \brief Latest timestamp in the file, 0 if it has no frames.
+  uint64_t last() const { return lastTime; }
+  /// \brief Frames in the file.
+  uint64_t frames() const { return numFrames; }
+  /// \brief Bytes after the last whole block, left by a writer that stopped.
+  uint64_t trailing() const { return size - indexed; }
+
+private:
+  /// a query with the ids sorted out for fast checks
+  typedef struct {
+    const CanLogQuery *query;
+    uint8_t bitmap[CAN_LOG_BITMAP / 8]; ///< bits of all ids, for the blocks
+    uint8_t standard[CAN_LOG_BITMAP / 8]; ///< exact standard ids
+    uint32_t *ext;                      ///< sorted extended can_ids
+    uint32_t numExt;
+  } Plan;
+
+  static bool wanted(const Plan *plan, const CanLogBlockHeader *block);
+  static bool matches(const Plan *plan, const CanLogRecord *record);
+  static uint32_t scan(const Plan *plan, const CanLogBlockHeader *block,
+                       const uint8_t *records, uint32_t *found);
+  const uint8_t *records(const CanLogBlock *block, CanLogCodec *codec,
+                         uint8_t *buffer, uint64_t *decodeNs) const;
+  uint64_t deliver(const Plan *plan, const uint8_t *records,
+                   const uint32_t *found, uint32_t count, uint64_t handed,
+                   const CanLogHandler &handle) const;
+
+  int fd;
+  const uint8_t *map;
+  uint64_t size;
+  uint64_t indexed;       ///< bytes of the header and whole blocks
+  const CanLogFileHeader *file;
+  CanLogBlock *index;
+  uint32_t numBlocks;
+  uint32_t maxDecoded;    ///< largest rawBytes of an encoded block
+  uint64_t numFrames;
+  uint64_t firstTime, lastTime;
+};
+
+#endif //_CAN_LOG_H_
@@ -0,0 +1,625 @@
+/**
+ * CanLogCodec.cpp
+ * \brief implements the block codec of capture files
+ */
+#include "CanLogCodec.h"
+#include "CanLog.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+/// the five streams of a block
+enum { TIME, CODE, DICT, MASK, DATA };
+
+/// modes of a coded stream
+enum { STORED, REPEATED, HUFFMAN };
+
+/// bytes of the header of a coded stream
+#define STREAM_HEADER 9
+/// bytes of the code lengths of a Huffman coded stream
+#define LENGTHS 128
+/// bytes of a dictionary entry in the dictionary stream
+#define ENTRY_BYTES 7
+
+static inline uint64_t zigzag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline uint32_t put_varint(uint8_t *p, uint64_t value) {
+  uint32_t n = 0;
+  while (value >= 0x80) {
+    p[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  p[n++] = (uint8_t)value;
+  return n;
+}
+
+static inline bool get_varint(const uint8_t **p, const uint8_t *end,
+                              uint64_t *value) {
+  uint64_t v = 0;
+  for (uint32_t shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*p)++;
+    v |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      *value = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline void put32(uint8_t *p, uint32_t value) {
+  for (int b = 0; b < 4; ++b) {
+    p[b] = (uint8_t)(value >> (8 * b));
+  }
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/// a bit for each byte of x that is not 0, bit 0 for the lowest byte
+static inline uint8_t nonzero_bytes(uint64_t x) {
+  const uint64_t low = 0x7F7F7F7F7F7F7F7FULL;
+  uint64_t high = (((x & low) + low) | x) & ~low;
+  // gather the top bits of the bytes into the top byte
+  return (uint8_t)(((high >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+static inline uint32_t ctz(uint32_t value) { return __builtin_ctz(value); }
+
+/// the low len bits of code in reverse order
+static inline uint32_t reverse(uint32_t code, uint32_t len) {
+  uint32_t out = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    out = (out << 1) | ((code >> i) & 1);
+  }
+  return out;
+}
+
+/**
+ * Huffman code lengths of the symbols with counts, none longer than
+ * \ref CAN_LOG_CODEC_BITS. Symbols with a count of 0 get length 0.
+ */
+static void code_lengths(const uint32_t *counts, uint8_t *lengths) {
+  uint16_t symbols[256];
+  uint32_t n = 0;
+  for (uint32_t s = 0; s < 256; ++s) {
+    lengths[s] = 0;
+    if (counts[s] != 0) {
+      symbols[n++] = (uint16_t)s;
+    }
+  }
+  if (n < 2) {
+    // a single symbol still needs a code of one bit
+    if (n == 1) {
+      lengths[symbols[0]] = 1;
+    }
+    return;
+  }
+  std::sort(symbols, symbols + n, [counts](uint16_t a, uint16_t b) {
+    return counts[a] < counts[b];
+  });
+
+  // two queues: the sorted leaves, and the merged nodes, which come out
+  // sorted as well. Nodes 0 to n - 1 are leaves, the rest merged ones
+  uint64_t weight[512];
+  uint16_t parent[512];
+  for (uint32_t i = 0; i < n; ++i) {
+    weight[i] = counts[symbols[i]];
+  }
+  uint32_t leaf = 0, merged = n, next = n;
+  for (uint32_t m = 0; m + 1 < n; ++m) {
+    uint32_t pick[2];
+    for (int k = 0; k < 2; ++k) {
+      if (leaf < n && (merged == next || weight[leaf] <= weight[merged])) {
+        pick[k] = leaf++;
+      } else {
+        pick[k] = merged++;
+      }
+    }
+    weight[next] = weight[pick[0]] + weight[pick[1]];
+    parent[pick[0]] = parent[pick[1]] = (uint16_t)next;
+    next++;
+  }
+  uint8_t depth[512];
+  depth[next - 1] = 0;
+  for (uint32_t i = next - 1; i-- > 0;) {
+    depth[i] = depth[parent[i]] + 1;
+  }
+
+  // cut long codes, then lengthen the longest shorter ones until the code
+  // lengths fit again (Kraft sum at most 1)
+  uint32_t kraft = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    uint8_t len = depth[i] > CAN_LOG_CODEC_BITS ? CAN_LOG_CODEC_BITS
+                                                : depth[i];
+    lengths[symbols[i]] = len;
+    kraft += 1U << (CAN_LOG_CODEC_BITS - len);
+  }
+  while (kraft > (1U << CAN_LOG_CODEC_BITS)) {
+    // symbols are sorted by count, so the first deepest is the least used
+    uint32_t best = n;
+    for (uint32_t i = 0; i < n; ++i) {
+      uint8_t len = lengths[symbols[i]];
+      if (len < CAN_LOG_CODEC_BITS &&
+          (best == n || len > lengths[symbols[best]])) {
+        best = i;
+      }
+    }
+    uint8_t len = lengths[symbols[best]]++;
+    kraft -= 1U << (CAN_LOG_CODEC_BITS - len - 1);
+  }
+}
+
+/**
+ * Canonical codes of the lengths, bit reversed so they can be written least
+ * significant bit first.
+ *
+ * \returns false if the lengths do not make a prefix code.
+ */
+static bool canonical_codes(const uint8_t *lengths, uint16_t *codes) {
+  uint32_t count[CAN_LOG_CODEC_BITS + 1] = {0};
+  for (uint32_t s = 0; s < 256; ++s) {
+    count[lengths[s]]++;
+  }
+  count[0] = 0;
+  uint32_t next[CAN_LOG_CODEC_BITS + 2];
+  uint32_t code = 0;
+  for (uint32_t len = 1; len <= CAN_LOG_CODEC_BITS; ++len) {
+    code = (code + count[len - 1]) << 1;
+    next[len] = code;
+    if (next[len] + count[len] > (1U << len)) {
+      return false;
+    }
+  }
+  for (uint32_t s = 0; s < 256; ++s) {
+    if (lengths[s] != 0) {
+      codes[s] = (uint16_t)reverse(next[lengths[s]]++, lengths[s]);
+    }
+  }
+  return true;
+}
+
+CanLogCodec::CanLogCodec() {
+  for (uint32_t s = 0; s < CAN_LOG_STREAMS; ++s) {
+    streams[s] = NULL;
+    lengths[s] = 0;
+    capacity[s] = 0;
+  }
+  entries = NULL;
+  numEntries = 0;
+  maxEntries = 0;
+  table = NULL;
+  tableSize = 0;
+}
+
+CanLogCodec::~CanLogCodec() {
+  for (uint32_t s = 0; s < CAN_LOG_STREAMS; ++s) {
+    free(streams[s]);
+  }
+  free(entries);
+  free(table);
+}
+
+bool CanLogCodec::reserve(uint32_t stream, size_t need) {
+  if (need <= capacity[stream]) {
+    return true;
+  }
+  uint8_t *more = (uint8_t *)realloc(streams[stream], need);
+  if (more == NULL) {
+    return false;
+  }
+  streams[stream] = more;
+  capacity[stream] = need;
+  return true;
+}
+
+/// Double the dictionary and its hash table
+bool CanLogCodec::grow() {
+  uint32_t max = maxEntries == 0 ? 256 : maxEntries * 2;
+  Entry *more = (Entry *)realloc(entries, max * sizeof(Entry));
+  if (more == NULL) {
+    return false;
+  }
+  entries = more;
+  maxEntries = max;
+  uint32_t *bigger = (uint32_t *)calloc(2 * max, sizeof(uint32_t));
+  if (bigger == NULL) {
+    return false;
+  }
+  free(table);
+  table = bigger;
+  tableSize = 2 * max;
+  uint32_t count = numEntries;
+  for (numEntries = 0; numEntries < count;) {
+    uint32_t code;
+    const Entry *entry = &entries[numEntries];
+    lookup(entry->canId, entry->len, entry->flags, entry->interface, &code);
+  }
+  return true;
+}
+
+/**
+ * Find the dictionary entry of a frame, adding it if it is new.
+ *
+ * \returns the entry, NULL if the dictionary could not grow.
+ */
+CanLogCodec::Entry *CanLogCodec::lookup(uint32_t canId, uint8_t len,
+                                        uint8_t flags, uint8_t interface,
+                                        uint32_t *code) {
+  if (numEntries >= maxEntries && !grow()) {
+    return NULL;
+  }
+  uint32_t other = len | (uint32_t)flags << 8 | (uint32_t)interface << 16;
+  uint32_t h = canId * 0x9E3779B1U ^ other * 0x85EBCA6BU;
+  for (uint32_t i = h & (tableSize - 1);; i = (i + 1) & (tableSize - 1)) {
+    if (table[i] == 0) {
+      table[i] = numEntries + 1;
+      Entry *entry = &entries[numEntries];
+      entry->canId = canId;
+      entry->len = len;
+      entry->flags = flags;
+      entry->interface = interface;
+      *code = numEntries++;
+      return entry;
+    }
+    Entry *entry = &entries[table[i] - 1];
+    if (entry->canId == canId && entry->len == len && entry->flags == flags &&
+        entry->interface == interface) {
+      *code = table[i] - 1;
+      return entry;
+    }
+  }
+}
+
+/**
+ * Code one stream with a header, the cheapest of stored, one repeated
+ * symbol or Huffman.
+ *
+ * \returns the bytes put in out, 0 if max is too small.
+ */
+size_t CanLogCodec::pack(const uint8_t *in, uint32_t len, uint8_t *out,
+                         size_t max) {
+  uint32_t counts[256] = {0};
+  for (uint32_t i = 0; i < len; ++i) {
+    counts[in[i]]++;
+  }
+  uint32_t distinct = 0;
+  for (uint32_t s = 0; s < 256; ++s) {
+    distinct += counts[s] != 0;
+  }
+
+  uint8_t lengths[256];
+  size_t bits = 0;
+  if (distinct > 1) {
+    code_lengths(counts, lengths);
+    for (uint32_t s = 0; s < 256; ++s) {
+      bits += (size_t)counts[s] * lengths[s];
+    }
+  }
+  size_t huffman = LENGTHS + (bits + 7) / 8;
+
+  uint8_t mode = distinct == 1 ? REPEATED
+                 : distinct > 1 && huffman < len ? HUFFMAN
+                                                  : STORED;
+  size_t bytes = mode == REPEATED ? 1 : mode == HUFFMAN ? huffman : len;
+  if (STREAM_HEADER + bytes > max) {
+    return 0;
+  }
+  out[0] = mode;
+  put32(out + 1, len);
+  put32(out + 5, (uint32_t)bytes);
+  uint8_t *p = out + STREAM_HEADER;
+
+  if (mode == STORED) {
+    memcpy(p, in, len);
+  } else if (mode == REPEATED) {
+    p[0] = in[0];
+  } else {
+    uint16_t codes[256];
+    canonical_codes(lengths, codes);
+    for (uint32_t s = 0; s < 256; s += 2) {
+      p[s / 2] = (uint8_t)(lengths[s] | lengths[s + 1] << 4);
+    }
+    p += LENGTHS;
+    uint64_t acc = 0;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+      acc |= (uint64_t)codes[in[i]] << n;
+      n += lengths[in[i]];
+      if (n >= 32) {
+        put32(p, (uint32_t)acc);
+        p += 4;
+        acc >>= 32;
+        n -= 32;
+      }
+    }
+    for (; n > 0; n = n > 8 ? n - 8 : 0) {
+      *p++ = (uint8_t)acc;
+      acc >>= 8;
+    }
+  }
+  return STREAM_HEADER + bytes;
+}
+
+/**
+ * Decode one stream into streams[stream].
+ *
+ * \returns false if the stream is damaged.
+ */
+bool CanLogCodec::unpack(const uint8_t **in, const uint8_t *end,
+                         uint32_t stream) {
+  if (end - *in < STREAM_HEADER) {
+    return false;
+  }
+  uint8_t mode = (*in)[0];
+  uint32_t len = get32(*in + 1);
+  uint32_t bytes = get32(*in + 5);
+  const uint8_t *p = *in + STREAM_HEADER;
+  if ((size_t)(end - p) < bytes || !reserve(stream, len)) {
+    return false;
+  }
+  *in = p + bytes;
+  lengths[stream] = len;
+  uint8_t *out = streams[stream];
+
+  if (mode == STORED) {
+    if (bytes != len) {
+      return false;
+    }
+    memcpy(out, p, len);
+    return true;
+  }
+  if (mode == REPEATED) {
+    if (bytes != 1) {
+      return false;
+    }
+    memset(out, p[0], len);
+    return true;
+  }
+  if (mode != HUFFMAN || bytes < LENGTHS) {
+    return false;
+  }
+
+  uint8_t codeLengths[256];
+  for (uint32_t s = 0; s < 256; s += 2) {
+    codeLengths[s] = p[s / 2] & 0xF;
+    codeLengths[s + 1] = p[s / 2] >> 4;
+    if (codeLengths[s] > CAN_LOG_CODEC_BITS ||
+        codeLengths[s + 1] > CAN_LOG_CODEC_BITS) {
+      return false;
+    }
+  }
+  uint16_t codes[256];
+  if (!canonical_codes(codeLengths, codes)) {
+    return false;
+  }
+  memset(decodeTable, 0, sizeof(decodeTable));
+  for (uint32_t s = 0; s < 256; ++s) {
+    for (uint32_t i = codes[s]; codeLengths[s] != 0 &&
+                                i < (1U << CAN_LOG_CODEC_BITS);
+         i += 1U << codeLengths[s]) {
+      decodeTable[i].symbol = (uint8_t)s;
+      decodeTable[i].len = codeLengths[s];
+    }
+  }
+
+  p += LENGTHS;
+  const uint8_t *bitsEnd = *in;
+  uint64_t acc = 0;
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    if (n < CAN_LOG_CODEC_BITS) {
+      if (bitsEnd - p >= 8) {
+        // take 8 bytes at once and keep the whole bytes that fit
+        uint64_t word;
+        memcpy(&word, p, 8);
+        acc |= word << n;
+        p += (63 - n) >> 3;
+        n |= 56;
+      } else {
+        while (n <= 56 && p < bitsEnd) {
+          acc |= (uint64_t)*p++ << n;
+          n += 8;
+        }
+      }
+    }
+    Code code = decodeTable[acc & ((1U << CAN_LOG_CODEC_BITS) - 1)];
+    if (code.len == 0 || code.len > n) {
+      return false;
+    }
+    out[i] = code.symbol;
+    acc >>= code.len;
+    n -= code.len;
+  }
+  return true;
+}
+
+/**
+ * \param records the records of a block as in CanLog.h
+ * \param bytes bytes of the records
+ * \param frames records in the block
+ * \param out where the encoded block goes
+ * \param max bytes out can take
+ *
+ * \returns the bytes of the encoded block, 0 if it does not fit in max or
+ * the records are damaged.
+ */
+size_t CanLogCodec::encode(const uint8_t *records, uint32_t bytes,
+                           uint32_t frames, uint8_t *out, size_t max) {
+  if (!reserve(TIME, (size_t)frames * 10) ||
+      !reserve(CODE, (size_t)frames * 5) ||
+      !reserve(DICT, (size_t)frames * ENTRY_BYTES) ||
+      !reserve(MASK, (size_t)frames * (CANFD_MAX_DLEN / 8)) ||
+      !reserve(DATA, bytes)) {
+    return 0;
+  }
+  for (uint32_t s = 0; s < CAN_LOG_STREAMS; ++s) {
+    lengths[s] = 0;
+  }
+  numEntries = 0;
+  if (table != NULL) {
+    memset(table, 0, tableSize * sizeof(uint32_t));
+  }
+
+  uint64_t prevTs = 0, prevDelta = 0;
+  uint32_t offset = 0;
+  for (uint32_t f = 0; f < frames; ++f) {
+    if (offset + sizeof(CanLogRecord) > bytes) {
+      return 0;
+    }
+    const CanLogRecord *record = (const CanLogRecord *)(records + offset);
+    uint32_t size = can_log_record_size(record->len);
+    if (record->len > CANFD_MAX_DLEN || offset + size > bytes) {
+      return 0;
+    }
+    offset += size;
+
+    uint64_t delta = record->timestamp - prevTs;
+    lengths[TIME] += put_varint(streams[TIME] + lengths[TIME],
+                                zigzag((int64_t)(delta - prevDelta)));
+    prevTs = record->timestamp;
+    prevDelta = delta;
+
+    uint32_t code;
+    uint32_t known = numEntries;
+    Entry *entry = lookup(record->canId, record->len, record->flags,
+                          record->interface, &code);
+    if (entry == NULL) {
+      return 0;
+    }
+    lengths[CODE] += put_varint(streams[CODE] + lengths[CODE], code);
+    if (numEntries != known) {
+      uint8_t *d = streams[DICT] + lengths[DICT];
+      put32(d, record->canId);
+      d[4] = record->len;
+      d[5] = record->flags;
+      d[6] = record->interface;
+      lengths[DICT] += ENTRY_BYTES;
+      memset(entry->prev, 0, sizeof(entry->prev));
+    }
+
+    // the changed bytes, and a bit for each byte telling if it changed,
+    // 8 bytes at a time (the data of a record is padded to 8)
+    for (uint32_t i = 0; i < record->len; i += 8) {
+      uint64_t x, prev;
+      memcpy(&x, record->data + i, 8);
+      memcpy(&prev, entry->prev + i, 8);
+      x ^= prev;
+      if (record->len - i < 8) {
+        x &= (1ULL << (8 * (record->len - i))) - 1;
+      }
+      uint8_t mask = nonzero_bytes(x);
+      for (uint32_t m = mask; m != 0; m &= m - 1) {
+        streams[DATA][lengths[DATA]++] = (uint8_t)(x >> (8 * ctz(m)));
+      }
+      streams[MASK][lengths[MASK]++] = mask;
+    }
+    memcpy(entry->prev, record->data, record->len);
+  }
+
+  size_t used = 0;
+  for (uint32_t s = 0; s < CAN_LOG_STREAMS; ++s) {
+    size_t n = pack(streams[s], (uint32_t)lengths[s], out + used, max - used);
+    if (n == 0) {
+      return 0;
+    }
+    used += n;
+  }
+  return used;
+}
+
+/**
+ * \param in an encoded block
+ * \param len bytes of the encoded block
+ * \param frames records in the block
+ * \param records[out] where the records go
+ * \param bytes bytes of the records, as the block header says
+ *
+ * \returns false if the block is damaged.
+ */
+bool CanLogCodec::decode(const uint8_t *in, size_t len, uint32_t frames,
+                         uint8_t *records, uint32_t bytes) {
+  const uint8_t *end = in + len;
+  for (uint32_t s = 0; s < CAN_LOG_STREAMS; ++s) {
+    if (!unpack(&in, end, s)) {
+      return false;
+    }
+  }
+  const uint8_t *pos[CAN_LOG_STREAMS], *stop[CAN_LOG_STREAMS];
+  for (uint32_t s = 0; s < CAN_LOG_STREAMS; ++s) {
+    pos[s] = streams[s];
+    stop[s] = streams[s] + lengths[s];
+  }
+
+  numEntries = 0;
+  uint64_t prevTs = 0, prevDelta = 0;
+  uint32_t offset = 0;
+  for (uint32_t f = 0; f < frames; ++f) {
+    uint64_t dod, code;
+    if (!get_varint(&pos[TIME], stop[TIME], &dod) ||
+        !get_varint(&pos[CODE], stop[CODE], &code) || code > numEntries) {
+      return false;
+    }
+    prevDelta += (uint64_t)unzigzag(dod);
+    prevTs += prevDelta;
+
+    if (code == numEntries) {
+      if (stop[DICT] - pos[DICT] < ENTRY_BYTES ||
+          pos[DICT][4] > CANFD_MAX_DLEN ||
+          (numEntries == maxEntries && !grow())) {
+        return false;
+      }
+      Entry *entry = &entries[numEntries++];
+      entry->canId = get32(pos[DICT]);
+      entry->len = pos[DICT][4];
+      entry->flags = pos[DICT][5];
+      entry->interface = pos[DICT][6];
+      memset(entry->prev, 0, sizeof(entry->prev));
+      pos[DICT] += ENTRY_BYTES;
+    }
+    Entry *entry = &entries[code];
+
+    uint32_t size = can_log_record_size(entry->len);
+    if (offset + size > bytes) {
+      return false;
+    }
+    CanLogRecord *record = (CanLogRecord *)(records + offset);
+    offset += size;
+    record->timestamp = prevTs;
+    record->canId = entry->canId;
+    record->len = entry->len;
+    record->flags = entry->flags;
+    record->interface = entry->interface;
+    record->reserved = 0;
+
+    for (uint32_t i = 0; i < entry->len; i += 8) {
+      if (pos[MASK] == stop[MASK]) {
+        return false;
+      }
+      uint32_t mask = *pos[MASK]++;
+      uint32_t valid = entry->len - i < 8 ? (1U << (entry->len - i)) - 1 : 0xFF;
+      if ((mask & ~valid) != 0 ||
+          stop[DATA] - pos[DATA] < __builtin_popcount(mask)) {
+        return false;
+      }
+      uint64_t x = 0;
+      for (; mask != 0; mask &= mask - 1) {
+        x |= (uint64_t)*pos[DATA]++ << (8 * ctz(mask));
+      }
+      uint64_t prev;
+      memcpy(&prev, entry->prev + i, 8);
+      prev ^= x;
+      memcpy(entry->prev + i, &prev, 8);
+    }
+    // the bytes of prev past len stay 0, so they pad the data as well
+    memcpy(record->data, entry->prev, size - sizeof(CanLogRecord));
+  }
+  return offset == bytes;
+}
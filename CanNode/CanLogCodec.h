@@ -0,0 +1,114 @@
+/**
+ * \file CanLogCodec.h
+ * \brief Compresses the blocks of capture files, see CanLog.h.
+ *
+ * Most of a capture is the same ids sent again and again at steady rates
+ * with payloads that change a little each time. Generic compressors find some
+ * of that; this codec is built around it. Every block is coded on its own, so
+ * a reader can still decode any block without the ones before it:
+ *
+ *  - timestamps become the change of the gap to the frame before
+ *    (delta-of-delta), which is close to 0 for periodic frames
+ *  - the id, length, flags and interface of a frame become a code into a
+ *    dictionary of the combinations seen in the block, a single byte while
+ *    there are fewer than 128
+ *  - the payload is XORed with the previous payload of the same dictionary
+ *    entry, and only the bytes that changed are kept, with a bitmask of
+ *    which ones they were
+ *
+ * These fields go to five separate streams, and each stream is then coded
+ * with its own table driven Huffman code of at most
+ * \ref CAN_LOG_CODEC_BITS bits a symbol, or kept as it is if that would not
+ * make it smaller.
+ *
+ * Encoded block (encoding 1 in the block header), little endian:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | ...   | timestamp stream: zigzag varints of the delta-of-delta in ns |
+ * | ...   | code stream: varint dictionary codes, a new entry takes the  |
+ * |       | next free code                                               |
+ * | ...   | dictionary stream: for each new entry its can_id (4 bytes),  |
+ * |       | length, flags and interface                                  |
+ * | ...   | mask stream: for each frame with data, a bit per data byte   |
+ * |       | (len + 7) / 8 bytes, set if the byte changed                 |
+ * | ...   | data stream: the changed bytes XORed with the previous ones  |
+ *
+ * each stream a header:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | 1     | mode, 0 stored, 1 one symbol repeated, 2 Huffman             |
+ * | 4     | bytes of the stream once decoded                             |
+ * | 4     | bytes that follow, stored: the stream, one symbol: 1 byte,   |
+ * |       | Huffman: 128 bytes of code lengths (4 bits per symbol, low   |
+ * |       | nibble first) and the codes, least significant bit first     |
+ */
+#ifndef _CAN_LOG_CODEC_H_
+#define _CAN_LOG_CODEC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Longest Huffman code, the decoding table has 2^CAN_LOG_CODEC_BITS entries
+#define CAN_LOG_CODEC_BITS 11
+
+/// Streams of an encoded block
+#define CAN_LOG_STREAMS 5
+
+/**
+ * \brief Encodes and decodes blocks of records.
+ *
+ * A codec keeps its working buffers between blocks, so each thread coding
+ * blocks should have one of its own.
+ */
+class CanLogCodec {
+public:
+  CanLogCodec();
+  ~CanLogCodec();
+  CanLogCodec(const CanLogCodec &) = delete;
+  CanLogCodec &operator=(const CanLogCodec &) = delete;
+
+  /// \brief Encode the records of a block, returns the bytes put in out.
+  size_t encode(const uint8_t *records, uint32_t bytes, uint32_t frames,
+                uint8_t *out, size_t max);
+  /// \brief Decode a block back into its records.
+  bool decode(const uint8_t *in, size_t len, uint32_t frames,
+              uint8_t *records, uint32_t bytes);
+
+private:
+  /// a combination of id, length, flags and interface seen in the block
+  typedef struct {
+    uint32_t canId;
+    uint8_t len;
+    uint8_t flags;
+    uint8_t interface;
+    uint8_t prev[64];     ///< payload of the last frame with this entry
+  } Entry;
+
+  /// a table entry decodes the symbol of the low bits it is indexed by
+  typedef struct {
+    uint8_t symbol;
+    uint8_t len;          ///< 0 for bit patterns no code starts with
+  } Code;
+
+  bool reserve(uint32_t stream, size_t need);
+  Entry *lookup(uint32_t canId, uint8_t len, uint8_t flags, uint8_t interface,
+                uint32_t *code);
+  bool grow();
+  static size_t pack(const uint8_t *in, uint32_t len, uint8_t *out,
+                     size_t max);
+  bool unpack(const uint8_t **in, const uint8_t *end, uint32_t stream);
+
+  uint8_t *streams[CAN_LOG_STREAMS];
+  size_t lengths[CAN_LOG_STREAMS];
+  size_t capacity[CAN_LOG_STREAMS];
+  Entry *entries;
+  uint32_t numEntries, maxEntries;
+  uint32_t *table;        ///< entry + 1 by hash, 0 for free
+  uint32_t tableSize;     ///< a power of two, at least 2 * maxEntries
+  Code decodeTable[1 << CAN_LOG_CODEC_BITS];
+};
+
+#endif //_CAN_LOG_CODEC_H_
@@ -0,0 +1,113 @@
+/**
+ * \file CanMessageView.h
+ * \brief Received frames read in place in the receive batch.
+ *
+ * recvmmsg() fills a batch of frames, and each CanMessageView is one slot of
+ * that batch: nothing is copied when a frame is received, and the id, flags
+ * and length are decoded from the raw frame only when asked for. A consumer
+ * set with CanNode::setBatchHandler() gets the frames of a batch as a
+ * CanMessageBatch, before the filter handlers run.
+ *
+ * Views are only valid while the handler they were passed to runs: the next
+ * batch is received into the same slots. They cannot be copied, copy() turns
+ * a view into a CanMessage that can be kept.
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * void logBatch(const CanMessageBatch &batch) {
+ *   for (const CanMessageView &view : batch) {
+ *     fwrite(view.data(), 1, view.len(), out);
+ *   }
+ * }
+ * CanNode::setBatchHandler(logBatch);
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_MESSAGE_VIEW_H_
+#define _CAN_MESSAGE_VIEW_H_
+
+#include "CanHandler.h"
+#include "CanTypes.h"
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef CANFD_FDF
+/// Flag of struct canfd_frame marking a CAN FD frame, set on every frame
+/// received as one
+#define CANFD_FDF 0x04
+#endif
+
+class CanNode;
+
+class CanMessageView {
+public:
+  /// \brief An empty slot of a receive batch.
+  CanMessageView() = default;
+  CanMessageView(const CanMessageView &) = delete;
+  CanMessageView &operator=(const CanMessageView &) = delete;
+
+  /// \brief Id of the frame, with \ref CAN_ID_EXT set for an extended id.
+  uint32_t id() const {
+    return frame.can_id & CAN_EFF_FLAG
+               ? frame.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK)
+               : frame.can_id & CAN_SFF_MASK;
+  }
+  /// \brief Check if the frame has an extended 29-bit id.
+  bool ext() const { return (frame.can_id & CAN_EFF_FLAG) != 0; }
+  /// \brief Check if the frame is a remote transmission request.
+  bool rtr() const { return (frame.can_id & CAN_RTR_FLAG) != 0; }
+  /// \brief Check if this is a CAN FD frame, whatever its length.
+  bool fd() const { return (frame.flags & CANFD_FDF) != 0; }
+  /// \brief CANFD_BRS and CANFD_ESI of a CAN FD frame, 0 for a classic one.
+  uint8_t fdFlags() const {
+    return fd() ? frame.flags & (CANFD_BRS | CANFD_ESI) : 0;
+  }
+  /// \brief Number of data bytes.
+  uint8_t len() const {
+    return frame.len > CAN_MAX_DATA ? CAN_MAX_DATA : frame.len;
+  }
+  /// \brief Data bytes of the frame, len() of them.
+  const uint8_t *data() const { return frame.data; }
+  /// \brief Mask filter the frame matched, or \ref CAN_NO_FMI.
+  uint8_t fmi() const;
+  /// \brief Copy the frame into a message that outlives the view.
+  void copy(CanMessage *msg) const;
+
+private:
+  friend class CanNode;
+
+  struct canfd_frame frame; ///< filled in place by recvmmsg() or io_uring,
+                            ///< or copied from a CanShm ring, flags has
+                            ///< CANFD_FDF set if it is a CAN FD frame
+};
+
+/**
+ * \brief Frames of one receive batch, in the order they were received.
+ */
+class CanMessageBatch {
+public:
+  const CanMessageView *begin() const { return views; }
+  const CanMessageView *end() const { return views + count; }
+  /// \brief Number of frames.
+  uint32_t size() const { return count; }
+  const CanMessageView &operator[](uint32_t i) const { return views[i]; }
+
+private:
+  friend class CanNode;
+
+  CanMessageBatch(const CanMessageView *views, uint32_t count)
+      : views(views), count(count) {}
+
+  const CanMessageView *views;
+  uint32_t count;
+};
+
+/**
+ * \typedef CanBatchHandler
+ * \brief Consumer of receive batches, a function or a callable with bound
+ * context (see CanDelegate).
+ *
+ * \see CanNode::setBatchHandler
+ */
+typedef CanDelegate<const CanMessageBatch &> CanBatchHandler;
+
+#endif //_CAN_MESSAGE_VIEW_H_
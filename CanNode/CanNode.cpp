@@ -6,12 +6,22 @@
  * \date 6-20-16
  */
 #include "CanNode.h"
+#include "CanAggregate.h"
+#include "CanStats.h"
+#include "CanTime.h"
+#include "CanTxQueue.h"
+#include <mutex>
+#include <stdio.h>
 #include <unistd.h>
 #include <sys/timeb.h>
 
-CanNode *CanNode::nodes[MAX_NODES] = {nullptr};
-bool CanNode::newMessage = false;
-CanMessage CanNode::tmpMsg;
+
+/// serializes setting up and deleting CAN_BCM receive jobs with the filters
+/// that use them
+static std::mutex bcm_filters;
+
+/// consumer of receive batches, see setBatchHandler()
+static CanBatchHandler batch_handle;
 
 inline uint32_t HAL_GetTick() {
   struct timeb tim;
@@ -27,58 +37,83 @@ inline uint32_t HAL_GetTick() {
  * also populates the RTR callback from the provided function. Additional callbacks
  * are added by using the \ref CanNode_addFilter() function.
  *
- * \param[in] id CAN Address, use the \ref CanNodeType type.
- * \param[in] rtrHandle function pointer to a handler function for rtr requests.
+ * \param[in] id CAN Address, use the \ref CanNodeType type, or a 29-bit id
+ * with \ref CAN_ID_EXT set.
+ * \param[in] rtrHandle handler for rtr requests, may be empty.
  * \param[in] force (depricated) Force the creation of a new node of the given paramaters
  * if an old one is not found in flash memory.
  *
  * \returns the address of a \ref CanNode struct that stores the can information.
  * This information is necessary for using any of the sendData functions
  */
-CanNode::CanNode(CanNodeType id, filterHandler rtrHandle) {
-  static bool has_run = false;
-  static uint64_t usedNodes = 0;
+CanNode::CanNode(uint32_t id, const CanHandler &rtrHandle) {
+  static std::once_flag has_run;
 
-  // if this is the first run clear list of nodes
-  if (!has_run) {
+  // the first node brings up the bus, even if several are made at once
+  std::call_once(has_run, []() {
     can_init();
     can_set_bitrate(CAN_BITRATE_500K);
     can_enable();
-    has_run = true;
+  });
+
+  cyclicPeriod = 0;
+  cyclicStarted = false;
+
+  //clear the name and info pointers
+  nameStr=NULL;
+  infoStr=NULL;
+
+  // nothing published, rtrs go to rtrHandle
+  values[0].len = 0;
+  values[1].len = 0;
+  valueSeq = 0;
+  valueRouted = false;
+
+  // no rate limit
+  txInterval = 0;
+  txTolerance = 0;
+  txTat = 0;
+
+  this->id = id;
+  this->registrySlot = UINT32_MAX;
+  if (!CanRegistry::addNode(this)) {
+    perror("can node");
+    return;
   }
 
-  // check if a node of that type exists
-  for (uint8_t i = 0; i < MAX_NODES; ++i) {
-    // check if spot is used
-    if (nodes[i] != nullptr ) {
-      continue;
-    }
-    // otherwise its open
-
-    for(int j = 0; j < NUM_FILTERS; j++){
-        this->filters[j] = 0;
-        this->handle[j] = nullptr;
-    }
-
-    // add id etc
-    nodes[i] = this;
-
-    //clear the name and info pointers
-    nameStr=NULL;
-    infoStr=NULL;
+  // rtr, get name and get info routes
+  if (rtrHandle) {
+    CanRegistry::add(this, id, CAN_ROUTE_RTR, rtrHandle, CanHandler());
+  }
+  CanRegistry::add(this, id + 1, CAN_ROUTE_NAME, CanHandler(), CanHandler());
+  CanRegistry::add(this, id + 2, CAN_ROUTE_INFO, CanHandler(), CanHandler());
+
+  // add filters to hardware
+  // default filters
+  can_add_filter_id(id);     // rtr filter
+  can_add_filter_id(id + 1); // get name filter
+  can_add_filter_id(id + 2); // get info filter
+  can_add_filter_id(id + 3); // configuration filter
+}
 
-    this->id = id;
-    // add filters to hardware
-    // default filters
-    can_add_filter_id(id);     // rtr filter
-    can_add_filter_id(id + 1); // get name filter
-    can_add_filter_id(id + 2); // get info filter
-    can_add_filter_id(id + 3); // configuration filter
+/**
+ * Removes the node from the registry, so its handlers are not called any more,
+ * even for messages that are already being dispatched. Returns once handlers
+ * of the node running on other threads have returned. Its periodic streams
+ * and CAN_BCM jobs are stopped. Hardware filters stay, they are shared with
+ * other nodes.
+ */
+CanNode::~CanNode() {
+  CanPeriodic::removeNode(this);
+  stopCyclic();
 
-    // fill a spot in used nodes
-    usedNodes |= 1 << i;
-    break;
+  CanFilterHandle filter;
+  while ((filter = CanRegistry::first(this)) != CAN_NO_FILTER) {
+    removeFilter(filter);
   }
+  CanRegistry::removeNode(this);
+  // handlers of the node may still be running on other threads
+  CanEpoch::synchronize();
 }
 
 /**
@@ -98,39 +133,232 @@ CanNode::CanNode(CanNodeType id, filterHandler rtrHandle) {
  *
  * \param node [in,out] pointer to a node that was initilized with CanNode_init()
  * \param filter [in] id of the device that should be handled by handle
- * \param handle [in] function used to handle the filter
+ * \param handle [in] function, or callable with its context, used to handle
+ * the filter (see CanHandler)
  *
- * \returns true if the filter was added, false if otherwise.
+ * \returns a handle for removeFilter(), or \ref CAN_NO_FILTER (false) if the
+ * filter was not added.
  *
  * \see can_add_filter_mask() for using mask filtering
  */
-bool CanNode::addFilter(uint16_t filter, filterHandler handle) {
-  if (filter > 0x7FF || handle == NULL) {
+CanFilterHandle CanNode::addFilter(uint32_t filter, const CanHandler &handle) {
+  if (!can_id_valid(filter) || !handle) {
+    return CAN_NO_FILTER;
+  }
+
+  /*
+   * If not a reseved address, add to hardware filtering
+   * aka. It's assumed that the id was already added to the
+   * hardware filtering if the id is below 52.
+   */
+  if (filter > 52) {
+    can_add_filter_id(filter);
+  }
+  return CanRegistry::add(this, filter, CAN_ROUTE_FILTER, handle,
+                          CanHandler());
+}
+
+/**
+ * Like addFilter(uint32_t, const CanHandler &), but the id is watched by the
+ * kernel broadcast manager (CAN_BCM) instead of being matched against every
+ * received frame. With changedOnly the handler is only called when the data
+ * of the id changes, so a steady value costs no wakeups at all. With a
+ * timeout the kernel reports an id that went silent.
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.c}
+ * CanFilterOptions opts = {true, 500, throttleLost};
+ * node.addFilter(THROTTLE, throttleChanged, &opts);
+ * ~~~~~~~~~~~~
+ *
+ * \param filter [in] id of the device that should be handled by handle
+ * \param handle [in] function used to handle the filter
+ * \param options [in] what the kernel should filter for
+ *
+ * \returns a handle for removeFilter(), or \ref CAN_NO_FILTER (false) if the
+ * filter was not added.
+ */
+CanFilterHandle CanNode::addFilter(uint32_t filter, const CanHandler &handle,
+                                   const CanFilterOptions *options) {
+  if (options == NULL) {
+    return addFilter(filter, handle);
+  }
+  if (!can_id_valid(filter) || !handle) {
+    return CAN_NO_FILTER;
+  }
+
+  std::lock_guard<std::mutex> guard(bcm_filters);
+  if (!can_bcm_rx_setup(filter, options->changedOnly, options->timeout)) {
+    return CAN_NO_FILTER;
+  }
+  CanFilterHandle added = CanRegistry::add(this, filter, CAN_ROUTE_BCM, handle,
+                                           options->timeoutHandle);
+  if (added == CAN_NO_FILTER && !CanRegistry::has(filter, CAN_ROUTE_BCM)) {
+    can_bcm_delete(filter, false);
+  }
+  return added;
+}
+
+/**
+ * Removing a filter takes effect right away, its handler is not called again
+ * even if a message for it is being dispatched: called from another thread
+ * it returns once a dispatch of the loop thread that may still call the
+ * handler has finished, so the context of the handler can be freed then. The
+ * hardware filter for the id stays, the CAN_BCM job of the id is removed once
+ * no node uses it.
+ *
+ * \param filter handle returned by addFilter()
+ *
+ * \returns false if the filter is not one of this node's, or was already
+ * removed.
+ */
+bool CanNode::removeFilter(CanFilterHandle filter) {
+  {
+    std::lock_guard<std::mutex> guard(bcm_filters);
+    uint32_t key;
+    CanRouteKind kind;
+    if (!CanRegistry::remove(filter, this, &key, &kind)) {
+      return false;
+    }
+    if (kind == CAN_ROUTE_BCM && !CanRegistry::has(key, CAN_ROUTE_BCM)) {
+      can_bcm_delete(key, false);
+    }
+  }
+  // the loop may be calling the handler, not waited for from a handler on
+  // the loop thread itself (see CanEpoch::synchronize())
+  CanEpoch::synchronize();
+  return true;
+}
+
+/**
+ * After this call the sendData functions of this node no longer send a single
+ * message. They update the data of a CAN_BCM transmit job instead, and the
+ * kernel sends the latest data every period without waking the process. The
+ * first sendData starts the job.
+ *
+ * \param period period in micro-seconds
+ *
+ * \returns false if the broadcast manager is not available.
+ */
+bool CanNode::startCyclic(uint32_t period) {
+  if (period == 0) {
     return false;
   }
+  if (cyclicStarted) {
+    stopCyclic();
+  }
+  cyclicPeriod = period;
+  return true;
+}
 
-  // add to the end of the list of filters... If there's room.
-  for (uint8_t i = 0; i < NUM_FILTERS; ++i) {
-    if (this->filters[i] == 0) {
-      // save the filter id
-      this->filters[i] = filter;
-      // save a pointer to the handler function
-      this->handle[i] = handle;
-
-      /*
-       * If not a reseved address, add to hardware filtering
-       * aka. It's assumed that the id was already added to the
-       * hardware filtering if the id is below 52.
-       */
-      if (filter > 52) {
-        can_add_filter_id(filter);
-      }
+void CanNode::stopCyclic() {
+  if (cyclicStarted) {
+    can_bcm_delete(this->id, true);
+  }
+  cyclicPeriod = 0;
+  cyclicStarted = false;
+}
 
-      return true; // Sucess! Filter has been added
+/**
+ * Limits how fast the sendData functions of this node put messages on the bus.
+ * Messages over the limit are not dropped, they wait in the transmit queue
+ * until the limit allows them, and do not hold up other nodes while waiting.
+ * Once CAN_TX_HELD_NODE messages of the node are waiting, sendData reports
+ * \ref BUS_BUSY instead.
+ *
+ * \param rate messages per second, 0 removes the limit
+ * \param burst number of messages that may be sent back to back
+ */
+void CanNode::setRateLimit(uint32_t rate, uint16_t burst) {
+  if (rate == 0) {
+    txInterval = 0;
+    return;
+  }
+  if (burst == 0) {
+    burst = 1;
+  }
+  txInterval = 1000000000ULL / rate;
+  txTolerance = txInterval * (burst - 1);
+  txTat = 0;
+}
+
+/**
+ * Queue a message from this node, held back as long as needed by the rate
+ * limit (a token bucket expressed as a theoretical arrival time). A message
+ * that is not queued gives its slot back.
+ */
+CanState CanNode::transmit(CanMessage *msg) const {
+  uint64_t notBefore = 0;
+
+  // the kernel repeats the message, only its data needs updating
+  if (cyclicPeriod != 0) {
+    CanState state =
+        can_bcm_tx(msg, cyclicPeriod, !cyclicStarted.load());
+    if (state == BUS_OK) {
+      cyclicStarted = true;
     }
+    return state;
+  }
+
+  if (txInterval == 0) {
+    return can_queue(msg, 0, 5);
   }
 
-  return false; // no empty slots
+  uint64_t now = can_time_ns();
+  uint64_t tat = txTat.load(std::memory_order_relaxed);
+  uint64_t next;
+  // threads sending from the same node each claim their own slot
+  do {
+    uint64_t due = tat < now ? now : tat;
+    if (due > now + txTolerance + CAN_TX_HELD_NODE * txInterval) {
+      CanStats::countTxFailure();
+      return BUS_BUSY; // the node already has its share of held messages
+    }
+    notBefore = due > now + txTolerance ? due - txTolerance : 0;
+    next = due + txInterval;
+  } while (!txTat.compare_exchange_weak(tat, next,
+                                        std::memory_order_relaxed));
+
+  CanState state = can_queue(msg, notBefore, 5);
+  if (state != BUS_OK) {
+    txTat.fetch_sub(txInterval, std::memory_order_relaxed);
+  }
+  return state;
+}
+
+/**
+ * The producer is called from checkForMessages() on the message loop thread,
+ * so the loop has to run at least as often as the shortest period (see
+ * waitForMessages()). Streams that fire in the same tick are sent together.
+ *
+ * \param period period in micro-seconds
+ * \param producer function that calls one of the sendData functions of node
+ *
+ * \returns a handle for stopPeriodic() and getPeriodicStats(), or -1 if the
+ * stream could not be started.
+ *
+ * \see CanPeriodic
+ */
+int CanNode::publishPeriodic(uint32_t period, periodicProducer producer) const {
+  return CanPeriodic::add(this, period, producer);
+}
+
+/**
+ * \param handle handle returned by publishPeriodic()
+ */
+void CanNode::stopPeriodic(int handle) {
+  CanPeriodic::remove(handle);
+}
+
+/**
+ * \param handle handle returned by publishPeriodic()
+ * \param stats[out] timing of the stream
+ *
+ * \returns false if there is no such stream.
+ */
+bool CanNode::getPeriodicStats(int handle, CanPeriodicStats *stats) {
+  return CanPeriodic::getStats(handle, stats);
 }
 
 //getter and setter functions -------------------------------------------------
@@ -140,6 +368,9 @@ bool CanNode::addFilter(uint16_t filter, filterHandler handle) {
  * \param node [in] Specifies the node to send data from (basically an id)
  * \param data [in] Data to send
  *
+ * \returns the \ref CanState of the transmit queue, \ref BUS_BUSY if it
+ * is full.
+ *
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_int16()
  * \see CanNode_sendData_uint16()
@@ -151,22 +382,20 @@ bool CanNode::addFilter(uint16_t filter, filterHandler handle) {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData(int8_t data) const {
+CanState CanNode::sendData(int8_t data) const {
   CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT8) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t)data;
-  // set other odds and ends
-  msg.len = 2;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+  putValue(&msg, CAN_INT8, (uint8_t)data, 1);
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns the \ref CanState of the transmit queue, \ref BUS_BUSY if it
+ * is full.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_int16()
  * \see CanNode_sendData_uint16()
@@ -178,22 +407,20 @@ void CanNode::sendData(int8_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData(uint8_t data) const {
+CanState CanNode::sendData(uint8_t data) const {
   CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT8) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = data;
-  // set other odds and ends
-  msg.len = 2;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+  putValue(&msg, CAN_UINT8, data, 1);
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns the \ref CanState of the transmit queue, \ref BUS_BUSY if it
+ * is full.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_uint16()
@@ -205,24 +432,20 @@ void CanNode::sendData(uint8_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData(int16_t data) const {
+CanState CanNode::sendData(int16_t data) const {
   CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT16) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t)(data & 0x00ff);
-  msg.data[2] = (uint8_t)((data & 0xff00) >> 8);
-  // set other odds and ends
-  msg.len = 3;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+  putValue(&msg, CAN_INT16, (uint16_t)data, 2);
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns the \ref CanState of the transmit queue, \ref BUS_BUSY if it
+ * is full.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_int16()
@@ -234,24 +457,20 @@ void CanNode::sendData(int16_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData(uint16_t data) const {
+CanState CanNode::sendData(uint16_t data) const {
   CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT16) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t) (data & 0x00ff);
-  msg.data[2] = (uint8_t)((data & 0xff00) >> 8);
-  // set other odds and ends
-  msg.len = 3;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+  putValue(&msg, CAN_UINT16, data, 2);
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns the \ref CanState of the transmit queue, \ref BUS_BUSY if it
+ * is full.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_int16()
@@ -263,26 +482,20 @@ void CanNode::sendData(uint16_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData(int32_t data) const {
+CanState CanNode::sendData(int32_t data) const {
   CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT32) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t) (data & 0x000000ff);
-  msg.data[2] = (uint8_t)((data & 0x0000ff00) >> 8);
-  msg.data[3] = (uint8_t)((data & 0x00ff0000) >> 16);
-  msg.data[4] = (uint8_t)((data & 0xff000000) >> 24);
-  // set other odds and ends
-  msg.len = 5;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+  putValue(&msg, CAN_INT32, (uint32_t)data, 4);
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns the \ref CanState of the transmit queue, \ref BUS_BUSY if it
+ * is full.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_int16()
@@ -294,31 +507,25 @@ void CanNode::sendData(int32_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData(uint32_t data) const {
+CanState CanNode::sendData(uint32_t data) const {
   CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT32) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t) (data & 0x000000ff);
-  msg.data[2] = (uint8_t)((data & 0x0000ff00) >> 8);
-  msg.data[3] = (uint8_t)((data & 0x00ff0000) >> 16);
-  msg.data[4] = (uint8_t)((data & 0xff000000) >> 24);
-  // set other odds and ends
-  msg.len = 5;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+  putValue(&msg, CAN_UINT32, data, 4);
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
 }
 
 /**
  * Sends an array of data over the CANBus.
- * Maximum size for the aray is 7 bytes.
+ * Up to 7 bytes fit in a classic frame, up to \ref CAN_MAX_ARRAY bytes are
+ * sent as one CAN FD frame if the interface supports it (see fdEnabled()).
  *
  * \param node Node to send data from (basically an id)
  * \param data An array of data
- * \param len  Length of the data to be sent. Maximum length of 7
+ * \param len  Length of the data to be sent. Maximum length of 7, or
+ * \ref CAN_MAX_ARRAY with CAN FD
  *
- * \returns \ref DATA_OVERFLOW if len > 7, \ref DATA_OK otherwise
+ * \returns \ref DATA_OVERFLOW if len is too long, \ref BUS_BUSY if the
+ * transmit queue is full, \ref DATA_OK otherwise
  *
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
@@ -333,35 +540,26 @@ void CanNode::sendData(uint32_t data) const {
  */
 CanState CanNode::sendData(int8_t *data, uint8_t len) const {
   CanMessage msg;
-  // check if valid
-  if (len > 7) {
-    return DATA_OVERFLOW;
+  CanState state = putValues(&msg, CAN_INT8, data, 1, len);
+  if (state != DATA_OK) {
+    return state;
   }
-
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT8) << 5) | (0x1F & CAN_DATA);
-  // data
-  for (uint8_t i = 0; i < len; ++i) {
-    msg.data[i + 1] = (uint8_t)data[i];
-  }
-
-  // set other odds and ends
-  msg.len = len + 1;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
-  return DATA_OK;
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
 }
 
 /**
  * Sends an array of data over the CANBus.
- * Maximum size for the aray is 7 bytes.
+ * Up to 7 bytes fit in a classic frame, up to \ref CAN_MAX_ARRAY bytes are
+ * sent as one CAN FD frame if the interface supports it (see fdEnabled()).
  *
  * \param node Pointer to a CanNode
  * \param data An array of data
- * \param len  Length of the data to be sent. Maximum length of 7
+ * \param len  Length of the data to be sent. Maximum length of 7, or
+ * \ref CAN_MAX_ARRAY with CAN FD
  *
- * \returns \ref DATA_OVERFLOW if len > 7, \ref DATA_OK otherwise
+ * \returns \ref DATA_OVERFLOW if len is too long, \ref BUS_BUSY if the
+ * transmit queue is full, \ref DATA_OK otherwise
  *
  * \see CanNode_sendDataArr_int8()
  * \see CanNode_sendDataArr_int16()
@@ -376,39 +574,64 @@ CanState CanNode::sendData(int8_t *data, uint8_t len) const {
  */
 CanState CanNode::sendData(uint8_t *data, uint8_t len) const {
   CanMessage msg;
-  // check if valid
-  if (len > 7) {
-    return DATA_OVERFLOW;
+  CanState state = putValues(&msg, CAN_UINT8, data, 1, len);
+  if (state != DATA_OK) {
+    return state;
   }
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
+}
 
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT8) << 5) | (0x1F & CAN_DATA);
-  // data
-  for (uint8_t i = 0; i < len; ++i) {
-    msg.data[i + 1] = data[i];
+/**
+ * Sends an array of data over the CANBus.
+ * Up to 3 integers fit in a classic frame, up to \ref CAN_MAX_ARRAY / 2 are
+ * sent as one CAN FD frame if the interface supports it (see fdEnabled()).
+ *
+ * \param node Pointer to a CanNode
+ * \param data An array of data
+ * \param len  Length of the data to be sent. Maximum length of 3, or
+ * \ref CAN_MAX_ARRAY / 2 with CAN FD
+ *
+ * \returns \ref DATA_OVERFLOW if len is too long, \ref BUS_BUSY if the
+ * transmit queue is full, \ref DATA_OK otherwise
+ *
+ * \see CanNode_sendDataArr_int8()
+ * \see CanNode_sendDataArr_uint8()
+ * \see CanNode_sendDataArr_uint16()
+ *
+ * \see CanNode_sendData_int8()
+ * \see CanNode_sendData_uint8()
+ * \see CanNode_sendData_int16()
+ * \see CanNode_sendData_uint16()
+ * \see CanNode_sendData_int32()
+ * \see CanNode_sendData_uint32()
+ */
+CanState CanNode::sendData(int16_t *data, uint8_t len) const {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_INT16, data, 2, len);
+  if (state != DATA_OK) {
+    return state;
   }
-
-  // set other odds and ends
-  msg.len = len + 1;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
-  return DATA_OK;
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
 }
 
 /**
  * Sends an array of data over the CANBus.
- * Maximum size for the aray is 2 integers.
+ * Up to 3 integers fit in a classic frame, up to \ref CAN_MAX_ARRAY / 2 are
+ * sent as one CAN FD frame if the interface supports it (see fdEnabled()).
  *
  * \param node Pointer to a CanNode
  * \param data An array of data
- * \param len  Length of the data to be sent. Maximum length of 2
+ * \param len  Length of the data to be sent. Maximum length of 3, or
+ * \ref CAN_MAX_ARRAY / 2 with CAN FD
  *
- * \returns \ref DATA_OVERFLOW if len > 2, \ref DATA_OK otherwise
+ * \returns \ref DATA_OVERFLOW if len is too long, \ref BUS_BUSY if the
+ * transmit queue is full, \ref DATA_OK otherwise
  *
  * \see CanNode_sendDataArr_int8()
  * \see CanNode_sendDataArr_uint8()
- * \see CanNode_sendDataArr_uint16()
+ * \see CanNode_sendDataArr_int16()
  *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_uint8()
@@ -417,71 +640,402 @@ CanState CanNode::sendData(uint8_t *data, uint8_t len) const {
  * \see CanNode_sendData_int32()
  * \see CanNode_sendData_uint32()
  */
-CanState CanNode::sendData(int16_t *data, uint8_t len) const {
-  CanMessage msg;
+CanState CanNode::sendData(uint16_t *data, uint8_t len) const {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_UINT16, data, 2, len);
+  if (state != DATA_OK) {
+    return state;
+  }
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
+}
+
+/**
+ * Sends an array of data over the CANBus.
+ * One integer fits in a classic frame, up to \ref CAN_MAX_ARRAY / 4 are sent
+ * as one CAN FD frame if the interface supports it (see fdEnabled()).
+ *
+ * \param data An array of data
+ * \param len  Length of the data to be sent. Maximum length of 1, or
+ * \ref CAN_MAX_ARRAY / 4 with CAN FD
+ *
+ * \returns \ref DATA_OVERFLOW if len is too long, \ref BUS_BUSY if the
+ * transmit queue is full, \ref DATA_OK otherwise
+ */
+CanState CanNode::sendData(int32_t *data, uint8_t len) const {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_INT32, data, 4, len);
+  if (state != DATA_OK) {
+    return state;
+  }
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
+}
+
+/**
+ * Sends an array of data over the CANBus.
+ * One integer fits in a classic frame, up to \ref CAN_MAX_ARRAY / 4 are sent
+ * as one CAN FD frame if the interface supports it (see fdEnabled()).
+ *
+ * \param data An array of data
+ * \param len  Length of the data to be sent. Maximum length of 1, or
+ * \ref CAN_MAX_ARRAY / 4 with CAN FD
+ *
+ * \returns \ref DATA_OVERFLOW if len is too long, \ref BUS_BUSY if the
+ * transmit queue is full, \ref DATA_OK otherwise
+ */
+CanState CanNode::sendData(uint32_t *data, uint8_t len) const {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_UINT32, data, 4, len);
+  if (state != DATA_OK) {
+    return state;
+  }
+  can_set_msg_id(&msg, this->id);
+  return transmit(&msg);
+}
+
+/**
+ * Encodes data like sendData() and keeps it as the value of this node: from
+ * now on checkForMessages() answers rtrs to the node id with it right away,
+ * instead of calling the rtr handler. The answers are queued on the loop
+ * thread without waiting for room and without the rate limit of the node.
+ * Publish again whenever the data changes, from any thread.
+ *
+ * \param data Data to answer with
+ *
+ * \returns \ref DATA_OK, \ref DATA_ERROR if there was no memory to route
+ * rtrs to the value.
+ *
+ * \see clearValue()
+ */
+CanState CanNode::publishValue(int8_t data) {
+  CanMessage msg;
+  putValue(&msg, CAN_INT8, (uint8_t)data, 1);
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(int8_t)
+ */
+CanState CanNode::publishValue(uint8_t data) {
+  CanMessage msg;
+  putValue(&msg, CAN_UINT8, data, 1);
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(int8_t)
+ */
+CanState CanNode::publishValue(int16_t data) {
+  CanMessage msg;
+  putValue(&msg, CAN_INT16, (uint16_t)data, 2);
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(int8_t)
+ */
+CanState CanNode::publishValue(uint16_t data) {
+  CanMessage msg;
+  putValue(&msg, CAN_UINT16, data, 2);
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(int8_t)
+ */
+CanState CanNode::publishValue(int32_t data) {
+  CanMessage msg;
+  putValue(&msg, CAN_INT32, (uint32_t)data, 4);
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(int8_t)
+ */
+CanState CanNode::publishValue(uint32_t data) {
+  CanMessage msg;
+  putValue(&msg, CAN_UINT32, data, 4);
+  return publish(&msg);
+}
+
+/**
+ * Encodes an array like sendData() and keeps it as the value rtrs to this
+ * node are answered with, see publishValue(int8_t).
+ *
+ * \param data An array of data
+ * \param len Number of elements, as many as sendData() takes
+ *
+ * \returns \ref DATA_OVERFLOW if len is too long for the interface,
+ * \ref DATA_ERROR if there was no memory to route rtrs to the value,
+ * \ref DATA_OK otherwise
+ */
+CanState CanNode::publishValue(const int8_t *data, uint8_t len) {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_INT8, data, 1, len);
+  if (state != DATA_OK) {
+    return state;
+  }
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(const int8_t *, uint8_t)
+ */
+CanState CanNode::publishValue(const uint8_t *data, uint8_t len) {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_UINT8, data, 1, len);
+  if (state != DATA_OK) {
+    return state;
+  }
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(const int8_t *, uint8_t)
+ */
+CanState CanNode::publishValue(const int16_t *data, uint8_t len) {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_INT16, data, 2, len);
+  if (state != DATA_OK) {
+    return state;
+  }
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(const int8_t *, uint8_t)
+ */
+CanState CanNode::publishValue(const uint16_t *data, uint8_t len) {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_UINT16, data, 2, len);
+  if (state != DATA_OK) {
+    return state;
+  }
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(const int8_t *, uint8_t)
+ */
+CanState CanNode::publishValue(const int32_t *data, uint8_t len) {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_INT32, data, 4, len);
+  if (state != DATA_OK) {
+    return state;
+  }
+  return publish(&msg);
+}
+
+/**
+ * \see publishValue(const int8_t *, uint8_t)
+ */
+CanState CanNode::publishValue(const uint32_t *data, uint8_t len) {
+  CanMessage msg;
+  CanState state = putValues(&msg, CAN_UINT32, data, 4, len);
+  if (state != DATA_OK) {
+    return state;
+  }
+  return publish(&msg);
+}
+
+/**
+ * Rtrs to the node call its rtr handler again, if it has one.
+ */
+void CanNode::clearValue() {
+  CanMessage msg;
+  msg.len = 0;
+  publish(&msg);
+}
+
+/**
+ * The value is kept twice. The loop answers from values[valueSeq & 1] while
+ * the other copy is written, so a publisher that is preempted half way never
+ * holds up the loop.
+ *
+ * \param msg message with the encoded data, or len 0 to clear the value
+ *
+ * \returns as publishValue()
+ */
+CanState CanNode::publish(const CanMessage *msg) {
+  if (msg->len > CAN_MAX_DLEN && !fdEnabled()) {
+    return DATA_OVERFLOW;
+  }
+
+  bool route;
+  {
+    std::lock_guard<std::mutex> lock(valueLock);
+    uint32_t seq = valueSeq.load(std::memory_order_relaxed);
+    // a reader that sees any of the new bytes sees the last seq bump too
+    std::atomic_thread_fence(std::memory_order_release);
+    CanValue *value = &values[(seq + 1) & 1];
+    for (uint8_t i = 0; i * 8 < msg->len; ++i) {
+      uint64_t word;
+      memcpy(&word, &msg->data[i * 8], sizeof(word));
+      value->data[i].store(word, std::memory_order_relaxed);
+    }
+    value->len.store(msg->len, std::memory_order_relaxed);
+    valueSeq.store(seq + 1, std::memory_order_release);
+
+    route = msg->len != 0 && !valueRouted;
+    valueRouted |= route;
+  }
+
+  // the first value routes rtrs of the node id to it
+  if (route && CanRegistry::add(this, id, CAN_ROUTE_VALUE, CanHandler(),
+                                CanHandler()) == CAN_NO_FILTER) {
+    std::lock_guard<std::mutex> lock(valueLock);
+    valueRouted = false;
+    return DATA_ERROR;
+  }
+  return DATA_OK;
+}
+
+/**
+ * Called by dispatch() for an rtr to the node id.
+ *
+ * \returns true if the rtr was answered, false if no value is published.
+ */
+bool CanNode::answerRtr() const {
+  CanMessage msg;
+  uint32_t seq;
+  do {
+    seq = valueSeq.load(std::memory_order_acquire);
+    const CanValue *value = &values[seq & 1];
+    msg.len = value->len.load(std::memory_order_relaxed);
+    for (uint8_t i = 0; i * 8 < msg.len; ++i) {
+      uint64_t word = value->data[i].load(std::memory_order_relaxed);
+      memcpy(&msg.data[i * 8], &word, sizeof(word));
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // published twice while reading, the copy may have been overwritten
+  } while (valueSeq.load(std::memory_order_relaxed) != seq);
+
+  if (msg.len == 0) {
+    return false;
+  }
+  msg.rtr = false;
+  can_set_msg_id(&msg, id);
+  can_queue(&msg, 0, 0);
+  return true;
+}
+
+/**
+ * \param msg[out] message to fill in, its len is set
+ * \param type type of the integer
+ * \param value the integer, its low size bytes are sent
+ * \param size 1, 2 or 4
+ */
+void CanNode::putValue(CanMessage *msg, CanNodeDataType type, uint32_t value,
+                       uint8_t size) {
+  // configuration byte
+  msg->data[0] = (uint8_t)((0x7 & type) << 5) | (0x1F & CAN_DATA);
+  // data, little endian
+  for (uint8_t b = 0; b < size; ++b) {
+    msg->data[1 + b] = (uint8_t)((value >> (b * 8)) & 0xff);
+  }
+  // set other odds and ends
+  msg->len = 1 + size;
+  msg->rtr = false;
+}
+
+/**
+ * \param msg[out] message to fill in, its len is set
+ * \param type type of the elements
+ * \param data the elements, size bytes each
+ * \param size 1, 2 or 4
+ * \param len number of elements
+ *
+ * \returns \ref DATA_OVERFLOW if the elements take more than
+ * \ref CAN_MAX_ARRAY bytes, \ref DATA_OK otherwise
+ */
+CanState CanNode::putValues(CanMessage *msg, CanNodeDataType type,
+                            const void *data, uint8_t size, uint8_t len) {
   // check if valid
-  if (len > 2) {
+  if ((uint32_t)len * size > CAN_MAX_ARRAY) {
     return DATA_OVERFLOW;
   }
 
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT16) << 5) | (0x1F & CAN_DATA);
-  // data
+  uint8_t *bytes = putArray(msg, type, len * size);
+  // data, each element little endian
   for (uint8_t i = 0; i < len; ++i) {
-    msg.data[i * 2 + 1] = (uint8_t) (data[i] & 0x00ff);
-    msg.data[i * 2 + 2] = (uint8_t)((data[i] & 0xff00) >> 8);
+    uint32_t value;
+    if (size == 1) {
+      value = ((const uint8_t *)data)[i];
+    } else if (size == 2) {
+      value = ((const uint16_t *)data)[i];
+    } else {
+      value = ((const uint32_t *)data)[i];
+    }
+    for (uint8_t b = 0; b < size; ++b) {
+      bytes[i * size + b] = (uint8_t)((value >> (b * 8)) & 0xff);
+    }
   }
 
   // set other odds and ends
-  msg.len = len * 2 + 1;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+  msg->rtr = false;
   return DATA_OK;
 }
 
 /**
- * Sends an array of data over the CANBus.
- * Maximum size for the aray is 2 integers.
- *
- * \param node Pointer to a CanNode
- * \param data An array of data
- * \param len  Length of the data to be sent. Maximum length of 2
+ * Arrays of up to 7 bytes keep the classic layout: the configuration byte
+ * followed by the data. Longer arrays only fit in a CAN FD frame, whose length
+ * is rounded up to the next valid CAN FD length on the wire, so they put the
+ * number of data bytes after the configuration byte.
  *
- * \returns \ref DATA_OVERFLOW if len > 2, \ref DATA_OK otherwise
+ * \param msg[out] message to fill in, its len is set
+ * \param type type of the elements
+ * \param bytes number of data bytes, at most \ref CAN_MAX_ARRAY
  *
- * \see CanNode_sendDataArr_int8()
- * \see CanNode_sendDataArr_uint8()
- * \see CanNode_sendDataArr_int16()
+ * \returns where the data bytes go in msg.
+ */
+uint8_t *CanNode::putArray(CanMessage *msg, CanNodeDataType type,
+                           uint8_t bytes) {
+  // configuration byte
+  msg->data[0] = (uint8_t)((0x7 & type) << 5) | (0x1F & CAN_DATA);
+  if (bytes <= 7) {
+    msg->len = bytes + 1;
+    return &msg->data[1];
+  }
+
+  msg->data[1] = bytes;
+  msg->len = bytes + 2;
+  return &msg->data[2];
+}
+
+/**
+ * \param msg message to look at
+ * \param type type of the elements
+ * \param size size of one element in bytes
+ * \param len[out] number of elements
  *
- * \see CanNode_sendData_int8()
- * \see CanNode_sendData_uint8()
- * \see CanNode_sendData_int16()
- * \see CanNode_sendData_uint16()
- * \see CanNode_sendData_int32()
- * \see CanNode_sendData_uint32()
+ * \returns the first data byte, or NULL if msg is not an array of type.
  */
-CanState CanNode::sendData(uint16_t *data, uint8_t len) const {
-  CanMessage msg;
-  // check if valid
-  if (len > 2) {
-    return DATA_OVERFLOW;
+const uint8_t *CanNode::getArray(const CanMessage *msg, CanNodeDataType type,
+                                 uint8_t size, uint8_t *len) {
+  // check configuration byte
+  if (msg->len < 1 ||                      // no configuration byte
+      (msg->data[0] >> 5) != type ||       // not right type
+      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
+    return NULL;
   }
 
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT16) << 5) | (0x1F & CAN_DATA);
-  // data
-  for (uint8_t i = 0; i < len; ++i) {
-    msg.data[i * 2 + 1] = (uint8_t)(data[i] & 0x00ff);
-    msg.data[i * 2 + 2] = (uint8_t)((data[i] & 0xff00) >> 8);
+  uint8_t bytes = msg->len - 1;
+  const uint8_t *data = &msg->data[1];
+  // long arrays carry their length, the frame may be padded
+  if (msg->len > 8) {
+    bytes = msg->data[1];
+    data = &msg->data[2];
+    if (bytes < 8 || bytes > msg->len - 2) {
+      return NULL;
+    }
   }
 
-  // set other odds and ends
-  msg.len = len * 2 + 1;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
-  return DATA_OK;
+  if (bytes % size != 0) {
+    return NULL;
+  }
+  *len = bytes / size;
+  return data;
 }
 
 /**
@@ -818,7 +1372,7 @@ CanState CanNode::getData(const CanMessage *msg, uint32_t *data) {
  *
  * \returns The function returns \ref DATA_ERROR if the message is null,
  * \ref INVALID_TYPE if the message doesn't contain the same type as the
- * function,
+ * function, \ref DATA_OVERFLOW if the array does not fit in data,
  * or \ref DATA_OK if the function succeeded.
  *
  * \see CanNode_getDataArr_uint8()
@@ -833,25 +1387,7 @@ CanState CanNode::getData(const CanMessage *msg, uint32_t *data) {
  * \see CanNode_getData_uint32()
  */
 CanState CanNode::getData(const CanMessage *msg, int8_t data[7], uint8_t *len) {
-  if (msg == NULL) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_INT8 ||   // not right type
-      msg->len > 1 ||                      // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  *len = msg->len - 1;
-  // data
-  for (int i = 0; i < *len; i++) {
-    data[i] = (int8_t)msg->data[i + 1];
-  }
-
-  return DATA_OK;
+  return getData(msg, data, 7, len);
 }
 
 /**
@@ -878,7 +1414,7 @@ CanState CanNode::getData(const CanMessage *msg, int8_t data[7], uint8_t *len) {
  *
  * \returns The function returns \ref DATA_ERROR if the message is null,
  * \ref INVALID_TYPE if the message doesn't contain the same type as the
- * function,
+ * function, \ref DATA_OVERFLOW if the array does not fit in data,
  * or \ref DATA_OK if the function succeeded.
  *
  * \see CanNode_getDataArr_int8()
@@ -894,25 +1430,7 @@ CanState CanNode::getData(const CanMessage *msg, int8_t data[7], uint8_t *len) {
  */
 CanState CanNode::getData(const CanMessage *msg, uint8_t data[7],
                           uint8_t *len) {
-  if (msg == NULL) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_UINT8 ||  // not right type
-      msg->len > 1 ||                      // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  *len = msg->len - 1;
-  // data
-  for (int i = 0; i < *len; i++) {
-    data[i] = (uint8_t)msg->data[i + 1];
-  }
-
-  return DATA_OK;
+  return getData(msg, data, 7, len);
 }
 
 /**
@@ -939,7 +1457,7 @@ CanState CanNode::getData(const CanMessage *msg, uint8_t data[7],
  *
  * \returns The function returns \ref DATA_ERROR if the message is null,
  * \ref INVALID_TYPE if the message doesn't contain the same type as the
- * function,
+ * function, \ref DATA_OVERFLOW if the array does not fit in data,
  * or \ref DATA_OK if the function succeeded.
  *
  * \see CanNode_getDataArr_int8()
@@ -955,28 +1473,7 @@ CanState CanNode::getData(const CanMessage *msg, uint8_t data[7],
  */
 CanState CanNode::getData(const CanMessage *msg, int16_t data[2],
                                   uint8_t *len) {
-  if (msg == NULL) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_INT16 ||  // not right type
-      msg->len > 3 ||                      // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  *len = msg->len - 1;
-  // data
-  for (int i = 0; i < *len; i += 2) {
-    data[i] = (int16_t)msg->data[i + 1];
-    data[i] |= (int16_t)(msg->data[i + 2] << 8);
-  }
-
-  // b/c 16 bit ints are twice as long as 8 bit ones
-  *len /= 2;
-  return DATA_OK;
+  return getData(msg, data, 2, len);
 }
 
 /**
@@ -1003,7 +1500,7 @@ CanState CanNode::getData(const CanMessage *msg, int16_t data[2],
  *
  * \returns The function returns \ref DATA_ERROR if the message is null,
  * \ref INVALID_TYPE if the message doesn't contain the same type as the
- * function,
+ * function, \ref DATA_OVERFLOW if the array does not fit in data,
  * or \ref DATA_OK if the function succeeded.
  *
  * \see CanNode_getDataArr_int8()
@@ -1019,27 +1516,182 @@ CanState CanNode::getData(const CanMessage *msg, int16_t data[2],
  */
 CanState CanNode::getData(const CanMessage *msg, uint16_t data[2],
                           uint8_t *len) {
+  return getData(msg, data, 2, len);
+}
+
+/**
+ * Interpert a CanMessage as an array of up to size signed 8 bit integers
+ * (will return error if incorrect). Unlike the fixed size getData functions
+ * this can get every element of a CAN FD array.
+ *
+ * \param msg[in] Message recieved from someone else, should contain int8s
+ * \param data[out] Place for the data extracted from the msg will be stored.
+ * \param size number of elements data has room for
+ * \param len[out] number of elements recieved
+ *
+ * \returns \ref DATA_ERROR if the message is null, \ref INVALID_TYPE if the
+ * message doesn't contain an array of the same type, \ref DATA_OVERFLOW if
+ * the array does not fit in data, or \ref DATA_OK if the function succeeded.
+ */
+CanState CanNode::getData(const CanMessage *msg, int8_t *data, uint8_t size,
+                          uint8_t *len) {
   if (msg == NULL) {
     return DATA_ERROR;
   }
 
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_UINT16 || // not right type
-      msg->len > 3 ||                      // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
+  uint8_t count;
+  const uint8_t *bytes = getArray(msg, CAN_INT8, 1, &count);
+  if (bytes == NULL) {
+    return INVALID_TYPE;
+  }
+  if (count > size) {
+    return DATA_OVERFLOW;
+  }
+
+  *len = count;
+  for (uint8_t i = 0; i < count; i++) {
+    data[i] = (int8_t)bytes[i];
+  }
+  return DATA_OK;
+}
+
+/**
+ * Interpert a CanMessage as an array of up to size unsigned 8 bit integers.
+ *
+ * \see getData(const CanMessage *, int8_t *, uint8_t, uint8_t *)
+ */
+CanState CanNode::getData(const CanMessage *msg, uint8_t *data, uint8_t size,
+                          uint8_t *len) {
+  if (msg == NULL) {
+    return DATA_ERROR;
+  }
 
+  uint8_t count;
+  const uint8_t *bytes = getArray(msg, CAN_UINT8, 1, &count);
+  if (bytes == NULL) {
     return INVALID_TYPE;
   }
+  if (count > size) {
+    return DATA_OVERFLOW;
+  }
 
-  *len = msg->len - 1;
-  // data
-  for (int i = 0; i < *len; i += 2) {
-    data[i] = (uint16_t)msg->data[i + 1];
-    data[i] |= (uint16_t)(msg->data[i + 2] << 8);
+  *len = count;
+  memcpy(data, bytes, count);
+  return DATA_OK;
+}
+
+/**
+ * Interpert a CanMessage as an array of up to size signed 16 bit integers.
+ *
+ * \see getData(const CanMessage *, int8_t *, uint8_t, uint8_t *)
+ */
+CanState CanNode::getData(const CanMessage *msg, int16_t *data, uint8_t size,
+                          uint8_t *len) {
+  if (msg == NULL) {
+    return DATA_ERROR;
+  }
+
+  uint8_t count;
+  const uint8_t *bytes = getArray(msg, CAN_INT16, 2, &count);
+  if (bytes == NULL) {
+    return INVALID_TYPE;
+  }
+  if (count > size) {
+    return DATA_OVERFLOW;
+  }
+
+  *len = count;
+  for (uint8_t i = 0; i < count; i++) {
+    data[i] = (int16_t)(bytes[i * 2] | (bytes[i * 2 + 1] << 8));
+  }
+  return DATA_OK;
+}
+
+/**
+ * Interpert a CanMessage as an array of up to size unsigned 16 bit integers.
+ *
+ * \see getData(const CanMessage *, int8_t *, uint8_t, uint8_t *)
+ */
+CanState CanNode::getData(const CanMessage *msg, uint16_t *data, uint8_t size,
+                          uint8_t *len) {
+  if (msg == NULL) {
+    return DATA_ERROR;
+  }
+
+  uint8_t count;
+  const uint8_t *bytes = getArray(msg, CAN_UINT16, 2, &count);
+  if (bytes == NULL) {
+    return INVALID_TYPE;
+  }
+  if (count > size) {
+    return DATA_OVERFLOW;
+  }
+
+  *len = count;
+  for (uint8_t i = 0; i < count; i++) {
+    data[i] = (uint16_t)(bytes[i * 2] | (bytes[i * 2 + 1] << 8));
+  }
+  return DATA_OK;
+}
+
+/**
+ * Interpert a CanMessage as an array of up to size signed 32 bit integers.
+ *
+ * \see getData(const CanMessage *, int8_t *, uint8_t, uint8_t *)
+ */
+CanState CanNode::getData(const CanMessage *msg, int32_t *data, uint8_t size,
+                          uint8_t *len) {
+  if (msg == NULL) {
+    return DATA_ERROR;
+  }
+
+  uint8_t count;
+  const uint8_t *bytes = getArray(msg, CAN_INT32, 4, &count);
+  if (bytes == NULL) {
+    return INVALID_TYPE;
+  }
+  if (count > size) {
+    return DATA_OVERFLOW;
+  }
+
+  *len = count;
+  for (uint8_t i = 0; i < count; i++) {
+    uint32_t value = 0;
+    for (uint8_t b = 0; b < 4; ++b) {
+      value |= (uint32_t)bytes[i * 4 + b] << (b * 8);
+    }
+    data[i] = (int32_t)value;
+  }
+  return DATA_OK;
+}
+
+/**
+ * Interpert a CanMessage as an array of up to size unsigned 32 bit integers.
+ *
+ * \see getData(const CanMessage *, int8_t *, uint8_t, uint8_t *)
+ */
+CanState CanNode::getData(const CanMessage *msg, uint32_t *data, uint8_t size,
+                          uint8_t *len) {
+  if (msg == NULL) {
+    return DATA_ERROR;
+  }
+
+  uint8_t count;
+  const uint8_t *bytes = getArray(msg, CAN_UINT32, 4, &count);
+  if (bytes == NULL) {
+    return INVALID_TYPE;
+  }
+  if (count > size) {
+    return DATA_OVERFLOW;
   }
 
-  // b/c 16 bit ints are twice as long as 8 bit ones
-  *len /= 2;
+  *len = count;
+  for (uint8_t i = 0; i < count; i++) {
+    data[i] = 0;
+    for (uint8_t b = 0; b < 4; ++b) {
+      data[i] |= (uint32_t)bytes[i * 4 + b] << (b * 8);
+    }
+  }
   return DATA_OK;
 }
 
@@ -1047,6 +1699,10 @@ CanState CanNode::getData(const CanMessage *msg, uint16_t data[2],
  * Function that should be called from within the main loop. It calls handler
  * functions for each stored node.
  *
+ * Each call handles the frames of one receive batch (up to
+ * \ref CanBusConfig::rxBatch). Frames are read in place, a frame is only
+ * copied into a CanMessage if a handler is called for it.
+ *
  * Because of the unknown length of the handler
  * functions this function call could take a very long time. In order to keep
  * this function call to take a reasonable ammount of time, be sure to make
@@ -1058,6 +1714,34 @@ CanState CanNode::getData(const CanMessage *msg, uint16_t data[2],
  * is not sending a request frame.
  */
 void CanNode::checkForMessages() {
+  can_claim_loop();
+  // run periodic streams that are due
+  CanPeriodic::service();
+  // time out exchanges, resume the coroutines waiting for them
+  CanAsync::service();
+  // hand queued and rate limited messages to the kernel
+  flushTx();
+
+  // pick up nodes and filters added since the last call
+  CanRegistry::update();
+
+  // notifications from CAN_BCM filters
+  CanMessage bcmMsg;
+  bool timedOut;
+  CanEpoch::enter();
+  while (can_bcm_rx(&bcmMsg, &timedOut)) {
+    const CanRoute *route;
+    uint32_t count = CanRegistry::find(can_msg_id(&bcmMsg), &route);
+    for (uint32_t r = 0; r < count; ++r, ++route) {
+      CanEntry *entry = CanRegistry::resolve(route);
+      if (entry != nullptr &&
+          entry->kind == (timedOut ? CAN_ROUTE_TIMEOUT : CAN_ROUTE_BCM)) {
+        entry->handle(&bcmMsg);
+      }
+    }
+  }
+  CanEpoch::leave();
+
   // pc code should check if a new message is avalible
   // TODO stm32 uses an interrupt to put the newest message in a struct
 
@@ -1066,51 +1750,143 @@ void CanNode::checkForMessages() {
     return;
   }
 
-  can_rx(&tmpMsg, 5);
-  // loop through nodes
-  for (uint8_t i = 0; i < MAX_NODES; ++i) {
+  uint64_t rxStart = CanStats::latencyTiming() ? can_time_ns() : 0;
+
+  const CanMessageView *views;
+  uint32_t batch;
+  uint32_t count = can_rx_views(&views, &batch);
+  if (batch_handle) {
+    batch_handle(CanMessageBatch(views, count));
+  }
 
-    // CanNode takes over if the caller asks for a reserved id
-    // rtr request for node data
-    if (nodes[i] != nullptr && tmpMsg.id == nodes[i]->id && tmpMsg.rtr) {
-      nodes[i]->rtrHandle(&tmpMsg);
+  CanEpoch::enter();
+  // a handler that receives (e.g. requestName()) reads the next batch into
+  // the same frames
+  for (uint32_t i = 0; i < count && can_rx_current(batch); ++i) {
+    const CanMessageView *view = &views[i];
+    // keep rolling aggregates of tracked ids
+    CanAggregate::update(view);
+
+    // handlers of the id, then handlers of the mask filter it matched
+    CanMessage msg;
+    bool copied = false;
+    bool matched = dispatch(view->id(), view, &msg, &copied);
+    uint8_t fmi = view->fmi();
+    if (fmi != CAN_NO_FMI) {
+      matched |= dispatch(CAN_ROUTE_FMI(fmi), view, &msg, &copied);
     }
-    // get name id if asked with an rtr
-    else if (nodes[i] != nullptr && tmpMsg.id == nodes[i]->id + 1 &&
-             tmpMsg.rtr) {
-      nodes[i]->sendName();
+    // replies to exchanges being awaited
+    matched |= CanAsync::deliver(view);
+
+    if (!matched) {
+      CanStats::countUnmatched();
     }
-    // get info id
-    else if (nodes[i] != nullptr && tmpMsg.id == nodes[i]->id + 2 &&
-             tmpMsg.rtr) {
-      nodes[i]->sendInfo();
+    if (rxStart != 0) {
+      CanStats::recordLatency(can_time_ns() - rxStart);
     }
-    // configuration id
-    //else if (nodes[i] != nullptr && tmpMsg.id == nodes[i]->id + 3) {
-      // CanNode_nodeHandler(&nodes[i], &tmpMsg);
-    else {
-      // call callbacks for the user defined filters
-      for (uint8_t j = 0; j < NUM_FILTERS; ++j) {
-        if (nodes[i] != nullptr && tmpMsg.id == nodes[i]->filters[j] &&
-            nodes[i]->handle[j] != nullptr) {
-
-          // call handler function
-          nodes[i]->handle[j](&tmpMsg);
-        }
-        // check if the filter match equals a filter id
-        else if (nodes[i] != nullptr &&
-                 tmpMsg.fmi == nodes[i]->filters[j] && // filter matches
-                 nodes[i]->handle[j] != nullptr) {
+  }
+  CanEpoch::leave();
+
+  // coroutines whose replies were in this batch
+  CanAsync::service();
+}
+
+/**
+ * The consumer is called from checkForMessages() with the frames of each
+ * receive batch, before any filter handler is called for them. The frames are
+ * not copied: a view is only valid until the consumer returns, and the
+ * consumer must not receive (can_rx(), requestName(), ...) itself.
+ *
+ * \param handle consumer of the batches, an empty handler to stop
+ *
+ * \see CanMessageView
+ */
+void CanNode::setBatchHandler(const CanBatchHandler &handle) {
+  batch_handle = handle;
+}
 
-          // call handler function
-          nodes[i]->handle[j](&tmpMsg);
+/**
+ * CanNode takes over rtr frames for the reserved ids of a node, so the
+ * node's own filters are not called for those.
+ *
+ * \param key id of the message with CAN_ID_EXT, or CAN_ROUTE_FMI()
+ * \param view received frame
+ * \param msg[out] the frame as a message, for the handlers
+ * \param copied[in,out] msg already holds the frame
+ *
+ * \returns true if any handler was called.
+ */
+bool CanNode::dispatch(uint32_t key, const CanMessageView *view,
+                       CanMessage *msg, bool *copied) {
+  const CanRoute *route;
+  uint32_t count = CanRegistry::find(key, &route);
+  bool matched = false;
+  uint32_t id = view->id();
+  bool rtr = view->rtr();
+
+  for (uint32_t r = 0; r < count; ++r, ++route) {
+    // removed by a handler called earlier in this loop
+    CanEntry *entry = CanRegistry::resolve(route);
+    if (entry == nullptr) {
+      continue;
+    }
+    CanNode *node = entry->node;
+    switch (entry->kind) {
+    case CAN_ROUTE_RTR:
+      // rtr request for node data, unless a published value answers it
+      if (rtr && !node->hasValue()) {
+        if (!*copied) {
+          view->copy(msg);
+          *copied = true;
         }
+        entry->handle(msg);
+        matched = true;
+      }
+      break;
+    case CAN_ROUTE_NAME:
+      // get name id if asked with an rtr
+      if (rtr) {
+        node->sendName();
+        matched = true;
+      }
+      break;
+    case CAN_ROUTE_INFO:
+      // get info id
+      if (rtr) {
+        node->sendInfo();
+        matched = true;
+      }
+      break;
+    case CAN_ROUTE_VALUE:
+      // answered from the published value, without a handler
+      if (rtr && node->answerRtr()) {
+        matched = true;
+      }
+      break;
+    case CAN_ROUTE_FILTER:
+      if (rtr && id - node->id <= 2) {
+        break;
+      }
+      // a filter matching both the id and the fmi is only called once
+      if (key != id && entry->key == id) {
+        break;
+      }
+      // the first handler of a frame copies it out of the receive batch
+      if (!*copied) {
+        view->copy(msg);
+        *copied = true;
       }
+      // call handler function
+      entry->handle(msg);
+      matched = true;
+      break;
+    case CAN_ROUTE_BCM:
+    case CAN_ROUTE_TIMEOUT:
+      // handled from the CAN_BCM socket
+      break;
     }
   }
-
-  // clear new message flag
-  newMessage = false;
+  return matched;
 }
 
 void CanNode::setName(const char *name) {
@@ -1121,18 +1897,20 @@ void CanNode::setInfo(const char *info) {
     this->infoStr = info;
 }
 
-void CanNode::getString(uint16_t id, char *buff, uint8_t len,
+void CanNode::getString(uint32_t id, char *buff, uint8_t len,
                         uint8_t timeout) {
   CanMessage msg;
   uint32_t tickStart;
+  // the kernel may only be passing ids that have a filter
+  can_add_filter_id(id);
   // send a request to the specified CanNode and query its get name address
-  msg.id = id;
+  can_set_msg_id(&msg, id);
   msg.len = 1;
   msg.rtr = true;
   msg.data[0] = CAN_GET_NAME | (CAN_INT8 << 5);
   can_tx(&msg, 5);
 
-  msg.id = 0;
+  can_set_msg_id(&msg, 0);
   // get start time
   tickStart = HAL_GetTick();
 
@@ -1148,22 +1926,31 @@ void CanNode::getString(uint16_t id, char *buff, uint8_t len,
     // get the next buffer
     can_rx(&msg, 5);
     // check if it is from our id
-    if (msg.id != id || (msg.data[0] & 0x1F) != CAN_NAME_INFO) {
+    if (can_msg_id(&msg) != id || (msg.data[0] & 0x1F) != CAN_NAME_INFO) {
       badMessages++;
       if (badMessages > 10) {
-        msg.id = id;
+        can_set_msg_id(&msg, id);
         msg.len = 1;
         msg.rtr = true;
         msg.data[0] = CAN_GET_NAME | (CAN_INT8 << 5);
         can_tx(&msg, 5);
-        msg.id = 0;
+        can_set_msg_id(&msg, 0);
       }
       HAL_Delay(50);
       continue;
     }
     // get all the data from this buffer
+    bool finished = false;
     for (uint8_t i = 1; i < msg.len && str - buff < len; ++str, ++i) {
       *str = msg.data[i];
+      if (*str == '\0') {
+        finished = true;
+        break;
+      }
+    }
+    // a CAN FD frame usually holds the whole string
+    if (finished) {
+      break;
     }
   }
 
@@ -1183,7 +1970,7 @@ void CanNode::getString(uint16_t id, char *buff, uint8_t len,
  *
  * \see CanNode_requestInfo()
  */
-void CanNode::requestName(CanNodeType id, char *buff, uint8_t len,
+void CanNode::requestName(uint32_t id, char *buff, uint8_t len,
                           uint16_t timeout) {
   getString(id + 1, buff, len, timeout);
 }
@@ -1199,18 +1986,109 @@ void CanNode::requestName(CanNodeType id, char *buff, uint8_t len,
  *
  * \see CanNode_requestName()
  */
-void CanNode::requestInfo(CanNodeType id, char *buff, uint8_t len,
+void CanNode::requestInfo(uint32_t id, char *buff, uint8_t len,
                           uint16_t timeout) {
   getString(id + 2, buff, len, timeout);
 }
 
-void CanNode::sendString(uint16_t id, const char *str) {
+/**
+ * The request is sent when the result is awaited, and the coroutine is
+ * resumed from checkForMessages().
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanString name = co_await CanNode::requestName(PITOT, 200);
+ * ~~~~~~~~~~~~
+ *
+ * \param id id of the node that you want the name of
+ * \param timeout mili-seconds to wait for the whole name
+ *
+ * \see CanAsync
+ */
+CanStringRequest CanNode::requestName(uint32_t id, uint16_t timeout) {
+  return CanStringRequest(id + 1, timeout);
+}
+
+/**
+ * Like requestName(uint32_t, uint16_t) for the info string.
+ */
+CanStringRequest CanNode::requestInfo(uint32_t id, uint16_t timeout) {
+  return CanStringRequest(id + 2, timeout);
+}
+
+/**
+ * Sends an rtr to id when the result is awaited, the first data frame of id
+ * that arrives after it is the reply. Any number of requests can be waiting
+ * at once, also for the same id.
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanReply reply = co_await CanNode::request(PITOT, 50);
+ * int16_t speed;
+ * if (reply.state == DATA_OK &&
+ *     CanNode::getData(&reply.msg, &speed) == DATA_OK) {
+ *   ...
+ * }
+ * ~~~~~~~~~~~~
+ *
+ * \param id id to send the rtr to, with \ref CAN_ID_EXT for an extended id
+ * \param timeout mili-seconds to wait for the reply
+ *
+ * \see CanAsync
+ */
+CanRequest CanNode::request(uint32_t id, uint16_t timeout) {
+  return CanRequest(id, timeout);
+}
+
+/**
+ * Instead of one round trip after the other, the rtrs of every id are sent
+ * in one batch and the replies are matched to their ids as they arrive, so a
+ * poll cycle takes about as long as the slowest node. Runs the message loop
+ * (other handlers are called as usual) until every id answered or the
+ * deadline passed, so it must not be called from a handler or a coroutine.
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * const uint32_t sensors[] = {THROTTLE, ENGINE_TEMP, PITOT, WHEEL_TACH};
+ * const uint16_t timeouts[] = {5, 0, 5, 10}; // ENGINE_TEMP gets the 20
+ * CanPollResult results[4];
+ * CanNode::pollGroup(sensors, 4, 20, results, timeouts);
+ * for (const CanPollResult &r : results) {
+ *   if (r.state == DATA_OK) {
+ *     printf("%u answered in %u us\n", r.id, r.latency);
+ *   }
+ * }
+ * ~~~~~~~~~~~~
+ *
+ * \param ids ids to send an rtr to, e.g. \ref CanNodeType values
+ * \param count number of ids
+ * \param timeout mili-seconds the whole group waits for replies
+ * \param results[out] one per id in the same order, with the reply or why
+ * there is none
+ * \param timeouts mili-seconds each id waits for its reply, shorter than
+ * timeout, 0 or NULL to wait as long as the group
+ *
+ * \returns the number of ids that answered.
+ */
+uint32_t CanNode::pollGroup(const uint32_t *ids, uint32_t count,
+                            uint16_t timeout, CanPollResult *results,
+                            const uint16_t *timeouts) {
+  CanPollGroup group(ids, count, timeout, results, timeouts);
+  if (CanAsync::wait(&group)) {
+    while (!group.done) {
+      waitForMessages(CAN_ASYNC_TICK);
+      checkForMessages();
+    }
+  }
+  return group.replies;
+}
+
+void CanNode::sendString(uint32_t id, const char *str) {
   CanMessage msg;
-  msg.id = id;
+  can_set_msg_id(&msg, id);
   msg.rtr = false;
   msg.data[0] = CAN_NAME_INFO | CAN_INT8 << 5;
 
   bool msgFinished = false;
+  // a CAN FD frame fits a whole name, or most of an info string
+  uint8_t frameLen = fdEnabled() ? CAN_MAX_DATA : 8;
 
   //fill buffers and send them 
   const char *namePtr = str;
@@ -1222,7 +2100,7 @@ void CanNode::sendString(uint16_t id, const char *str) {
   while (!msgFinished) {
 
     // break if end of name has been reached
-    for (msg.len = 1; msg.len < 8; msg.len++, namePtr++) {
+    for (msg.len = 1; msg.len < frameLen; msg.len++, namePtr++) {
 
       // set data
       msg.data[msg.len] = *namePtr;
@@ -14,30 +14,56 @@
 #ifndef _CAN_NODE_H_
 #define _CAN_NODE_H_
 
+#include "CanAsync.h"
+#include "CanMessageView.h"
+#include "CanPeriodic.h"
+#include "CanRegistry.h"
 #include "CanTypes.h"
+#include <atomic>
+#include <mutex>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+/// Most bytes an array sendData can send (a CAN FD frame less the
+/// configuration and length bytes)
+#define CAN_MAX_ARRAY (CAN_MAX_DATA - 2)
 
 /**
- * \typedef filterHandler
- * \brief Function pointer to a function that accepts a CanMessage pointer
+ * \struct CanFilterOptions
+ * \brief Ask the kernel broadcast manager (CAN_BCM) to pre-filter a filter.
  *
- * A function of this type should look like
+ * With these options the kernel watches the id, so the handler is only called
+ * when it needs to be instead of for every frame.
  *
- * <code> void foo(CanMessage* msg) </code>
- *
- * Functions of this type can be used to handle filter matches. These functions
- * are added set to handle filters with the CanNode_addFilter() function. They
- * are
- * called by the CanNode_checkForMessages() function
+ * \see CanNode::addFilter
+ */
+typedef struct {
+  bool changedOnly;            ///< Only call the handler when the length or
+                               ///< data differs from the last frame
+  uint32_t timeout;            ///< Call timeoutHandle if no frame arrives for
+                               ///< this many mili-seconds (0 for none)
+  CanHandler timeoutHandle;    ///< Called with an empty message (len 0) for
+                               ///< the id when the timeout passes
+} CanFilterOptions;
+
+/**
+ * \typedef busStateHandler
+ * \brief Function called when the state of the bus changes.
  *
- * \see CanNode_addFilter
- * \see CanNode_checkForMessages
+ * \see CanNode::setBusStateHandler
  */
-typedef void (*filterHandler)(CanMessage *data);
+typedef void (*busStateHandler)(const CanBusStatus *status);
+
+/**
+ * \struct CanValue
+ * \brief One copy of a value published with CanNode::publishValue().
+ */
+typedef struct {
+  std::atomic<uint64_t> data[CAN_MAX_DATA / 8]; ///< the data bytes
+  std::atomic<uint8_t> len; ///< number of data bytes, 0 for no value
+} CanValue;
 
 /** \addtogroup CanNode_Module CanNode
  * \brief Library to provide a higher level protocol for CAN communication.
@@ -54,29 +80,46 @@ typedef void (*filterHandler)(CanMessage *data);
  * ### Initilizing a node ###
  *
  * In order to send data and use filter callbacks you need to initilize a node.
- * to do this call CanNode_init(), passing in a CanNodeType (acts like an id), a
- * filterHandler for handling RTR (Retrun Transmission Request) callbacks for
- * that node, this returns a CanNode pointer to
- * a newly initilized CanNode struct. You can initilize up to \ref MAX_NODES
- * nodes in this way.
+ * to do this construct a CanNode, passing in a CanNodeType (acts like an id)
+ * and a CanHandler for handling RTR (Retrun Transmission Request) callbacks
+ * for that node. There is no limit on the number of nodes, and a node that is
+ * destroyed stops receiving messages.
+ *
+ * A handler is a plain function, or a lambda or member function bound to the
+ * object it needs (see CanHandler), so it can answer from the node it belongs
+ * to without any globals.
  *
  * Example code
- * ~~~~~~~~~~~~ {.c}
+ * ~~~~~~~~~~~~ {.cpp}
  *
- * CanNode* newNode;
- * void pitotRTR(CanMessage* msg);
+ * class Pitot {
+ *   CanNode node;
  *
- * void main(){
- *	newNode = CanNode_init(PITOT, pitotRTR);
- *	//other stuff here
- *	//...
- * }
+ * public:
+ *   Pitot() : node(PITOT, CanHandler::bind<&Pitot::onRtr>(this)) {}
+ *
+ *   void onRtr(CanMessage *msg) {
+ *     //continue to do what needs to be done.
+ *     uint16_t data = getSensorData();
+ *     //call one of the \ref sendData functions to return the data
+ *     node.sendData(data);
+ *   }
+ * };
+ * ~~~~~~~~~~~~
  *
- * void pitotRTR(CanMessage* msg){
- *	//continue to do what needs to be done.
- *	uint16_t data = getSensorData();
- *	//call one of the \ref sendData functions to return the data
- *	CanNode_sendData_uint16(newNode, data);
+ * A node whose data is slow to read can publish it instead: a thread of its
+ * own reads the sensor and calls one of the \ref publishValue functions with
+ * each new reading. checkForMessages() then answers rtrs to the node with the
+ * last published value as soon as they arrive, the rtr handler is not called
+ * while there is one.
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanNode node(PITOT, CanHandler());
+ *
+ * void sample() {
+ *   for (;;) {
+ *     node.publishValue(getSensorData());
+ *   }
  * }
  * ~~~~~~~~~~~~
  *
@@ -96,6 +139,9 @@ typedef void (*filterHandler)(CanMessage *data);
  * CanNode_addFilter(node, filterId, handler);
  * ~~~~~~~~~~~~
  *
+ * Extended 29-bit ids are passed with \ref CAN_ID_EXT set, e.g.
+ * <code>CAN_ID_EXT | 0x18FEF100</code>, both for node ids and filters.
+ *
  * This is how a filter mask is added (data from multiple ids).
  *
  * Example code
@@ -107,6 +153,35 @@ typedef void (*filterHandler)(CanMessage *data);
  * uint16_t id = can_add_filter_mask(id_to_filter, id_mask);
  * CanNode_addFilter(node, id, handler);
  * ~~~~~~~~~~~~
+ *
+ * ### Threads ###
+ *
+ * One thread runs the message loop: checkForMessages(), waitForMessages(),
+ * flushTx() and holdTx(). The thread that initilized the bus (constructed
+ * the first node) is the loop thread until another thread calls
+ * checkForMessages(), only one thread may do so at a time. flushTx() from
+ * another thread only wakes the loop.
+ * Handlers, the batch consumer (setBatchHandler()), periodic producers,
+ * CanAggregate, the blocking requestName() and requestInfo() and coroutines
+ * awaiting exchanges (see CanAsync) belong to the loop thread as well.
+ *
+ * Everything else may be called from any thread:
+ *  - The sendData functions. On the loop thread messages go straight to the
+ *    transmit queue, other threads stage them in a ring of their own (see
+ *    CanTxStage) without taking a lock, and the loop sends them on its next
+ *    pass.
+ *  - Constructing and destroying nodes, addFilter() and removeFilter(). These
+ *    take the registry's writer lock, the loop never does. New filters are
+ *    picked up by the next checkForMessages(), removed ones are not called
+ *    again once removeFilter() returns, it waits for a dispatch of the loop
+ *    thread in progress (see CanEpoch).
+ *  - publishPeriodic(), stopPeriodic() and the CanStats functions.
+ *  - The publishValue functions and clearValue(). The loop never waits for
+ *    them, an rtr that arrives while a value is being published is answered
+ *    with the value before.
+ *
+ * Settings (setRateLimit(), startCyclic(), setName(), setBusConfig(), ...)
+ * should be made before other threads use the node.
  *@{
  */
 
@@ -123,30 +198,60 @@ class CanNode {
 
 
 private:
-  static bool newMessage;
-  static CanMessage tmpMsg;
   static const unsigned int UNUSED_FILTER = 0xFFFF;
-  static CanNode *nodes[MAX_NODES];
+  friend class CanRegistry;
 
-  uint16_t id;                   ///< id of the node
+  uint32_t id;                   ///< id of the node
   uint8_t status;                ///< status of the node (not currently used)
-  uint16_t filters[NUM_FILTERS]; ///< array of id's to handle
-  filterHandler rtrHandle;       ///< function to handle rtr requests for
-                                 /// the node
+  uint32_t registrySlot;         ///< position of the node in CanRegistry
+  uint64_t txInterval;           ///< ns between messages at the rate limit
+  uint64_t txTolerance;          ///< ns of burst allowed by the rate limit
+  mutable std::atomic<uint64_t> txTat; ///< when the next message is due
 
-  filterHandler handle[NUM_FILTERS]; ///< array of function pointers to call
-                                     ///< when a id in filters is found
+  uint32_t cyclicPeriod;             ///< CAN_BCM transmit period in us
+  mutable std::atomic<bool> cyclicStarted; ///< CAN_BCM transmit job is running
   CanNodeType sensorType;            ///< Type of sensor
   const char *nameStr;               ///< points to the name of the node
   const char *infoStr;               ///< points to the info string for the node
 
+  CanValue values[2];             ///< published value, written alternately
+  std::atomic<uint32_t> valueSeq; ///< values[valueSeq & 1] is the current one
+  std::mutex valueLock;           ///< held while a value is published
+  bool valueRouted;               ///< the CAN_ROUTE_VALUE entry was added
+
 public:
   /// \brief Initilize a CanNode from given parameters.
-  CanNode(CanNodeType id, filterHandler rtrHandle);
+  CanNode(uint32_t id, const CanHandler &rtrHandle);
+  /// \brief Stop all handlers and periodic streams of the node.
+  ~CanNode();
+  CanNode(const CanNode &) = delete;
+  CanNode &operator=(const CanNode &) = delete;
   /// \brief Add a filter and handler to a given CanNode.
-  bool addFilter(uint16_t filter, filterHandler handle);
+  CanFilterHandle addFilter(uint32_t filter, const CanHandler &handle);
+  /// \brief Add a filter that the kernel pre-filters with CAN_BCM.
+  CanFilterHandle addFilter(uint32_t filter, const CanHandler &handle,
+                            const CanFilterOptions *options);
+  /// \brief Remove a filter added with addFilter().
+  bool removeFilter(CanFilterHandle filter);
+  /// \brief Have the kernel repeat this node's data every period.
+  bool startCyclic(uint32_t period);
+  /// \brief Stop repeating this node's data.
+  void stopCyclic();
   /// \brief Check all initilized CanNodes for messages and call callbacks.
   static void checkForMessages();
+  /// \brief Hand every receive batch to a consumer, without copying it.
+  static void setBatchHandler(const CanBatchHandler &handle);
+  /// \brief Wait until checkForMessages() has something to do.
+  static bool waitForMessages(uint32_t timeout);
+  /// \brief Limit the rate messages are sent from this node.
+  void setRateLimit(uint32_t rate, uint16_t burst);
+
+  /// \brief Call producer for this node every period micro-seconds.
+  int publishPeriodic(uint32_t period, periodicProducer producer) const;
+  /// \brief Stop a stream started with publishPeriodic().
+  static void stopPeriodic(int handle);
+  /// \brief Get how late a periodic stream has been firing.
+  static bool getPeriodicStats(int handle, CanPeriodicStats *stats);
 
   /**
    * \anchor sendData
@@ -156,17 +261,17 @@ public:
    * @{
    */
   /// \brief Send a signed 8-bit integer.
-  void sendData(int8_t data) const;
+  CanState sendData(int8_t data) const;
   /// \brief Send an unsigned 8-bit integer.
-  void sendData(uint8_t data) const;
+  CanState sendData(uint8_t data) const;
   /// \brief Send a signed 16-bit integer.
-  void sendData(int16_t data) const;
+  CanState sendData(int16_t data) const;
   /// \brief Send an unsigned 16-bit integer.
-  void sendData(uint16_t data) const;
+  CanState sendData(uint16_t data) const;
   /// \brief Send a signed 32-bit integer.
-  void sendData(int32_t data) const;
+  CanState sendData(int32_t data) const;
   /// \brief Send an unsigned 32-bit integer.
-  void sendData(uint32_t data) const;
+  CanState sendData(uint32_t data) const;
 
   /// \brief Send an array of uinsigned 8-bit integers.
   CanState sendData(int8_t *data, uint8_t len) const;
@@ -176,6 +281,48 @@ public:
   CanState sendData(int16_t *data, uint8_t len) const;
   /// \brief Send an array of signed 16-bit integers.
   CanState sendData(uint16_t *data, uint8_t len) const;
+  /// \brief Send an array of signed 32-bit integers.
+  CanState sendData(int32_t *data, uint8_t len) const;
+  /// \brief Send an array of unsigned 32-bit integers.
+  CanState sendData(uint32_t *data, uint8_t len) const;
+  //@}
+
+  /**
+   * \anchor publishValue
+   * \name publishValue Functions
+   * These functions keep the data rtrs to this node are answered with, in the
+   * same encoding as the \ref sendData functions. Nothing is sent until an
+   * rtr arrives.
+   * @{
+   */
+  /// \brief Answer rtrs with a signed 8-bit integer.
+  CanState publishValue(int8_t data);
+  /// \brief Answer rtrs with an unsigned 8-bit integer.
+  CanState publishValue(uint8_t data);
+  /// \brief Answer rtrs with a signed 16-bit integer.
+  CanState publishValue(int16_t data);
+  /// \brief Answer rtrs with an unsigned 16-bit integer.
+  CanState publishValue(uint16_t data);
+  /// \brief Answer rtrs with a signed 32-bit integer.
+  CanState publishValue(int32_t data);
+  /// \brief Answer rtrs with an unsigned 32-bit integer.
+  CanState publishValue(uint32_t data);
+
+  /// \brief Answer rtrs with an array of signed 8-bit integers.
+  CanState publishValue(const int8_t *data, uint8_t len);
+  /// \brief Answer rtrs with an array of unsigned 8-bit integers.
+  CanState publishValue(const uint8_t *data, uint8_t len);
+  /// \brief Answer rtrs with an array of signed 16-bit integers.
+  CanState publishValue(const int16_t *data, uint8_t len);
+  /// \brief Answer rtrs with an array of unsigned 16-bit integers.
+  CanState publishValue(const uint16_t *data, uint8_t len);
+  /// \brief Answer rtrs with an array of signed 32-bit integers.
+  CanState publishValue(const int32_t *data, uint8_t len);
+  /// \brief Answer rtrs with an array of unsigned 32-bit integers.
+  CanState publishValue(const uint32_t *data, uint8_t len);
+
+  /// \brief Stop answering rtrs with a value, call the rtr handler again.
+  void clearValue();
   //@}
 
   /**
@@ -213,6 +360,25 @@ public:
   static CanState getData(const CanMessage *msg, int16_t data[2], uint8_t *len);
   /// \brief Get an array of unsigned 16-bit integers from a CanMessage.
   static CanState getData(const CanMessage *msg, uint16_t data[2], uint8_t *len);
+
+  /// \brief Get an array of up to size signed 8-bit integers.
+  static CanState getData(const CanMessage *msg, int8_t *data, uint8_t size,
+                          uint8_t *len);
+  /// \brief Get an array of up to size unsigned 8-bit integers.
+  static CanState getData(const CanMessage *msg, uint8_t *data, uint8_t size,
+                          uint8_t *len);
+  /// \brief Get an array of up to size signed 16-bit integers.
+  static CanState getData(const CanMessage *msg, int16_t *data, uint8_t size,
+                          uint8_t *len);
+  /// \brief Get an array of up to size unsigned 16-bit integers.
+  static CanState getData(const CanMessage *msg, uint16_t *data, uint8_t size,
+                          uint8_t *len);
+  /// \brief Get an array of up to size signed 32-bit integers.
+  static CanState getData(const CanMessage *msg, int32_t *data, uint8_t size,
+                          uint8_t *len);
+  /// \brief Get an array of up to size unsigned 32-bit integers.
+  static CanState getData(const CanMessage *msg, uint32_t *data, uint8_t size,
+                          uint8_t *len);
   //@}
 
   /**
@@ -230,11 +396,21 @@ public:
   /// \brief Set the info string
   void setInfo(const char *info);
   /// \brief request the name string from another CanNode
-  static void requestName(CanNodeType id, char *buff, uint8_t len,
+  static void requestName(uint32_t id, char *buff, uint8_t len,
                           uint16_t timeout);
   /// \brief request the info string from another CanNode
-  static void requestInfo(CanNodeType id, char *buff, uint8_t len,
+  static void requestInfo(uint32_t id, char *buff, uint8_t len,
                           uint16_t timeout);
+  /// \brief Await the name string of another CanNode, see CanAsync.
+  static CanStringRequest requestName(uint32_t id, uint16_t timeout);
+  /// \brief Await the info string of another CanNode, see CanAsync.
+  static CanStringRequest requestInfo(uint32_t id, uint16_t timeout);
+  /// \brief Send an rtr to id and await the data sent back, see CanAsync.
+  static CanRequest request(uint32_t id, uint16_t timeout);
+  /// \brief Send rtrs to a set of ids at once and collect their replies.
+  static uint32_t pollGroup(const uint32_t *ids, uint32_t count,
+                            uint16_t timeout, CanPollResult *results,
+                            const uint16_t *timeouts = NULL);
 
   //@}
 
@@ -243,16 +419,35 @@ public:
   /*@}*/
 
   /// \brief Add a filter to the can hardware with an id
-  static uint16_t can_add_filter_id(uint16_t id);
+  static uint16_t can_add_filter_id(uint32_t id);
   /// \brief Add a filter to the can hardware with a mask
-  static uint16_t can_add_filter_mask(uint16_t id, uint16_t mask);
+  static uint16_t can_add_filter_mask(uint32_t id, uint32_t mask);
 
   /// \brief Send a CanMessage over the bus.
   static CanState can_tx(CanMessage *tx_msg, uint32_t timeout);
   /// \brief Get a CanMessage from the hardware if it is availible.
   static CanState can_rx(CanMessage *rx_msg, uint32_t timeout);
+  /// \brief Get the received frames of the current batch in place.
+  static uint32_t can_rx_views(const CanMessageView **views, uint32_t *batch);
+  /// \brief Check if views of a batch still show its frames.
+  static bool can_rx_current(uint32_t batch);
   /// \brief Check if a new message is avalible.
   static bool is_can_msg_pending();
+  /// \brief Hand queued messages to the kernel without waiting.
+  static void flushTx();
+  /// \brief Only queue messages until called with false.
+  static bool holdTx(bool hold);
+
+  /// \brief Set the settings used when the CAN hardware is initilized.
+  static void setBusConfig(const CanBusConfig *config);
+  /// \brief Number of frames the kernel dropped because we fell behind.
+  static uint64_t getKernelDrops();
+  /// \brief Get the state of the bus from the last error frames.
+  static void getBusStatus(CanBusStatus *status);
+  /// \brief Set a function to call when the bus state changes.
+  static void setBusStateHandler(busStateHandler handle);
+  /// \brief Check if messages can be longer than 8 bytes (CAN FD).
+  static bool fdEnabled();
 
 private:
   // private functions to handle CanNode name functions
@@ -272,10 +467,52 @@ private:
   void sendInfo();
 
   /// \brief Get a string
-  static void getString(uint16_t id, char *buff, uint8_t len, uint8_t timeout);
+  static void getString(uint32_t id, char *buff, uint8_t len, uint8_t timeout);
   /// \brief Send a string
-  static void sendString(uint16_t id, const char *str);
+  static void sendString(uint32_t id, const char *str);
+  /// \brief Call the handlers of the routes of a key for a received frame.
+  static bool dispatch(uint32_t key, const CanMessageView *view,
+                       CanMessage *msg, bool *copied);
+
+  /// \brief Fill in a message with one integer of size bytes.
+  static void putValue(CanMessage *msg, CanNodeDataType type, uint32_t value,
+                       uint8_t size);
+  /// \brief Fill in a message with an array of integers of size bytes.
+  static CanState putValues(CanMessage *msg, CanNodeDataType type,
+                            const void *data, uint8_t size, uint8_t len);
+  /// \brief Start an array message, returns where its bytes go.
+  static uint8_t *putArray(CanMessage *msg, CanNodeDataType type,
+                           uint8_t bytes);
+  /// \brief Find the array in a message of a given type and element size.
+  static const uint8_t *getArray(const CanMessage *msg, CanNodeDataType type,
+                                 uint8_t size, uint8_t *len);
+
+  /// \brief Make the data of msg the value rtrs are answered with.
+  CanState publish(const CanMessage *msg);
+  /// \brief Check if rtrs are answered with a published value.
+  bool hasValue() const {
+    return values[valueSeq.load(std::memory_order_acquire) & 1].len.load(
+               std::memory_order_relaxed) != 0;
+  }
+  /// \brief Answer an rtr with the published value, false if there is none.
+  bool answerRtr() const;
+  /// \brief Queue a message from this node, applying its rate limit.
+  CanState transmit(CanMessage *msg) const;
+  /// \brief Set up or update a CAN_BCM cyclic transmit job.
+  static CanState can_bcm_tx(CanMessage *tx_msg, uint32_t period, bool start);
+  /// \brief Set up a CAN_BCM receive filter.
+  static bool can_bcm_rx_setup(uint32_t id, bool changedOnly,
+                               uint32_t timeout);
+  /// \brief Remove a CAN_BCM transmit or receive job.
+  static void can_bcm_delete(uint32_t id, bool tx);
+  /// \brief Get a notification from the CAN_BCM socket if there is one.
+  static bool can_bcm_rx(CanMessage *rx_msg, bool *timedOut);
+  /// \brief Queue a CanMessage to be sent no earlier than notBefore.
+  static CanState can_queue(CanMessage *tx_msg, uint64_t notBefore,
+                            uint32_t timeout);
 
+  /// \brief Make the calling thread the message loop thread.
+  static void can_claim_loop(void);
   /// \brief Initilize CAN hardware.
   static void can_init(void);
   /// \brief Enable CAN hardware.
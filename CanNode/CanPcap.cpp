@@ -0,0 +1,306 @@
+/**
+ * CanPcap.cpp
+ * \brief implements writing frames as pcap and pcapng files
+ */
+#include "CanPcap.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef CANFD_FDF
+/// FD flag of LINKTYPE_CAN_SOCKETCAN marking a CAN FD frame
+#define CANFD_FDF 0x04
+#endif
+
+/// bytes of a packet of a classic CAN frame
+#define CLASSIC_PACKET (8 + CAN_MAX_DLEN)
+/// bytes of a packet of a CAN FD frame, the largest
+#define FD_PACKET (8 + CANFD_MAX_DLEN)
+
+/// pcapng block types
+#define SECTION_BLOCK 0x0A0D0D0A
+#define INTERFACE_BLOCK 1
+#define PACKET_BLOCK 6
+
+/// pcapng options
+#define OPT_END 0
+#define OPT_IF_NAME 2
+#define OPT_IF_TSRESOL 9
+#define OPT_EPB_FLAGS 2
+/// epb_flags of an outbound packet
+#define EPB_OUTBOUND 2
+
+/// bytes of the fixed fields of an enhanced packet block, trailer included
+#define PACKET_BLOCK_BYTES 32
+/// bytes of the epb_flags option and the end of the options
+#define FLAGS_OPTION_BYTES 12
+
+// both formats are in the byte order of the writing host, which the magic
+// numbers tell readers
+static inline uint8_t *put16(uint8_t *p, uint16_t value) {
+  memcpy(p, &value, 2);
+  return p + 2;
+}
+
+static inline uint8_t *put32(uint8_t *p, uint32_t value) {
+  memcpy(p, &value, 4);
+  return p + 4;
+}
+
+/// write all of buf, false if the file did not take it
+static bool write_all(int fd, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+CanPcapWriter::CanPcapWriter() {
+  fd = -1;
+  ownFd = false;
+  format = CAN_PCAPNG;
+  buf = NULL;
+  used = 0;
+  numInterfaces = 0;
+  memset(names, 0, sizeof(names));
+  memset(&stats, 0, sizeof(stats));
+}
+
+CanPcapWriter::~CanPcapWriter() { close(); }
+
+/**
+ * The header is only collected, it is written with the first packets.
+ *
+ * \param path file to create, replacing an existing one, "-" for stdout
+ * \param config format and interface names, NULL for the defaults
+ *
+ * \returns false if the file could not be created.
+ */
+bool CanPcapWriter::open(const char *path, const CanPcapConfig *config) {
+  if (fd >= 0) {
+    errno = EBUSY;
+    return false;
+  }
+  buf = (uint8_t *)malloc(CAN_PCAP_BUFFER);
+  if (buf == NULL) {
+    perror("can pcap buffer");
+    return false;
+  }
+  if (strcmp(path, "-") == 0) {
+    fd = STDOUT_FILENO;
+    ownFd = false;
+  } else {
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      perror(path);
+      close();
+      return false;
+    }
+    ownFd = true;
+  }
+
+  format = config != NULL ? config->format : CAN_PCAPNG;
+  memset(names, 0, sizeof(names));
+  uint8_t named = 0;
+  for (; config != NULL && named < CAN_LOG_INTERFACES &&
+         config->interfaces[named] != NULL;
+       ++named) {
+    strncpy(names[named], config->interfaces[named], CAN_LOG_NAME - 1);
+  }
+  memset(&stats, 0, sizeof(stats));
+  numInterfaces = 0;
+
+  uint8_t *p = buf;
+  if (format == CAN_PCAP) {
+    p = put32(p, 0xA1B23C4D); // nano-second timestamps
+    p = put16(p, 2);
+    p = put16(p, 4);
+    p = put32(p, 0);          // time zone
+    p = put32(p, 0);          // accuracy
+    p = put32(p, FD_PACKET);  // snap length
+    p = put32(p, CAN_PCAP_LINKTYPE);
+    used = p - buf;
+  } else {
+    p = put32(p, SECTION_BLOCK);
+    p = put32(p, 28);
+    p = put32(p, 0x1A2B3C4D); // byte order
+    p = put16(p, 1);
+    p = put16(p, 0);
+    p = put32(p, 0xFFFFFFFF); // section length unknown
+    p = put32(p, 0xFFFFFFFF);
+    p = put32(p, 28);
+    used = p - buf;
+    if (named != 0) {
+      addInterface(named - 1);
+    }
+  }
+  return true;
+}
+
+/**
+ * Collect the pcapng interface blocks up to interface, named like the
+ * capture or "canN" past its names.
+ */
+void CanPcapWriter::addInterface(uint8_t interface) {
+  for (; numInterfaces <= interface; ++numInterfaces) {
+    char name[CAN_LOG_NAME];
+    if (numInterfaces < CAN_LOG_INTERFACES && names[numInterfaces][0] != 0) {
+      memcpy(name, names[numInterfaces], CAN_LOG_NAME);
+    } else {
+      snprintf(name, sizeof(name), "can%u", numInterfaces);
+    }
+    uint32_t nameLen = (uint32_t)strlen(name);
+    uint32_t padded = (nameLen + 3) & ~3U;
+    uint32_t total = 20 + (4 + padded) + 8 + 4;
+    if (used + total > CAN_PCAP_BUFFER) {
+      flush();
+    }
+    uint8_t *p = buf + used;
+    p = put32(p, INTERFACE_BLOCK);
+    p = put32(p, total);
+    p = put16(p, CAN_PCAP_LINKTYPE);
+    p = put16(p, 0);
+    p = put32(p, FD_PACKET);
+    p = put16(p, OPT_IF_NAME);
+    p = put16(p, (uint16_t)nameLen);
+    memset(p, 0, padded);
+    memcpy(p, name, nameLen);
+    p += padded;
+    p = put16(p, OPT_IF_TSRESOL);
+    p = put16(p, 1);
+    p[0] = 9;                 // 10^-9 seconds
+    memset(p + 1, 0, 3);
+    p += 4;
+    p = put32(p, OPT_END);
+    p = put32(p, total);
+    used = p - buf;
+  }
+}
+
+/**
+ * \param timestamp nano-seconds since the epoch
+ * \param canId SocketCAN can_id with its flags
+ * \param data len data bytes, at most CAN_MAX_DLEN or CANFD_MAX_DLEN for an
+ * FD frame are kept
+ * \param flags \ref CAN_LOG_FD, \ref CAN_LOG_OUTGOING
+ * \param interface index into the interface names
+ */
+void CanPcapWriter::add(uint64_t timestamp, uint32_t canId,
+                        const uint8_t *data, uint8_t len, uint8_t flags,
+                        uint8_t interface) {
+  if (fd < 0) {
+    return;
+  }
+  bool canFd = (flags & CAN_LOG_FD) != 0;
+  bool outbound = (flags & CAN_LOG_OUTGOING) != 0;
+  uint32_t packet = canFd ? FD_PACKET : CLASSIC_PACKET;
+  if (len > packet - 8) {
+    len = (uint8_t)(packet - 8);
+  }
+  if (format == CAN_PCAPNG && interface >= numInterfaces) {
+    addInterface(interface);
+  }
+  uint32_t total = format == CAN_PCAP
+                       ? 16 + packet
+                       : PACKET_BLOCK_BYTES + packet +
+                             (outbound ? FLAGS_OPTION_BYTES : 0);
+  if (used + total > CAN_PCAP_BUFFER) {
+    flush();
+  }
+
+  uint8_t *p = buf + used;
+  if (format == CAN_PCAP) {
+    p = put32(p, (uint32_t)(timestamp / 1000000000ULL));
+    p = put32(p, (uint32_t)(timestamp % 1000000000ULL));
+    p = put32(p, packet);
+    p = put32(p, packet);
+  } else {
+    p = put32(p, PACKET_BLOCK);
+    p = put32(p, total);
+    p = put32(p, interface);
+    p = put32(p, (uint32_t)(timestamp >> 32));
+    p = put32(p, (uint32_t)timestamp);
+    p = put32(p, packet);
+    p = put32(p, packet);
+  }
+  p = put32(p, htonl(canId));
+  p[0] = len;
+  p[1] = canFd ? CANFD_FDF : 0;
+  p[2] = 0;
+  p[3] = 0;
+  memcpy(p + 4, data, len);
+  memset(p + 4 + len, 0, packet - 8 - len);
+  p += packet - 4;
+  if (format == CAN_PCAPNG) {
+    if (outbound) {
+      p = put16(p, OPT_EPB_FLAGS);
+      p = put16(p, 4);
+      p = put32(p, EPB_OUTBOUND);
+      p = put32(p, OPT_END);
+    }
+    p = put32(p, total);
+  }
+  used = p - buf;
+  stats.frames++;
+}
+
+void CanPcapWriter::add(const CanCaptureFrame &frame) {
+  uint32_t canId = frame.id();
+  canId |= frame.rtr() ? CAN_RTR_FLAG : 0;
+  canId |= frame.error() ? CAN_ERR_FLAG : 0;
+  uint8_t flags = (frame.fd() ? CAN_LOG_FD : 0) |
+                  (frame.outgoing() ? CAN_LOG_OUTGOING : 0);
+  add(frame.timestamp(), canId, frame.data(), frame.len(), flags,
+      frame.interface());
+}
+
+void CanPcapWriter::add(const CanLogFrame &frame) {
+  uint8_t flags = (frame.fd() ? CAN_LOG_FD : 0) |
+                  (frame.outgoing() ? CAN_LOG_OUTGOING : 0);
+  add(frame.timestamp(), frame.canId(), frame.data(), frame.len(), flags,
+      frame.interface());
+}
+
+/**
+ * \returns false if the packets could not be written, they are dropped then
+ * and counted in \ref CanPcapStats::writeErrors.
+ */
+bool CanPcapWriter::flush() {
+  if (fd < 0 || used == 0) {
+    return true;
+  }
+  bool ok = write_all(fd, buf, used);
+  if (ok) {
+    stats.bytes += used;
+  } else {
+    perror("can pcap write");
+    stats.writeErrors++;
+  }
+  used = 0;
+  return ok;
+}
+
+void CanPcapWriter::close() {
+  if (fd >= 0) {
+    flush();
+    if (ownFd) {
+      ::close(fd);
+    }
+    fd = -1;
+  }
+  free(buf);
+  buf = NULL;
+  used = 0;
+}
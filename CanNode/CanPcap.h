@@ -0,0 +1,136 @@
+/**
+ * \file CanPcap.h
+ * \brief Writes frames as pcap or pcapng files Wireshark and tcpdump read.
+ *
+ * Frames are stored with the LINKTYPE_CAN_SOCKETCAN link type, the layout
+ * tcpdump produces on a SocketCAN interface, so Wireshark shows them with
+ * its CAN dissectors:
+ *
+ * | bytes | field                                                        |
+ * |-------|--------------------------------------------------------------|
+ * | 4     | can_id with its EFF, RTR and ERR flags, big endian           |
+ * | 1     | number of data bytes                                         |
+ * | 1     | FD flags, CANFD_FDF for a CAN FD frame                       |
+ * | 2     | reserved, 0                                                  |
+ * | 8, 64 | data padded with zeros, 64 bytes for CAN FD frames           |
+ *
+ * Both formats keep nano-second timestamps: pcap files use the nano-second
+ * magic number, pcapng files an if_tsresol of 9. Only pcapng tells the
+ * interfaces apart, with an interface block per interface named like the
+ * capture, and marks frames sent by the capturing host as outbound.
+ *
+ * Packets are put in a buffer that is written once full, so files are
+ * written as a stream of a few large writes and never held in memory.
+ *
+ * Example code
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanPcapWriter pcap;
+ * pcap.open("drive.pcapng", NULL);
+ * log.query(&query, 4, [&pcap](const CanLogFrame &frame) {
+ *   pcap.add(frame);
+ * });
+ * pcap.close();
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_PCAP_H_
+#define _CAN_PCAP_H_
+
+#include "CanCapture.h"
+#include "CanLog.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// LINKTYPE_CAN_SOCKETCAN
+#define CAN_PCAP_LINKTYPE 227
+
+#ifndef CAN_PCAP_BUFFER
+/// Bytes of packets a writer collects before it writes them. Can be
+/// overwriten by redefinition
+#define CAN_PCAP_BUFFER (256 * 1024)
+#endif
+
+/**
+ * \enum CanPcapFormat
+ * \brief File formats a CanPcapWriter writes.
+ */
+typedef enum {
+  CAN_PCAPNG, ///< pcapng, with interface names and directions
+  CAN_PCAP,   ///< classic pcap with nano-second timestamps
+} CanPcapFormat;
+
+/**
+ * \struct CanPcapConfig
+ * \brief What a writer puts in the file.
+ *
+ * Zero fields keep the defaults.
+ */
+typedef struct {
+  CanPcapFormat format;   ///< default \ref CAN_PCAPNG
+  const char *interfaces[CAN_LOG_INTERFACES]; ///< pcapng interface names,
+                                              ///< NULL after the last one
+} CanPcapConfig;
+
+/**
+ * \struct CanPcapStats
+ * \brief Counters of a writer since open().
+ */
+typedef struct {
+  uint64_t frames;        ///< frames written
+  uint64_t bytes;         ///< bytes written
+  uint64_t writeErrors;   ///< writes that failed, their frames are lost
+} CanPcapStats;
+
+/**
+ * \brief Format of a file by its name, classic pcap for a ".pcap" ending.
+ */
+static inline CanPcapFormat can_pcap_format(const char *path) {
+  size_t len = strlen(path);
+  return len >= 5 && strcmp(path + len - 5, ".pcap") == 0 ? CAN_PCAP
+                                                           : CAN_PCAPNG;
+}
+
+/**
+ * \brief Writes frames to a pcap or pcapng file.
+ *
+ * A writer belongs to one thread.
+ */
+class CanPcapWriter {
+public:
+  CanPcapWriter();
+  ~CanPcapWriter();
+  CanPcapWriter(const CanPcapWriter &) = delete;
+  CanPcapWriter &operator=(const CanPcapWriter &) = delete;
+
+  /// \brief Create the file, "-" for stdout, and write its header.
+  bool open(const char *path, const CanPcapConfig *config);
+  /// \brief Add a frame given as a SocketCAN can_id and its data.
+  void add(uint64_t timestamp, uint32_t canId, const uint8_t *data,
+           uint8_t len, uint8_t flags, uint8_t interface);
+  /// \brief Add a captured frame.
+  void add(const CanCaptureFrame &frame);
+  /// \brief Add a frame of a capture file.
+  void add(const CanLogFrame &frame);
+  /// \brief Write the packets collected so far.
+  bool flush();
+  /// \brief Write what is pending and close the file.
+  void close();
+  /// \brief Bytes collected and not written yet.
+  size_t pending() const { return used; }
+  /// \brief Get the counters of the writer.
+  void getStats(CanPcapStats *stats) const { *stats = this->stats; }
+
+private:
+  void addInterface(uint8_t interface);
+
+  int fd;
+  bool ownFd;             ///< false for stdout
+  CanPcapFormat format;
+  uint8_t *buf;
+  size_t used;
+  uint32_t numInterfaces; ///< interface blocks written
+  char names[CAN_LOG_INTERFACES][CAN_LOG_NAME];
+  CanPcapStats stats;
+};
+
+#endif //_CAN_PCAP_H_
@@ -0,0 +1,237 @@
+/**
+ * CanPeriodic.cpp
+ * \brief implements periodic publishing on a timer wheel
+ */
+#include "CanPeriodic.h"
+#include "CanNode.h"
+#include "CanTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/// default tick of the wheel in ns
+#define DEFAULT_TICK 500000
+
+std::recursive_mutex CanPeriodic::lock;
+CanTimerWheel CanPeriodic::wheel;
+CanPeriodic::Stream *CanPeriodic::firing = nullptr;
+bool CanPeriodic::firingRemoved = false;
+CanPeriodic::Stream **CanPeriodic::streams = nullptr;
+int CanPeriodic::numStreams = 0;
+int CanPeriodic::timerFd = -1;
+uint64_t CanPeriodic::tickNs = DEFAULT_TICK;
+uint64_t CanPeriodic::start = 0;
+
+/**
+ * Streams fire at most one tick late (plus however late the message loop
+ * is), so the tick bounds the jitter. Streams due in the same tick share a
+ * wakeup, so longer ticks batch more of them.
+ *
+ * \param tickUs tick in micro-seconds (default 500)
+ *
+ * \returns false if the timer is already running.
+ */
+bool CanPeriodic::setTick(uint32_t tickUs) {
+  std::lock_guard<std::recursive_mutex> guard(lock);
+  if (timerFd >= 0 || tickUs == 0) {
+    return false;
+  }
+  tickNs = tickUs * 1000ULL;
+  return true;
+}
+
+bool CanPeriodic::startTimer() {
+  timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timerFd < 0) {
+    perror("can periodic timerfd");
+    return false;
+  }
+  start = can_time_ns();
+  return true;
+}
+
+/**
+ * Arm the timer once for the tick the next stream is due on, or disarm it
+ * when there are no streams, so the loop only wakes when there is something
+ * to send. Called with the lock held whenever the wheel changed.
+ */
+void CanPeriodic::armTimer() {
+  if (timerFd < 0) {
+    return;
+  }
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  uint64_t next = wheel.nextExpiry();
+  if (next != UINT64_MAX) {
+    // can_time_ns() is CLOCK_MONOTONIC as well
+    uint64_t due = start + next * tickNs;
+    spec.it_value.tv_sec = due / 1000000000ULL;
+    spec.it_value.tv_nsec = due % 1000000000ULL;
+  }
+  if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    perror("can periodic timerfd_settime");
+  }
+}
+
+/**
+ * \returns the first tick at or after a can_time_ns() time.
+ */
+uint64_t CanPeriodic::tickFor(uint64_t ns) {
+  if (ns <= start) {
+    return 0;
+  }
+  return (ns - start + tickNs - 1) / tickNs;
+}
+
+/**
+ * \param node node the stream sends from
+ * \param period period in micro-seconds
+ * \param producer function that sends the data for one period
+ *
+ * \returns a handle for the stream, or -1 if the stream could not be added.
+ */
+int CanPeriodic::add(const CanNode *node, uint32_t period,
+                     periodicProducer producer) {
+  std::lock_guard<std::recursive_mutex> guard(lock);
+  if (node == nullptr || producer == nullptr || period == 0) {
+    return -1;
+  }
+  if (timerFd < 0 && !startTimer()) {
+    return -1;
+  }
+
+  // reuse a free handle if there is one
+  int handle = 0;
+  while (handle < numStreams && streams[handle] != nullptr) {
+    handle++;
+  }
+  if (handle == numStreams) {
+    Stream **grown = (Stream **)realloc(
+        streams, (numStreams * 2 + 16) * sizeof(Stream *));
+    if (grown == nullptr) {
+      return -1;
+    }
+    memset(grown + numStreams, 0, (numStreams + 16) * sizeof(Stream *));
+    streams = grown;
+    numStreams = numStreams * 2 + 16;
+  }
+
+  Stream *stream = (Stream *)calloc(1, sizeof(Stream));
+  if (stream == nullptr) {
+    return -1;
+  }
+  stream->node = node;
+  stream->producer = producer;
+  stream->period = period * 1000ULL;
+  stream->due = can_time_ns() + stream->period;
+  stream->stats.period = period;
+  streams[handle] = stream;
+
+  wheel.add(&stream->timer, tickFor(stream->due));
+  // while producers run, service() arms the timer once they are done
+  if (firing == nullptr) {
+    armTimer();
+  }
+  return handle;
+}
+
+void CanPeriodic::remove(int handle) {
+  std::lock_guard<std::recursive_mutex> guard(lock);
+  if (handle < 0 || handle >= numStreams || streams[handle] == nullptr) {
+    return;
+  }
+  wheel.remove(&streams[handle]->timer);
+  // a producer stopping its own stream is freed once it returns
+  if (streams[handle] == firing) {
+    firingRemoved = true;
+  } else {
+    free(streams[handle]);
+  }
+  streams[handle] = nullptr;
+  if (firing == nullptr) {
+    armTimer();
+  }
+}
+
+void CanPeriodic::removeNode(const CanNode *node) {
+  std::lock_guard<std::recursive_mutex> guard(lock);
+  for (int i = 0; i < numStreams; ++i) {
+    if (streams[i] != nullptr && streams[i]->node == node) {
+      remove(i);
+    }
+  }
+}
+
+/**
+ * \param handle stream returned by add()
+ * \param stats[out] timing of the stream
+ *
+ * \returns false if there is no such stream.
+ */
+bool CanPeriodic::getStats(int handle, CanPeriodicStats *stats) {
+  std::lock_guard<std::recursive_mutex> guard(lock);
+  if (handle < 0 || handle >= numStreams || streams[handle] == nullptr) {
+    return false;
+  }
+  *stats = streams[handle]->stats;
+  return true;
+}
+
+/**
+ * Called from CanNode::checkForMessages(). Everything the producers send is
+ * held back and written in one batch once all due streams have run. Streams
+ * can be added and removed from other threads meanwhile, the producers run
+ * with the lock held.
+ */
+void CanPeriodic::service() {
+  uint64_t expirations;
+  if (timerFd < 0 ||
+      read(timerFd, &expirations, sizeof(expirations)) !=
+          sizeof(expirations)) {
+    return;
+  }
+
+  // a hold of the caller stays in place, its flush sends our messages too
+  bool held = CanNode::holdTx(true);
+  {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    wheel.advance((can_time_ns() - start) / tickNs, fire, nullptr);
+    armTimer();
+  }
+  CanNode::holdTx(held);
+  if (!held) {
+    CanNode::flushTx();
+  }
+}
+
+void CanPeriodic::fire(CanTimerWheel::Timer *timer, void *) {
+  Stream *stream = (Stream *)timer;
+  uint64_t now = can_time_ns();
+  uint64_t late = now > stream->due ? now - stream->due : 0;
+
+  stream->stats.fired++;
+  stream->stats.lastLate = late / 1000;
+  if (stream->stats.lastLate > stream->stats.maxLate) {
+    stream->stats.maxLate = stream->stats.lastLate;
+  }
+
+  firing = stream;
+  firingRemoved = false;
+  stream->producer(stream->node);
+  firing = nullptr;
+  if (firingRemoved) {
+    free(stream);
+    return;
+  }
+
+  // stay on the original schedule, skipping periods that are already over
+  stream->due += stream->period;
+  if (stream->due <= now) {
+    uint64_t skip = (now - stream->due) / stream->period + 1;
+    stream->stats.missed += skip;
+    stream->due += skip * stream->period;
+  }
+  wheel.add(&stream->timer, tickFor(stream->due));
+}
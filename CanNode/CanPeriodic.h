@@ -0,0 +1,105 @@
+/**
+ * \file CanPeriodic.h
+ * \brief Periodic publishing of CanNode data from one timer.
+ *
+ * Streams registered with CanNode::publishPeriodic() are kept in a
+ * CanTimerWheel that is driven by a single timerfd, so any number of streams
+ * can run on the message loop thread without their own sleep loops. The
+ * timerfd is armed for the next stream that is due, the loop does not wake
+ * every tick. Every
+ * stream is scheduled from its own start time, so streams do not drift, and
+ * all streams that fire in the same tick are sent with one batched write.
+ *
+ * The timer is serviced by CanNode::checkForMessages(). Use
+ * CanNode::waitForMessages() (or poll CanPeriodic::fd()) to sleep until either
+ * a message arrives or a stream is due.
+ *
+ * Example code
+ * ~~~~~~~~~~~~ {.c}
+ * void sendPitot(const CanNode *node) {
+ *   node->sendData(readPitot());
+ * }
+ *
+ * CanNode pitot(PITOT, pitotRTR);
+ * pitot.publishPeriodic(10000, sendPitot); // 100 Hz
+ * while (1) {
+ *   CanNode::waitForMessages(100);
+ *   CanNode::checkForMessages();
+ * }
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_PERIODIC_H_
+#define _CAN_PERIODIC_H_
+
+#include "CanTimerWheel.h"
+#include "CanTypes.h"
+#include <mutex>
+#include <stdbool.h>
+#include <stdint.h>
+
+class CanNode;
+
+/**
+ * \typedef periodicProducer
+ * \brief Function called each period, it should call one of the sendData
+ * functions of the node.
+ */
+typedef void (*periodicProducer)(const CanNode *node);
+
+/**
+ * \struct CanPeriodicStats
+ * \brief Timing of a periodic stream.
+ */
+typedef struct {
+  uint32_t period;  ///< Period in micro-seconds
+  uint64_t fired;   ///< Number of times the producer was called
+  uint64_t missed;  ///< Periods skipped because the loop was too late
+  uint32_t lastLate; ///< How late the last call was in micro-seconds
+  uint32_t maxLate;  ///< Latest call so far in micro-seconds
+} CanPeriodicStats;
+
+class CanPeriodic {
+public:
+  /// \brief Set the tick of the timer wheel, before adding any stream.
+  static bool setTick(uint32_t tickUs);
+  /// \brief Start calling producer for node every period micro-seconds.
+  static int add(const CanNode *node, uint32_t period,
+                 periodicProducer producer);
+  /// \brief Stop a stream.
+  static void remove(int handle);
+  /// \brief Stop every stream of a node.
+  static void removeNode(const CanNode *node);
+  /// \brief Get the timing of a stream.
+  static bool getStats(int handle, CanPeriodicStats *stats);
+  /// \brief Call the producers of every stream that is due.
+  static void service();
+  /// \brief File descriptor that is readable when the timer ticked, or -1.
+  static int fd() { return timerFd; }
+
+private:
+  typedef struct {
+    CanTimerWheel::Timer timer; ///< must stay the first member
+    const CanNode *node;
+    periodicProducer producer;
+    uint64_t period; ///< ns
+    uint64_t due;    ///< ns, can_time_ns() clock
+    CanPeriodicStats stats;
+  } Stream;
+
+  static std::recursive_mutex lock; ///< producers may add and remove streams
+  static CanTimerWheel wheel;
+  static Stream *firing;      ///< stream whose producer is running
+  static bool firingRemoved;  ///< firing was removed by its own producer
+  static Stream **streams;
+  static int numStreams;
+  static int timerFd;
+  static uint64_t tickNs;
+  static uint64_t start;
+
+  static bool startTimer();
+  static void armTimer();
+  static uint64_t tickFor(uint64_t ns);
+  static void fire(CanTimerWheel::Timer *timer, void *ctx);
+};
+
+#endif //_CAN_PERIODIC_H_
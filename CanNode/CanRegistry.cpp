@@ -0,0 +1,356 @@
+/**
+ * CanRegistry.cpp
+ * \brief implements the registry of nodes and their handlers
+ */
+#include "CanRegistry.h"
+#include "CanNode.h"
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// end of an entry list
+#define NONE UINT32_MAX
+
+std::mutex CanRegistry::lock;
+std::atomic<CanEntry **> CanRegistry::chunks(nullptr);
+uint32_t CanRegistry::numChunks = 0;
+uint32_t CanRegistry::freeList = NONE;
+CanRegistry::NodeSlot *CanRegistry::nodes = nullptr;
+uint32_t CanRegistry::nodeCount = 0;
+uint32_t CanRegistry::sizeNodes = 0;
+std::atomic<CanRouteIndex *> CanRegistry::index(nullptr);
+std::atomic<bool> CanRegistry::dirty(true);
+
+static inline CanFilterHandle make_handle(uint32_t i, uint32_t gen) {
+  return ((uint64_t)gen << 32) | i;
+}
+
+/**
+ * Add a chunk of free entries. Entries already handed out stay where they
+ * are, only the table of chunks is replaced. Readers may still be using the
+ * old table, so it is retired instead of freed.
+ */
+bool CanRegistry::grow() {
+  CanEntry **old = chunks.load(std::memory_order_relaxed);
+  CanEntry **table = (CanEntry **)malloc((numChunks + 1) * sizeof(CanEntry *));
+  if (table == nullptr) {
+    return false;
+  }
+  // entries start on a cache line
+  CanEntry *chunk = (CanEntry *)aligned_alloc(
+      alignof(CanEntry), CAN_REGISTRY_CHUNK * sizeof(CanEntry));
+  if (chunk == nullptr) {
+    free(table);
+    return false;
+  }
+  for (uint32_t i = 0; i < CAN_REGISTRY_CHUNK; ++i) {
+    new (&chunk[i]) CanEntry();
+  }
+  if (numChunks > 0) {
+    memcpy(table, old, numChunks * sizeof(CanEntry *));
+  }
+  table[numChunks] = chunk;
+
+  // lowest index first, so entries fill the chunk in order
+  uint32_t base = numChunks * CAN_REGISTRY_CHUNK;
+  for (uint32_t i = CAN_REGISTRY_CHUNK; i-- > 0;) {
+    chunk[i].gen.store(1, std::memory_order_relaxed);
+    chunk[i].next = freeList;
+    freeList = base + i;
+  }
+  numChunks++;
+
+  chunks.store(table, std::memory_order_release);
+  if (old != nullptr) {
+    CanEpoch::retire(free, old);
+  }
+  return true;
+}
+
+/**
+ * \returns false if out of memory.
+ */
+bool CanRegistry::addNode(CanNode *node) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (nodeCount == sizeNodes) {
+    uint32_t size = sizeNodes * 2 + 16;
+    NodeSlot *grown = (NodeSlot *)realloc(nodes, size * sizeof(NodeSlot));
+    if (grown == nullptr) {
+      return false;
+    }
+    nodes = grown;
+    sizeNodes = size;
+  }
+
+  node->registrySlot = nodeCount;
+  nodes[nodeCount].node = node;
+  nodes[nodeCount].first = NONE;
+  nodes[nodeCount].last = NONE;
+  nodeCount++;
+  dirty.store(true, std::memory_order_release);
+  return true;
+}
+
+/**
+ * The last node takes the place of the removed one, so nodes do not keep the
+ * order they were added in.
+ */
+void CanRegistry::removeNode(CanNode *node) {
+  std::lock_guard<std::mutex> guard(lock);
+  uint32_t slot = node->registrySlot;
+  if (slot >= nodeCount || nodes[slot].node != node) {
+    return;
+  }
+
+  for (uint32_t i = nodes[slot].first; i != NONE;) {
+    uint32_t next = at(i)->next;
+    release(i);
+    i = next;
+  }
+
+  nodes[slot] = nodes[--nodeCount];
+  nodes[slot].node->registrySlot = slot;
+  node->registrySlot = NONE;
+  dirty.store(true, std::memory_order_release);
+  CanEpoch::reclaim();
+}
+
+uint32_t CanRegistry::numNodes() {
+  std::lock_guard<std::mutex> guard(lock);
+  return nodeCount;
+}
+
+/**
+ * \param node node the handler belongs to
+ * \param key id with CAN_ID_EXT set for extended ids, or a mask filter number
+ * \param kind what to do with a matching message
+ * \param handle handler to call
+ * \param timeoutHandle handler for a CAN_BCM timeout, may be empty
+ *
+ * \returns a handle of the entry, or \ref CAN_NO_FILTER if the node is not
+ * registered or out of memory.
+ */
+CanFilterHandle CanRegistry::add(CanNode *node, uint32_t key,
+                                 CanRouteKind kind, const CanHandler &handle,
+                                 const CanHandler &timeoutHandle) {
+  std::lock_guard<std::mutex> guard(lock);
+  uint32_t slot = node->registrySlot;
+  if (slot >= nodeCount || nodes[slot].node != node) {
+    return CAN_NO_FILTER;
+  }
+  CanEpoch::reclaim();
+
+  uint32_t i = append(slot, key, kind, handle);
+  if (i == NONE) {
+    return CAN_NO_FILTER;
+  }
+  // the timeout handler follows in an entry of its own, see remove()
+  if (timeoutHandle &&
+      append(slot, key, CAN_ROUTE_TIMEOUT, timeoutHandle) == NONE) {
+    release(i);
+    return CAN_NO_FILTER;
+  }
+
+  dirty.store(true, std::memory_order_release);
+  return make_handle(i, at(i)->gen.load(std::memory_order_relaxed));
+}
+
+/**
+ * Take a free entry and add it after the last entry of a node, called with
+ * the lock held.
+ *
+ * \returns the index of the entry, or NONE if out of memory.
+ */
+uint32_t CanRegistry::append(uint32_t slot, uint32_t key, CanRouteKind kind,
+                             const CanHandler &handle) {
+  if (freeList == NONE && !grow()) {
+    return NONE;
+  }
+
+  uint32_t i = freeList;
+  CanEntry *entry = at(i);
+  freeList = entry->next;
+
+  entry->node = nodes[slot].node;
+  entry->key = key;
+  entry->kind = kind;
+  entry->handle = handle;
+
+  // append, routes of a key keep the order they were added in
+  entry->next = NONE;
+  entry->prev = nodes[slot].last;
+  if (nodes[slot].last == NONE) {
+    nodes[slot].first = i;
+  } else {
+    at(nodes[slot].last)->next = i;
+  }
+  nodes[slot].last = i;
+  return i;
+}
+
+/**
+ * Unlink an entry from its node. A reader that resolved the entry before its
+ * generation changed may still be calling its handler, so the entry only goes
+ * back on the free list once those readers are done.
+ */
+void CanRegistry::release(uint32_t i) {
+  CanEntry *entry = at(i);
+  NodeSlot *slot = &nodes[entry->node->registrySlot];
+
+  if (entry->prev == NONE) {
+    slot->first = entry->next;
+  } else {
+    at(entry->prev)->next = entry->next;
+  }
+  if (entry->next == NONE) {
+    slot->last = entry->prev;
+  } else {
+    at(entry->next)->prev = entry->prev;
+  }
+
+  // 0 is never a valid generation, so no handle is ever 0
+  uint32_t gen = entry->gen.load(std::memory_order_relaxed) + 1;
+  entry->gen.store(gen != 0 ? gen : 1, std::memory_order_release);
+  CanEpoch::retire(recycle, (void *)(uintptr_t)i);
+  dirty.store(true, std::memory_order_release);
+}
+
+/**
+ * Put a removed entry back on the free list, called from CanEpoch::reclaim()
+ * with the lock held.
+ */
+void CanRegistry::recycle(void *arg) {
+  uint32_t i = (uint32_t)(uintptr_t)arg;
+  CanEntry *entry = at(i);
+  entry->node = nullptr;
+  entry->handle = CanHandler();
+  entry->next = freeList;
+  freeList = i;
+}
+
+/**
+ * \param handle handle returned by add()
+ * \param node node the entry has to belong to
+ * \param key[out] key of the removed entry
+ * \param kind[out] kind of the removed entry
+ *
+ * The timeout entry of a CAN_BCM filter is removed with it.
+ *
+ * \returns false if the handle is stale, e.g. the entry was already removed,
+ * or the entry is not one of node's.
+ */
+bool CanRegistry::remove(CanFilterHandle handle, const CanNode *node,
+                         uint32_t *key, CanRouteKind *kind) {
+  std::lock_guard<std::mutex> guard(lock);
+  CanEntry *entry = get(handle);
+  if (entry == nullptr || entry->node != node) {
+    return false;
+  }
+  *key = entry->key;
+  *kind = entry->kind;
+  uint32_t next = entry->next;
+  release((uint32_t)handle);
+  if (*kind == CAN_ROUTE_BCM && next != NONE &&
+      at(next)->kind == CAN_ROUTE_TIMEOUT) {
+    release(next);
+  }
+  CanEpoch::reclaim();
+  return true;
+}
+
+/**
+ * Only called with the lock held.
+ */
+CanEntry *CanRegistry::get(CanFilterHandle handle) {
+  uint32_t i = (uint32_t)handle;
+  uint32_t gen = (uint32_t)(handle >> 32);
+  if (handle == CAN_NO_FILTER || i / CAN_REGISTRY_CHUNK >= numChunks) {
+    return nullptr;
+  }
+  CanEntry *entry = at(i);
+  return entry->node != nullptr &&
+                 entry->gen.load(std::memory_order_relaxed) == gen
+             ? entry
+             : nullptr;
+}
+
+CanFilterHandle CanRegistry::first(const CanNode *node) {
+  std::lock_guard<std::mutex> guard(lock);
+  uint32_t slot = node->registrySlot;
+  if (slot >= nodeCount || nodes[slot].node != node ||
+      nodes[slot].first == NONE) {
+    return CAN_NO_FILTER;
+  }
+  uint32_t i = nodes[slot].first;
+  return make_handle(i, at(i)->gen.load(std::memory_order_relaxed));
+}
+
+/**
+ * Looks at the entries of every node, it is only used when a CAN_BCM filter
+ * is added or removed.
+ */
+bool CanRegistry::has(uint32_t key, CanRouteKind kind) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (uint32_t n = 0; n < nodeCount; ++n) {
+    for (uint32_t i = nodes[n].first; i != NONE; i = at(i)->next) {
+      if (at(i)->key == key && at(i)->kind == kind) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void CanRegistry::freeIndex(void *arg) {
+  delete (CanRouteIndex *)arg;
+}
+
+/**
+ * Builds the routes into a new index and publishes it, the old one is freed
+ * once no reader is looking at it. Filters numbered like mask filters (0 - 52)
+ * also get a route for the fmi of received messages. Entries removed later
+ * are skipped by resolve().
+ *
+ * Never waits for a writer: if one holds the lock the routes are published
+ * on a later call.
+ */
+void CanRegistry::update() {
+  if (!dirty.load(std::memory_order_acquire)) {
+    return;
+  }
+  std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+  if (!guard.owns_lock()) {
+    return;
+  }
+
+  CanRouteIndex *routeIndex = new (std::nothrow) CanRouteIndex();
+  if (routeIndex == nullptr) {
+    return;
+  }
+  // a route that could not be added fails the update like build() does, the
+  // old routes stay and the next call tries again
+  bool added = true;
+  for (uint32_t n = 0; n < nodeCount && added; ++n) {
+    for (uint32_t i = nodes[n].first; i != NONE && added; i = at(i)->next) {
+      const CanEntry *entry = at(i);
+      uint32_t gen = entry->gen.load(std::memory_order_relaxed);
+      added = routeIndex->add(entry->key, i, gen);
+      if (added && entry->kind == CAN_ROUTE_FILTER && entry->key <= 52) {
+        added = routeIndex->add(CAN_ROUTE_FMI(entry->key), i, gen);
+      }
+    }
+  }
+  if (!added || !routeIndex->build()) {
+    perror("can routes");
+    delete routeIndex;
+    return;
+  }
+
+  dirty.store(false, std::memory_order_relaxed);
+  CanRouteIndex *old = index.exchange(routeIndex, std::memory_order_acq_rel);
+  if (old != nullptr) {
+    CanEpoch::retire(freeIndex, old);
+  }
+  CanEpoch::reclaim();
+}
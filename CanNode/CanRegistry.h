@@ -0,0 +1,141 @@
+/**
+ * \file CanRegistry.h
+ * \brief Nodes and the handlers they registered, without fixed limits.
+ *
+ * Every handler of a node (its rtr, name and info ids and each of its
+ * filters) is an entry in a pool. The pool grows a chunk at a time, so entries
+ * never move once added, sit next to each other in memory and freed entries
+ * are reused. Nodes are kept in a dense array that knows where each node is,
+ * so removing a node or an entry takes constant time however many there are.
+ *
+ * Entries are referred to by a \ref CanFilterHandle that carries the
+ * generation of the entry. Removing an entry bumps its generation, so a handle
+ * or route that outlived the entry is recognized as stale instead of calling
+ * the handler of a destroyed node.
+ *
+ * Nodes and entries can be added and removed from any thread, writers take
+ * one lock. Dispatch never does: update() publishes the routes as an
+ * immutable snapshot, and readers look at it inside a CanEpoch read section.
+ * Replaced snapshots, chunk tables and removed entries are only freed or
+ * reused once no read section can still see them.
+ */
+#ifndef _CAN_REGISTRY_H_
+#define _CAN_REGISTRY_H_
+
+#include "CanEpoch.h"
+#include "CanHandler.h"
+#include "CanRouteIndex.h"
+#include "CanTypes.h"
+#include <atomic>
+#include <mutex>
+#include <stdbool.h>
+#include <stdint.h>
+
+class CanNode;
+
+#ifndef CAN_REGISTRY_CHUNK
+/// Number of entries the pool grows by. Can be overwriten by redefinition
+#define CAN_REGISTRY_CHUNK 256
+#endif
+
+/**
+ * \typedef CanFilterHandle
+ * \brief Refers to one filter of a node, 0 (\ref CAN_NO_FILTER) for none.
+ *
+ * The generation of the entry is in the high 32 bits, its index in the low 32.
+ */
+typedef uint64_t CanFilterHandle;
+
+/// Handle that refers to no filter
+#define CAN_NO_FILTER ((CanFilterHandle)0)
+
+/**
+ * \struct CanEntry
+ * \brief One handler of a node.
+ *
+ * An entry fills exactly one cache line, so calling the handler of a route
+ * touches one line however much context the handler holds. A CAN_BCM filter
+ * with a timeout handler takes two entries, the second one of kind
+ * CAN_ROUTE_TIMEOUT.
+ */
+typedef struct {
+  alignas(64) CanNode *node; ///< owner, NULL while the entry is unused
+  uint32_t key;              ///< id with CAN_ID_EXT, or a mask filter number
+  CanRouteKind kind;         ///< what to do with a matching message
+  CanHandler handle;         ///< handler of a filter, timeout or rtr
+  std::atomic<uint32_t> gen; ///< bumped each time the entry is removed
+  uint32_t next;             ///< next entry of the node, or of the free list
+  uint32_t prev;             ///< previous entry of the node
+} CanEntry;
+
+static_assert(sizeof(CanEntry) == 64, "CanEntry is not one cache line");
+
+class CanRegistry {
+public:
+  /// \brief Add a node, returns false if out of memory.
+  static bool addNode(CanNode *node);
+  /// \brief Remove a node and all of its entries.
+  static void removeNode(CanNode *node);
+  /// \brief Add a handler to a node, returns \ref CAN_NO_FILTER on failure.
+  static CanFilterHandle add(CanNode *node, uint32_t key, CanRouteKind kind,
+                             const CanHandler &handle,
+                             const CanHandler &timeoutHandle);
+  /// \brief Remove an entry of a node, returns false if the handle is stale.
+  static bool remove(CanFilterHandle handle, const CanNode *node,
+                     uint32_t *key, CanRouteKind *kind);
+  /// \brief First entry of a node, or \ref CAN_NO_FILTER if it has none.
+  static CanFilterHandle first(const CanNode *node);
+  /// \brief Check if any node has an entry of a kind for a key.
+  static bool has(uint32_t key, CanRouteKind kind);
+  /// \brief Number of registered nodes.
+  static uint32_t numNodes();
+
+  /// \brief Publish new routes if nodes or entries were added or removed.
+  static void update();
+  /**
+   * \brief Get the routes of a key as of the last update().
+   *
+   * Call inside a CanEpoch read section, the routes stay valid until it ends.
+   */
+  static uint32_t find(uint32_t key, const CanRoute **routes) {
+    const CanRouteIndex *routeIndex = index.load(std::memory_order_acquire);
+    return routeIndex != nullptr ? routeIndex->find(key, routes) : 0;
+  }
+  /// \brief Entry a route points to, or NULL if it was removed since.
+  static CanEntry *resolve(const CanRoute *route) {
+    CanEntry *entry = at(route->entry);
+    return entry->gen.load(std::memory_order_acquire) == route->gen ? entry
+                                                                    : nullptr;
+  }
+
+private:
+  typedef struct {
+    CanNode *node;
+    uint32_t first; ///< first entry of the node, in the order they were added
+    uint32_t last;  ///< last entry of the node
+  } NodeSlot;
+
+  static std::mutex lock;   ///< held by writers, never by readers
+  static std::atomic<CanEntry **> chunks; ///< CAN_REGISTRY_CHUNK entries each
+  static uint32_t numChunks;
+  static uint32_t freeList;  ///< first free entry
+  static NodeSlot *nodes;    ///< dense, CanNode::registrySlot is the position
+  static uint32_t nodeCount;
+  static uint32_t sizeNodes;
+  static std::atomic<CanRouteIndex *> index; ///< published routes
+  static std::atomic<bool> dirty;            ///< index needs to be rebuilt
+
+  static CanEntry *at(uint32_t i) {
+    CanEntry **table = chunks.load(std::memory_order_acquire);
+    return &table[i / CAN_REGISTRY_CHUNK][i % CAN_REGISTRY_CHUNK];
+  }
+  static CanEntry *get(CanFilterHandle handle);
+  static bool grow();
+  static uint32_t append(uint32_t slot, uint32_t key, CanRouteKind kind,
+                         const CanHandler &handle);
+  static void release(uint32_t i);
+  static void recycle(void *arg);
+  static void freeIndex(void *arg);
+};
+
+#endif //_CAN_REGISTRY_H_
@@ -0,0 +1,122 @@
+/**
+ * CanRouteIndex.cpp
+ * \brief implements the id to handler lookup
+ */
+#include "CanRouteIndex.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+CanRouteIndex::CanRouteIndex()
+    : routes(nullptr), numRoutes(0), sizeRoutes(0), slots(nullptr),
+      numSlots(0) {}
+
+CanRouteIndex::~CanRouteIndex() {
+  free(routes);
+  free(slots);
+}
+
+/**
+ * find() keeps returning nothing until build() is called.
+ */
+void CanRouteIndex::clear() {
+  numRoutes = 0;
+  if (slots != nullptr) {
+    memset(slots, 0, numSlots * sizeof(Slot));
+  }
+}
+
+/**
+ * \returns false if out of memory.
+ */
+bool CanRouteIndex::add(uint32_t key, uint32_t entry, uint32_t gen) {
+  if (numRoutes == sizeRoutes) {
+    uint32_t size = sizeRoutes * 2 + 64;
+    CanRoute *grown = (CanRoute *)realloc(routes, size * sizeof(CanRoute));
+    if (grown == nullptr) {
+      return false;
+    }
+    routes = grown;
+    sizeRoutes = size;
+  }
+
+  CanRoute *route = &routes[numRoutes++];
+  route->key = key;
+  route->entry = entry;
+  route->gen = gen;
+  return true;
+}
+
+/**
+ * Sort the routes by key, keeping the order they were added in for equal
+ * keys, and hash the first route of every key.
+ *
+ * \returns false if out of memory.
+ */
+bool CanRouteIndex::build() {
+  std::stable_sort(routes, routes + numRoutes,
+                   [](const CanRoute &a, const CanRoute &b) {
+                     return a.key < b.key;
+                   });
+
+  uint32_t keys = 0;
+  for (uint32_t i = 0; i < numRoutes; ++i) {
+    if (i == 0 || routes[i].key != routes[i - 1].key) {
+      keys++;
+    }
+  }
+
+  // keep the table at most half full so probes stay short
+  uint32_t size = 16;
+  while (size < keys * 2) {
+    size *= 2;
+  }
+  if (size != numSlots) {
+    Slot *grown = (Slot *)realloc(slots, size * sizeof(Slot));
+    if (grown == nullptr) {
+      return false;
+    }
+    slots = grown;
+    numSlots = size;
+  }
+  memset(slots, 0, numSlots * sizeof(Slot));
+
+  uint32_t mask = numSlots - 1;
+  for (uint32_t i = 0; i < numRoutes;) {
+    uint32_t first = i;
+    while (i < numRoutes && routes[i].key == routes[first].key) {
+      i++;
+    }
+
+    uint32_t s = can_id_hash(routes[first].key) & mask;
+    while (slots[s].count != 0) {
+      s = (s + 1) & mask;
+    }
+    slots[s].key = routes[first].key;
+    slots[s].first = first;
+    slots[s].count = i - first;
+  }
+  return true;
+}
+
+/**
+ * \param key id with CAN_ID_EXT set for extended ids, or CAN_ROUTE_FMI()
+ * \param routes[out] first route of the key
+ *
+ * \returns the number of routes of the key, 0 if there are none.
+ */
+uint32_t CanRouteIndex::find(uint32_t key, const CanRoute **routes) const {
+  if (numSlots == 0) {
+    return 0;
+  }
+
+  uint32_t mask = numSlots - 1;
+  for (uint32_t s = can_id_hash(key) & mask; slots[s].count != 0;
+       s = (s + 1) & mask) {
+    if (slots[s].key == key) {
+      *routes = &this->routes[slots[s].first];
+      return slots[s].count;
+    }
+  }
+  return 0;
+}
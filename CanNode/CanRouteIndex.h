@@ -0,0 +1,77 @@
+/**
+ * \file CanRouteIndex.h
+ * \brief Lookup of the handlers that want a received id.
+ *
+ * CanNode::checkForMessages() used to compare every received id against every
+ * filter of every node. The route index maps an id straight to the handlers
+ * registered for it, so the cost of dispatching a message does not grow with
+ * the number of nodes and filters. Ids are hashed, which keeps the table small
+ * for the sparse 29-bit extended id space.
+ *
+ * The index is rebuilt from scratch whenever a node or filter is added or
+ * removed, since that is rare next to lookups. Routes for the same id keep the
+ * order they were added in.
+ */
+#ifndef _CAN_ROUTE_INDEX_H_
+#define _CAN_ROUTE_INDEX_H_
+
+#include "CanTypes.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Key of the routes for a mask filter number, instead of an id
+#define CAN_ROUTE_FMI(fmi) (0x40000000U | (fmi))
+
+/**
+ * \enum CanRouteKind
+ * \brief What a route does with a matching message.
+ */
+typedef enum {
+  CAN_ROUTE_RTR,    ///< call the node's rtr handler (rtr frames only)
+  CAN_ROUTE_NAME,   ///< send the node's name (rtr frames only)
+  CAN_ROUTE_INFO,   ///< send the node's info string (rtr frames only)
+  CAN_ROUTE_VALUE,  ///< send the node's published value (rtr frames only)
+  CAN_ROUTE_FILTER, ///< call the handler of one of the node's filters
+  CAN_ROUTE_BCM,    ///< filter matched by CAN_BCM, not by the raw socket
+  CAN_ROUTE_TIMEOUT ///< CAN_BCM timeout of the CAN_ROUTE_BCM entry before it
+} CanRouteKind;
+
+/**
+ * \struct CanRoute
+ * \brief One handler that wants an id.
+ */
+typedef struct {
+  uint32_t key;   ///< id with CAN_ID_EXT, or CAN_ROUTE_FMI()
+  uint32_t entry; ///< CanRegistry entry of the handler
+  uint32_t gen;   ///< generation of the entry when the route was added
+} CanRoute;
+
+class CanRouteIndex {
+public:
+  CanRouteIndex();
+  ~CanRouteIndex();
+
+  /// \brief Start collecting the routes for a rebuild.
+  void clear();
+  /// \brief Add a route, call build() once all routes are added.
+  bool add(uint32_t key, uint32_t entry, uint32_t gen);
+  /// \brief Make the added routes available to find().
+  bool build();
+  /// \brief Get the routes of a key, returns how many there are.
+  uint32_t find(uint32_t key, const CanRoute **routes) const;
+
+private:
+  typedef struct {
+    uint32_t key;
+    uint32_t first; ///< index of the first route in routes
+    uint32_t count; ///< 0 for an empty slot
+  } Slot;
+
+  CanRoute *routes;   ///< sorted by key once built
+  uint32_t numRoutes;
+  uint32_t sizeRoutes;
+  Slot *slots;        ///< open addressing by can_id_hash()
+  uint32_t numSlots;  ///< a power of two, at least twice the number of keys
+};
+
+#endif //_CAN_ROUTE_INDEX_H_
@@ -0,0 +1,373 @@
+/**
+ * CanShm.cpp
+ * \brief implements the shared memory frame ring
+ */
+#include "CanShm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// magic of a ring that is ready, "CANR"
+#define SHM_MAGIC 0x43414E52U
+
+CanShmHeader *CanShm::header;
+CanShmSlot *CanShm::ring;
+size_t CanShm::size;
+uint64_t CanShm::mask;
+int CanShm::self = -1;
+int CanShm::wakeFd = -1;
+char CanShm::name[64];
+
+/**
+ * Readers are woken through an abstract unix socket named after the ring
+ * and their consumer slot, so nothing is left in the file system.
+ */
+static socklen_t wake_addr(const char *name, int index,
+                           struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  // sun_path[0] stays 0 for the abstract namespace
+  int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                     "can-shm%s.%d", name, index);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/**
+ * \param name name of the shared memory object, starting with '/'
+ * \param slots frames the ring holds, a power of two, 0 for
+ * \ref CAN_SHM_SLOTS
+ *
+ * A ring of the same size left by an earlier writer is taken over with its
+ * readers, who carry on reading once frames are written again. A ring of
+ * another size is replaced, readers of the old one have to attach again.
+ *
+ * \returns false if the ring could not be created.
+ */
+bool CanShm::create(const char *ringName, uint32_t slots) {
+  if (header != NULL) {
+    errno = EBUSY;
+    return false;
+  }
+  if (slots == 0) {
+    slots = CAN_SHM_SLOTS;
+  }
+  if ((slots & (slots - 1)) != 0) {
+    errno = EINVAL;
+    return false;
+  }
+
+  snprintf(name, sizeof(name), "%s", ringName);
+  size = sizeof(CanShmHeader) + (size_t)slots * sizeof(CanShmSlot);
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0666);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size != 0 &&
+      (size_t)st.st_size != size) {
+    // another size, mapped readers would fault if it was resized in place
+    ::close(fd);
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+  }
+  if (fd < 0 || ftruncate(fd, size) < 0) {
+    perror("can shm_open");
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return false;
+  }
+
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED) {
+    perror("can shm mmap");
+    return false;
+  }
+  header = (CanShmHeader *)mem;
+  ring = (CanShmSlot *)(header + 1);
+  mask = slots - 1;
+  self = -1;
+
+  if (header->magic.load(std::memory_order_acquire) != SHM_MAGIC ||
+      header->slots != slots) {
+    // a new ring, ftruncate() filled it with zeros
+    header->slots = slots;
+    header->head.store(0, std::memory_order_relaxed);
+    header->magic.store(SHM_MAGIC, std::memory_order_release);
+  }
+  header->producer.store(getpid(), std::memory_order_relaxed);
+
+  wakeFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (wakeFd < 0) {
+    perror("can shm wake socket");
+  }
+  return true;
+}
+
+/**
+ * Frames are written to the slots one at a time, then the head moves past
+ * all of them at once. Readers waiting in waitForMessages() are woken once
+ * per call.
+ *
+ * \param frames first frame, a struct canfd_frame at the start of each
+ * frameSize bytes
+ * \param frameSize distance between frames in bytes
+ * \param count number of frames
+ * \param timestamp can_time_ns() the frames were received
+ */
+void CanShm::publish(const void *frames, uint32_t frameSize, uint32_t count,
+                     uint64_t timestamp) {
+  uint64_t head = header->head.load(std::memory_order_relaxed);
+  const uint8_t *frame = (const uint8_t *)frames;
+  for (uint64_t pos = head; pos < head + count; ++pos, frame += frameSize) {
+    CanShmSlot *slot = &ring[pos & mask];
+    slot->seq.store(pos * 2 + 1, std::memory_order_relaxed);
+    // a reader that sees any of the new words sees the odd seq too
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t w = 0; w < sizeof(slot->frame) / 8; ++w) {
+      uint64_t word;
+      memcpy(&word, frame + w * 8, sizeof(word));
+      slot->frame[w].store(word, std::memory_order_relaxed);
+    }
+    slot->timestamp.store(timestamp, std::memory_order_relaxed);
+    slot->seq.store(pos * 2 + 2, std::memory_order_release);
+  }
+
+  // pairs with sleep(): a reader either sees the new head or is woken
+  header->head.store(head + count, std::memory_order_seq_cst);
+  for (int i = 0; i < CAN_SHM_CONSUMERS; ++i) {
+    CanShmConsumer *consumer = &header->consumers[i];
+    if (consumer->sleeping.load(std::memory_order_seq_cst) != 0 &&
+        consumer->sleeping.exchange(0) != 0) {
+      struct sockaddr_un addr;
+      socklen_t len = wake_addr(name, i, &addr);
+      char byte = 0;
+      sendto(wakeFd, &byte, 1, MSG_DONTWAIT, (struct sockaddr *)&addr, len);
+    }
+  }
+}
+
+/**
+ * Takes a free consumer slot, or the slot of a reader that died without
+ * leaving, and starts reading at the newest frame.
+ *
+ * \param name name the writer created the ring with
+ *
+ * \returns false if there is no such ring or all consumer slots are taken.
+ */
+bool CanShm::attach(const char *ringName) {
+  if (header != NULL) {
+    errno = EBUSY;
+    return false;
+  }
+
+  snprintf(name, sizeof(name), "%s", ringName);
+  int fd = shm_open(name, O_RDWR, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 ||
+      (size_t)st.st_size < sizeof(CanShmHeader)) {
+    perror("can shm_open");
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return false;
+  }
+  size = st.st_size;
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED) {
+    perror("can shm mmap");
+    return false;
+  }
+  header = (CanShmHeader *)mem;
+  ring = (CanShmSlot *)(header + 1);
+  mask = header->slots - 1;
+
+  if (header->magic.load(std::memory_order_acquire) != SHM_MAGIC ||
+      size != sizeof(CanShmHeader) +
+                  (size_t)header->slots * sizeof(CanShmSlot)) {
+    fprintf(stderr, "%s: not a CanShm ring\n", name);
+    close();
+    return false;
+  }
+
+  uint32_t me = getpid();
+  for (int i = 0; i < CAN_SHM_CONSUMERS; ++i) {
+    CanShmConsumer *consumer = &header->consumers[i];
+    uint32_t pid = consumer->pid.load(std::memory_order_relaxed);
+    if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH)) {
+      continue;
+    }
+    if (!consumer->pid.compare_exchange_strong(pid, me)) {
+      continue;
+    }
+
+    // the socket the writer wakes this reader on
+    struct sockaddr_un addr;
+    socklen_t len = wake_addr(name, i, &addr);
+    wakeFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (wakeFd < 0 || bind(wakeFd, (struct sockaddr *)&addr, len) < 0) {
+      perror("can shm wake socket");
+      consumer->pid.store(0, std::memory_order_release);
+      close();
+      return false;
+    }
+
+    self = i;
+    consumer->sleeping.store(0, std::memory_order_relaxed);
+    consumer->lost.store(0, std::memory_order_relaxed);
+    consumer->cursor.store(header->head.load(std::memory_order_acquire),
+                           std::memory_order_relaxed);
+    return true;
+  }
+
+  fprintf(stderr, "%s: all %d consumers are taken\n", name,
+          CAN_SHM_CONSUMERS);
+  close();
+  return false;
+}
+
+/**
+ * A reader that fell behind far enough for its next frame to be overwritten
+ * skips to a quarter of a ring past the oldest frame, so it is not overtaken
+ * again right away. The frames skipped are counted as lost.
+ *
+ * \param frames where to copy the frames to, a struct canfd_frame at the
+ * start of each frameSize bytes
+ * \param frameSize distance between frames in bytes
+ * \param max room for frames
+ * \param timestamps[out] when each frame was received, may be NULL
+ *
+ * \returns the number of frames copied.
+ */
+uint32_t CanShm::read(void *frames, uint32_t frameSize, uint32_t max,
+                      uint64_t *timestamps) {
+  CanShmConsumer *consumer = &header->consumers[self];
+  consumer->sleeping.store(0, std::memory_order_relaxed);
+
+  uint64_t slots = mask + 1;
+  uint64_t cursor = consumer->cursor.load(std::memory_order_relaxed);
+  uint64_t head = header->head.load(std::memory_order_acquire);
+  uint8_t *frame = (uint8_t *)frames;
+  uint32_t count = 0;
+  while (count < max && cursor != head) {
+    if (head - cursor <= slots) {
+      CanShmSlot *slot = &ring[cursor & mask];
+      uint64_t seq = slot->seq.load(std::memory_order_acquire);
+      if (seq == cursor * 2 + 2) {
+        for (size_t w = 0; w < sizeof(slot->frame) / 8; ++w) {
+          uint64_t word = slot->frame[w].load(std::memory_order_relaxed);
+          memcpy(frame + w * 8, &word, sizeof(word));
+        }
+        if (timestamps != NULL) {
+          timestamps[count] =
+              slot->timestamp.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) == seq) {
+          frame += frameSize;
+          ++count;
+          ++cursor;
+          continue;
+        }
+      }
+      // overwritten, the head may not show it yet
+      head = header->head.load(std::memory_order_acquire);
+    }
+
+    uint64_t next = cursor + 1;
+    if (head + slots / 4 > next + slots) {
+      next = head + slots / 4 - slots;
+    }
+    consumer->lost.fetch_add(next - cursor, std::memory_order_relaxed);
+    cursor = next;
+  }
+
+  consumer->cursor.store(cursor, std::memory_order_release);
+  return count;
+}
+
+/**
+ * Called before waiting for fd(). Datagrams of earlier wake ups are read, and
+ * the writer is asked to send one after its next batch.
+ *
+ * \returns false if frames are already waiting, so there is no need to wait.
+ */
+bool CanShm::sleep() {
+  char byte;
+  while (recv(wakeFd, &byte, sizeof(byte), MSG_DONTWAIT) > 0) {
+  }
+
+  CanShmConsumer *consumer = &header->consumers[self];
+  // pairs with publish(): either the head moved or the writer sees the flag
+  consumer->sleeping.store(1, std::memory_order_seq_cst);
+  if (header->head.load(std::memory_order_seq_cst) !=
+      consumer->cursor.load(std::memory_order_relaxed)) {
+    consumer->sleeping.store(0, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * \returns the frames this reader lost because it fell behind, since
+ * attach().
+ */
+uint64_t CanShm::lost() {
+  return header->consumers[self].lost.load(std::memory_order_relaxed);
+}
+
+/**
+ * Lets the writer, or any process mapping the ring, see which readers keep
+ * up.
+ *
+ * \param stats[out] one entry per reader
+ * \param max room in stats
+ *
+ * \returns the number of entries filled in.
+ */
+uint32_t CanShm::consumers(CanShmConsumerStats *stats, uint32_t max) {
+  uint64_t head = header->head.load(std::memory_order_acquire);
+  uint32_t count = 0;
+  for (int i = 0; i < CAN_SHM_CONSUMERS && count < max; ++i) {
+    CanShmConsumer *consumer = &header->consumers[i];
+    uint32_t pid = consumer->pid.load(std::memory_order_acquire);
+    if (pid == 0) {
+      continue;
+    }
+    stats[count].pid = pid;
+    stats[count].backlog =
+        head - consumer->cursor.load(std::memory_order_relaxed);
+    stats[count].lost = consumer->lost.load(std::memory_order_relaxed);
+    ++count;
+  }
+  return count;
+}
+
+/**
+ * The shared memory object is not removed, a writer started again takes it
+ * over and its readers carry on.
+ */
+void CanShm::close() {
+  if (header == NULL) {
+    return;
+  }
+  if (self >= 0) {
+    header->consumers[self].sleeping.store(0, std::memory_order_relaxed);
+    header->consumers[self].pid.store(0, std::memory_order_release);
+  }
+  if (wakeFd >= 0) {
+    ::close(wakeFd);
+  }
+  munmap(header, size);
+  header = NULL;
+  ring = NULL;
+  self = -1;
+  wakeFd = -1;
+}
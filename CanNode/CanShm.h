@@ -0,0 +1,144 @@
+/**
+ * \file CanShm.h
+ * \brief Shares the received frames of one process with others through a ring
+ * in POSIX shared memory.
+ *
+ * Every process that opens its own raw socket makes the kernel copy, filter
+ * and wake it for each frame. With \ref CanBusConfig::shmRing set, the
+ * process that owns the bus receives as usual and also writes every received
+ * frame, with the time its batch was received, into a ring in shared memory.
+ * Processes that set \ref CanBusConfig::shmConsumer as well take their frames
+ * from the ring instead of their socket: their CanNodes, filters and handlers
+ * work as before, and the socket is only used to transmit.
+ *
+ * There is one writer and any number of readers, up to
+ * \ref CAN_SHM_CONSUMERS of them attached through CanNode. The writer never
+ * waits for a reader: each reader keeps its own cursor, and a reader that
+ * falls a whole ring behind loses the oldest frames and counts them (see
+ * getKernelDrops() and consumers()). Every slot carries a sequence number, so
+ * a slot that is written again while it is being read is noticed as well.
+ *
+ * A reader about to sleep in waitForMessages() marks itself in the ring, and
+ * the writer sends it a datagram on a socket of its own after the next batch,
+ * so sleeping readers cost nothing while frames are read in time.
+ *
+ * Frames sent by the readers are received by the writer and come back to
+ * every reader through the ring, including the one that sent them. Only
+ * frames the writer receives are shared, so it should not use
+ * \ref CanBusConfig::kernelFilter.
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * // canLogger, owns the bus
+ * CanBusConfig config = {"can0"};
+ * config.shmRing = "/can0";
+ * CanNode::setBusConfig(&config);
+ *
+ * // dashboard, attaches to the ring of canLogger
+ * config.shmConsumer = true;
+ * CanNode::setBusConfig(&config);
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_SHM_H_
+#define _CAN_SHM_H_
+
+#include <atomic>
+#include <linux/can.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CAN_SHM_SLOTS
+/// Frames the ring holds, a power of two. Can be overwriten by redefinition
+#define CAN_SHM_SLOTS 4096
+#endif
+
+#ifndef CAN_SHM_CONSUMERS
+/// Readers that can attach to one ring. Can be overwriten by redefinition
+#define CAN_SHM_CONSUMERS 16
+#endif
+
+/**
+ * \struct CanShmSlot
+ * \brief One frame in the ring.
+ *
+ * The frame is kept as 64-bit words so a reader racing the writer copies it
+ * without a data race, seq then tells if the copy can be used.
+ */
+typedef struct {
+  alignas(64) std::atomic<uint64_t> seq; ///< 2 * position + 2 once written,
+                                         ///< odd while being written
+  std::atomic<uint64_t> timestamp;       ///< can_time_ns() of the batch
+  std::atomic<uint64_t> frame[sizeof(struct canfd_frame) / 8];
+} CanShmSlot;
+
+/**
+ * \struct CanShmConsumer
+ * \brief A reader attached to the ring.
+ */
+typedef struct {
+  alignas(64) std::atomic<uint32_t> pid; ///< process of the reader, 0 if free
+  std::atomic<uint32_t> sleeping;        ///< wake the reader on the next batch
+  std::atomic<uint64_t> cursor;          ///< next position it reads
+  std::atomic<uint64_t> lost;            ///< frames overwritten before read
+} CanShmConsumer;
+
+/**
+ * \struct CanShmHeader
+ * \brief Start of the shared memory, followed by the slots.
+ */
+typedef struct {
+  std::atomic<uint32_t> magic;    ///< set once the ring is ready
+  uint32_t slots;                 ///< number of slots, a power of two
+  std::atomic<uint32_t> producer; ///< process of the writer
+  alignas(64) std::atomic<uint64_t> head; ///< frames written so far
+  CanShmConsumer consumers[CAN_SHM_CONSUMERS];
+} CanShmHeader;
+
+/**
+ * \struct CanShmConsumerStats
+ * \brief State of one attached reader, see CanShm::consumers().
+ */
+typedef struct {
+  uint32_t pid;     ///< process of the reader
+  uint64_t backlog; ///< frames written that it has not read yet
+  uint64_t lost;    ///< frames it lost because it fell a whole ring behind
+} CanShmConsumerStats;
+
+class CanShm {
+public:
+  /// \brief Create the ring, or take over one left by an earlier writer.
+  static bool create(const char *name, uint32_t slots);
+  /// \brief Write a run of received frames to the ring and wake readers.
+  static void publish(const void *frames, uint32_t frameSize, uint32_t count,
+                      uint64_t timestamp);
+  /// \brief Attach to a ring as a reader, starting at its newest frame.
+  static bool attach(const char *name);
+  /// \brief Take up to max frames, returns how many.
+  static uint32_t read(void *frames, uint32_t frameSize, uint32_t max,
+                       uint64_t *timestamps);
+  /// \brief Ask to be woken by the next batch, false if frames are waiting.
+  static bool sleep();
+  /// \brief Frames this reader lost so far.
+  static uint64_t lost();
+  /// \brief State of the readers attached to the ring, returns how many.
+  static uint32_t consumers(CanShmConsumerStats *stats, uint32_t max);
+  /// \brief Unmap the ring, and leave it if attached as a reader.
+  static void close();
+  /// \brief Socket that is readable when the writer woke this reader.
+  static int fd() { return wakeFd; }
+  /// \brief Check if create() succeeded.
+  static bool producer() { return header != NULL && self < 0; }
+  /// \brief Check if attach() succeeded.
+  static bool consumer() { return header != NULL && self >= 0; }
+
+private:
+  static CanShmHeader *header;
+  static CanShmSlot *ring;
+  static size_t size;     ///< bytes mapped
+  static uint64_t mask;   ///< slots - 1
+  static int self;        ///< consumer slot of this reader, -1 for the writer
+  static int wakeFd;      ///< datagram socket, bound by a reader
+  static char name[64];   ///< name of the ring
+};
+
+#endif //_CAN_SHM_H_
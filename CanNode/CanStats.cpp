@@ -0,0 +1,271 @@
+/**
+ * CanStats.cpp
+ * \brief implements per-thread runtime counters
+ */
+#include "CanStats.h"
+#include "CanTime.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// attempts of readShm() to get a consistent snapshot, 10 us apart, before
+/// it gives up on a writer that died while publishing
+#define READ_TRIES 1000
+
+std::atomic<bool> CanStats::timing(true);
+std::atomic<CanStats::Counters *> CanStats::threads(nullptr);
+thread_local CanStats::Counters *CanStats::local = nullptr;
+CanStatsShm *CanStats::shm = nullptr;
+
+/// only the owning thread writes a counter so a relaxed load/store is enough
+static inline void bump(std::atomic<uint64_t> &counter) {
+  counter.store(counter.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+}
+
+/**
+ * Get the counters of the calling thread, creating them on first use. Blocks
+ * are never freed so the counts of finished threads stay in the totals.
+ */
+CanStats::Counters *CanStats::counters() {
+  if (local != nullptr) {
+    return local;
+  }
+
+  Counters *block = (Counters *)calloc(1, sizeof(Counters));
+  if (block == nullptr) {
+    perror("can stats");
+    abort();
+  }
+  // push onto the list of all blocks
+  block->next = threads.load(std::memory_order_relaxed);
+  while (!threads.compare_exchange_weak(block->next, block,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed))
+    ;
+  local = block;
+  return local;
+}
+
+/**
+ * \param id id of the message, with \ref CAN_ID_EXT set if it is extended
+ */
+void CanStats::countRx(uint32_t id) {
+  Counters *c = counters();
+  bump(c->rxTotal);
+  if (id < CAN_STATS_IDS) {
+    bump(c->rx[id]);
+  } else if (id & CAN_ID_EXT) {
+    bump(c->rxExtended);
+  }
+}
+
+/**
+ * \param id id of the message, with \ref CAN_ID_EXT set if it is extended
+ */
+void CanStats::countTx(uint32_t id) {
+  Counters *c = counters();
+  bump(c->txTotal);
+  if (id < CAN_STATS_IDS) {
+    bump(c->tx[id]);
+  } else if (id & CAN_ID_EXT) {
+    bump(c->txExtended);
+  }
+}
+
+void CanStats::countTxFailure() { bump(counters()->txFailures); }
+
+void CanStats::countRxDropped(uint32_t count) {
+  std::atomic<uint64_t> &dropped = counters()->rxDropped;
+  dropped.store(dropped.load(std::memory_order_relaxed) + count,
+                std::memory_order_relaxed);
+}
+
+void CanStats::countUnmatched() { bump(counters()->unmatched); }
+
+/**
+ * \param ns time in nano-seconds, stored in the bucket of its highest set bit
+ */
+void CanStats::recordLatency(uint64_t ns) {
+  int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+  if (bucket >= CAN_STATS_LAT_BUCKETS) {
+    bucket = CAN_STATS_LAT_BUCKETS - 1;
+  }
+  bump(counters()->latency[bucket]);
+}
+
+/**
+ * Counters of other threads are read while they may still be counting, so
+ * the totals are not an atomic cut across threads. Every counter is however
+ * read in full and never goes backwards.
+ *
+ * \param snap[out] totals of all threads
+ */
+void CanStats::snapshot(CanStatsSnapshot *snap) {
+  memset(snap, 0, sizeof(*snap));
+  snap->timestamp = can_time_ns();
+
+  for (Counters *c = threads.load(std::memory_order_acquire); c != nullptr;
+       c = c->next) {
+    snap->rxTotal += c->rxTotal.load(std::memory_order_relaxed);
+    snap->txTotal += c->txTotal.load(std::memory_order_relaxed);
+    snap->unmatched += c->unmatched.load(std::memory_order_relaxed);
+    snap->txFailures += c->txFailures.load(std::memory_order_relaxed);
+    snap->rxDropped += c->rxDropped.load(std::memory_order_relaxed);
+    snap->rxExtended += c->rxExtended.load(std::memory_order_relaxed);
+    snap->txExtended += c->txExtended.load(std::memory_order_relaxed);
+    for (int i = 0; i < CAN_STATS_IDS; ++i) {
+      snap->rx[i] += c->rx[i].load(std::memory_order_relaxed);
+      snap->tx[i] += c->tx[i].load(std::memory_order_relaxed);
+    }
+    for (int i = 0; i < CAN_STATS_LAT_BUCKETS; ++i) {
+      snap->latency[i] += c->latency[i].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+double CanStats::rxRate(const CanStatsSnapshot *prev,
+                        const CanStatsSnapshot *cur, uint32_t id) {
+  if (id >= CAN_STATS_IDS || cur->timestamp <= prev->timestamp) {
+    return 0.0;
+  }
+  return (cur->rx[id] - prev->rx[id]) * 1e9 /
+         (double)(cur->timestamp - prev->timestamp);
+}
+
+double CanStats::txRate(const CanStatsSnapshot *prev,
+                        const CanStatsSnapshot *cur, uint32_t id) {
+  if (id >= CAN_STATS_IDS || cur->timestamp <= prev->timestamp) {
+    return 0.0;
+  }
+  return (cur->tx[id] - prev->tx[id]) * 1e9 /
+         (double)(cur->timestamp - prev->timestamp);
+}
+
+/**
+ * \param snap snapshot to read the histogram from
+ * \param p percentile from 0.0 to 1.0
+ *
+ * \returns the upper edge of the bucket containing the percentile, or 0 if
+ * nothing was recorded.
+ */
+uint64_t CanStats::latencyPercentile(const CanStatsSnapshot *snap, double p) {
+  uint64_t total = 0;
+  for (int i = 0; i < CAN_STATS_LAT_BUCKETS; ++i) {
+    total += snap->latency[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(p * total);
+  uint64_t seen = 0;
+  for (int i = 0; i < CAN_STATS_LAT_BUCKETS; ++i) {
+    seen += snap->latency[i];
+    if (seen > rank) {
+      return 2ULL << i;
+    }
+  }
+  return 2ULL << (CAN_STATS_LAT_BUCKETS - 1);
+}
+
+/**
+ * \param name shared memory name, e.g. "/canstats"
+ *
+ * \returns false if the object could not be created.
+ */
+bool CanStats::exportShm(const char *name) {
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    perror("can stats shm_open");
+    return false;
+  }
+  if (ftruncate(fd, sizeof(CanStatsShm)) < 0) {
+    perror("can stats ftruncate");
+    close(fd);
+    return false;
+  }
+
+  void *mem = mmap(NULL, sizeof(CanStatsShm), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    perror("can stats mmap");
+    return false;
+  }
+
+  shm = (CanStatsShm *)mem;
+  shm->magic = CAN_STATS_MAGIC;
+  shm->version = CAN_STATS_VERSION;
+  publish();
+  return true;
+}
+
+/**
+ * Call periodically (e.g. once a second) from any one thread after
+ * exportShm(). Does nothing if nothing was exported.
+ */
+void CanStats::publish() {
+  static CanStatsSnapshot snap;
+  if (shm == nullptr) {
+    return;
+  }
+
+  snapshot(&snap);
+  uint32_t seq = shm->seq.load(std::memory_order_relaxed);
+  shm->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&shm->snap, &snap, sizeof(snap));
+  shm->seq.store(seq + 2, std::memory_order_release);
+}
+
+/**
+ * \param name shared memory name given to exportShm()
+ * \param snap[out] last published snapshot
+ *
+ * \returns false if the object does not exist, is too small or from another
+ * version, or stays in the middle of an update.
+ */
+bool CanStats::readShm(const char *name, CanStatsSnapshot *snap) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  // a shorter object (still being created, or foreign) would fault on read
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CanStatsShm)) {
+    close(fd);
+    return false;
+  }
+  void *mem = mmap(NULL, sizeof(CanStatsShm), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    return false;
+  }
+
+  CanStatsShm *src = (CanStatsShm *)mem;
+  bool ok = src->magic == CAN_STATS_MAGIC && src->version == CAN_STATS_VERSION;
+  for (int tries = 0; ok; ++tries) {
+    if (tries == READ_TRIES) {
+      ok = false;
+      break;
+    }
+    uint32_t seq = src->seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      usleep(10);
+      continue;
+    }
+    memcpy(snap, &src->snap, sizeof(*snap));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (src->seq.load(std::memory_order_relaxed) == seq) {
+      break;
+    }
+  }
+
+  munmap(mem, sizeof(CanStatsShm));
+  return ok;
+}
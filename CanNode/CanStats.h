@@ -0,0 +1,147 @@
+/**
+ * \file CanStats.h
+ * \brief Runtime counters for the CanNode receive and transmit paths.
+ *
+ * Every thread that sends or receives gets its own block of counters, so the
+ * hot path only does an uncontended increment. CanStats::snapshot() adds up
+ * the blocks of all threads. Rates are computed from the difference of two
+ * snapshots. Standard ids are counted per id, messages with 29-bit extended
+ * ids only in their own totals.
+ *
+ * A snapshot can also be exported to POSIX shared memory with
+ * CanStats::exportShm() and refreshed with CanStats::publish(), so a separate
+ * monitoring process can read the counters without talking to the bus
+ * process. Readers should use CanStats::readShm() which handles the sequence
+ * counter that guards the shared copy.
+ *
+ * Example code
+ * ~~~~~~~~~~~~ {.c}
+ * CanStatsSnapshot prev, cur;
+ * CanStats::snapshot(&prev);
+ * // ... run the message loop for a while
+ * CanStats::snapshot(&cur);
+ * double hz = CanStats::rxRate(&prev, &cur, PITOT);
+ * uint64_t p99 = CanStats::latencyPercentile(&cur, 0.99);
+ * ~~~~~~~~~~~~
+ */
+#ifndef _CAN_STATS_H_
+#define _CAN_STATS_H_
+
+#include "CanTypes.h"
+#include <atomic>
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Number of ids that get their own counters (the 11-bit standard ids)
+#define CAN_STATS_IDS 0x800
+/// Number of log2 latency buckets, bucket i counts [2^i, 2^(i+1)) ns
+#define CAN_STATS_LAT_BUCKETS 32
+/// Identifies a shared memory export
+#define CAN_STATS_MAGIC 0x43535453
+/// Layout version of \ref CanStatsShm
+#define CAN_STATS_VERSION 3
+
+/**
+ * \struct CanStatsSnapshot
+ * \brief Totals of all counters at one point in time.
+ */
+typedef struct {
+  uint64_t timestamp;               ///< can_time_ns() when taken
+  uint64_t rxTotal;                 ///< Messages received
+  uint64_t txTotal;                 ///< Messages transmitted
+  uint64_t unmatched;               ///< Received messages no handler wanted
+  uint64_t txFailures;              ///< Messages the driver failed to send
+  uint64_t rxDropped;               ///< Messages the kernel dropped for us
+  uint64_t rxExtended;              ///< Messages received with extended ids
+  uint64_t txExtended;              ///< Messages transmitted with extended ids
+  uint64_t rx[CAN_STATS_IDS];       ///< Messages received per id
+  uint64_t tx[CAN_STATS_IDS];       ///< Messages transmitted per id
+  uint64_t latency[CAN_STATS_LAT_BUCKETS]; ///< can_rx to handler completion
+} CanStatsSnapshot;
+
+/**
+ * \struct CanStatsShm
+ * \brief Layout of the shared memory object made by CanStats::exportShm().
+ *
+ * seq is odd while the snapshot is being rewritten.
+ */
+typedef struct {
+  uint32_t magic;             ///< \ref CAN_STATS_MAGIC
+  uint32_t version;           ///< \ref CAN_STATS_VERSION
+  std::atomic<uint32_t> seq;  ///< sequence counter guarding snap
+  uint32_t reserved;
+  CanStatsSnapshot snap;      ///< last published snapshot
+} CanStatsShm;
+
+class CanStats {
+public:
+  /**
+   * \name Hot path counters
+   * Called by the driver and CanNode::checkForMessages().
+   * @{
+   */
+  /// \brief Count a received message.
+  static void countRx(uint32_t id);
+  /// \brief Count a transmitted message.
+  static void countTx(uint32_t id);
+  /// \brief Count a message the driver failed to transmit.
+  static void countTxFailure();
+  /// \brief Count messages the kernel dropped from the receive queue.
+  static void countRxDropped(uint32_t count);
+  /// \brief Count a received message that no handler wanted.
+  static void countUnmatched();
+  /// \brief Record the time from can_rx to handler completion.
+  static void recordLatency(uint64_t ns);
+  /// \brief Check if dispatch latency should be measured.
+  static bool latencyTiming() {
+    return timing.load(std::memory_order_relaxed);
+  }
+  //@}
+
+  /// \brief Turn dispatch latency measurement on or off.
+  static void setLatencyTiming(bool enable) {
+    timing.store(enable, std::memory_order_relaxed);
+  }
+  /// \brief Add up the counters of all threads.
+  static void snapshot(CanStatsSnapshot *snap);
+  /// \brief Messages per second received from an id between two snapshots.
+  static double rxRate(const CanStatsSnapshot *prev,
+                       const CanStatsSnapshot *cur, uint32_t id);
+  /// \brief Messages per second transmitted from an id between two snapshots.
+  static double txRate(const CanStatsSnapshot *prev,
+                       const CanStatsSnapshot *cur, uint32_t id);
+  /// \brief Upper bound in ns of a dispatch latency percentile.
+  static uint64_t latencyPercentile(const CanStatsSnapshot *snap, double p);
+
+  /// \brief Create a shared memory object to publish snapshots to.
+  static bool exportShm(const char *name);
+  /// \brief Write a fresh snapshot to the shared memory object.
+  static void publish();
+  /// \brief Read a snapshot published by another process.
+  static bool readShm(const char *name, CanStatsSnapshot *snap);
+
+private:
+  /// Counters owned by one thread
+  struct Counters {
+    std::atomic<uint64_t> rx[CAN_STATS_IDS];
+    std::atomic<uint64_t> tx[CAN_STATS_IDS];
+    std::atomic<uint64_t> rxTotal;
+    std::atomic<uint64_t> txTotal;
+    std::atomic<uint64_t> unmatched;
+    std::atomic<uint64_t> txFailures;
+    std::atomic<uint64_t> rxDropped;
+    std::atomic<uint64_t> rxExtended;
+    std::atomic<uint64_t> txExtended;
+    std::atomic<uint64_t> latency[CAN_STATS_LAT_BUCKETS];
+    Counters *next;
+  };
+
+  static std::atomic<bool> timing; ///< set from any thread
+  static std::atomic<Counters *> threads;
+  static thread_local Counters *local;
+  static CanStatsShm *shm;
+
+  static Counters *counters();
+};
+
+#endif //_CAN_STATS_H_
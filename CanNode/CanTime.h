@@ -0,0 +1,27 @@
+/**
+ * \file CanTime.h
+ * \brief Monotonic time helpers for the PC port of CanNode.
+ *
+ * HAL_GetTick() only mirrors the stm32 millisecond tick. These helpers read
+ * CLOCK_MONOTONIC directly so windowing and timing code is not affected by
+ * wall clock changes.
+ */
+#ifndef _CAN_TIME_H_
+#define _CAN_TIME_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/// \brief Monotonic time in nano-seconds.
+static inline uint64_t can_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/// \brief Monotonic time in mili-seconds.
+static inline uint64_t can_time_ms(void) {
+  return can_time_ns() / 1000000ULL;
+}
+
+#endif //_CAN_TIME_H_
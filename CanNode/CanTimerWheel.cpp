@@ -0,0 +1,142 @@
+/**
+ * CanTimerWheel.cpp
+ * \brief implements the hierarchical timer wheel
+ */
+#include "CanTimerWheel.h"
+
+#define SLOT_MASK (CAN_WHEEL_SLOTS - 1)
+
+CanTimerWheel::CanTimerWheel() : current(0) {
+  for (int l = 0; l < CAN_WHEEL_LEVELS; ++l) {
+    for (int i = 0; i < CAN_WHEEL_SLOTS; ++i) {
+      slots[l][i].next = &slots[l][i];
+      slots[l][i].prev = &slots[l][i];
+    }
+  }
+}
+
+/**
+ * \param timer timer that is not in the wheel
+ * \param expires tick to fire on, ticks that already passed fire on the next
+ * advance
+ */
+void CanTimerWheel::add(Timer *timer, uint64_t expires) {
+  // the slot of the current tick has already been fired
+  timer->expires = expires > current ? expires : current + 1;
+  place(timer);
+}
+
+void CanTimerWheel::remove(Timer *timer) {
+  if (timer->next == nullptr) {
+    return;
+  }
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = nullptr;
+  timer->prev = nullptr;
+}
+
+/**
+ * Put a timer in the slot for its expiry relative to the current tick. Timers
+ * cascading down on the tick they expire go in the current level 0 slot,
+ * which advance() fires right after cascading.
+ */
+void CanTimerWheel::place(Timer *timer) {
+  uint64_t expires = timer->expires;
+  if (expires < current) {
+    expires = current;
+  }
+
+  uint64_t delta = expires - current;
+  int level = 0;
+  while (level < CAN_WHEEL_LEVELS - 1 &&
+         delta >= (1ULL << (CAN_WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+  // past the top level, park in the furthest slot and place again later
+  uint64_t range = 1ULL << (CAN_WHEEL_BITS * CAN_WHEEL_LEVELS);
+  if (delta >= range) {
+    expires = current + range - 1;
+  }
+
+  Timer *head =
+      &slots[level][(expires >> (CAN_WHEEL_BITS * level)) & SLOT_MASK];
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+/**
+ * Move the timers of the current slot of a level down to lower levels.
+ */
+void CanTimerWheel::cascade(int level) {
+  Timer *head =
+      &slots[level][(current >> (CAN_WHEEL_BITS * level)) & SLOT_MASK];
+  Timer *timer = head->next;
+  head->next = head;
+  head->prev = head;
+
+  while (timer != head) {
+    Timer *next = timer->next;
+    place(timer);
+    timer = next;
+  }
+}
+
+/**
+ * Timers added from the fire handler with an expiry at or before tick are
+ * fired again in the same call, after the other timers of their tick.
+ *
+ * \param tick tick to advance to
+ * \param fire called for each expired timer
+ * \param ctx passed to fire
+ */
+void CanTimerWheel::advance(uint64_t tick, fireHandler fire, void *ctx) {
+  while (current < tick) {
+    current++;
+
+    // refill lower levels when they wrap
+    for (int l = 1; l < CAN_WHEEL_LEVELS; ++l) {
+      if ((current & ((1ULL << (CAN_WHEEL_BITS * l)) - 1)) != 0) {
+        break;
+      }
+      cascade(l);
+    }
+
+    Timer *head = &slots[0][current & SLOT_MASK];
+    while (head->next != head) {
+      Timer *timer = head->next;
+      remove(timer);
+      if (timer->expires > current) {
+        // parked past the top level
+        place(timer);
+        continue;
+      }
+      fire(timer, ctx);
+    }
+  }
+}
+
+/**
+ * Lets the owner of the wheel sleep until a timer is due instead of waking
+ * every tick. Each level is searched from the slot after the current one,
+ * the first slot holding timers has the earliest ones of its level.
+ */
+uint64_t CanTimerWheel::nextExpiry() const {
+  uint64_t next = UINT64_MAX;
+  for (int l = 0; l < CAN_WHEEL_LEVELS; ++l) {
+    uint64_t slot = current >> (CAN_WHEEL_BITS * l);
+    for (int k = 1; k <= CAN_WHEEL_SLOTS; ++k) {
+      const Timer *head = &slots[l][(slot + k) & SLOT_MASK];
+      if (head->next == head) {
+        continue;
+      }
+      for (const Timer *t = head->next; t != head; t = t->next) {
+        next = t->expires < next ? t->expires : next;
+      }
+      break;
+    }
+  }
+  return next;
+}
@@ -0,0 +1,60 @@
+/**
+ * \file CanTimerWheel.h
+ * \brief Hierarchical timer wheel counting in ticks.
+ *
+ * Four levels of 64 slots cover 2^24 ticks. Adding and removing a timer is
+ * O(1), and advancing one tick only touches the timers that expire in it plus,
+ * once every 64 ticks, the timers moving down from a higher level.
+ *
+ * Timers are intrusive, the wheel never allocates. A timer must stay at the
+ * same address while it is in the wheel.
+ */
+#ifndef _CAN_TIMER_WHEEL_H_
+#define _CAN_TIMER_WHEEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Number of levels in the wheel
+#define CAN_WHEEL_LEVELS 4
+/// log2 of the number of slots in each level
+#define CAN_WHEEL_BITS 6
+/// Number of slots in each level
+#define CAN_WHEEL_SLOTS (1 << CAN_WHEEL_BITS)
+
+class CanTimerWheel {
+public:
+  /// A timer, embed it in the structure it belongs to
+  struct Timer {
+    Timer *next;      ///< next timer in the slot
+    Timer *prev;      ///< previous timer in the slot
+    uint64_t expires; ///< tick the timer fires on
+  };
+
+  /// Called for every expired timer, the timer is already out of the wheel
+  typedef void (*fireHandler)(Timer *timer, void *ctx);
+
+  CanTimerWheel();
+
+  /// \brief Current tick of the wheel.
+  uint64_t now() const { return current; }
+  /// \brief Add a timer that fires on tick expires.
+  void add(Timer *timer, uint64_t expires);
+  /// \brief Remove a timer that is in the wheel.
+  void remove(Timer *timer);
+  /// \brief Check if a timer is in the wheel.
+  static bool pending(const Timer *timer) { return timer->next != nullptr; }
+  /// \brief Advance to tick, firing every timer that expires on the way.
+  void advance(uint64_t tick, fireHandler fire, void *ctx);
+  /// \brief Earliest tick a timer expires on, UINT64_MAX if there is none.
+  uint64_t nextExpiry() const;
+
+private:
+  Timer slots[CAN_WHEEL_LEVELS][CAN_WHEEL_SLOTS]; ///< list heads
+  uint64_t current;
+
+  void place(Timer *timer);
+  void cascade(int level);
+};
+
+#endif //_CAN_TIMER_WHEEL_H_
@@ -0,0 +1,188 @@
+/**
+ * CanTxQueue.cpp
+ * \brief implements the priority ordered transmit queue
+ */
+#include "CanTxQueue.h"
+#include <stddef.h>
+
+CanTxQueue::CanTxQueue()
+    : numFree(CAN_TX_ENTRIES), numReady(0), numHeld(0), used(0),
+      depth(CAN_TX_QUEUE_MAX), seq(0) {
+  for (uint16_t i = 0; i < CAN_TX_ENTRIES; ++i) {
+    freeList[i] = CAN_TX_ENTRIES - 1 - i;
+  }
+}
+
+/**
+ * Lowering the depth below the current size does not drop messages, it only
+ * refuses new ones until the queue drains. Held messages are not counted.
+ *
+ * \param depth maximum number of released messages, 0 for the maximum
+ */
+void CanTxQueue::setDepth(uint16_t depth) {
+  if (depth == 0 || depth > CAN_TX_QUEUE_MAX) {
+    depth = CAN_TX_QUEUE_MAX;
+  }
+  this->depth = depth;
+}
+
+/**
+ * \param msg message to copy into the queue
+ * \param notBefore can_time_ns() time before which the message is held, 0 to
+ * make it ready right away
+ *
+ * \returns false if the queue is full, or with notBefore if CAN_TX_HELD_MAX
+ * messages are held already.
+ */
+bool CanTxQueue::push(const CanMessage *msg, uint64_t notBefore) {
+  if (numFree == 0 || (notBefore == 0 ? used - numHeld >= depth
+                                      : numHeld >= CAN_TX_HELD_MAX)) {
+    return false;
+  }
+
+  uint16_t entry = freeList[--numFree];
+  entries[entry].notBefore = notBefore;
+  entries[entry].seq = seq++;
+  entries[entry].msg = *msg;
+  used++;
+
+  if (notBefore == 0) {
+    heapPush(ready, &numReady, entry, true);
+  } else {
+    heapPush(held, &numHeld, entry, false);
+  }
+  return true;
+}
+
+/**
+ * \param now current can_time_ns()
+ */
+void CanTxQueue::release(uint64_t now) {
+  while (numHeld > 0 && entries[held[0]].notBefore <= now) {
+    uint16_t entry = held[0];
+    heapPop(held, &numHeld, false);
+    heapPush(ready, &numReady, entry, true);
+  }
+}
+
+CanMessage *CanTxQueue::peek() {
+  return numReady > 0 ? &entries[ready[0]].msg : NULL;
+}
+
+void CanTxQueue::pop() {
+  if (numReady == 0) {
+    return;
+  }
+  freeList[numFree++] = ready[0];
+  heapPop(ready, &numReady, true);
+  used--;
+}
+
+/**
+ * take(), done() and untake() let several messages be written in one batch
+ * while keeping the ones the kernel did not accept in their original order.
+ */
+int CanTxQueue::take() {
+  if (numReady == 0) {
+    return -1;
+  }
+  int entry = ready[0];
+  heapPop(ready, &numReady, true);
+  return entry;
+}
+
+void CanTxQueue::done(int entry) {
+  freeList[numFree++] = entry;
+  used--;
+}
+
+void CanTxQueue::untake(int entry) {
+  heapPush(ready, &numReady, entry, true);
+}
+
+uint16_t CanTxQueue::clear() {
+  uint16_t dropped = used;
+  while (numReady > 0) {
+    freeList[numFree++] = ready[--numReady];
+  }
+  while (numHeld > 0) {
+    freeList[numFree++] = held[--numHeld];
+  }
+  used = 0;
+  return dropped;
+}
+
+uint64_t CanTxQueue::nextRelease() const {
+  return numHeld > 0 ? entries[held[0]].notBefore : UINT64_MAX;
+}
+
+/**
+ * Rank of a message in bus arbitration, lower wins. The 11 base bits of an
+ * extended id arbitrate first, and a standard frame beats an extended frame
+ * with the same base because its next bit is dominant.
+ */
+static inline uint32_t arbitration(const CanMessage *msg) {
+  if (!msg->ext) {
+    return msg->id << 19;
+  }
+  return ((msg->id >> 18) << 19) | (1U << 18) | (msg->id & 0x3FFFF);
+}
+
+bool CanTxQueue::readyBefore(uint16_t a, uint16_t b) const {
+  uint32_t rankA = arbitration(&entries[a].msg);
+  uint32_t rankB = arbitration(&entries[b].msg);
+  if (rankA != rankB) {
+    return rankA < rankB;
+  }
+  return entries[a].seq < entries[b].seq;
+}
+
+bool CanTxQueue::heldBefore(uint16_t a, uint16_t b) const {
+  if (entries[a].notBefore != entries[b].notBefore) {
+    return entries[a].notBefore < entries[b].notBefore;
+  }
+  return entries[a].seq < entries[b].seq;
+}
+
+void CanTxQueue::heapPush(uint16_t *heap, uint16_t *len, uint16_t entry,
+                          bool isReady) {
+  uint16_t i = (*len)++;
+  heap[i] = entry;
+  while (i > 0) {
+    uint16_t parent = (i - 1) / 2;
+    bool before = isReady ? readyBefore(heap[i], heap[parent])
+                          : heldBefore(heap[i], heap[parent]);
+    if (!before) {
+      break;
+    }
+    uint16_t tmp = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = tmp;
+    i = parent;
+  }
+}
+
+void CanTxQueue::heapPop(uint16_t *heap, uint16_t *len, bool isReady) {
+  heap[0] = heap[--(*len)];
+  uint16_t i = 0;
+  for (;;) {
+    uint16_t left = 2 * i + 1;
+    uint16_t right = left + 1;
+    uint16_t best = i;
+    if (left < *len && (isReady ? readyBefore(heap[left], heap[best])
+                                : heldBefore(heap[left], heap[best]))) {
+      best = left;
+    }
+    if (right < *len && (isReady ? readyBefore(heap[right], heap[best])
+                                 : heldBefore(heap[right], heap[best]))) {
+      best = right;
+    }
+    if (best == i) {
+      break;
+    }
+    uint16_t tmp = heap[i];
+    heap[i] = heap[best];
+    heap[best] = tmp;
+    i = best;
+  }
+}
@@ -0,0 +1,99 @@
+/**
+ * \file CanTxQueue.h
+ * \brief Priority ordered queue of messages waiting to be transmitted.
+ *
+ * Pending messages are handed to the kernel in the order the bus arbitrates
+ * in (lowest id first, standard before extended ids with the same base), so a
+ * backlog of low priority messages can not hold up a high priority one.
+ * Messages with the same id keep the order they were queued in.
+ *
+ * A message can also be held back until a given time, which is how
+ * CanNode rate limits are applied. Held messages do not take part in the
+ * priority order until they are released, and do not count against the
+ * depth: they have room of their own (CAN_TX_HELD_MAX), so a rate limited
+ * node can not refuse messages of other nodes.
+ */
+#ifndef _CAN_TX_QUEUE_H_
+#define _CAN_TX_QUEUE_H_
+
+#include "CanTypes.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef CAN_TX_QUEUE_MAX
+/// Maximum number of queued messages. Can be overwriten by redefinition
+#define CAN_TX_QUEUE_MAX 1024
+#endif
+
+#ifndef CAN_TX_HELD_MAX
+/// Maximum number of messages held back by rate limits, on top of the
+/// queued ones. Can be overwriten by redefinition
+#define CAN_TX_HELD_MAX 1024
+#endif
+
+#ifndef CAN_TX_HELD_NODE
+/// Maximum number of messages one node may have held back by its rate limit
+/// before sendData reports \ref BUS_BUSY. Can be overwriten by redefinition
+#define CAN_TX_HELD_NODE 64
+#endif
+
+/// Number of entries of a queue, queued and held
+#define CAN_TX_ENTRIES (CAN_TX_QUEUE_MAX + CAN_TX_HELD_MAX)
+
+class CanTxQueue {
+public:
+  CanTxQueue();
+
+  /// \brief Limit the number of released messages (at most
+  /// CAN_TX_QUEUE_MAX).
+  void setDepth(uint16_t depth);
+  /// \brief Queue a message, held back until notBefore (can_time_ns()).
+  bool push(const CanMessage *msg, uint64_t notBefore);
+  /// \brief Move held messages whose time has come into the priority order.
+  void release(uint64_t now);
+  /// \brief Get the highest priority released message, or NULL.
+  CanMessage *peek();
+  /// \brief Remove the message returned by peek().
+  void pop();
+  /// \brief Take the highest priority released entry out of the order, or -1.
+  int take();
+  /// \brief Message of an entry returned by take().
+  CanMessage *message(int entry) { return &entries[entry].msg; }
+  /// \brief Free an entry returned by take() once it has been sent.
+  void done(int entry);
+  /// \brief Put an entry returned by take() back in its place in the order.
+  void untake(int entry);
+  /// \brief Drop every queued message, returns how many were dropped.
+  uint16_t clear();
+  /// \brief Number of queued messages, held or not.
+  uint16_t size() const { return used; }
+  /// \brief Number of messages held back.
+  uint16_t heldSize() const { return numHeld; }
+  /// \brief Time the next held message is released, or UINT64_MAX.
+  uint64_t nextRelease() const;
+
+private:
+  typedef struct {
+    uint64_t notBefore; ///< release time
+    uint64_t seq;       ///< queue order, keeps equal ids in order
+    CanMessage msg;
+  } Entry;
+
+  Entry entries[CAN_TX_ENTRIES];
+  uint16_t freeList[CAN_TX_ENTRIES]; ///< unused entries
+  uint16_t ready[CAN_TX_ENTRIES];    ///< heap ordered by id then seq
+  uint16_t held[CAN_TX_HELD_MAX];    ///< heap ordered by notBefore then seq
+  uint16_t numFree;
+  uint16_t numReady;
+  uint16_t numHeld;
+  uint16_t used;
+  uint16_t depth;
+  uint64_t seq;
+
+  bool readyBefore(uint16_t a, uint16_t b) const;
+  bool heldBefore(uint16_t a, uint16_t b) const;
+  void heapPush(uint16_t *heap, uint16_t *len, uint16_t entry, bool isReady);
+  void heapPop(uint16_t *heap, uint16_t *len, bool isReady);
+};
+
+#endif //_CAN_TX_QUEUE_H_
@@ -0,0 +1,157 @@
+/**
+ * CanTxStage.cpp
+ * \brief implements the per-thread transmit staging rings
+ */
+#include "CanTxStage.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+std::atomic<CanTxStage::Ring *> CanTxStage::rings(nullptr);
+thread_local CanTxStage::Slot CanTxStage::local = {nullptr};
+std::atomic<int> CanTxStage::eventFd(-1);
+std::atomic<bool> CanTxStage::signaled(false);
+
+CanTxStage::Slot::~Slot() {
+  if (ring != nullptr) {
+    ring->owned.store(false, std::memory_order_release);
+  }
+}
+
+/**
+ * Get the ring of the calling thread. A ring given up by an exited thread is
+ * reused, otherwise a new one is added. Rings are never freed.
+ */
+CanTxStage::Ring *CanTxStage::ring() {
+  if (local.ring != nullptr) {
+    return local.ring;
+  }
+
+  for (Ring *r = rings.load(std::memory_order_acquire); r != nullptr;
+       r = r->next) {
+    bool owned = false;
+    if (!r->owned.load(std::memory_order_relaxed) &&
+        r->owned.compare_exchange_strong(owned, true,
+                                         std::memory_order_acquire)) {
+      local.ring = r;
+      return r;
+    }
+  }
+
+  Ring *r = (Ring *)calloc(1, sizeof(Ring));
+  if (r == nullptr) {
+    return nullptr;
+  }
+  r->owned.store(true, std::memory_order_relaxed);
+  // push onto the list of all rings
+  r->next = rings.load(std::memory_order_relaxed);
+  while (!rings.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                      std::memory_order_relaxed))
+    ;
+  local.ring = r;
+  return r;
+}
+
+/**
+ * Created on first use by either side, so it exists before anything is
+ * staged.
+ */
+int CanTxStage::fd() {
+  int efd = eventFd.load(std::memory_order_acquire);
+  if (efd >= 0) {
+    return efd;
+  }
+
+  efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd < 0) {
+    perror("can tx stage eventfd");
+    return -1;
+  }
+  int expected = -1;
+  if (!eventFd.compare_exchange_strong(expected, efd,
+                                       std::memory_order_acq_rel)) {
+    close(efd); // another thread was first
+    return expected;
+  }
+  return efd;
+}
+
+/**
+ * Write the eventfd once until the loop reads it, so a burst of messages
+ * costs one system call.
+ */
+void CanTxStage::wake() {
+  if (signaled.exchange(true, std::memory_order_acq_rel)) {
+    return;
+  }
+  int efd = fd();
+  if (efd >= 0) {
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0) {
+      signaled.store(false, std::memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * \param msg message to copy into the ring
+ * \param notBefore can_time_ns() time before which the message is held, 0 to
+ * send it right away
+ *
+ * \returns false if the ring of the calling thread is full (or could not be
+ * allocated).
+ */
+bool CanTxStage::push(const CanMessage *msg, uint64_t notBefore) {
+  Ring *r = ring();
+  if (r == nullptr) {
+    return false;
+  }
+
+  uint32_t tail = r->tail.load(std::memory_order_relaxed);
+  if (tail - r->head.load(std::memory_order_acquire) == CAN_TX_STAGE) {
+    wake();
+    return false;
+  }
+
+  Entry *entry = &r->entries[tail % CAN_TX_STAGE];
+  entry->notBefore = notBefore;
+  entry->msg = *msg;
+  r->tail.store(tail + 1, std::memory_order_release);
+  wake();
+  return true;
+}
+
+/**
+ * Only called from the message loop thread. Messages of one thread keep their
+ * order, those that do not fit in the queue stay staged for the next call.
+ *
+ * \returns the number of messages moved.
+ */
+uint32_t CanTxStage::drain(CanTxQueue *queue) {
+  // clear the wakeup first, a message staged from here on wakes the loop again
+  if (signaled.exchange(false, std::memory_order_acq_rel)) {
+    uint64_t count;
+    while (read(eventFd.load(std::memory_order_relaxed), &count,
+                sizeof(count)) < 0 &&
+           errno == EINTR)
+      ;
+  }
+
+  uint32_t moved = 0;
+  for (Ring *r = rings.load(std::memory_order_acquire); r != nullptr;
+       r = r->next) {
+    uint32_t head = r->head.load(std::memory_order_relaxed);
+    uint32_t tail = r->tail.load(std::memory_order_acquire);
+    for (; head != tail; ++head, ++moved) {
+      Entry *entry = &r->entries[head % CAN_TX_STAGE];
+      if (!queue->push(&entry->msg, entry->notBefore)) {
+        r->head.store(head, std::memory_order_release);
+        return moved;
+      }
+    }
+    r->head.store(head, std::memory_order_release);
+  }
+  return moved;
+}
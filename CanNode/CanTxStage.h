@@ -0,0 +1,70 @@
+/**
+ * \file CanTxStage.h
+ * \brief Hands messages sent from other threads to the message loop thread.
+ *
+ * The transmit queue and the socket belong to the thread running the message
+ * loop. Every other thread that sends gets its own single producer, single
+ * consumer ring, so sending takes no lock and threads never contend with each
+ * other. The loop thread moves staged messages into the transmit queue each
+ * time it flushes, and an eventfd wakes CanNode::waitForMessages() when
+ * something was staged.
+ *
+ * The ring of a thread that exits is taken over by the next thread that
+ * sends, after the loop has sent what was left in it.
+ */
+#ifndef _CAN_TX_STAGE_H_
+#define _CAN_TX_STAGE_H_
+
+#include "CanTxQueue.h"
+#include "CanTypes.h"
+#include <atomic>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef CAN_TX_STAGE
+/// Number of messages a thread can stage, a power of two. Can be overwriten
+/// by redefinition
+#define CAN_TX_STAGE 256
+#endif
+
+class CanTxStage {
+public:
+  /// \brief Stage a message from the calling thread, false if its ring is full.
+  static bool push(const CanMessage *msg, uint64_t notBefore);
+  /// \brief Move staged messages into the queue while it has room.
+  static uint32_t drain(CanTxQueue *queue);
+  /// \brief File descriptor that is readable when a message was staged, or -1.
+  static int fd();
+  /// \brief Make fd() readable so the loop thread flushes.
+  static void wake();
+
+private:
+  typedef struct {
+    uint64_t notBefore;
+    CanMessage msg;
+  } Entry;
+
+  /// Ring of one thread
+  struct Ring {
+    alignas(64) std::atomic<uint32_t> head; ///< next entry the loop takes
+    alignas(64) std::atomic<uint32_t> tail; ///< next entry the thread fills
+    std::atomic<bool> owned;                ///< a running thread uses it
+    Entry entries[CAN_TX_STAGE];
+    Ring *next;
+  };
+
+  /// Ring of a thread, given back when the thread exits
+  struct Slot {
+    Ring *ring;
+    ~Slot();
+  };
+
+  static std::atomic<Ring *> rings;
+  static thread_local Slot local;
+  static std::atomic<int> eventFd;
+  static std::atomic<bool> signaled; ///< eventFd was written and not read
+
+  static Ring *ring();
+};
+
+#endif //_CAN_TX_STAGE_H_
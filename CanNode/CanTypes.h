@@ -18,15 +18,23 @@
  *@{
  */
 
-#ifndef MAX_NODES
-/// Maximum number of nodes stored internally. Can be overwriten by redefinition
-#define MAX_NODES 50
+#ifndef CAN_RX_BATCH
+/// Maximum number of frames read from the kernel at once. Can be overwriten by
+/// redefinition
+#define CAN_RX_BATCH 64
 #endif
 
-#ifndef NUM_FILTERS
-/// Number of filters each node can have. Can be overwriten by redefinition
-#define NUM_FILTERS 10
-#endif
+/// Maximum data length of a CanMessage (a CAN FD frame)
+#define CAN_MAX_DATA 64
+
+/// Set on an id to mark it as a 29-bit extended id (the bit of CAN_EFF_FLAG)
+#define CAN_ID_EXT 0x80000000U
+/// Largest 11-bit standard id
+#define CAN_STD_ID_MAX 0x7FFU
+/// Largest 29-bit extended id
+#define CAN_EXT_ID_MAX 0x1FFFFFFFU
+/// fmi of a message that matched no mask filter
+#define CAN_NO_FMI 0xFF
 
 /// Maximum length of a name string for the CanNode_getName()
 #define MAX_NAME_LEN 30
@@ -121,13 +129,106 @@ typedef enum {
  *
  */
 typedef struct {                                                                                    
-  uint16_t id;     ///< ID of the sender                                                            
+  uint32_t id;     ///< ID of the sender (11 or 29 bits)
+  bool ext;        ///< id is a 29-bit extended id
   uint8_t len;     ///< Length of the message                                                       
   uint8_t fmi;     ///< Filter mask index (what filter triggered message)                           
   bool rtr;        ///< Asking for data (true) or sending data (false)                              
-  uint8_t data[8]; ///< Data                                                                        
+  uint8_t data[CAN_MAX_DATA]; ///< Data, more than 8 bytes are sent as a
+                              ///< CAN FD frame
 } CanMessage;
 
+/**
+ * \brief Id of a message as one number, with \ref CAN_ID_EXT set if it is
+ * extended. This is the form ids are passed to CanNode in.
+ */
+static inline uint32_t can_msg_id(const CanMessage *msg) {
+  return msg->ext ? (msg->id | CAN_ID_EXT) : msg->id;
+}
+
+/**
+ * \brief Set the id of a message from an id that may have \ref CAN_ID_EXT
+ * set.
+ */
+static inline void can_set_msg_id(CanMessage *msg, uint32_t id) {
+  msg->ext = (id & CAN_ID_EXT) != 0;
+  msg->id = id & ~CAN_ID_EXT;
+}
+
+/**
+ * \brief Spread ids over a hash table, for tables of extended ids which are
+ * too sparse to index directly.
+ */
+static inline uint32_t can_id_hash(uint32_t id) {
+  id ^= id >> 16;
+  id *= 0x7FEB352DU;
+  id ^= id >> 15;
+  return id;
+}
+
+/**
+ * \brief Check an id that may have \ref CAN_ID_EXT set is in range.
+ */
+static inline bool can_id_valid(uint32_t id) {
+  if (id & CAN_ID_EXT) {
+    return (id & ~CAN_ID_EXT) <= CAN_EXT_ID_MAX;
+  }
+  return id <= CAN_STD_ID_MAX;
+}
+
+/**
+ * \struct CanBusConfig
+ * \brief Settings used by can_init() when the first CanNode is created.
+ *
+ * Pass to CanNode::setBusConfig() before creating any CanNode. Zero fields
+ * keep the kernel or library defaults.
+ */
+typedef struct {
+  const char *interface; ///< SocketCAN interface name (default "can0")
+  int rcvBuf;            ///< SO_RCVBUF size in bytes
+  int sndBuf;            ///< SO_SNDBUF size in bytes
+  uint16_t rxBatch;      ///< Frames read per recvmmsg(), or receive slots
+                         ///< with ioUring (max CAN_RX_BATCH)
+  uint32_t dropWarn;     ///< Warn if more frames are dropped in one second
+  uint32_t busOffProbe;  ///< mili-seconds between transmit attempts while
+                         ///< the bus is off (default 100)
+  uint16_t txQueueDepth; ///< Messages queued before sendData reports
+                         ///< \ref BUS_BUSY (max CAN_TX_QUEUE_MAX), not
+                         ///< counting ones held by a rate limit
+  bool kernelFilter;     ///< Have the kernel drop ids no filter asked for
+  bool ioUring;          ///< Receive and transmit the bus socket through
+                         ///< io_uring (see CanUring, one bus per process),
+                         ///< recvmmsg() if it is not available
+  const char *shmRing;   ///< Share received frames with other processes
+                         ///< through a CanShm ring of this name, or NULL
+  bool shmConsumer;      ///< Receive from the shmRing of the process that
+                         ///< owns the bus instead of the socket
+} CanBusConfig;
+
+/**
+ * \enum CanErrorState
+ * \brief Fault confinement state of the CAN controller.
+ */
+typedef enum {
+  CAN_ERROR_ACTIVE,  ///< Normal operation
+  CAN_ERROR_WARNING, ///< An error counter passed 96
+  CAN_ERROR_PASSIVE, ///< An error counter passed 127
+  CAN_ERROR_BUS_OFF  ///< The transmit error counter passed 255
+} CanErrorState;
+
+/**
+ * \struct CanBusStatus
+ * \brief State of the bus decoded from CAN error frames.
+ */
+typedef struct {
+  CanState state;           ///< \ref BUS_OK, \ref BUS_BUSY or \ref BUS_OFF
+  CanErrorState errorState; ///< Controller fault confinement state
+  uint8_t txErrors;         ///< Transmit error counter
+  uint8_t rxErrors;         ///< Receive error counter
+  uint32_t errorClass;      ///< CAN_ERR_* bits of the last error frame
+  uint32_t errorFrames;     ///< Error frames seen since can_init()
+} CanBusStatus;
+
 /**
  * \enum CanNodeDataType
  * \brief CanNode Data Type Enum.
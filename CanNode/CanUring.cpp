@@ -0,0 +1,417 @@
+/**
+ * CanUring.cpp
+ * \brief implements the io_uring receive and transmit paths
+ */
+#include "CanUring.h"
+#include "CanMessageView.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef CAN_URING_ENTRIES
+/// Submission queue entries, the most frames one send() takes. Can be
+/// overwriten by redefinition
+#define CAN_URING_ENTRIES 64
+#endif
+
+/// user_data of the multishot receive
+#define RECV_DATA 0
+/// user_data of the first send of a batch, the others follow it
+#define SEND_DATA (1ULL << 32)
+/// buffer group the receive slots are registered as
+#define SLOT_GROUP 0
+
+int CanUring::ringFd = -1;
+int CanUring::sock = -1;
+uint32_t *CanUring::sqHead;
+uint32_t *CanUring::sqTail;
+uint32_t CanUring::sqMask;
+uint32_t *CanUring::sqArray;
+struct io_uring_sqe *CanUring::sqes;
+uint32_t *CanUring::cqHead;
+uint32_t *CanUring::cqTail;
+uint32_t CanUring::cqMask;
+struct io_uring_cqe *CanUring::cqes;
+struct io_uring_buf_ring *CanUring::bufRing;
+uint32_t CanUring::bufMask;
+uint16_t CanUring::bufTail;
+uint8_t *CanUring::slots;
+uint32_t CanUring::slotSize;
+uint32_t CanUring::slotCount;
+uint32_t CanUring::taken;
+uint32_t CanUring::takenFirst;
+bool CanUring::armed;
+struct io_uring_cqe *CanUring::stash;
+uint32_t CanUring::stashHead;
+uint32_t CanUring::stashCount;
+
+/**
+ * Create the ring and map its queues.
+ */
+bool CanUring::setup(uint32_t cqEntries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = cqEntries;
+  int fd = (int)syscall(__NR_io_uring_setup, CAN_URING_ENTRIES, &p);
+  if (fd < 0) {
+    perror("can io_uring_setup");
+    return false;
+  }
+
+  size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && cqSize > sqSize) {
+    sqSize = cqSize;
+  }
+  uint8_t *sq = (uint8_t *)mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd,
+                                IORING_OFF_SQ_RING);
+  uint8_t *cq = single ? sq
+                       : (uint8_t *)mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, fd,
+                                         IORING_OFF_CQ_RING);
+  void *entries =
+      mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+           IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || entries == MAP_FAILED) {
+    // the ring is torn down with its file, the maps do not keep it
+    perror("can io_uring mmap");
+    close(fd);
+    return false;
+  }
+
+  sqHead = (uint32_t *)(sq + p.sq_off.head);
+  sqTail = (uint32_t *)(sq + p.sq_off.tail);
+  sqMask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+  sqArray = (uint32_t *)(sq + p.sq_off.array);
+  sqes = (struct io_uring_sqe *)entries;
+  cqHead = (uint32_t *)(cq + p.cq_off.head);
+  cqTail = (uint32_t *)(cq + p.cq_off.tail);
+  cqMask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ringFd = fd;
+  return true;
+}
+
+/**
+ * Registers the slots as provided buffers and arms a multishot receive on
+ * the socket. The slots belong to the kernel from then on, receive() hands
+ * them out as frames arrive.
+ *
+ * \param socket raw CAN socket, non-blocking
+ * \param slots first slot of the receive batch
+ * \param slotSize bytes from one slot to the next, at least CANFD_MTU
+ * \param count number of slots
+ *
+ * \returns false if the kernel has no io_uring or no multishot receive.
+ */
+bool CanUring::init(int socket, void *slots, uint32_t slotSize,
+                    uint32_t count) {
+  if (ringFd >= 0) {
+    return true;
+  }
+  // one completion per slot, and the one that ends the receive
+  stash = (struct io_uring_cqe *)calloc(count + 2, sizeof(*stash));
+  if (stash == NULL) {
+    perror("can io_uring stash");
+    return false;
+  }
+  if (!setup(2 * (CAN_URING_ENTRIES + count))) {
+    free(stash);
+    stash = NULL;
+    return false;
+  }
+
+  uint32_t entries = 1;
+  while (entries < count) {
+    entries <<= 1;
+  }
+  size_t size = entries * sizeof(struct io_uring_buf);
+  void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)ring;
+  reg.ring_entries = entries;
+  reg.bgid = SLOT_GROUP;
+  if (ring == MAP_FAILED ||
+      syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0) {
+    perror("can io_uring buffer ring");
+    if (ring != MAP_FAILED) {
+      munmap(ring, size);
+    }
+    close(ringFd);
+    ringFd = -1;
+    free(stash);
+    stash = NULL;
+    return false;
+  }
+
+  sock = socket;
+  bufRing = (struct io_uring_buf_ring *)ring;
+  bufMask = entries - 1;
+  bufTail = 0;
+  CanUring::slots = (uint8_t *)slots;
+  CanUring::slotSize = slotSize;
+  slotCount = count;
+  taken = 0;
+  stashHead = 0;
+  stashCount = 0;
+
+  provide(0, count);
+  arm();
+  if (!armed) {
+    close(ringFd);
+    ringFd = -1;
+    munmap(ring, size);
+    free(stash);
+    stash = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool CanUring::active() {
+  return ringFd >= 0;
+}
+
+int CanUring::fd() {
+  return ringFd;
+}
+
+/**
+ * \returns true if receive() has something to do: completions it has not
+ * read yet, which poll() on fd() misses once send() took them off the ring,
+ * or a receive that stopped and has to be armed again.
+ */
+bool CanUring::pending() {
+  return !armed || stashCount != 0 ||
+         *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Give slots back to the kernel, in slot order from first and wrapping
+ * around.
+ */
+void CanUring::provide(uint32_t first, uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t slot = (first + i) % slotCount;
+    // not bufRing->bufs, in C++ the kernel header puts it one entry late
+    struct io_uring_buf *buf =
+        (struct io_uring_buf *)bufRing + ((bufTail + i) & bufMask);
+    buf->addr = (uint64_t)(slots + (size_t)slot * slotSize);
+    buf->len = slotSize;
+    buf->bid = slot;
+  }
+  bufTail += count;
+  __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Start a multishot receive, it runs until it fails or the kernel runs out
+ * of slots.
+ */
+void CanUring::arm() {
+  struct io_uring_sqe *sqe = nextSqe(0);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sock;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = SLOT_GROUP;
+  sqe->user_data = RECV_DATA;
+  armed = submit(1, 0);
+}
+
+/**
+ * \returns the i-th free submission entry, cleared.
+ */
+struct io_uring_sqe *CanUring::nextSqe(uint32_t i) {
+  uint32_t index = (*sqTail + i) & sqMask;
+  sqArray[index] = index;
+  memset(&sqes[index], 0, sizeof(sqes[index]));
+  return &sqes[index];
+}
+
+/**
+ * Publish count entries filled with nextSqe() and hand everything not yet
+ * submitted to the kernel.
+ *
+ * \param wait completions to wait for, 0 to return right away
+ */
+bool CanUring::submit(uint32_t count, uint32_t wait) {
+  __atomic_store_n(sqTail, *sqTail + count, __ATOMIC_RELEASE);
+  for (;;) {
+    uint32_t todo = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, ringFd, todo, wait,
+                wait != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0) >= 0) {
+      return true;
+    }
+    if (errno != EINTR) {
+      perror("can io_uring_enter");
+      return false;
+    }
+  }
+}
+
+/**
+ * Look at the oldest completion without taking it.
+ *
+ * \param stashed include the receive completions send() set aside, which
+ * are older than the ones on the ring
+ */
+bool CanUring::peek(struct io_uring_cqe *cqe, bool stashed) {
+  if (stashed && stashCount != 0) {
+    *cqe = stash[stashHead];
+    return true;
+  }
+  uint32_t head = *cqHead;
+  if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  *cqe = cqes[head & cqMask];
+  return true;
+}
+
+/**
+ * Take the completion peek() returned.
+ */
+void CanUring::pop(bool stashed) {
+  if (stashed && stashCount != 0) {
+    stashHead = (stashHead + 1) % (slotCount + 2);
+    stashCount--;
+    return;
+  }
+  __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Gives the slots of the previous run back to the kernel, then takes the
+ * frames that arrived since, up to where the slots wrap around. The rest
+ * stays queued for the next call. The slots taken are only written again
+ * after the next call.
+ *
+ * \param first[out] slot of the first frame
+ *
+ * \returns the number of frames, in slots first, first + 1, ...
+ */
+uint32_t CanUring::receive(uint32_t *first) {
+  if (taken != 0) {
+    provide(takenFirst, taken);
+    taken = 0;
+  }
+  if (!armed) {
+    arm();
+  }
+
+  uint32_t count = 0;
+  struct io_uring_cqe cqe;
+  *first = 0;
+  while (count < slotCount && peek(&cqe, true)) {
+    if (cqe.user_data != RECV_DATA) {
+      pop(true);
+      continue;
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      // out of slots or failed, armed again next call
+      armed = false;
+    }
+    if (cqe.res <= 0 || !(cqe.flags & IORING_CQE_F_BUFFER)) {
+      if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+        errno = -cqe.res;
+        perror("can io_uring receive");
+      }
+      pop(true);
+      continue;
+    }
+    uint32_t slot = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (count == 0) {
+      *first = slot;
+    } else if (slot != *first + count) {
+      break;
+    }
+    // older kernels only tell CAN FD frames apart by their size
+    struct canfd_frame *frame = (struct canfd_frame *)(slots + slot * slotSize);
+    frame->flags = cqe.res == CANFD_MTU ? frame->flags | CANFD_FDF : 0;
+    pop(true);
+    count++;
+  }
+
+  if (count == 0 && !armed) {
+    // every slot is back with the kernel
+    arm();
+  }
+  takenFirst = *first;
+  taken = count;
+  return count;
+}
+
+/**
+ * Submits the frames as a chain of linked non-blocking sends and waits for
+ * them. Receive completions that arrive meanwhile are kept for receive().
+ *
+ * \param frames frames to send, in order
+ * \param count number of frames, at most \ref CAN_URING_ENTRIES are sent
+ *
+ * \returns the number of frames sent, or -1 with errno set to why the first
+ * one failed.
+ */
+int CanUring::send(const struct iovec *frames, int count) {
+  if (count > CAN_URING_ENTRIES) {
+    count = CAN_URING_ENTRIES;
+  }
+  for (int i = 0; i < count; ++i) {
+    struct io_uring_sqe *sqe = nextSqe(i);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)frames[i].iov_base;
+    sqe->len = frames[i].iov_len;
+    sqe->msg_flags = MSG_DONTWAIT;
+    // a failed send cancels the rest of the chain
+    sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+    sqe->user_data = SEND_DATA + i;
+  }
+  if (!submit(count, count)) {
+    return -1;
+  }
+
+  int sent = 0;
+  int err = 0;
+  struct io_uring_cqe cqe;
+  for (int done = 0; done < count;) {
+    if (!peek(&cqe, false)) {
+      if (!submit(0, 1)) {
+        break;
+      }
+      continue;
+    }
+    pop(false);
+    if (cqe.user_data < SEND_DATA) {
+      if (stashCount < slotCount + 2) {
+        stash[(stashHead + stashCount) % (slotCount + 2)] = cqe;
+        stashCount++;
+      }
+      continue;
+    }
+    done++;
+    if (cqe.res >= 0) {
+      sent++;
+    } else if (cqe.res != -ECANCELED) {
+      err = -cqe.res;
+    }
+  }
+
+  if (sent == 0) {
+    errno = err;
+    return -1;
+  }
+  return sent;
+}
@@ -0,0 +1,97 @@
+/**
+ * \file CanUring.h
+ * \brief io_uring backend for the raw socket, used when
+ * \ref CanBusConfig::ioUring is set.
+ *
+ * A multishot receive stays armed on the socket, and the kernel puts each
+ * frame straight into a slot of the receive batch (registered as a ring of
+ * provided buffers) and posts a completion for it. Reading a batch only walks
+ * the completion queue in shared memory, no system call is needed while
+ * frames are waiting. A transmit batch is one chain of linked sends submitted
+ * with a single io_uring_enter(): a send that fails cancels the ones after
+ * it, so like sendmmsg() only a prefix of the batch is ever sent.
+ *
+ * Receive and transmit completions arrive on the same ring and are told apart
+ * by their user_data, so one completion loop serves the whole bus. Buffers
+ * are given to the kernel in slot order and given back in that order once
+ * their batch has been used, so frames always land in consecutive slots and a
+ * batch is one run of the receive array, split where it wraps around.
+ *
+ * The system calls are made directly, liburing is not needed. Multishot
+ * receive into provided buffer rings needs Linux 6.0, can_init() falls back
+ * to recvmmsg() and sendmmsg() if the ring cannot be set up.
+ *
+ * There is one ring per process and it serves the one bus socket of
+ * can_init(), not a loop over several buses: other sockets, like the UDP
+ * socket of a CanBridge, keep their own system calls.
+ * The backend is off unless asked for: canBench measures it against
+ * recvmmsg() and sendmmsg() on the same sockets, and on a small machine it
+ * receives about as fast and sends somewhat slower, so turn it on only where
+ * canBench shows a gain.
+ */
+#ifndef _CAN_URING_H_
+#define _CAN_URING_H_
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+class CanUring {
+public:
+  /// \brief Set up the ring and start receiving into count slots.
+  static bool init(int sock, void *slots, uint32_t slotSize, uint32_t count);
+  /// \brief Take the next run of received frames, returns how many.
+  static uint32_t receive(uint32_t *first);
+  /// \brief Send a batch of frames in order, like sendmmsg().
+  static int send(const struct iovec *frames, int count);
+  /// \brief Check if receive() should be called before polling fd().
+  static bool pending();
+  /// \brief Check if init() succeeded.
+  static bool active();
+  /// \brief File descriptor that polls readable when completions arrive.
+  static int fd();
+
+private:
+  static bool setup(uint32_t entries);
+  static void provide(uint32_t first, uint32_t count);
+  static void arm();
+  static struct io_uring_sqe *nextSqe(uint32_t i);
+  static bool submit(uint32_t count, uint32_t wait);
+  static bool peek(struct io_uring_cqe *cqe, bool stashed);
+  static void pop(bool stashed);
+
+  static int ringFd;
+  static int sock;
+
+  // submission queue, shared with the kernel
+  static uint32_t *sqHead;
+  static uint32_t *sqTail;
+  static uint32_t sqMask;
+  static uint32_t *sqArray;
+  static struct io_uring_sqe *sqes;
+
+  // completion queue, shared with the kernel
+  static uint32_t *cqHead;
+  static uint32_t *cqTail;
+  static uint32_t cqMask;
+  static struct io_uring_cqe *cqes;
+
+  // provided buffers, the slots of the receive batch
+  static struct io_uring_buf_ring *bufRing;
+  static uint32_t bufMask;
+  static uint16_t bufTail;
+  static uint8_t *slots;
+  static uint32_t slotSize;
+  static uint32_t slotCount;
+  static uint32_t taken;      ///< slots handed out by the last receive()
+  static uint32_t takenFirst; ///< first of them
+  static bool armed;          ///< the multishot receive is still running
+
+  /// receive completions read while waiting for sends, in arrival order
+  static struct io_uring_cqe *stash;
+  static uint32_t stashHead;
+  static uint32_t stashCount;
+};
+
+#endif //_CAN_URING_H_
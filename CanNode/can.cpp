@@ -6,60 +6,389 @@
 
 
 #include "CanNode.h"
+#include "CanPeriodic.h"
+#include "CanShm.h"
+#include "CanStats.h"
+#include "CanTxQueue.h"
+#include "CanTxStage.h"
+#include "CanUring.h"
+#include <atomic>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/can.h>
+#include <linux/can/bcm.h>
+#include <linux/can/error.h>
+#include <linux/can/raw.h>
+#include <linux/sock_diag.h>
+#include <mutex>
+#include <poll.h>
 #include <net/if.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/timeb.h>
+#include <thread>
+#include <unordered_map>
 #include <unistd.h>
+#include "CanTime.h"
 
-static int s;
-static CanState bus_state;
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+
+/// Maximum number of frames written with one sendmmsg()
+#define TX_BATCH 32
+
+/// Ancillary data space for the SO_RXQ_OVFL drop counter
+#define RX_CTRL_LEN CMSG_SPACE(sizeof(uint32_t))
+
+/// value returned by can_add_filter functions if no filter was added
+#ifndef CAN_FILTER_ERROR
+#define CAN_FILTER_ERROR 0xFFFF
+#endif
+
+/// Number of mask filters, their numbers are the reserved filter ids 0 - 52
+#define MASK_FILTERS 53
+
+// ids are passed around with CAN_ID_EXT, which is also the socket's flag
+static_assert(CAN_ID_EXT == CAN_EFF_FLAG, "CAN_ID_EXT must be CAN_EFF_FLAG");
+
+static int s = -1;
+static std::atomic<int> bcm_s(-1);
+static std::mutex bcm_lock; ///< serializes opening bcm_s
+/// on a CAN FD interface, which receive jobs of an id (bit 0 classic, bit 1
+/// CAN FD) timed out and got no frame since
+static std::unordered_map<uint32_t, uint8_t> bcm_silent;
+static std::mutex bcm_silent_lock; ///< guards bcm_silent
+static int ifindex;
+static std::atomic<CanState> bus_state(BUS_OK);
+static bool fd_enabled;
 static uint8_t num_msg;
-static struct can_frame *tmp_msg;
 
-static void frame_to_message(CanMessage *out, struct can_frame *in);
-static void message_to_frame(struct can_frame *out, CanMessage *in);
+static CanBusConfig config = {"can0", 0, 0, CAN_RX_BATCH, 0, 100, 0, false,
+                                   false, NULL, false};
+
+// receive batch, filled by recvmmsg() and drained by can_rx() or handed out
+// in place by can_rx_views()
+static CanMessageView rx_frames[CAN_RX_BATCH];
+static struct iovec rx_iov[CAN_RX_BATCH];
+static struct mmsghdr rx_msgs[CAN_RX_BATCH];
+static char rx_ctrl[CAN_RX_BATCH][RX_CTRL_LEN];
+static int rx_count;
+static int rx_next;
+static uint32_t rx_batches; ///< number of batches read, views of older ones
+                            ///< are stale
+
+// kernel drop accounting
+static uint32_t ovfl_last;
+static std::atomic<uint64_t> kernel_drops;
+static uint64_t interval_start;
+static uint32_t interval_drops;
+static bool backlog_warned;
+
+// filters, installed in the kernel when config.kernelFilter is set
+static struct can_filter *id_filters;
+static int num_id_filters;
+static int id_filters_size;
+static struct can_filter mask_filters[MASK_FILTERS];
+static std::atomic<int> num_mask_filters; ///< read by the receive path
+static std::mutex filters_lock;           ///< held while filters change
+
+// messages waiting for room in the kernel queue
+static CanTxQueue tx_queue;
+static bool tx_hold;
+
+// bus state from error frames
+static CanBusStatus bus_status;
+static busStateHandler state_handle;
+static std::atomic<uint64_t> next_probe;
+static std::atomic<bool> sleeping;
+/// thread that owns the socket, the transmit queue and the receive batch
+static std::atomic<std::thread::id> loop_thread;
+
+static void frame_to_message(CanMessage *out, const struct canfd_frame *in);
+static size_t message_to_frame(struct canfd_frame *out, const CanMessage *in);
+static uint8_t can_fd_len(uint8_t len);
+
+
+static bool fill_batch();
+static bool fill_uring_batch();
+static bool fill_shm_batch();
+static void update_drops(uint32_t ovfl);
+static void check_backlog();
+static void handle_error_frame(const struct can_frame *frame);
+static void set_bus_state(CanState state);
+static CanState write_batch(const int *entries, int count, int *sent);
+static CanState stage_message(const CanMessage *tx_msg, uint64_t notBefore,
+                              uint32_t timeout);
+static void flush_queue(uint16_t target, uint32_t timeout);
+static void apply_filters();
+static uint8_t match_mask_filters(canid_t can_id);
+
+/**
+ * Only has an effect before the first CanNode is created, since that is when
+ * can_init() opens the socket.
+ *
+ * \param config settings to use, zero fields keep the defaults
+ */
+void CanNode::setBusConfig(const CanBusConfig *cfg) {
+  if (cfg->interface != NULL) {
+    config.interface = cfg->interface;
+  }
+  config.rcvBuf = cfg->rcvBuf;
+  config.sndBuf = cfg->sndBuf;
+  config.rxBatch = cfg->rxBatch;
+  if (config.rxBatch == 0 || config.rxBatch > CAN_RX_BATCH) {
+    config.rxBatch = CAN_RX_BATCH;
+  }
+  config.dropWarn = cfg->dropWarn;
+  if (cfg->busOffProbe != 0) {
+    config.busOffProbe = cfg->busOffProbe;
+  }
+  config.txQueueDepth = cfg->txQueueDepth;
+  tx_queue.setDepth(config.txQueueDepth);
+  config.kernelFilter = cfg->kernelFilter;
+  config.ioUring = cfg->ioUring;
+  config.shmRing = cfg->shmRing;
+  config.shmConsumer = cfg->shmConsumer;
+}
+
+/**
+ * \returns the total number of frames the kernel dropped from the receive
+ * queue of the socket since can_init(), or with
+ * \ref CanBusConfig::shmConsumer the frames lost by falling a whole ring
+ * behind. Only counted as the receive path reads frames.
+ */
+uint64_t CanNode::getKernelDrops() {
+  return kernel_drops;
+}
+
+/**
+ * The state is only as fresh as the last call to the receive path, since
+ * error frames arrive on the same socket as data.
+ *
+ * \param status[out] copy of the current bus state
+ */
+void CanNode::getBusStatus(CanBusStatus *status) {
+  *status = bus_status;
+  status->state = bus_state;
+}
+
+/**
+ * The handler is called from the receive path (e.g.
+ * CanNode::checkForMessages()) whenever an error frame changes the bus state
+ * or error counters, and from can_tx() when a write shows the bus went away.
+ *
+ * \param handle function to call, or NULL to stop calling one
+ */
+void CanNode::setBusStateHandler(busStateHandler handle) {
+  state_handle = handle;
+}
+
+/**
+ * \returns true if the interface takes CAN FD frames, so messages can carry
+ * up to \ref CAN_MAX_DATA bytes. Only known once the first CanNode exists.
+ */
+bool CanNode::fdEnabled() {
+  return fd_enabled;
+}
+
+/**
+ * Set a socket buffer size. The privileged *FORCE option is tried first so
+ * root can go over net.core.[rw]mem_max.
+ */
+static void set_buf_size(int opt, int force_opt, int size, const char *name) {
+  if (size <= 0) {
+    return;
+  }
+  if (setsockopt(s, SOL_SOCKET, force_opt, &size, sizeof(size)) < 0 &&
+      setsockopt(s, SOL_SOCKET, opt, &size, sizeof(size)) < 0) {
+    perror(name);
+    return;
+  }
 
+  // the kernel doubles the value for bookkeeping
+  int actual = 0;
+  socklen_t len = sizeof(actual);
+  getsockopt(s, SOL_SOCKET, opt, &actual, &len);
+  if (actual / 2 < size) {
+    fprintf(stderr, "%s: asked for %d bytes, got %d (check net.core limits)\n",
+            name, size, actual / 2);
+  }
+}
 
 void CanNode::can_init(void) {
   // default to kbit/s
   struct sockaddr_can addr;
   struct ifreq ifr;
-  tmp_msg = NULL;
+
+  can_claim_loop();
+  // so waitForMessages() can watch for messages staged by other threads
+  CanTxStage::fd();
 
   s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
 
-  strcpy(ifr.ifr_name, "can0");
+  strncpy(ifr.ifr_name, config.interface, IFNAMSIZ - 1);
+  ifr.ifr_name[IFNAMSIZ - 1] = '\0';
   ioctl(s, SIOCGIFINDEX, &ifr);
 
   addr.can_family = AF_CAN;
   addr.can_ifindex = ifr.ifr_ifindex;
+  ifindex = ifr.ifr_ifindex;
 
   bind(s, (struct sockaddr *)&addr, sizeof(addr));
 
+  // CAN FD interfaces have a CANFD_MTU, classic ones only take can_frames
+  int enable_fd = 1;
+  fd_enabled = ioctl(s, SIOCGIFMTU, &ifr) == 0 && ifr.ifr_mtu == CANFD_MTU &&
+               setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable_fd,
+                          sizeof(enable_fd)) == 0;
+
   int flags = fcntl(s, F_GETFL, 0);
   fcntl(s, F_SETFL, flags | O_NONBLOCK);
+
+  set_buf_size(SO_RCVBUF, SO_RCVBUFFORCE, config.rcvBuf, "can SO_RCVBUF");
+  set_buf_size(SO_SNDBUF, SO_SNDBUFFORCE, config.sndBuf, "can SO_SNDBUF");
+
+  // have the kernel report how many frames it dropped from our queue
+  int enable = 1;
+  if (setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) < 0) {
+    perror("can SO_RXQ_OVFL");
+  }
+
+  // get controller problems, bus-off and restarts as error frames
+  can_err_mask_t err_mask = CAN_ERR_TX_TIMEOUT | CAN_ERR_CRTL |
+                            CAN_ERR_BUSOFF | CAN_ERR_RESTARTED | CAN_ERR_CNT;
+  if (setsockopt(s, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask,
+                 sizeof(err_mask)) < 0) {
+    perror("can CAN_RAW_ERR_FILTER");
+  }
+  memset(&bus_status, 0, sizeof(bus_status));
+  bus_state = BUS_OK;
+  sleeping = false;
+
+  // point every slot of the receive batch at its buffers
+  for (int i = 0; i < CAN_RX_BATCH; ++i) {
+    rx_iov[i].iov_base = &rx_frames[i].frame;
+    rx_iov[i].iov_len = sizeof(struct canfd_frame);
+    memset(&rx_msgs[i].msg_hdr, 0, sizeof(rx_msgs[i].msg_hdr));
+    rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+    rx_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  rx_count = 0;
+  rx_next = 0;
+  ovfl_last = 0;
+  interval_start = can_time_ms();
+
+  // frames come from the ring of the process that owns the bus, the socket
+  // only transmits
+  if (config.shmRing != NULL && config.shmConsumer) {
+    if (CanShm::attach(config.shmRing)) {
+      err_mask = 0;
+      setsockopt(s, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask,
+                 sizeof(err_mask));
+      setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+    } else {
+      fprintf(stderr, "%s: cannot attach to %s, receiving from the socket\n",
+              config.interface, config.shmRing);
+    }
+  } else if (config.shmRing != NULL &&
+             !CanShm::create(config.shmRing, 0)) {
+    fprintf(stderr, "%s: cannot share frames through %s\n",
+            config.interface, config.shmRing);
+  }
+
+  // the kernel receives straight into the slots of the batch
+  if (config.ioUring && !CanShm::consumer() &&
+      !CanUring::init(s, rx_frames, sizeof(rx_frames[0]), config.rxBatch)) {
+    fprintf(stderr, "%s: no io_uring, using recvmmsg()\n", config.interface);
+  }
+
+  std::lock_guard<std::mutex> guard(filters_lock);
+  apply_filters();
 }
 
+/**
+ * Called by the message loop functions. Messages sent from the loop thread go
+ * straight to the transmit queue, other threads stage theirs.
+ */
+void CanNode::can_claim_loop(void) {
+  std::thread::id self = std::this_thread::get_id();
+  if (loop_thread.load(std::memory_order_relaxed) != self) {
+    loop_thread.store(self, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Wakes the bus up after can_sleep().
+ */
 void CanNode::can_enable(void) {
+  if (!sleeping) {
+    return;
+  }
+  sleeping = false;
+  std::lock_guard<std::mutex> guard(filters_lock);
+  apply_filters();
 }
 
-void CanNode::can_set_bitrate(canBitrate bitrate) {
+/**
+ * There is no controller to power down on a PC, so sleeping means the socket
+ * stops receiving frames and can_tx() refuses to send until can_enable() is
+ * called.
+ */
+void CanNode::can_sleep(void) {
+  // an empty filter list receives nothing
+  setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+  rx_count = 0;
+  rx_next = 0;
+  sleeping = true;
+}
+
+void CanNode::can_set_bitrate(canBitrate) {
 }
 
 /**
- * \param id id to filter on 
+ * The filter only reaches the kernel when \ref CanBusConfig::kernelFilter is
+ * set. Otherwise every frame is received and filtering is left to the
+ * handlers.
+ *
+ * \param id id to filter on, with \ref CAN_ID_EXT set for an extended id
  *
  * \returns the filter number of the added filter returns \ref CAN_FILTER_ERROR
  * if the function was unable to add a filter.
  */
-uint16_t CanNode::can_add_filter_id(uint16_t id) {
-    return 0;
+uint16_t CanNode::can_add_filter_id(uint32_t id) {
+  if (!can_id_valid(id)) {
+    return CAN_FILTER_ERROR;
+  }
+  // the flag is part of the mask so standard and extended ids never mix
+  canid_t mask =
+      CAN_EFF_FLAG | ((id & CAN_ID_EXT) ? CAN_EFF_MASK : CAN_SFF_MASK);
+
+  std::lock_guard<std::mutex> guard(filters_lock);
+  for (int i = 0; i < num_id_filters; ++i) {
+    if (id_filters[i].can_id == id && id_filters[i].can_mask == mask) {
+      return i;
+    }
+  }
+  if (num_id_filters == id_filters_size) {
+    int size = id_filters_size * 2 + 16;
+    struct can_filter *grown = (struct can_filter *)realloc(
+        id_filters, size * sizeof(struct can_filter));
+    if (grown == NULL) {
+      return CAN_FILTER_ERROR;
+    }
+    id_filters = grown;
+    id_filters_size = size;
+  }
+
+  id_filters[num_id_filters].can_id = id;
+  id_filters[num_id_filters].can_mask = mask;
+  num_id_filters++;
+  apply_filters();
+  return num_id_filters - 1;
 }
 
 /**
@@ -69,6 +398,9 @@ uint16_t CanNode::can_add_filter_id(uint16_t id) {
  * For it to work correctly the returned value from this function should be 
  * passed to CanNode_addFilter() as the id. This lets CanNode_checkForMessages() 
  * know what handler to call if a message using this filter is recieved.*
+ *
+ * The number of the first mask filter a frame matches is put in the fmi of
+ * the received message.
  * 
  * Example code
  *
@@ -77,73 +409,949 @@ uint16_t CanNode::can_add_filter_id(uint16_t id) {
  * CanNode_addFilter(id, handler);
  * ~~~~~~~~~~~~
  * 
- * \param id base id of the filter mask
+ * \param id base id of the filter mask, with \ref CAN_ID_EXT set for
+ * extended ids
  * \param mask mask on top of the base id, 0's are don't cares
  *
  * \returns the filter number of the added filter returns \ref CAN_FILTER_ERROR
  * if the function was unable to add a filter.
  */
-uint16_t CanNode::can_add_filter_mask(uint16_t id, uint16_t mask) {
-    return 0;
+uint16_t CanNode::can_add_filter_mask(uint32_t id, uint32_t mask) {
+  std::lock_guard<std::mutex> guard(filters_lock);
+  int n = num_mask_filters.load(std::memory_order_relaxed);
+  if (!can_id_valid(id) || n == MASK_FILTERS) {
+    return CAN_FILTER_ERROR;
+  }
+
+  struct can_filter *filter = &mask_filters[n];
+  filter->can_id = id;
+  filter->can_mask =
+      CAN_EFF_FLAG | (mask & ((id & CAN_ID_EXT) ? CAN_EFF_MASK : CAN_SFF_MASK));
+  // the receive path only looks at filters below the count
+  num_mask_filters.store(n + 1, std::memory_order_release);
+  apply_filters();
+  return n;
 }
 
-CanState CanNode::can_tx(CanMessage *tx_msg, uint32_t timeout) { 
-    struct can_frame msg;
-    message_to_frame(&msg, tx_msg);
-    write(s, &msg, sizeof(struct can_frame));
-    HAL_Delay(10);
+/**
+ * Install the id and mask filters in the kernel, so frames nobody asked for
+ * never wake the process. Called with filters_lock held.
+ */
+static void apply_filters() {
+  if (!config.kernelFilter || sleeping || s < 0 || CanShm::consumer()) {
+    return;
+  }
+  int count = num_id_filters + num_mask_filters;
+  if (count > CAN_RAW_FILTER_MAX) {
+    fprintf(stderr, "%s: %d filters is too many, receiving every id\n",
+            config.interface, count);
+    struct can_filter all = {0, 0};
+    setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &all, sizeof(all));
+    return;
+  }
+
+  struct can_filter filters[CAN_RAW_FILTER_MAX];
+  memcpy(filters, id_filters, num_id_filters * sizeof(struct can_filter));
+  memcpy(filters + num_id_filters, mask_filters,
+         num_mask_filters * sizeof(struct can_filter));
+  setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+             count * sizeof(struct can_filter));
+}
+
+/**
+ * \returns the number of the first mask filter can_id matches, or
+ * \ref CAN_NO_FMI.
+ */
+static uint8_t match_mask_filters(canid_t can_id) {
+  int count = num_mask_filters.load(std::memory_order_acquire);
+  for (int i = 0; i < count; ++i) {
+    if ((can_id & mask_filters[i].can_mask) ==
+        (mask_filters[i].can_id & mask_filters[i].can_mask)) {
+      return i;
+    }
+  }
+  return CAN_NO_FMI;
+}
+
+/**
+ * \param tx_msg message to send
+ * \param timeout mili-seconds to wait for room if the transmit queue is full
+ *
+ * \see can_queue()
+ */
+CanState CanNode::can_tx(CanMessage *tx_msg, uint32_t timeout) {
+  return can_queue(tx_msg, 0, timeout);
+}
+
+/**
+ * Messages go through a priority queue (see CanTxQueue) that hands them to the
+ * kernel lowest id first, as fast as the kernel takes them. While the bus is
+ * off the message is rejected right away with \ref BUS_OFF, except for one
+ * probe every \ref CanBusConfig::busOffProbe mili-seconds that checks if the
+ * bus is back.
+ *
+ * \param tx_msg message to send
+ * \param notBefore can_time_ns() time to hold the message until, 0 for none
+ * \param timeout mili-seconds to wait for room if the transmit queue is full
+ *
+ * Threads other than the loop thread stage the message instead (see
+ * CanTxStage), it is queued the next time the loop flushes.
+ *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if
+ * the queue stayed full for timeout, \ref BUS_OFF if the bus is off or
+ * asleep, \ref DATA_OVERFLOW if the message is too long for the interface.
+ */
+CanState CanNode::can_queue(CanMessage *tx_msg, uint64_t notBefore,
+                            uint32_t timeout) {
+  if (tx_msg->len > CAN_MAX_DATA ||
+      (tx_msg->len > CAN_MAX_DLEN && !fd_enabled)) {
+    CanStats::countTxFailure();
+    return DATA_OVERFLOW;
+  }
+  if (sleeping || (bus_state == BUS_OFF && can_time_ms() < next_probe)) {
+    CanStats::countTxFailure();
+    return BUS_OFF;
+  }
+  if (loop_thread.load(std::memory_order_relaxed) !=
+      std::this_thread::get_id()) {
+    return stage_message(tx_msg, notBefore, timeout);
+  }
+
+  if (!tx_queue.push(tx_msg, notBefore)) {
+    // sending does not make room for held messages, only their time does
+    if (notBefore == 0) {
+      // wait for the kernel to take some of the backlog
+      flush_queue(tx_queue.size() - 1, timeout);
+    }
+    if (notBefore != 0 || !tx_queue.push(tx_msg, notBefore)) {
+      CanStats::countTxFailure();
+      return BUS_BUSY;
+    }
+  }
+
+  if (!tx_hold) {
+    flush_queue(0, 0);
+  }
+  return bus_state == BUS_OFF ? BUS_OFF : BUS_OK;
+}
+
+/**
+ * Called from checkForMessages() so rate limited messages go out once their
+ * time comes. Call it from other loops that send without checking for
+ * messages. From a thread other than the loop thread it only wakes the loop,
+ * which sends what the thread staged on its next pass.
+ */
+void CanNode::flushTx() {
+  if (loop_thread.load(std::memory_order_relaxed) !=
+      std::this_thread::get_id()) {
+    CanTxStage::wake();
+    return;
+  }
+  flush_queue(0, 0);
+}
+
+/**
+ * Hand a message from a thread other than the loop thread to the loop,
+ * waiting up to timeout mili-seconds for room in the thread's ring.
+ */
+static CanState stage_message(const CanMessage *tx_msg, uint64_t notBefore,
+                              uint32_t timeout) {
+  uint64_t deadline = can_time_ms() + timeout;
+  while (!CanTxStage::push(tx_msg, notBefore)) {
+    if (can_time_ms() >= deadline) {
+      CanStats::countTxFailure();
+      return BUS_BUSY;
+    }
+    usleep(100);
+  }
+  return bus_state == BUS_OFF ? BUS_OFF : BUS_OK;
+}
+
+/**
+ * Write released messages until only target are left in the queue, waiting
+ * up to timeout mili-seconds for the kernel to make room. Messages are handed
+ * over in batches of up to \ref TX_BATCH with one sendmmsg() call.
+ */
+static void flush_queue(uint16_t target, uint32_t timeout) {
+  uint64_t deadline = can_time_ms() + timeout;
+  int batch[TX_BATCH];
+
+  // messages other threads sent since the last flush
+  CanTxStage::drain(&tx_queue);
+  tx_queue.release(can_time_ns());
+  while (tx_queue.size() > target) {
+    int limit = tx_queue.size() - target;
+    int count = 0;
+    int entry;
+    while (count < limit && count < TX_BATCH &&
+           (entry = tx_queue.take()) >= 0) {
+      batch[count++] = entry;
+    }
+    if (count == 0) {
+      return; // everything left is held back by a rate limit
+    }
+
+    int sent;
+    CanState state = write_batch(batch, count, &sent);
+    int err = errno;
+    for (int i = 0; i < count; ++i) {
+      if (i < sent) {
+        tx_queue.done(batch[i]);
+      } else {
+        tx_queue.untake(batch[i]);
+      }
+    }
+
+    if (state == BUS_OK) {
+      continue;
+    }
+
+    if (state == BUS_BUSY) {
+      uint64_t now = can_time_ms();
+      if (now >= deadline) {
+        set_bus_state(BUS_BUSY);
+        return;
+      }
+      if (err == ENOBUFS) {
+        // the device queue is full, poll() will not tell us when it drains
+        usleep(1000);
+      } else {
+        struct pollfd pfd = {s, POLLOUT, 0};
+        poll(&pfd, 1, (int)(deadline - now));
+      }
+      continue;
+    }
+
+    if (state == BUS_OFF) {
+      // don't build up a backlog of stale messages during an outage
+      for (uint16_t n = tx_queue.clear(); n > 0; --n) {
+        CanStats::countTxFailure();
+      }
+      return;
+    }
+
+    // the kernel refused the first unsent message, drop it
+    CanStats::countTxFailure();
+    tx_queue.pop();
+  }
+}
+
+/**
+ * Try once to hand a batch of messages to the kernel.
+ *
+ * \param entries queue entries to send, in priority order
+ * \param count number of entries
+ * \param sent[out] number of entries the kernel accepted
+ *
+ * \returns \ref BUS_OK if some or all were sent, otherwise why the first one
+ * failed: \ref BUS_BUSY if the kernel queue is full, \ref BUS_OFF if the
+ * interface is gone, \ref DATA_ERROR for other errors.
+ */
+static CanState write_batch(const int *entries, int count, int *sent) {
+  static struct canfd_frame frames[TX_BATCH];
+  static struct iovec iov[TX_BATCH];
+  static struct mmsghdr msgs[TX_BATCH];
+
+  for (int i = 0; i < count; ++i) {
+    iov[i].iov_base = &frames[i];
+    iov[i].iov_len = message_to_frame(&frames[i], tx_queue.message(entries[i]));
+    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int n = CanUring::active() ? CanUring::send(iov, count)
+                              : sendmmsg(s, msgs, count, MSG_DONTWAIT);
+  if (n > 0) {
+    *sent = n;
+    for (int i = 0; i < n; ++i) {
+      CanStats::countTx(can_msg_id(tx_queue.message(entries[i])));
+    }
+    if (bus_state != BUS_OK) {
+      set_bus_state(BUS_OK);
+    }
+    return BUS_OK;
+  }
+
+  *sent = 0;
+  if (errno == ENETDOWN || errno == ENXIO || errno == ENODEV) {
+    set_bus_state(BUS_OFF);
+    next_probe = can_time_ms() + config.busOffProbe;
+    return BUS_OFF;
+  }
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+    return BUS_BUSY;
+  }
+  return DATA_ERROR;
+}
+
+/**
+ * Used to coalesce several sends into one batched write: while held, can_tx()
+ * only queues messages and a later flushTx() writes them together.
+ *
+ * Code that holds messages only for a moment restores the hold it found, so
+ * it does not end a hold of its caller:
+ *
+ * ~~~~~~~~~~~~ {.c}
+ * bool held = CanNode::holdTx(true);
+ * ... send ...
+ * CanNode::holdTx(held);
+ * if (!held) {
+ *   CanNode::flushTx();
+ * }
+ * ~~~~~~~~~~~~
+ *
+ * \param hold true to hold messages in the queue, false to stop holding
+ *
+ * \returns true if messages were held before the call.
+ */
+bool CanNode::holdTx(bool hold) {
+  bool held = tx_hold;
+  tx_hold = hold;
+  return held;
+}
+
+/**
+ * Sleep until there is something for checkForMessages() to do: a message was
+ * received, a periodic stream is due, a rate limited message can be sent,
+ * another thread sent a message, or an awaited exchange may have timed out.
+ *
+ * \param timeout maximum time to wait in mili-seconds
+ *
+ * \returns false if the timeout was reached.
+ */
+bool CanNode::waitForMessages(uint32_t timeout) {
+  if (rx_next < rx_count || (CanUring::active() && CanUring::pending())) {
+    return true;
+  }
+  // the writer of the ring wakes us through CanShm::fd()
+  if (CanShm::consumer() && !CanShm::sleep()) {
+    return true;
+  }
+
+  uint64_t next = tx_queue.nextRelease();
+  if (next != UINT64_MAX) {
+    uint64_t now = can_time_ns();
+    uint64_t wait = next > now ? (next - now + 999999) / 1000000 : 0;
+    if (wait < timeout) {
+      timeout = wait;
+    }
+  }
+
+  // with io_uring frames are received by the time the ring is readable
+  int rx = CanUring::active() ? CanUring::fd() : s;
+  if (CanShm::consumer()) {
+    rx = CanShm::fd();
+  }
+  struct pollfd fds[5] = {{rx, POLLIN, 0},
+                          {bcm_s, POLLIN, 0},
+                          {CanPeriodic::fd(), POLLIN, 0},
+                          {CanTxStage::fd(), POLLIN, 0},
+                          {CanAsync::fd(), POLLIN, 0}};
+  return poll(fds, 5, (int)timeout) > 0;
 }
 
-CanState CanNode::can_rx(CanMessage *rx_msg, uint32_t timeout) {
+/// Size of a broadcast manager message carrying one classic frame
+#define BCM_MSG_LEN (sizeof(struct bcm_msg_head) + sizeof(struct can_frame))
+/// Size of a broadcast manager message carrying one CAN FD frame
+#define BCM_FD_MSG_LEN \
+  (sizeof(struct bcm_msg_head) + sizeof(struct canfd_frame))
+
+/// Buffer for a broadcast manager message carrying one frame
+struct bcm_one_frame {
+  alignas(struct bcm_msg_head) unsigned char buf[BCM_FD_MSG_LEN];
+  struct bcm_msg_head *head() { return (struct bcm_msg_head *)buf; }
+  struct canfd_frame *frame() {
+    return (struct canfd_frame *)&head()->frames[0];
+  }
+};
+
+/**
+ * Open the broadcast manager socket the first time it is needed.
+ */
+static bool bcm_open() {
+  if (bcm_s >= 0) {
+    return true;
+  }
+
+  std::lock_guard<std::mutex> guard(bcm_lock);
+  if (bcm_s >= 0) {
+    return true; // opened by another thread
+  }
+  int fd = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK, CAN_BCM);
+  if (fd < 0) {
+    perror("can bcm socket");
+    return false;
+  }
+
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifindex;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("can bcm connect");
+    close(fd);
+    return false;
+  }
+  bcm_s = fd;
+  return true;
+}
+
+static void bcm_set_ival(struct bcm_timeval *ival, uint32_t us) {
+  ival->tv_sec = us / 1000000;
+  ival->tv_usec = us % 1000000;
+}
+
+/**
+ * The kernel sends the frame every period until the job is deleted. Calling
+ * again with start false only replaces the data, the timer keeps running.
+ *
+ * \param tx_msg message to repeat
+ * \param period period in micro-seconds
+ * \param start true to (re)start the timer and send the frame right away
+ *
+ * Messages longer than 8 bytes set up a CAN FD job. A job stays classic or
+ * CAN FD, so the length of the repeated message should not cross 8 bytes.
+ *
+ * \returns \ref BUS_OK if the job was set up, \ref BUS_OFF if the bus is off
+ * or asleep, \ref DATA_OVERFLOW if the message is too long for the interface,
+ * \ref DATA_ERROR if the broadcast manager refused it.
+ */
+CanState CanNode::can_bcm_tx(CanMessage *tx_msg, uint32_t period, bool start) {
+  if (tx_msg->len > CAN_MAX_DATA ||
+      (tx_msg->len > CAN_MAX_DLEN && !fd_enabled)) {
+    CanStats::countTxFailure();
+    return DATA_OVERFLOW;
+  }
+  if (sleeping || bus_state == BUS_OFF) {
+    CanStats::countTxFailure();
+    return BUS_OFF;
+  }
+  if (!bcm_open()) {
+    return DATA_ERROR;
+  }
+
+  struct bcm_one_frame msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.head()->opcode = TX_SETUP;
+  msg.head()->can_id = can_msg_id(tx_msg);
+  msg.head()->nframes = 1;
+  if (start) {
+    msg.head()->flags = SETTIMER | STARTTIMER | TX_ANNOUNCE;
+    bcm_set_ival(&msg.head()->ival2, period);
+  }
+  size_t len = BCM_MSG_LEN;
+  if (message_to_frame(msg.frame(), tx_msg) == CANFD_MTU) {
+    msg.head()->flags |= CAN_FD_FRAME;
+    len = BCM_FD_MSG_LEN;
+  }
+
+  if (write(bcm_s, msg.buf, len) != (ssize_t)len) {
+    perror("can bcm TX_SETUP");
+    CanStats::countTxFailure();
+    return DATA_ERROR;
+  }
+  CanStats::countTx(can_msg_id(tx_msg));
+  return BUS_OK;
+}
+
+/**
+ * Set up the receive job of an id for either classic or CAN FD frames, the
+ * broadcast manager keeps them apart.
+ */
+static bool bcm_rx_job(uint32_t id, bool changedOnly, uint32_t timeout,
+                       bool fd) {
+  struct bcm_one_frame msg;
+  struct bcm_msg_head *head = msg.head();
+  memset(&msg, 0, sizeof(msg));
+  head->opcode = RX_SETUP;
+  head->can_id = id;
+  if (changedOnly) {
+    // a content filter on every data bit, plus length changes
+    head->flags = RX_CHECK_DLC;
+    head->nframes = 1;
+    msg.frame()->can_id = id;
+    memset(msg.frame()->data, 0xFF, fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+  } else {
+    head->flags = RX_FILTER_ID;
+    head->nframes = 0;
+  }
+  if (timeout != 0) {
+    head->flags |= SETTIMER | STARTTIMER;
+    bcm_set_ival(&head->ival1, timeout * 1000);
+  }
+  if (fd) {
+    head->flags |= CAN_FD_FRAME;
+  }
+  if (fd_enabled && timeout != 0) {
+    // a frame after a timeout restarts the job and tells can_bcm_rx() the
+    // id is back, even if its data did not change
+    head->flags |= RX_ANNOUNCE_RESUME;
+  }
+
+  size_t len = sizeof(*head) +
+               head->nframes * (fd ? sizeof(struct canfd_frame)
+                                   : sizeof(struct can_frame));
+  if (write(bcm_s, msg.buf, len) != (ssize_t)len) {
+    perror("can bcm RX_SETUP");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * On a CAN FD interface the id is watched for both classic and CAN FD
+ * frames, with a job for each, and only reported as timed out once neither
+ * kind arrived for timeout.
+ *
+ * \param id id to watch, with \ref CAN_ID_EXT set for an extended id
+ * \param changedOnly only report frames whose length or data changed
+ * \param timeout report the id as timed out after this many mili-seconds
+ * without a frame, 0 for no timeout
+ *
+ * \returns false if the broadcast manager refused the filter.
+ */
+bool CanNode::can_bcm_rx_setup(uint32_t id, bool changedOnly,
+                               uint32_t timeout) {
+  if (!bcm_open()) {
+    return false;
+  }
+  if (!bcm_rx_job(id, changedOnly, timeout, false)) {
+    return false;
+  }
+  if (fd_enabled) {
+    if (!bcm_rx_job(id, changedOnly, timeout, true)) {
+      can_bcm_delete(id, false);
+      return false;
+    }
+    std::lock_guard<std::mutex> guard(bcm_silent_lock);
+    bcm_silent[id] = 0;
+  }
+  return true;
+}
+
+/**
+ * \param id id of the job, with \ref CAN_ID_EXT set for an extended id
+ * \param tx true for a transmit job, false for a receive filter
+ */
+void CanNode::can_bcm_delete(uint32_t id, bool tx) {
+  if (bcm_s < 0) {
+    return;
+  }
+
+  struct bcm_msg_head head;
+  memset(&head, 0, sizeof(head));
+  head.opcode = tx ? TX_DELETE : RX_DELETE;
+  head.can_id = id;
+  write(bcm_s, &head, sizeof(head));
+  if (!tx && fd_enabled) {
+    head.flags = CAN_FD_FRAME;
+    write(bcm_s, &head, sizeof(head));
+    std::lock_guard<std::mutex> guard(bcm_silent_lock);
+    bcm_silent.erase(id);
+  }
+}
+
+/**
+ * \param rx_msg[out] frame that passed a filter, or an empty message for the
+ * id that timed out
+ * \param timedOut[out] true if the id of rx_msg timed out
+ *
+ * \returns false if there was no notification waiting.
+ */
+bool CanNode::can_bcm_rx(CanMessage *rx_msg, bool *timedOut) {
+  struct bcm_one_frame msg;
+  struct bcm_msg_head *head = msg.head();
+  if (bcm_s < 0) {
+    return false;
+  }
+
+  for (;;) {
+    ssize_t nbytes = read(bcm_s, msg.buf, BCM_FD_MSG_LEN);
+    if (nbytes < (ssize_t)sizeof(*head)) {
+      return false;
+    }
+
+    uint8_t kind = head->flags & CAN_FD_FRAME ? 2 : 1;
+    if (head->opcode == RX_TIMEOUT && fd_enabled) {
+      // the id timed out once neither its classic nor its CAN FD job sees it
+      std::lock_guard<std::mutex> guard(bcm_silent_lock);
+      auto silent = bcm_silent.find(head->can_id);
+      if (silent == bcm_silent.end() || (silent->second |= kind) != 3) {
+        continue;
+      }
+    }
+    if (head->opcode == RX_TIMEOUT) {
+      memset(rx_msg, 0, sizeof(*rx_msg));
+      can_set_msg_id(rx_msg, head->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK));
+      *timedOut = true;
+      return true;
+    }
+    size_t len = head->flags & CAN_FD_FRAME ? BCM_FD_MSG_LEN : BCM_MSG_LEN;
+    if (head->opcode == RX_CHANGED && head->nframes == 1 &&
+        nbytes == (ssize_t)len) {
+      if (fd_enabled) {
+        std::lock_guard<std::mutex> guard(bcm_silent_lock);
+        auto silent = bcm_silent.find(head->can_id);
+        if (silent != bcm_silent.end()) {
+          silent->second &= ~kind;
+        }
+      }
+      frame_to_message(rx_msg, msg.frame());
+      CanStats::countRx(can_msg_id(rx_msg));
+      *timedOut = false;
+      return true;
+    }
+    // other replies (TX_EXPIRED, status) are not used
+  }
+}
+
+CanState CanNode::can_rx(CanMessage *rx_msg, uint32_t) {
 
   if (is_can_msg_pending()) {
     // convert a can_frame into a CanMessage
-    frame_to_message(rx_msg, tmp_msg);
-    free(tmp_msg);
-    tmp_msg = NULL;
-    HAL_Delay(10);
+    frame_to_message(rx_msg, &rx_frames[rx_next++].frame);
+    CanStats::countRx(can_msg_id(rx_msg));
     return DATA_OK;
   }
 
   return NO_DATA;
 }
 
+/**
+ * Take the frames left in the receive batch, up to the next error frame,
+ * without copying them. The views stay valid until the next batch is read,
+ * which can_rx_current() tells.
+ *
+ * \param views[out] first frame
+ * \param batch[out] number of the batch the frames are in
+ *
+ * \returns the number of frames, 0 if none are waiting.
+ */
+uint32_t CanNode::can_rx_views(const CanMessageView **views,
+                               uint32_t *batch) {
+  if (!is_can_msg_pending()) {
+    return 0;
+  }
+
+  int first = rx_next;
+  while (rx_next < rx_count &&
+         !(rx_frames[rx_next].frame.can_id & CAN_ERR_FLAG)) {
+    CanStats::countRx(rx_frames[rx_next++].id());
+  }
+  *views = &rx_frames[first];
+  *batch = rx_batches;
+  return rx_next - first;
+}
+
+/**
+ * \returns false if a batch was read since can_rx_views() returned batch, so
+ * its views now show other frames.
+ */
+bool CanNode::can_rx_current(uint32_t batch) {
+  return batch == rx_batches;
+}
+
+uint8_t CanMessageView::fmi() const {
+  return match_mask_filters(frame.can_id);
+}
+
+void CanMessageView::copy(CanMessage *msg) const {
+  frame_to_message(msg, &frame);
+}
+
+/**
+ * Frames are read from the kernel in batches of up to
+ * \ref CanBusConfig::rxBatch with one recvmmsg() call, taken from the
+ * io_uring completions, or copied from a CanShm ring. This only reads from
+ * the kernel once the previous batch has been used up by can_rx().
+ */
 bool CanNode::is_can_msg_pending() {
-  if (tmp_msg == NULL) {
-    tmp_msg = (can_frame*) malloc(sizeof(struct can_frame));
-  } 
-  else {
-    return true;
+  for (;;) {
+    // error frames update the bus state and are never handed to can_rx()
+    while (rx_next < rx_count) {
+      if (!(rx_frames[rx_next].frame.can_id & CAN_ERR_FLAG)) {
+        return true;
+      }
+      // error frames are always classic frames
+      handle_error_frame(
+          (const struct can_frame *)&rx_frames[rx_next++].frame);
+    }
+
+    if (!fill_batch()) {
+      return false;
+    }
   }
+}
 
-  int nbytes = read(s, tmp_msg, sizeof(struct can_frame));
-  if (nbytes > 0) {
-    return true;
+/**
+ * Read the next batch from the kernel.
+ *
+ * \returns false if there were no frames waiting.
+ */
+static bool fill_batch() {
+  if (CanUring::active()) {
+    return fill_uring_batch();
+  }
+  if (CanShm::consumer()) {
+    return fill_shm_batch();
   }
 
-  free(tmp_msg);
-  tmp_msg = NULL;
+  // reset the control buffers, recvmmsg shrinks msg_controllen
+  for (int i = 0; i < config.rxBatch; ++i) {
+    rx_msgs[i].msg_hdr.msg_control = rx_ctrl[i];
+    rx_msgs[i].msg_hdr.msg_controllen = RX_CTRL_LEN;
+  }
 
-  if (errno = EAGAIN) {
+  rx_next = 0;
+  rx_count = recvmmsg(s, rx_msgs, config.rxBatch, MSG_DONTWAIT, NULL);
+  if (rx_count <= 0) {
+    if (rx_count < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("can raw socket read");
+    }
+    rx_count = 0;
     return false;
   }
-  if (nbytes < 0) {
-    perror("can raw socket read");
-  } 
+  rx_batches++;
+  // older kernels only tell CAN FD frames apart by their size
+  for (int i = 0; i < rx_count; ++i) {
+    struct canfd_frame *frame = (struct canfd_frame *)rx_iov[i].iov_base;
+    frame->flags = rx_msgs[i].msg_len == CANFD_MTU ? frame->flags | CANFD_FDF
+                                                   : 0;
+  }
+  if (CanShm::producer()) {
+    CanShm::publish(rx_frames, sizeof(rx_frames[0]), rx_count,
+                    can_time_ns());
+  }
+
+  // the newest drop counter is in the last frame of the batch
+  struct msghdr *hdr = &rx_msgs[rx_count - 1].msg_hdr;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t ovfl;
+      memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+      update_drops(ovfl);
+    }
+  }
 
-  return false;
+  // a full batch means the queue is backing up
+  if (rx_count == config.rxBatch) {
+    check_backlog();
+  }
+
+  return true;
 }
 
-void frame_to_message(CanMessage *out, struct can_frame *in){
-    out->id = (uint16_t) in->can_id & 0x7FF;
-    out->len = in->can_dlc;
+/**
+ * Take the frames io_uring received since the last batch, they are already
+ * in place in the slots.
+ */
+static bool fill_uring_batch() {
+  uint32_t first;
+  uint32_t count = CanUring::receive(&first);
+  rx_next = first;
+  rx_count = first + count;
+  if (count == 0) {
+    return false;
+  }
+  rx_batches++;
+  if (CanShm::producer()) {
+    CanShm::publish(&rx_frames[first], sizeof(rx_frames[0]), count,
+                    can_time_ns());
+  }
+
+  // completions carry no SO_RXQ_OVFL, read the counter once a second
+  if (can_time_ms() - interval_start >= 1000) {
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(s, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0) {
+      update_drops(meminfo[SK_MEMINFO_DROPS]);
+    }
+  }
+
+  // frames still waiting mean the queue is backing up
+  if (CanUring::pending()) {
+    check_backlog();
+  }
+  return true;
+}
+
+/**
+ * Copy the frames the writer of the ring published since the last batch.
+ * Frames this reader lost by falling behind are counted like kernel drops.
+ */
+static bool fill_shm_batch() {
+  rx_next = 0;
+  rx_count = sleeping ? 0 : CanShm::read(rx_frames, sizeof(rx_frames[0]),
+                                         config.rxBatch, NULL);
+  if (rx_count == 0) {
+    return false;
+  }
+  rx_batches++;
+  update_drops((uint32_t)CanShm::lost());
+  return true;
+}
+
+/**
+ * Decode an error frame (see linux/can/error.h) into the bus status and tell
+ * the state handler if anything changed.
+ */
+static void handle_error_frame(const struct can_frame *frame) {
+  CanBusStatus before = bus_status;
+  before.state = bus_state;
+  CanState state = bus_state;
+
+  bus_status.errorFrames++;
+  bus_status.errorClass = frame->can_id & CAN_ERR_MASK;
+
+  if (frame->can_id & CAN_ERR_CRTL) {
+    uint8_t ctrl = frame->data[1];
+    if (ctrl & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE)) {
+      bus_status.errorState = CAN_ERROR_PASSIVE;
+    } else if (ctrl & (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING)) {
+      bus_status.errorState = CAN_ERROR_WARNING;
+    } else if (ctrl & CAN_ERR_CRTL_ACTIVE) {
+      bus_status.errorState = CAN_ERROR_ACTIVE;
+    }
+  }
+  if (frame->can_id & CAN_ERR_CNT) {
+    bus_status.txErrors = frame->data[6];
+    bus_status.rxErrors = frame->data[7];
+  }
+  if (frame->can_id & CAN_ERR_TX_TIMEOUT) {
+    state = BUS_BUSY;
+  }
+  if (frame->can_id & CAN_ERR_BUSOFF) {
+    bus_status.errorState = CAN_ERROR_BUS_OFF;
+    state = BUS_OFF;
+    next_probe = can_time_ms() + config.busOffProbe;
+  }
+  if (frame->can_id & CAN_ERR_RESTARTED) {
+    bus_status.errorState = CAN_ERROR_ACTIVE;
+    state = BUS_OK;
+  }
+
+  bus_state = state;
+  bus_status.state = state;
+  if (state_handle != NULL &&
+      (before.state != state || before.errorState != bus_status.errorState ||
+       before.txErrors != bus_status.txErrors ||
+       before.rxErrors != bus_status.rxErrors)) {
+    state_handle(&bus_status);
+  }
+}
+
+/**
+ * Change the bus state from the transmit path and tell the state handler.
+ */
+static void set_bus_state(CanState state) {
+  if (bus_state == state) {
+    return;
+  }
+  bus_state = state;
+  bus_status.state = state;
+  if (state == BUS_OK && bus_status.errorState == CAN_ERROR_BUS_OFF) {
+    bus_status.errorState = CAN_ERROR_ACTIVE;
+  }
+  if (state_handle != NULL) {
+    state_handle(&bus_status);
+  }
+}
+
+/**
+ * Account for the socket's cumulative drop counter and warn once per second
+ * if the drops go over \ref CanBusConfig::dropWarn.
+ */
+static void update_drops(uint32_t ovfl) {
+  uint32_t dropped = ovfl - ovfl_last;
+  ovfl_last = ovfl;
+  kernel_drops += dropped;
+  interval_drops += dropped;
+  if (dropped != 0) {
+    CanStats::countRxDropped(dropped);
+  }
+
+  uint64_t now = can_time_ms();
+  if (now - interval_start < 1000) {
+    return;
+  }
+  if (interval_drops > config.dropWarn) {
+    fprintf(stderr, "%s: kernel dropped %u frames in the last %ums\n",
+            config.interface, interval_drops,
+            (unsigned int)(now - interval_start));
+  }
+  interval_start = now;
+  interval_drops = 0;
+  backlog_warned = false;
+}
+
+/**
+ * Warn before frames are lost if the receive queue is more than three
+ * quarters full.
+ */
+static void check_backlog() {
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len = sizeof(meminfo);
+  if (backlog_warned ||
+      getsockopt(s, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0) {
+    return;
+  }
+
+  uint32_t used = meminfo[SK_MEMINFO_RMEM_ALLOC];
+  uint32_t size = meminfo[SK_MEMINFO_RCVBUF];
+  if (size != 0 && used > size / 4 * 3) {
+    fprintf(stderr, "%s: receive queue %u%% full, frames will be dropped\n",
+            config.interface, (unsigned int)(used * 100ULL / size));
+    backlog_warned = true;
+  }
+}
+
+void frame_to_message(CanMessage *out, const struct canfd_frame *in){
+    out->ext = (in->can_id & CAN_EFF_FLAG) ? true : false;
+    out->id = in->can_id & (out->ext ? CAN_EFF_MASK : CAN_SFF_MASK);
+    out->fmi = match_mask_filters(in->can_id);
+    // len is where can_dlc is in a classic can_frame
+    out->len = in->len > CAN_MAX_DATA ? CAN_MAX_DATA : in->len;
     out->rtr = (in->can_id & CAN_RTR_FLAG) ? true : false;
-    memcpy(out->data, in->data, 8);
+    memcpy(out->data, in->data, out->len);
+    memset(out->data + out->len, 0, CAN_MAX_DATA - out->len);
 }
 
-void message_to_frame(struct can_frame *out, CanMessage *in){
+/**
+ * CAN FD frames can only be 12, 16, 20, 24, 32, 48 or 64 bytes long past 8, so
+ * longer messages are padded with zeros to the next of these lengths.
+ *
+ * \returns the number of bytes of out to write, CAN_MTU or CANFD_MTU.
+ */
+size_t message_to_frame(struct canfd_frame *out, const CanMessage *in){
     out->can_id = in->id;
+    out->can_id |= in->ext ? CAN_EFF_FLAG : 0;
     out->can_id |= in->rtr ? CAN_RTR_FLAG: 0;
-    out->can_dlc = in->len;
-    memcpy(out->data, in->data, 8);
+    out->flags = 0;
+    out->__res0 = 0;
+    out->__res1 = 0;
+    if (in->len <= CAN_MAX_DLEN) {
+      out->len = in->len;
+      memcpy(out->data, in->data, CAN_MAX_DLEN);
+      return CAN_MTU;
+    }
+
+    out->len = can_fd_len(in->len);
+    memcpy(out->data, in->data, in->len);
+    memset(out->data + in->len, 0, out->len - in->len);
+    return CANFD_MTU;
+}
+
+/**
+ * \returns the shortest CAN FD frame length that holds len bytes.
+ */
+static uint8_t can_fd_len(uint8_t len) {
+  static const uint8_t lengths[] = {12, 16, 20, 24, 32, 48, CANFD_MAX_DLEN};
+  for (uint8_t i = 0; i < sizeof(lengths) - 1; ++i) {
+    if (len <= lengths[i]) {
+      return lengths[i];
+    }
+  }
+  return CANFD_MAX_DLEN;
 }
@@ -0,0 +1,367 @@
+/**
+ * canBench.cpp
+ * \brief Compares the io_uring backend (see CanUring.h) with the plain
+ * recvmmsg() and sendmmsg() system calls on the same sockets.
+ *
+ * Each backend runs three tests over its own pair of sockets, a datagram
+ * socketpair by default or two raw CAN sockets on an interface with -i
+ * (e.g. a vcan), so no bus or other process is needed:
+ *
+ * - rx: a thread writes -n frames as fast as it can, the backend receives
+ *   them in batches, waiting in poll() when nothing is there
+ * - tx: the backend sends -n frames in batches of -b, a thread drains them
+ * - rtt: one frame is sent and echoed back by a thread, -r times
+ *
+ * Reported are the frames per second, the CPU time the receiving or sending
+ * thread spent per frame, and the mean and 99th percentile round trip.
+ *
+ * ~~~~~~~~~~~~
+ * canBench
+ * canBench -i vcan0 -n 200000 -b 64
+ * ~~~~~~~~~~~~
+ */
+#include "CanNode/CanTime.h"
+#include "CanNode/CanUring.h"
+#include <errno.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+/// Most frames moved by one system call, the receive slots of io_uring
+#define BATCH_MAX 64
+
+/// What a test measured
+typedef struct {
+  uint64_t frames;
+  uint64_t wallNs;
+  uint64_t cpuNs; ///< of the thread running the backend
+} Result;
+
+static uint64_t frames = 1000000;
+static uint32_t batch = 32;
+static uint32_t trips = 10000;
+static const char *interface = NULL;
+
+static uint8_t slots[BATCH_MAX][CANFD_MTU];
+
+static uint64_t thread_cpu_ns() {
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  return (uint64_t)ru.ru_utime.tv_sec * 1000000000ULL +
+         ru.ru_utime.tv_usec * 1000ULL +
+         (uint64_t)ru.ru_stime.tv_sec * 1000000000ULL +
+         ru.ru_stime.tv_usec * 1000ULL;
+}
+
+static int can_socket(unsigned int ifindex) {
+  int fd = socket(PF_CAN, SOCK_RAW | SOCK_CLOEXEC, CAN_RAW);
+  if (fd < 0) {
+    perror("can socket");
+    return -1;
+  }
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifindex;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(interface);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Open two connected sockets: what one sends the other receives.
+ */
+static bool open_pair(int fds[2]) {
+  if (interface == NULL) {
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) < 0) {
+      perror("socketpair");
+      return false;
+    }
+    return true;
+  }
+  unsigned int ifindex = if_nametoindex(interface);
+  if (ifindex == 0) {
+    perror(interface);
+    return false;
+  }
+  fds[0] = can_socket(ifindex);
+  fds[1] = fds[0] >= 0 ? can_socket(ifindex) : -1;
+  return fds[1] >= 0;
+}
+
+static void wait_for(int fd, short events) {
+  struct pollfd pfd = {fd, events, 0};
+  poll(&pfd, 1, 100);
+}
+
+static void fill_frames(struct can_frame *tx, struct iovec *iov,
+                        struct mmsghdr *msgs, uint32_t count) {
+  memset(msgs, 0, count * sizeof(*msgs));
+  for (uint32_t i = 0; i < count; ++i) {
+    memset(&tx[i], 0, sizeof(tx[i]));
+    tx[i].can_id = 900 + i;
+    tx[i].len = 8;
+    iov[i].iov_base = &tx[i];
+    iov[i].iov_len = sizeof(tx[i]);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+/// Write count frames to fd, blocking while its peer is full
+static void feed(int fd, uint64_t count) {
+  struct can_frame tx[BATCH_MAX];
+  struct iovec iov[BATCH_MAX];
+  struct mmsghdr msgs[BATCH_MAX];
+  fill_frames(tx, iov, msgs, BATCH_MAX);
+  while (count > 0) {
+    int n = sendmmsg(fd, msgs, count < BATCH_MAX ? count : BATCH_MAX, 0);
+    if (n < 0) {
+      if (errno == EINTR || errno == ENOBUFS) {
+        usleep(10);
+        continue;
+      }
+      perror("feed");
+      return;
+    }
+    count -= n;
+  }
+}
+
+/// Read count frames from fd
+static void drain(int fd, uint64_t count) {
+  static struct can_frame rx[BATCH_MAX];
+  struct iovec iov[BATCH_MAX];
+  struct mmsghdr msgs[BATCH_MAX];
+  fill_frames(rx, iov, msgs, BATCH_MAX);
+  while (count > 0) {
+    int n = recvmmsg(fd, msgs, BATCH_MAX, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("drain");
+      return;
+    }
+    count -= n;
+  }
+}
+
+/// Echo count frames from fd back to it
+static void echo(int fd, uint32_t count) {
+  struct can_frame frame;
+  for (uint32_t i = 0; i < count;) {
+    if (recv(fd, &frame, sizeof(frame), 0) == (ssize_t)sizeof(frame)) {
+      send(fd, &frame, sizeof(frame), 0);
+      i++;
+    }
+  }
+}
+
+/**
+ * Receive up to BATCH_MAX frames from fd with the backend, waiting up to
+ * 100 ms if none are there.
+ */
+static uint32_t receive(int fd, bool uring) {
+  if (uring) {
+    uint32_t first;
+    if (!CanUring::pending()) {
+      wait_for(CanUring::fd(), POLLIN);
+    }
+    return CanUring::receive(&first);
+  }
+
+  static struct iovec iov[BATCH_MAX];
+  static struct mmsghdr msgs[BATCH_MAX];
+  for (uint32_t i = 0; i < BATCH_MAX; ++i) {
+    iov[i].iov_base = slots[i];
+    iov[i].iov_len = CANFD_MTU;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int n = recvmmsg(fd, msgs, BATCH_MAX, MSG_DONTWAIT, NULL);
+  if (n > 0) {
+    return n;
+  }
+  wait_for(fd, POLLIN);
+  return 0;
+}
+
+/**
+ * Send count frames to fd with the backend, the way can.cpp hands over a
+ * batch: without blocking, waiting for room when the peer is full.
+ *
+ * \returns the number of frames sent.
+ */
+static int send_batch(int fd, bool uring, struct iovec *iov,
+                      struct mmsghdr *msgs, uint32_t count) {
+  int n = uring ? CanUring::send(iov, count)
+                : sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == ENOBUFS) {
+      wait_for(fd, POLLOUT);
+    }
+    return 0;
+  }
+  return n;
+}
+
+static Result bench_rx(int fds[2], bool uring) {
+  Result r = {frames, 0, 0};
+  uint64_t start = can_time_ns();
+  uint64_t cpu = thread_cpu_ns();
+  std::thread feeder(feed, fds[0], frames);
+  for (uint64_t got = 0; got < frames;) {
+    got += receive(fds[1], uring);
+  }
+  r.cpuNs = thread_cpu_ns() - cpu;
+  r.wallNs = can_time_ns() - start;
+  feeder.join();
+  return r;
+}
+
+static Result bench_tx(int fds[2], bool uring) {
+  struct can_frame tx[BATCH_MAX];
+  struct iovec iov[BATCH_MAX];
+  struct mmsghdr msgs[BATCH_MAX];
+  fill_frames(tx, iov, msgs, batch);
+
+  Result r = {frames, 0, 0};
+  uint64_t start = can_time_ns();
+  uint64_t cpu = thread_cpu_ns();
+  std::thread drainer(drain, fds[0], frames);
+  for (uint64_t sent = 0; sent < frames;) {
+    uint32_t count = frames - sent < batch ? frames - sent : batch;
+    sent += send_batch(fds[1], uring, iov, msgs, count);
+  }
+  r.cpuNs = thread_cpu_ns() - cpu;
+  drainer.join();
+  r.wallNs = can_time_ns() - start;
+  return r;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * \param p99[out] 99th percentile round trip in ns
+ *
+ * \returns the mean round trip in ns.
+ */
+static uint64_t bench_rtt(int fds[2], bool uring, uint64_t *p99) {
+  struct can_frame tx[1];
+  struct iovec iov[1];
+  struct mmsghdr msgs[1];
+  fill_frames(tx, iov, msgs, 1);
+  uint64_t *samples = (uint64_t *)malloc(trips * sizeof(uint64_t));
+  if (samples == NULL) {
+    perror("rtt samples");
+    return 0;
+  }
+
+  std::thread echoer(echo, fds[0], trips);
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < trips; ++i) {
+    uint64_t start = can_time_ns();
+    while (send_batch(fds[1], uring, iov, msgs, 1) != 1)
+      ;
+    while (receive(fds[1], uring) == 0)
+      ;
+    samples[i] = can_time_ns() - start;
+    total += samples[i];
+  }
+  echoer.join();
+
+  qsort(samples, trips, sizeof(uint64_t), compare_u64);
+  *p99 = samples[trips * 99 / 100];
+  free(samples);
+  return total / trips;
+}
+
+static void print(const char *test, const char *backend, const Result &r) {
+  printf("%-4s %-8s %9llu frames %8.1f ms %7.2f Mframes/s "
+         "%6.0f ns cpu/frame\n",
+         test, backend, (unsigned long long)r.frames, r.wallNs / 1e6,
+         r.wallNs > 0 ? r.frames * 1e3 / r.wallNs : 0,
+         r.frames > 0 ? (double)r.cpuNs / r.frames : 0);
+}
+
+static bool run(bool uring) {
+  const char *name = uring ? "io_uring" : "syscalls";
+  int fds[2];
+  if (!open_pair(fds)) {
+    return false;
+  }
+  if (uring && !CanUring::init(fds[1], slots, CANFD_MTU, BATCH_MAX)) {
+    fprintf(stderr, "io_uring is not available\n");
+    return false;
+  }
+
+  print("rx", name, bench_rx(fds, uring));
+  print("tx", name, bench_tx(fds, uring));
+  uint64_t p99;
+  uint64_t mean = bench_rtt(fds, uring, &p99);
+  printf("%-4s %-8s %9u trips  %8.1f us mean %6.1f us p99\n", "rtt", name,
+         trips, mean / 1e3, p99 / 1e3);
+  // the io_uring ring stays on its socket until the process exits
+  if (!uring) {
+    close(fds[0]);
+    close(fds[1]);
+  }
+  return true;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-i interface] [-n frames] [-b batch] [-r trips]\n"
+          "  -i  raw CAN sockets on interface, a socketpair by default\n"
+          "  -n  frames of the rx and tx tests (default 1000000)\n"
+          "  -b  frames per send of the tx test, at most %d (default 32)\n"
+          "  -r  round trips of the rtt test (default 10000)\n",
+          name, BATCH_MAX);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "i:n:b:r:h")) != -1) {
+    switch (opt) {
+    case 'i':
+      interface = optarg;
+      break;
+    case 'n':
+      frames = strtoull(optarg, NULL, 0);
+      break;
+    case 'b':
+      batch = (uint32_t)atoi(optarg);
+      break;
+    case 'r':
+      trips = (uint32_t)atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (batch == 0 || batch > BATCH_MAX || trips == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  bool ok = run(false);
+  ok = run(true) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,268 @@
+/**
+ * canBridge.cpp
+ * \brief Forwards the traffic of a bus to other machines over UDP multicast,
+ * and their traffic back onto the bus.
+ *
+ * Frames received on the bus are packed into datagrams by a CanBridge and
+ * sent to the multicast group, frames arriving from other bridges in the
+ * group are sent on the bus. With -m no bus is used: the bridge sends a
+ * counting pattern at the given rate and checks the patterns of the other
+ * bridges, so two bridges can be tested over localhost multicast without any
+ * CAN hardware.
+ *
+ * ~~~~~~~~~~~~
+ * canBridge -i can0              # vehicle computer
+ * canBridge -i vcan0 -T          # pit laptop, only puts frames on vcan0
+ * canBridge -m 20000 & canBridge -m 0
+ * ~~~~~~~~~~~~
+ */
+#include "CanNode/CanBridge.h"
+#include "CanNode/CanNode.h"
+#include "CanNode/CanTime.h"
+#include <atomic>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+/// Id of the node the bridge creates to bring up the bus
+#define BRIDGE_NODE_ID 2000
+
+static volatile sig_atomic_t stop;
+
+/// counting pattern of one sender in -m mode
+typedef struct {
+  uint32_t sender;
+  uint32_t next;
+  uint64_t gaps;
+} Pattern;
+
+static Pattern patterns[CAN_BRIDGE_PEERS];
+static uint64_t patternGaps;
+
+static void onSignal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+/// wall clock time, comparable between machines
+static uint64_t wall_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-i interface] [-g group] [-p port] [-a local address]\n"
+          "          [-t ttl] [-s datagram bytes] [-l latency us] [-T] [-R]\n"
+          "          [-m frames/s] [-v]\n"
+          "  -T  do not send frames of the bus to the group\n"
+          "  -R  do not put frames of the group on the bus\n"
+          "  -m  no bus, send a counting pattern and check the ones received\n"
+          "  -v  print counters every second\n",
+          name);
+}
+
+static void printStats(const CanBridge *bridge) {
+  CanBridgeStats stats;
+  bridge->getStats(&stats);
+  fprintf(stderr,
+          "sent %llu frames in %llu datagrams (%llu errors), received %llu "
+          "frames in %llu datagrams, %llu lost, %llu late, %llu bad",
+          (unsigned long long)stats.framesSent,
+          (unsigned long long)stats.datagramsSent,
+          (unsigned long long)stats.sendErrors,
+          (unsigned long long)stats.framesReceived,
+          (unsigned long long)stats.datagramsReceived,
+          (unsigned long long)stats.datagramsLost,
+          (unsigned long long)stats.datagramsLate,
+          (unsigned long long)stats.badDatagrams);
+  if (patternGaps != 0) {
+    fprintf(stderr, ", %llu pattern gaps", (unsigned long long)patternGaps);
+  }
+  fprintf(stderr, "\n");
+}
+
+/**
+ * Check that the frames of each sender count up by one.
+ */
+static void checkPattern(const CanBridgeFrame &frame) {
+  uint32_t value;
+  if (CanNode::getData(&frame.msg, &value) != DATA_OK) {
+    patternGaps++;
+    return;
+  }
+  Pattern *pattern = &patterns[frame.sender % CAN_BRIDGE_PEERS];
+  if (pattern->sender != frame.sender) {
+    pattern->sender = frame.sender;
+  } else if (value != pattern->next) {
+    patternGaps++;
+  }
+  pattern->next = value + 1;
+}
+
+/**
+ * -m: no bus, add rate frames a second and check what the others send.
+ */
+static void runMemory(CanBridge *bridge, uint32_t rate, bool verbose) {
+  CanMessage msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.id = BRIDGE_NODE_ID;
+  msg.data[0] = (uint8_t)((0x7 & CAN_UINT32) << 5) | (0x1F & CAN_DATA);
+  msg.len = 5;
+
+  uint64_t start = can_time_ns();
+  uint64_t added = 0;
+  uint64_t nextStats = can_time_ms() + 1000;
+  struct pollfd fds = {bridge->fd(), POLLIN, 0};
+  while (!stop) {
+    // catch up with the rate, a bounded burst at a time
+    uint64_t due = rate == 0 ? 0 : (can_time_ns() - start) * rate / 1000000000;
+    for (uint32_t burst = 0; added < due && burst < 4096; ++burst) {
+      uint32_t value = (uint32_t)added++;
+      for (int b = 0; b < 4; ++b) {
+        msg.data[1 + b] = (uint8_t)(value >> (b * 8));
+      }
+      bridge->add(&msg, wall_ns());
+    }
+    bridge->service();
+
+    uint32_t wait = bridge->timeout(rate == 0 ? 100 : 1);
+    if (poll(&fds, 1, (int)wait) > 0) {
+      while (bridge->receive(checkPattern) != 0) {
+      }
+    }
+    if (verbose && can_time_ms() >= nextStats) {
+      nextStats += 1000;
+      printStats(bridge);
+    }
+  }
+}
+
+/**
+ * Forward bus frames to the group on this thread, and frames of the group to
+ * the bus on a second one.
+ */
+static void runBus(CanBridge *bridge, const char *interface, bool toGroup,
+                   bool toBus, bool verbose) {
+  CanBusConfig config;
+  memset(&config, 0, sizeof(config));
+  config.interface = interface;
+  CanNode::setBusConfig(&config);
+  CanNode node(BRIDGE_NODE_ID, nullptr);
+
+  if (toGroup) {
+    CanNode::setBatchHandler([bridge](const CanMessageBatch &batch) {
+      uint64_t now = wall_ns();
+      for (const CanMessageView &view : batch) {
+        bridge->add(view, now);
+      }
+    });
+  }
+
+  // other threads stage their messages, the loop below sends them
+  std::thread receiver([bridge, toBus]() {
+    struct pollfd fds = {bridge->fd(), POLLIN, 0};
+    while (!stop) {
+      if (poll(&fds, 1, 100) <= 0) {
+        continue;
+      }
+      bridge->receive([toBus](const CanBridgeFrame &frame) {
+        if (toBus) {
+          // can_tx() sends up to 8 bytes as a classic frame, so fdFlags only
+          // survives for longer frames
+          CanMessage msg = frame.msg;
+          CanNode::can_tx(&msg, 0);
+        }
+      });
+    }
+  });
+
+  uint64_t nextStats = can_time_ms() + 1000;
+  while (!stop) {
+    CanNode::waitForMessages(bridge->timeout(100));
+    CanNode::checkForMessages();
+    bridge->service();
+    if (verbose && can_time_ms() >= nextStats) {
+      nextStats += 1000;
+      printStats(bridge);
+    }
+  }
+  receiver.join();
+}
+
+int main(int argc, char **argv) {
+  CanBridgeConfig config;
+  memset(&config, 0, sizeof(config));
+  const char *interface = "can0";
+  bool toGroup = true;
+  bool toBus = true;
+  bool memory = false;
+  bool verbose = false;
+  uint32_t rate = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:g:p:a:t:s:l:TRm:vh")) != -1) {
+    switch (opt) {
+    case 'i':
+      interface = optarg;
+      break;
+    case 'g':
+      config.group = optarg;
+      break;
+    case 'p':
+      config.port = (uint16_t)atoi(optarg);
+      break;
+    case 'a':
+      config.local = optarg;
+      break;
+    case 't':
+      config.ttl = (uint8_t)atoi(optarg);
+      break;
+    case 's':
+      config.datagramSize = (uint16_t)atoi(optarg);
+      break;
+    case 'l':
+      config.maxLatency = (uint32_t)atoi(optarg);
+      break;
+    case 'T':
+      toGroup = false;
+      break;
+    case 'R':
+      toBus = false;
+      break;
+    case 'm':
+      memory = true;
+      rate = (uint32_t)atoi(optarg);
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  CanBridge bridge;
+  if (!bridge.open(&config)) {
+    return 1;
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  if (memory) {
+    runMemory(&bridge, rate, verbose);
+  } else {
+    runBus(&bridge, interface, toGroup, toBus, verbose);
+  }
+
+  bridge.close();
+  printStats(&bridge);
+  return 0;
+}
@@ -0,0 +1,238 @@
+/**
+ * canLogger.cpp
+ * \brief Captures CAN interfaces into an indexed capture file.
+ *
+ * Frames are read from AF_PACKET rings (see CanCapture) and written to a
+ * capture file in blocks (see CanLogWriter), each with the time range and id
+ * bitmap canQuery uses to skip it. A block that is not full is written
+ * anyway after -f mili-seconds, so a crash loses little. With -z blocks are
+ * compressed as they are written (see CanLogCodec).
+ *
+ * With -p the frames also go to a pcapng file, or a pcap file for a name
+ * ending in ".pcap" (see CanPcap). "-" writes it to stdout, to watch the bus
+ * live in Wireshark.
+ *
+ * With -s the logger also brings up the bus on the first interface and
+ * shares what it receives through a shared memory ring, so other processes
+ * can attach to it instead of opening sockets of their own (see CanShm).
+ *
+ * ~~~~~~~~~~~~
+ * canLogger -i can0 -i can1 -o drive.canlog -v
+ * canLogger -i can0 -o drive.canlog -s /can0 -d 3600 -z
+ * canLogger -i can0 -p - -f 100 | wireshark -k -i -
+ * ~~~~~~~~~~~~
+ */
+#include "CanNode/CanCapture.h"
+#include "CanNode/CanLog.h"
+#include "CanNode/CanNode.h"
+#include "CanNode/CanPcap.h"
+#include "CanNode/CanTime.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Id of the node the logger creates to bring up the bus for -s
+#define LOGGER_NODE_ID 2001
+
+static volatile sig_atomic_t stop;
+
+static void onSignal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s -i interface [-i interface]... [-o file] [-b block KiB]\n"
+          "          [-f flush ms] [-d seconds] [-s ring] [-z] [-p pcap]\n"
+          "          [-O] [-H] [-v]\n"
+          "  -f  write a block that is not full after this long, default "
+          "1000\n"
+          "  -s  share the frames of the first interface through a shm ring\n"
+          "  -z  compress the blocks\n"
+          "  -p  also write a pcapng or .pcap file, - for stdout\n"
+          "  -O  also log frames sent from this host\n"
+          "  -H  use hardware timestamps if the interfaces have them\n"
+          "  -v  print counters every second\n",
+          name);
+}
+
+static void printStats(const CanLogWriter *writer, const CanPcapWriter *pcap,
+                       uint8_t interfaces) {
+  CanLogWriterStats stats;
+  writer->getStats(&stats);
+  fprintf(stderr, "%llu frames in %llu blocks, %.1f MB, %llu write errors",
+          (unsigned long long)stats.frames, (unsigned long long)stats.blocks,
+          stats.bytes / 1e6, (unsigned long long)stats.writeErrors);
+  if (stats.encodeNs != 0) {
+    fprintf(stderr, ", %.2fx compressed at %.0f MB/s",
+            (double)stats.rawBytes / stats.bytes,
+            stats.rawBytes / 1e6 / (stats.encodeNs / 1e9));
+  }
+  if (pcap != NULL) {
+    CanPcapStats pcapStats;
+    pcap->getStats(&pcapStats);
+    fprintf(stderr, ", pcap %.1f MB, %llu write errors",
+            pcapStats.bytes / 1e6,
+            (unsigned long long)pcapStats.writeErrors);
+  }
+  for (uint8_t i = 0; i < interfaces; ++i) {
+    CanCaptureStats capture;
+    if (CanCapture::getStats(i, &capture)) {
+      fprintf(stderr, ", %u: %llu dropped", i,
+              (unsigned long long)capture.dropped);
+    }
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+  CanLogConfig config;
+  memset(&config, 0, sizeof(config));
+  CanCaptureConfig capture;
+  memset(&capture, 0, sizeof(capture));
+  const char *path = "capture.canlog";
+  const char *ring = NULL;
+  const char *pcapPath = NULL;
+  uint8_t interfaces = 0;
+  uint64_t flushAfter = 1000;
+  double duration = 0;
+  bool verbose = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:o:b:f:d:s:zp:OHvh")) != -1) {
+    switch (opt) {
+    case 'i':
+      if (interfaces == CAN_LOG_INTERFACES) {
+        fprintf(stderr, "at most %d interfaces\n", CAN_LOG_INTERFACES);
+        return 1;
+      }
+      config.interfaces[interfaces++] = optarg;
+      break;
+    case 'o':
+      path = optarg;
+      break;
+    case 'b':
+      config.blockSize = (uint32_t)atoi(optarg) * 1024;
+      break;
+    case 'f':
+      flushAfter = (uint64_t)atoi(optarg);
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 's':
+      ring = optarg;
+      break;
+    case 'z':
+      config.compress = true;
+      break;
+    case 'p':
+      pcapPath = optarg;
+      break;
+    case 'O':
+      capture.outgoing = true;
+      break;
+    case 'H':
+      capture.hwTimestamps = true;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (interfaces == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // the index of an interface in the file is its capture number
+  for (uint8_t i = 0; i < interfaces; ++i) {
+    if (CanCapture::open(config.interfaces[i], &capture) != i) {
+      return 1;
+    }
+  }
+  CanLogWriter writer;
+  if (!writer.open(path, &config)) {
+    return 1;
+  }
+  CanPcapWriter pcapWriter;
+  CanPcapWriter *pcap = NULL;
+  if (pcapPath != NULL) {
+    CanPcapConfig pcapConfig;
+    memset(&pcapConfig, 0, sizeof(pcapConfig));
+    pcapConfig.format = can_pcap_format(pcapPath);
+    memcpy(pcapConfig.interfaces, config.interfaces,
+           sizeof(pcapConfig.interfaces));
+    if (!pcapWriter.open(pcapPath, &pcapConfig)) {
+      return 1;
+    }
+    pcap = &pcapWriter;
+  }
+
+  CanNode *node = NULL;
+  if (ring != NULL) {
+    CanBusConfig bus;
+    memset(&bus, 0, sizeof(bus));
+    bus.interface = config.interfaces[0];
+    bus.shmRing = ring;
+    CanNode::setBusConfig(&bus);
+    node = new CanNode(LOGGER_NODE_ID, nullptr);
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  uint64_t end = duration > 0 ? can_time_ms() + (uint64_t)(duration * 1000)
+                              : 0;
+  uint64_t oldest = 0; // can_time_ms() the open block got its first frame
+  uint64_t pcapFlushed = can_time_ms();
+  uint64_t nextStats = can_time_ms() + 1000;
+  while (!stop) {
+    // the bus socket is not in the capture poll, so do not wait long on it
+    CanCapture::poll(node != NULL ? 10 : 100,
+                     [&writer, pcap](const CanCaptureFrame &frame) {
+                       writer.add(frame);
+                       if (pcap != NULL) {
+                         pcap->add(frame);
+                       }
+                     });
+    if (node != NULL) {
+      CanNode::checkForMessages();
+    }
+
+    uint64_t now = can_time_ms();
+    if (writer.pending() == 0) {
+      oldest = 0;
+    } else if (oldest == 0) {
+      oldest = now;
+    } else if (now - oldest >= flushAfter) {
+      writer.flush();
+      oldest = 0;
+    }
+    // the pcap stream may be watched live, so it is flushed on its own
+    if (pcap != NULL && pcap->pending() != 0 &&
+        now - pcapFlushed >= flushAfter) {
+      pcap->flush();
+      pcapFlushed = now;
+    }
+    if (verbose && now >= nextStats) {
+      nextStats += 1000;
+      printStats(&writer, pcap, interfaces);
+    }
+    if (end != 0 && now >= end) {
+      break;
+    }
+  }
+
+  writer.close();
+  pcapWriter.close();
+  printStats(&writer, pcap, interfaces);
+  CanCapture::close();
+  delete node;
+  return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * canPcap.cpp
+ * \brief Converts a capture file to pcapng or pcap for Wireshark.
+ *
+ * The blocks of the capture are read through its memory map, decoded by -j
+ * threads if they are compressed, and their frames streamed out in order
+ * through a CanPcapWriter (see CanPcap.h), so files of any size convert in
+ * little memory. The output is pcap for a name ending in ".pcap" or with
+ * -F pcap, pcapng otherwise; "-" or no name writes to stdout.
+ *
+ * ~~~~~~~~~~~~
+ * canPcap drive.canlog drive.pcapng
+ * canPcap -j 4 drive.canlog | wireshark -k -i -
+ * ~~~~~~~~~~~~
+ */
+#include "CanNode/CanLog.h"
+#include "CanNode/CanPcap.h"
+#include "CanNode/CanTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-F pcap|pcapng] [-j threads] [-s] file [output]\n"
+          "  -F  output format, by default from the output name\n"
+          "  -j  threads decoding compressed blocks\n"
+          "  -s  print what was converted\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  const char *format = NULL;
+  uint32_t threads = 1;
+  bool verbose = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "F:j:sh")) != -1) {
+    switch (opt) {
+    case 'F':
+      format = optarg;
+      if (strcmp(format, "pcap") != 0 && strcmp(format, "pcapng") != 0) {
+        fprintf(stderr, "bad format %s\n", format);
+        return 1;
+      }
+      break;
+    case 'j':
+      threads = (uint32_t)atoi(optarg);
+      break;
+    case 's':
+      verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind + 1 != argc && optind + 2 != argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *output = optind + 2 == argc ? argv[optind + 1] : "-";
+
+  CanLogReader log;
+  if (!log.open(argv[optind])) {
+    return 1;
+  }
+  const CanLogFileHeader *file = log.header();
+
+  CanPcapConfig config;
+  memset(&config, 0, sizeof(config));
+  config.format = format != NULL ? (strcmp(format, "pcap") == 0 ? CAN_PCAP
+                                                                : CAN_PCAPNG)
+                                 : can_pcap_format(output);
+  char names[CAN_LOG_INTERFACES][CAN_LOG_NAME + 1];
+  for (uint8_t i = 0; i < file->numInterfaces && i < CAN_LOG_INTERFACES; ++i) {
+    memcpy(names[i], file->interfaces[i], CAN_LOG_NAME);
+    names[i][CAN_LOG_NAME] = '\0';
+    config.interfaces[i] = names[i];
+  }
+  CanPcapWriter pcap;
+  if (!pcap.open(output, &config)) {
+    return 1;
+  }
+
+  CanLogQuery query;
+  can_log_query_init(&query);
+  CanLogQueryStats stats;
+  uint64_t start = can_time_ns();
+  CanPcapWriter *w = &pcap;
+  log.query(&query, threads, [w](const CanLogFrame &frame) { w->add(frame); },
+            &stats);
+  pcap.close();
+  double seconds = (can_time_ns() - start) / 1e9;
+
+  CanPcapStats written;
+  pcap.getStats(&written);
+  if (verbose) {
+    fprintf(stderr,
+            "%llu frames, %.1f MB to %.1f MB in %.3fs, %.0f MB/s in, "
+            "%.0f MB/s out\n",
+            (unsigned long long)written.frames, stats.bytesRead / 1e6,
+            written.bytes / 1e6, seconds,
+            seconds > 0 ? stats.bytesRead / 1e6 / seconds : 0,
+            seconds > 0 ? written.bytes / 1e6 / seconds : 0);
+  }
+  return written.writeErrors == 0 ? 0 : 1;
+}
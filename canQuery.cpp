@@ -0,0 +1,363 @@
+/**
+ * canQuery.cpp
+ * \brief Prints the frames of a capture file that match a query.
+ *
+ * The file is mapped and only the blocks whose index entry may hold matching
+ * frames are read, by -j threads at once. Frames are printed in the order
+ * they were logged, in the candump log format:
+ *
+ * ~~~~~~~~~~~~
+ * canQuery -i 0x123,0x200-0x20f -f +60 -t +65 drive.canlog
+ * canQuery -i e0x18fef100 -p 01xx3f -j 8 -s drive.canlog
+ * (1697040000.123456789) can0 123#DEADBEEF
+ * canQuery -w small.canlog -z -s drive.canlog
+ * ~~~~~~~~~~~~
+ *
+ * With -w the matching frames go to a new capture file instead, compressed
+ * with -z, which also converts whole files between plain and compressed
+ * blocks. -s then tells how well and how fast the blocks were encoded, and
+ * how fast encoded blocks were decoded.
+ *
+ * Times are seconds since the epoch, or seconds after the first frame of the
+ * file with a + in front. A payload pattern gives the first data bytes in
+ * hex, an x matches any nibble.
+ */
+#include "CanNode/CanLog.h"
+#include "CanNode/CanTime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char hex[] = "0123456789ABCDEF";
+
+/// interface names of the file
+static const CanLogFileHeader *file;
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-i ids] [-f from] [-t to] [-p payload] [-n frames]\n"
+          "          [-j threads] [-w file [-z]] [-c] [-s] file\n"
+          "  -i  ids and ranges, e.g. 0x123,0x200-0x20f,e0x18fef100\n"
+          "  -f  -t  seconds since the epoch, or since the first frame with "
+          "+\n"
+          "  -p  first data bytes in hex, x for any nibble, e.g. 01xx3f\n"
+          "  -w  write the frames to a capture file instead, -z compressed\n"
+          "  -c  only count the frames\n"
+          "  -s  print what was read and skipped\n",
+          name);
+}
+
+/// Parse one id, "e" in front for an extended id
+static bool parseId(const char *str, char **end, uint32_t *id) {
+  bool ext = *str == 'e';
+  unsigned long value = strtoul(str + (ext ? 1 : 0), end, 0);
+  *id = ext ? ((uint32_t)value | CAN_ID_EXT) : (uint32_t)value;
+  return *end != str && can_id_valid(*id);
+}
+
+/**
+ * Parse ids and ranges separated by commas.
+ *
+ * \returns the number of ids put in *ids, 0 if the list is bad.
+ */
+static uint32_t parseIds(const char *str, uint32_t **ids) {
+  uint32_t count = 0;
+  char *end;
+  for (const char *s = str; *s != '\0'; s = end + (*end == ',' ? 1 : 0)) {
+    uint32_t first, last;
+    if (!parseId(s, &end, &first)) {
+      return 0;
+    }
+    last = first;
+    if (*end == '-' && !parseId(end + 1, &end, &last)) {
+      return 0;
+    }
+    if ((*end != ',' && *end != '\0') || last < first) {
+      return 0;
+    }
+    uint32_t *more = (uint32_t *)realloc(
+        *ids, (count + (last - first) + 1) * sizeof(uint32_t));
+    if (more == NULL) {
+      return 0;
+    }
+    *ids = more;
+    for (uint32_t id = first; id <= last; ++id) {
+      (*ids)[count++] = id;
+    }
+  }
+  return count;
+}
+
+/**
+ * Parse seconds with up to nine decimals into nano-seconds, after base if
+ * the time starts with +.
+ */
+static bool parseTime(const char *str, uint64_t base, uint64_t *ns) {
+  bool relative = *str == '+';
+  char *end;
+  uint64_t seconds = strtoull(str + (relative ? 1 : 0), &end, 10);
+  uint64_t fraction = 0;
+  if (*end == '.') {
+    uint64_t scale = 100000000;
+    for (end++; *end >= '0' && *end <= '9'; ++end) {
+      fraction += (uint64_t)(*end - '0') * scale;
+      scale /= 10;
+    }
+  }
+  if (*end != '\0') {
+    return false;
+  }
+  *ns = (relative ? base : 0) + seconds * 1000000000ULL + fraction;
+  return true;
+}
+
+/// Parse a payload pattern of hex digits and x for any nibble
+static bool parsePayload(const char *str, CanLogQuery *query) {
+  size_t len = strlen(str);
+  if (len % 2 != 0 || len / 2 > CAN_MAX_DATA) {
+    return false;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    char c = str[i];
+    uint8_t value, mask = 0xF;
+    if (c == 'x' || c == 'X') {
+      value = 0;
+      mask = 0;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      value = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      value = c - 'A' + 10;
+    } else {
+      return false;
+    }
+    int shift = i % 2 == 0 ? 4 : 0;
+    query->match[i / 2] |= value << shift;
+    query->mask[i / 2] |= mask << shift;
+  }
+  query->matchLen = (uint8_t)(len / 2);
+  return true;
+}
+
+/// Put value as digits decimal digits, with leading zeros
+static char *putDecimal(char *p, uint64_t value, int digits) {
+  for (int d = digits - 1; d >= 0; --d) {
+    p[d] = (char)('0' + value % 10);
+    value /= 10;
+  }
+  return p + digits;
+}
+
+/**
+ * Print a frame as a candump log line, built by hand as printf would take
+ * most of the time of a query.
+ */
+static void printFrame(const CanLogFrame &frame) {
+  char line[64 + 2 * CANFD_MAX_DLEN + CAN_LOG_NAME];
+  char *p = line;
+  uint64_t ts = frame.timestamp();
+  uint64_t seconds = ts / 1000000000ULL;
+  int digits = 1;
+  for (uint64_t s = seconds; s >= 10; s /= 10) {
+    digits++;
+  }
+  *p++ = '(';
+  p = putDecimal(p, seconds, digits);
+  *p++ = '.';
+  p = putDecimal(p, ts % 1000000000ULL, 9);
+  *p++ = ')';
+  *p++ = ' ';
+  if (frame.interface() < file->numInterfaces) {
+    size_t n = strnlen(file->interfaces[frame.interface()], CAN_LOG_NAME);
+    memcpy(p, file->interfaces[frame.interface()], n);
+    p += n;
+  } else {
+    p += sprintf(p, "can%u", frame.interface());
+  }
+  *p++ = ' ';
+
+  uint32_t id;
+  if (frame.error()) {
+    id = frame.canId() & (CAN_ERR_FLAG | CAN_ERR_MASK);
+    digits = 8;
+  } else if (frame.ext()) {
+    id = frame.id() & CAN_EFF_MASK;
+    digits = 8;
+  } else {
+    id = frame.id();
+    digits = 3;
+  }
+  for (int d = digits - 1; d >= 0; --d) {
+    *p++ = hex[(id >> (4 * d)) & 0xF];
+  }
+  *p++ = '#';
+  if (frame.fd()) {
+    *p++ = '#';
+    *p++ = '0';
+  }
+  if (frame.rtr()) {
+    *p++ = 'R';
+  } else {
+    for (uint8_t i = 0; i < frame.len(); ++i) {
+      *p++ = hex[frame.data()[i] >> 4];
+      *p++ = hex[frame.data()[i] & 0xF];
+    }
+  }
+  *p++ = '\n';
+  fwrite_unlocked(line, 1, p - line, stdout);
+}
+
+int main(int argc, char **argv) {
+  CanLogQuery query;
+  can_log_query_init(&query);
+  const char *from = NULL;
+  const char *to = NULL;
+  uint32_t *ids = NULL;
+  uint32_t threads = 1;
+  bool count = false;
+  bool verbose = false;
+  const char *output = NULL;
+  CanLogConfig config;
+  memset(&config, 0, sizeof(config));
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:f:t:p:n:j:w:zcsh")) != -1) {
+    switch (opt) {
+    case 'i':
+      query.numIds = parseIds(optarg, &ids);
+      if (query.numIds == 0) {
+        fprintf(stderr, "bad ids %s\n", optarg);
+        return 1;
+      }
+      query.ids = ids;
+      break;
+    case 'f':
+      from = optarg;
+      break;
+    case 't':
+      to = optarg;
+      break;
+    case 'p':
+      if (!parsePayload(optarg, &query)) {
+        fprintf(stderr, "bad payload %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'n':
+      query.limit = strtoull(optarg, NULL, 0);
+      break;
+    case 'j':
+      threads = (uint32_t)atoi(optarg);
+      break;
+    case 'w':
+      output = optarg;
+      break;
+    case 'z':
+      config.compress = true;
+      break;
+    case 'c':
+      count = true;
+      break;
+    case 's':
+      verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  CanLogReader log;
+  if (!log.open(argv[optind])) {
+    return 1;
+  }
+  file = log.header();
+  if ((from != NULL && !parseTime(from, log.first(), &query.from)) ||
+      (to != NULL && !parseTime(to, log.first(), &query.to))) {
+    fprintf(stderr, "bad time\n");
+    return 1;
+  }
+
+  CanLogWriter writer;
+  char names[CAN_LOG_INTERFACES][CAN_LOG_NAME + 1];
+  if (output != NULL) {
+    // keep the interface names and block size of the file
+    config.blockSize = file->blockSize;
+    for (uint8_t i = 0; i < file->numInterfaces && i < CAN_LOG_INTERFACES;
+         ++i) {
+      memcpy(names[i], file->interfaces[i], CAN_LOG_NAME);
+      names[i][CAN_LOG_NAME] = '\0';
+      config.interfaces[i] = names[i];
+    }
+    if (!writer.open(output, &config)) {
+      return 1;
+    }
+  }
+
+  static char buffer[1 << 20];
+  setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+  CanLogQueryStats stats;
+  uint64_t start = can_time_ns();
+  uint64_t frames;
+  if (count) {
+    frames = log.query(&query, threads, CanLogHandler(), &stats);
+  } else if (output != NULL) {
+    CanLogWriter *w = &writer;
+    frames = log.query(&query, threads, [w](const CanLogFrame &frame) {
+      uint8_t flags = (frame.fd() ? CAN_LOG_FD : 0) |
+                      (frame.outgoing() ? CAN_LOG_OUTGOING : 0);
+      w->add(frame.timestamp(), frame.canId(), frame.data(), frame.len(),
+             flags, frame.interface());
+    }, &stats);
+    writer.close();
+  } else {
+    frames = log.query(&query, threads, printFrame, &stats);
+  }
+  double seconds = (can_time_ns() - start) / 1e9;
+  fflush(stdout);
+
+  if (count) {
+    printf("%llu\n", (unsigned long long)frames);
+  }
+  if (verbose) {
+    fprintf(stderr,
+            "%llu frames matched of %llu read, %u blocks read, %u skipped of "
+            "%u, %.1f MB in %.3fs, %.0f MB/s\n",
+            (unsigned long long)stats.frames,
+            (unsigned long long)stats.framesRead, stats.blocksRead,
+            stats.blocksSkipped, log.blocks(), stats.bytesRead / 1e6, seconds,
+            seconds > 0 ? stats.bytesRead / 1e6 / seconds : 0);
+    if (stats.decodeNs != 0) {
+      fprintf(stderr, "%.1f MB of records decoded at %.0f MB/s\n",
+              stats.bytesDecoded / 1e6,
+              stats.bytesDecoded / 1e6 / (stats.decodeNs / 1e9));
+    }
+    CanLogWriterStats written;
+    writer.getStats(&written);
+    if (output != NULL) {
+      fprintf(stderr, "wrote %llu frames in %llu blocks, %.1f MB",
+              (unsigned long long)written.frames,
+              (unsigned long long)written.blocks, written.bytes / 1e6);
+    }
+    if (written.encodeNs != 0) {
+      fprintf(stderr, " of %.1f MB, %.2fx, encoded at %.0f MB/s",
+              written.rawBytes / 1e6, (double)written.rawBytes / written.bytes,
+              written.rawBytes / 1e6 / (written.encodeNs / 1e9));
+    }
+    if (output != NULL) {
+      fprintf(stderr, "\n");
+    }
+    if (log.trailing() != 0) {
+      fprintf(stderr, "%llu bytes after the last whole block\n",
+              (unsigned long long)log.trailing());
+    }
+  }
+  free(ids);
+  return 0;
+}
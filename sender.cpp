@@ -0,0 +1,574 @@
+/**
+ * sender.cpp
+ * \brief Load generator: sends configurable traffic at precise rates and
+ * reports what the bus and the transmit path managed.
+ *
+ * Traffic is given as streams, each a set of ids with a rate per id, the
+ * type the data is encoded as by the sendData functions, how the payload
+ * changes and the share of frames sent as rtrs instead:
+ *
+ * ~~~~~~~~~~~~
+ * IDS@RATE[:TYPE[:PAYLOAD[:RTR%]]]
+ *   IDS      900 | 900-915 | 900,904,e0x18FEF100 (e for an extended id)
+ *   RATE     frames per second for each id
+ *   TYPE     u8 i8 u16 i16 u32 i32, or an array like u8x7 or i16x3
+ *            (default u16)
+ *   PAYLOAD  inc, rand or a fixed number (default inc)
+ *   RTR%     percent of the frames sent as rtrs (default 0)
+ *
+ * sender -d 10 900-963@1000:u16:rand 1000,1004@50:i32x2:inc:10
+ * ~~~~~~~~~~~~
+ *
+ * Every id gets its own schedule, and the ids are kept in a heap ordered by
+ * when they are due, so rates stay exact whatever their mix. The sender
+ * sleeps until shortly before the next frame is due and spins the rest of
+ * the way. All frames due at once are queued with holdTx() and handed to the
+ * kernel together, in batches of up to the -b count.
+ *
+ * The send latency of a frame is the time from when it was due until the
+ * batch it is in was written, so it shows both pacing and transmit delays.
+ */
+#include "CanNode/CanNode.h"
+#include "CanNode/CanStats.h"
+#include "CanNode/CanTime.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Most elements an array stream sends (a CAN FD frame of 8-bit integers)
+#define MAX_ELEMENTS CAN_MAX_ARRAY
+/// Sub-buckets per power of two of the latency histogram
+#define HIST_SUB 16
+/// Buckets of the latency histogram, enough for any 64-bit ns value
+#define HIST_BUCKETS (HIST_SUB + 60 * HIST_SUB)
+
+/// How a stream's payload changes from frame to frame
+typedef enum {
+  PAYLOAD_INC,   ///< counts up by one per frame and id
+  PAYLOAD_RAND,  ///< random
+  PAYLOAD_FIXED, ///< the same value every time
+} PayloadMode;
+
+/// One IDS@RATE:TYPE:PAYLOAD:RTR% argument
+typedef struct {
+  CanNodeDataType type;
+  uint8_t size;     ///< bytes of one element
+  uint8_t elements; ///< 0 for a single integer, else the array length
+  PayloadMode payload;
+  uint32_t fixed;
+  uint32_t rtrPercent;
+  double rate;      ///< frames a second per id
+} Stream;
+
+/// One id of a stream and its schedule
+typedef struct {
+  CanNode *node;
+  const Stream *stream;
+  uint32_t id;
+  uint64_t due;    ///< can_time_ns() the next frame is due
+  uint64_t period; ///< ns between frames
+  uint32_t counter;
+} Source;
+
+typedef struct {
+  uint64_t sent;      ///< frames queued
+  uint64_t rtrs;      ///< of them rtrs
+  uint64_t queueFull; ///< sends refused with BUS_BUSY
+  uint64_t busOff;    ///< sends refused with BUS_OFF
+  uint64_t tooLong;   ///< arrays too long for the frame (DATA_OVERFLOW)
+  uint64_t errors;    ///< other refusals
+} Counts;
+
+static volatile sig_atomic_t stop;
+static Stream *streams;
+static uint32_t numStreams;
+static Source *sources;
+static uint32_t numSources;
+static Source **heap; ///< sources ordered by due
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+static uint64_t hist[HIST_BUCKETS];
+static uint64_t histMax;
+
+static void onSignal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static uint64_t nextRandom() {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+/**
+ * Log-linear buckets: exact below HIST_SUB ns, then HIST_SUB buckets per
+ * power of two, so percentiles are within 1/HIST_SUB of the true value.
+ */
+static uint32_t histBucket(uint64_t ns) {
+  if (ns < HIST_SUB) {
+    return (uint32_t)ns;
+  }
+  uint32_t shift = 63 - __builtin_clzll(ns) - 4;
+  return HIST_SUB + shift * HIST_SUB + (uint32_t)((ns >> shift) - HIST_SUB);
+}
+
+/// Largest value that falls in a bucket
+static uint64_t histUpper(uint32_t bucket) {
+  if (bucket < HIST_SUB) {
+    return bucket;
+  }
+  uint32_t shift = (bucket - HIST_SUB) / HIST_SUB;
+  uint64_t sub = (bucket - HIST_SUB) % HIST_SUB;
+  return ((HIST_SUB + sub + 1) << shift) - 1;
+}
+
+static void histRecord(uint64_t ns) {
+  hist[histBucket(ns)]++;
+  if (ns > histMax) {
+    histMax = ns;
+  }
+}
+
+static uint64_t histPercentile(double p) {
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < HIST_BUCKETS; ++i) {
+    total += hist[i];
+  }
+  uint64_t rank = (uint64_t)(p * total);
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HIST_BUCKETS; ++i) {
+    seen += hist[i];
+    if (seen > rank) {
+      uint64_t upper = histUpper(i);
+      return upper < histMax ? upper : histMax;
+    }
+  }
+  return histMax;
+}
+
+static void heapSwap(uint32_t a, uint32_t b) {
+  Source *tmp = heap[a];
+  heap[a] = heap[b];
+  heap[b] = tmp;
+}
+
+/// Move the first source down after its due time grew
+static void heapDown() {
+  uint32_t i = 0;
+  for (;;) {
+    uint32_t child = 2 * i + 1;
+    if (child >= numSources) {
+      return;
+    }
+    if (child + 1 < numSources && heap[child + 1]->due < heap[child]->due) {
+      child++;
+    }
+    if (heap[i]->due <= heap[child]->due) {
+      return;
+    }
+    heapSwap(i, child);
+    i = child;
+  }
+}
+
+static void heapUp(uint32_t i) {
+  while (i > 0 && heap[(i - 1) / 2]->due > heap[i]->due) {
+    heapSwap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static bool parseType(const char *str, Stream *stream) {
+  static const struct {
+    const char *name;
+    CanNodeDataType type;
+    uint8_t size;
+  } types[] = {{"u8", CAN_UINT8, 1},   {"i8", CAN_INT8, 1},
+               {"u16", CAN_UINT16, 2}, {"i16", CAN_INT16, 2},
+               {"u32", CAN_UINT32, 4}, {"i32", CAN_INT32, 4}};
+  for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); ++t) {
+    size_t len = strlen(types[t].name);
+    if (strncmp(str, types[t].name, len) != 0) {
+      continue;
+    }
+    stream->type = types[t].type;
+    stream->size = types[t].size;
+    stream->elements = 0;
+    if (str[len] == '\0') {
+      return true;
+    }
+    if (str[len] != 'x') {
+      continue;
+    }
+    long elements = strtol(str + len + 1, NULL, 10);
+    if (elements < 1 || elements * types[t].size > MAX_ELEMENTS) {
+      return false;
+    }
+    stream->elements = (uint8_t)elements;
+    return true;
+  }
+  return false;
+}
+
+/// Parse one id, "e" in front for an extended id
+static bool parseId(const char *str, char **end, uint32_t *id) {
+  bool ext = *str == 'e';
+  unsigned long value = strtoul(str + (ext ? 1 : 0), end, 0);
+  *id = ext ? ((uint32_t)value | CAN_ID_EXT) : (uint32_t)value;
+  return *end != str && can_id_valid(*id);
+}
+
+static bool addSource(uint32_t id, const Stream *stream) {
+  Source *more = (Source *)realloc(sources, (numSources + 1) *
+                                                sizeof(Source));
+  if (more == NULL) {
+    return false;
+  }
+  sources = more;
+  Source *source = &sources[numSources++];
+  source->node = NULL;
+  source->stream = stream;
+  source->period = (uint64_t)(1e9 / stream->rate);
+  source->counter = 0;
+  source->id = id;
+  return true;
+}
+
+/**
+ * Parse IDS@RATE[:TYPE[:PAYLOAD[:RTR%]]].
+ */
+static bool parseStream(char *arg, Stream *stream) {
+  char *fields[5] = {NULL};
+  int numFields = 0;
+  char *at = strchr(arg, '@');
+  if (at == NULL) {
+    return false;
+  }
+  *at = '\0';
+  for (char *field = strtok(at + 1, ":"); field != NULL && numFields < 4;
+       field = strtok(NULL, ":")) {
+    fields[numFields++] = field;
+  }
+
+  stream->rate = numFields > 0 ? atof(fields[0]) : 0;
+  if (stream->rate <= 0) {
+    return false;
+  }
+  stream->type = CAN_UINT16;
+  stream->size = 2;
+  stream->elements = 0;
+  if (numFields > 1 && !parseType(fields[1], stream)) {
+    return false;
+  }
+  stream->payload = PAYLOAD_INC;
+  if (numFields > 2) {
+    if (strcmp(fields[2], "rand") == 0) {
+      stream->payload = PAYLOAD_RAND;
+    } else if (strcmp(fields[2], "inc") != 0) {
+      stream->payload = PAYLOAD_FIXED;
+      stream->fixed = (uint32_t)strtoul(fields[2], NULL, 0);
+    }
+  }
+  stream->rtrPercent = numFields > 3 ? (uint32_t)atoi(fields[3]) : 0;
+
+  // ids: single ids and ranges, separated by commas, at least one
+  if (*arg == '\0') {
+    return false;
+  }
+  char *end;
+  for (char *ids = arg; *ids != '\0'; ids = end + (*end == ',' ? 1 : 0)) {
+    uint32_t first, last;
+    if (!parseId(ids, &end, &first)) {
+      return false;
+    }
+    last = first;
+    if (*end == '-' && !parseId(end + 1, &end, &last)) {
+      return false;
+    }
+    if ((*end != ',' && *end != '\0') || last < first) {
+      return false;
+    }
+    for (uint32_t id = first; id <= last; ++id) {
+      if (!addSource(id, stream)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static uint32_t payloadValue(Source *source) {
+  switch (source->stream->payload) {
+  case PAYLOAD_RAND:
+    return (uint32_t)nextRandom();
+  case PAYLOAD_FIXED:
+    return source->stream->fixed;
+  default:
+    return source->counter++;
+  }
+}
+
+/**
+ * Send the next frame of a source through the sendData codec, or an rtr.
+ */
+static CanState sendFrame(Source *source, Counts *counts) {
+  const Stream *stream = source->stream;
+  if (stream->rtrPercent != 0 && nextRandom() % 100 < stream->rtrPercent) {
+    CanMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    can_set_msg_id(&msg, source->id);
+    msg.rtr = true;
+    CanState state = CanNode::can_tx(&msg, 0);
+    if (state == BUS_OK) {
+      counts->rtrs++;
+    }
+    return state;
+  }
+
+  if (stream->elements == 0) {
+    uint32_t value = payloadValue(source);
+    switch (stream->type) {
+    case CAN_UINT8:
+      return source->node->sendData((uint8_t)value);
+    case CAN_INT8:
+      return source->node->sendData((int8_t)value);
+    case CAN_UINT16:
+      return source->node->sendData((uint16_t)value);
+    case CAN_INT16:
+      return source->node->sendData((int16_t)value);
+    case CAN_UINT32:
+      return source->node->sendData((uint32_t)value);
+    default:
+      return source->node->sendData((int32_t)value);
+    }
+  }
+
+  // arrays, every element gets a value of its own
+  uint32_t values[MAX_ELEMENTS];
+  uint8_t bytes[MAX_ELEMENTS];
+  uint16_t shorts[MAX_ELEMENTS / 2];
+  uint8_t n = stream->elements;
+  for (uint8_t i = 0; i < n; ++i) {
+    values[i] = payloadValue(source);
+    bytes[i] = (uint8_t)values[i];
+    if (i < MAX_ELEMENTS / 2) {
+      shorts[i] = (uint16_t)values[i];
+    }
+  }
+  switch (stream->type) {
+  case CAN_UINT8:
+    return source->node->sendData(bytes, n);
+  case CAN_INT8:
+    return source->node->sendData((int8_t *)bytes, n);
+  case CAN_UINT16:
+    return source->node->sendData(shorts, n);
+  case CAN_INT16:
+    return source->node->sendData((int16_t *)shorts, n);
+  case CAN_UINT32:
+    return source->node->sendData(values, n);
+  default:
+    return source->node->sendData((int32_t *)values, n);
+  }
+}
+
+/**
+ * Sleep until due, spinning the last spin ns so the wake up is on time.
+ */
+static void waitUntil(uint64_t due, uint64_t spin) {
+  uint64_t now = can_time_ns();
+  if (due > now + spin) {
+    uint64_t until = due - spin;
+    struct timespec ts = {(time_t)(until / 1000000000ULL),
+                          (long)(until % 1000000000ULL)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR &&
+           !stop) {
+    }
+  }
+  while (can_time_ns() < due && !stop) {
+  }
+}
+
+static void report(const char *what, const Counts *counts, const Counts *prev,
+                   const CanStatsSnapshot *cur, const CanStatsSnapshot *last,
+                   double seconds) {
+  fprintf(stderr,
+          "%s %.1fs: %.0f frames/s queued, %.0f frames/s written, "
+          "%llu rtrs, %llu queue full, %llu bus off, %llu too long, "
+          "%llu errors, %llu write failures\n",
+          what, seconds, (counts->sent - prev->sent) / seconds,
+          (cur->txTotal - last->txTotal) / seconds,
+          (unsigned long long)(counts->rtrs - prev->rtrs),
+          (unsigned long long)(counts->queueFull - prev->queueFull),
+          (unsigned long long)(counts->busOff - prev->busOff),
+          (unsigned long long)(counts->tooLong - prev->tooLong),
+          (unsigned long long)(counts->errors - prev->errors),
+          (unsigned long long)(cur->txFailures - last->txFailures));
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-i interface] [-d seconds] [-n frames] [-b batch]\n"
+          "          [-q queue depth] [-w send buffer] [-s spin us]\n"
+          "          [-r report seconds] IDS@RATE[:TYPE[:PAYLOAD[:RTR%%]]]...\n"
+          "  IDS      900 | 900-915 | 900,904,e0x18FEF100\n"
+          "  RATE     frames per second for each id\n"
+          "  TYPE     u8 i8 u16 i16 u32 i32 or arrays like u8x7, default u16\n"
+          "  PAYLOAD  inc, rand or a fixed number, default inc\n"
+          "  RTR%%     percent of frames sent as rtrs, default 0\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  CanBusConfig config;
+  memset(&config, 0, sizeof(config));
+  config.interface = "can0";
+  double duration = 0;
+  uint64_t limit = 0;
+  uint32_t batch = 32;
+  uint64_t spin = 50000;
+  double every = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:d:n:b:q:w:s:r:h")) != -1) {
+    switch (opt) {
+    case 'i':
+      config.interface = optarg;
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'n':
+      limit = strtoull(optarg, NULL, 0);
+      break;
+    case 'b':
+      batch = (uint32_t)atoi(optarg);
+      break;
+    case 'q':
+      config.txQueueDepth = (uint16_t)atoi(optarg);
+      break;
+    case 'w':
+      config.sndBuf = atoi(optarg);
+      break;
+    case 's':
+      spin = (uint64_t)atoi(optarg) * 1000;
+      break;
+    case 'r':
+      every = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind == argc || batch == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  numStreams = argc - optind;
+  streams = (Stream *)calloc(numStreams, sizeof(Stream));
+  for (uint32_t i = 0; i < numStreams; ++i) {
+    if (streams == NULL || !parseStream(argv[optind + i], &streams[i])) {
+      fprintf(stderr, "bad stream %s\n", argv[optind + i]);
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  CanNode::setBusConfig(&config);
+  heap = (Source **)calloc(numSources, sizeof(Source *));
+  if (heap == NULL) {
+    return 1;
+  }
+  // spread the ids of a stream over its period, so they do not all go at once
+  uint64_t start = can_time_ns() + 10000000;
+  for (uint32_t i = 0; i < numSources; ++i) {
+    Source *source = &sources[i];
+    source->node = new CanNode(source->id, nullptr);
+    source->due = start + nextRandom() % source->period;
+    heap[i] = source;
+    heapUp(i);
+  }
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  Counts counts;
+  memset(&counts, 0, sizeof(counts));
+  Counts prev = counts;
+  CanStatsSnapshot first, last, cur;
+  CanStats::snapshot(&first);
+  last = first;
+  uint64_t end = duration > 0 ? start + (uint64_t)(duration * 1e9) : 0;
+  uint64_t nextReport = start + (uint64_t)(every * 1e9);
+  uint64_t *dues = (uint64_t *)malloc(batch * sizeof(uint64_t));
+  if (dues == NULL) {
+    return 1;
+  }
+
+  while (!stop && (end == 0 || heap[0]->due < end) &&
+         (limit == 0 || counts.sent < limit)) {
+    waitUntil(heap[0]->due, spin);
+
+    // everything due goes to the kernel in one batch
+    uint64_t now = can_time_ns();
+    uint32_t n = 0;
+    CanNode::holdTx(true);
+    while (n < batch && heap[0]->due <= now &&
+           (limit == 0 || counts.sent < limit)) {
+      Source *source = heap[0];
+      CanState state = sendFrame(source, &counts);
+      if (state == BUS_OK) {
+        counts.sent++;
+      } else if (state == BUS_BUSY) {
+        counts.queueFull++;
+      } else if (state == BUS_OFF) {
+        counts.busOff++;
+      } else if (state == DATA_OVERFLOW) {
+        counts.tooLong++;
+      } else if (state != BUS_OK) {
+        counts.errors++;
+      }
+      dues[n++] = source->due;
+      source->due += source->period;
+      heapDown();
+    }
+    CanNode::holdTx(false);
+    CanNode::flushTx();
+    now = can_time_ns();
+    for (uint32_t i = 0; i < n; ++i) {
+      histRecord(now - dues[i]);
+    }
+
+    // frames of other nodes, error frames and the bus state
+    CanNode::checkForMessages();
+
+    if (now >= nextReport) {
+      CanStats::snapshot(&cur);
+      report("last", &counts, &prev, &cur, &last,
+             (cur.timestamp - last.timestamp) / 1e9);
+      nextReport += (uint64_t)(every * 1e9);
+      prev = counts;
+      last = cur;
+    }
+  }
+
+  CanNode::flushTx();
+  CanStats::snapshot(&cur);
+  Counts none;
+  memset(&none, 0, sizeof(none));
+  report("total", &counts, &none, &cur, &first,
+         (cur.timestamp - first.timestamp) / 1e9);
+  fprintf(stderr,
+          "send latency: p50 %.1fus p90 %.1fus p99 %.1fus p99.9 %.1fus "
+          "max %.1fus\n",
+          histPercentile(0.5) / 1e3, histPercentile(0.9) / 1e3,
+          histPercentile(0.99) / 1e3, histPercentile(0.999) / 1e3,
+          histMax / 1e3);
+  return 0;
+}